@@ -23,6 +23,78 @@ enum {
 	INSTR_CLOSURE_REF,
 	INSTR_STACK_REF,
 	INSTR_RETURN,
+
+	// superinstructions generated by the peephole pass
+	INSTR_STACK_REF2,
+	INSTR_CLOSURE_REF2,
+	INSTR_CLOSURE_STACK_REF,
+	INSTR_STACK_REF_CALL,
+	INSTR_REF_CONST_CALL,
+	// operand storage for the previous instruction, never executed
+	INSTR_DATA,
+
+	// inlined builtins, the operand is the closure index of the builtin
+	// which is checked before taking the inline path
+	INSTR_ADD2,
+	INSTR_SUB2,
+	INSTR_LT,
+	INSTR_GT,
+	INSTR_EQ,
+	INSTR_CAR,
+	INSTR_CDR,
+	INSTR_IS_NULL,
+	INSTR_IS_PAIR,
+	INSTR_CONS,
+	// compare-and-branch forms, always followed by a jump_if_false
+	INSTR_LT_JUMP,
+	INSTR_GT_JUMP,
+	INSTR_NULL_JUMP,
+
+	// self tail calls, see compile_self_tail_call()
+	INSTR_SELF_TAIL_GUARD,
+	INSTR_STORE_ARGS,
+	// self_tail_guard counting the loop, emitted by the baseline tier
+	INSTR_LOOP_GUARD,
+	// makes a closure of a nested lambda, the operand is a
+	// vm_closure_proto_t
+	INSTR_MAKE_CLOSURE,
+
+	// variables which are assigned to with set! are kept in boxes when
+	// they're on the stack, so that closures capturing them share them.
+	// the operand is the stack slot, boxed when the variable is bound
+	INSTR_BOX,
+	INSTR_BOX_REF,
+	INSTR_BOX_SET,
+	// set! of a variable in a closure slot, which is already shared
+	INSTR_CLOSURE_SET,
+	// pops the value of a local defined after its box was made, see
+	// compile_letrec_slots()
+	INSTR_BOX_INIT,
+	// pops the value of an expression in a begin which isn't the last
+	INSTR_DROP,
+	// checks the builtins folded and the procedures inlined by
+	// optimize_tree() on entry, the operand is a vm_fold_guard_t
+	INSTR_FOLD_GUARD,
+	// moves the value of an inlined procedure's body down over its
+	// arguments, the operand is the number of arguments
+	INSTR_SLIDE,
+	// copies the value on top of the stack into a slot reserved for it,
+	// see cse.c
+	INSTR_STACK_SET,
+	// drops everything above the given slot, for loops entered past the
+	// values hoisted out of them
+	INSTR_SET_SP,
+	// records the types of the arguments on entry to baseline code, the
+	// operand is the number of parameters
+	INSTR_PROFILE_ARGS,
+	// inlined arithmetic and comparisons on operands known to be
+	// fixnums, which skip the type checks of the forms above
+	INSTR_FIX_ADD,
+	INSTR_FIX_SUB,
+	INSTR_FIX_LT,
+	INSTR_FIX_GT,
+	INSTR_FIX_LT_JUMP,
+	INSTR_FIX_GT_JUMP,
 };
 
 enum {
@@ -47,6 +119,15 @@ typedef struct instr_node {
 
 	struct instr_node *prev;
 	struct instr_node *next;
+
+	// used by the peephole pass, jumps refer to their target by node
+	// rather than by index while instructions are being rewritten
+	struct instr_node *target;
+	unsigned index;
+	bool is_target;
+
+	// 1 + the body expression starting here, or 0, see compile_body()
+	unsigned osr_entry;
 } instr_node_t;
 
 typedef struct comp_state {
@@ -60,6 +141,62 @@ typedef struct comp_state {
 	unsigned stack_ptr;
 	unsigned closure_ptr;
 	unsigned instr_ptr;
+	// VM_TIER_* level the closure is being compiled at
+	unsigned tier;
+	// number of expressions in the closure's body
+	unsigned body_exprs;
+
+	// state of the code a nested lambda is compiled in, and the scope of
+	// the lambda expression there. free variables are captured from it
+	struct comp_state *parent;
+	struct scope *parent_scope;
+	// true while the scopes of local definitions are generated, their
+	// variables can't be captured yet
+	bool defining;
+
+	// variables assigned to anywhere in the body, including by nested
+	// lambdas, see find_assigned() in scope.c
+	scm_value_t *assigned;
+	unsigned num_assigned;
+	// true if any parameters or locals are boxed
+	bool has_boxes;
+	// true if closures made by local definitions capture locals, which
+	// are then all boxed before the first definition runs
+	bool letrec;
+
+	// VM_COMPILE_FAIL_* reason, when compiling fails
+	unsigned failure;
+
+	// closure slots of the builtins that optimize_tree() folded calls to,
+	// and of the procedures it inlined
+	unsigned *folded;
+	unsigned num_folded;
+	// how many inlined bodies optimize_tree() is in
+	unsigned inline_depth;
+	// variables outside the closure which optimize_tree() relied on the
+	// values of, see tree_effects() in optimize.c
+	vm_effects_t *guard_vars;
+	// global variables the code has the values of built in, watched once
+	// it's compiled. see use_stable_global() in optimize.c
+	env_node_t **stable;
+	unsigned num_stable;
+	unsigned stable_uses;
+	bool embed_globals;
+
+	// expressions hoisted out of self tail call loops, computed once on
+	// entry into the slots of `hoisted_slots`, see hoist_invariants()
+	struct comp_node **hoisted;
+	struct scope_node **hoisted_slots;
+	unsigned num_hoisted;
+	// where self tail calls jump back to, and where the ones which keep
+	// the parameters' types jump to when the fold guard only checks those
+	unsigned loop_entry;
+	unsigned typed_entry;
+	// parameters assumed to hold fixnums, and the ones of those which
+	// the code relies on, checked by the fold guard. see
+	// speculate_arg_types() in optimize.c
+	uint32_t fixnum_args;
+	uint32_t fixnum_used;
 } comp_state_t;
 
 typedef struct scope_node {
@@ -85,12 +222,72 @@ typedef struct comp_node {
 
 	// scope info, only used for unquoted symbols
 	scope_node_t *node;
+	// closures to make, for lambda expressions
+	vm_closure_proto_t *proto;
+	// the body of the procedure, for calls optimize_tree() inlined
+	struct comp_inline *inlined;
+	// slots reserved around the expression, for values it computes more
+	// than once, see cse.c
+	struct comp_temps *temps;
+	// slot the value of the expression is also stored in, for the same
+	// expression later on
+	scope_node_t *saves;
 } comp_node_t;
 
-scm_closure_t *vm_compile_closure(vm_t *vm, scm_closure_t *closure);
+// stack slots for values kept to be used again, located once the stack
+// pointer where they're reserved is known
+typedef struct comp_temps {
+	scope_node_t **slots;
+	unsigned num_slots;
+} comp_temps_t;
+
+static inline void free_comp_temps(comp_temps_t *temps) {
+	if (temps) {
+		for (unsigned i = 0; i < temps->num_slots; i++) {
+			free(temps->slots[i]);
+		}
+
+		free(temps->slots);
+		free(temps);
+	}
+}
+
+// a call replaced by the body of the procedure it calls, see
+// try_inline_call() in optimize.c
+typedef struct comp_inline {
+	// the body, with its variables resolved in the code it's inlined into
+	comp_node_t *body;
+	// the arguments are pushed into the parameters' slots, which are
+	// located once the stack pointer at the call is known. parameters
+	// which were replaced by their arguments are NULL
+	scope_node_t **params;
+	unsigned num_params;
+} comp_inline_t;
+
+scm_closure_t *vm_compile_closure(vm_t *vm, scm_closure_t *closure, unsigned tier);
+void optimize_tree(comp_state_t *, comp_node_t *);
+vm_fold_guard_t *make_fold_guard(comp_state_t *);
+unsigned tree_effects(comp_state_t *, comp_node_t *, bool);
+void free_dead_tree(comp_node_t *);
+void eliminate_common_subexprs(comp_state_t *, comp_node_t *);
+void hoist_invariants(comp_state_t *, comp_node_t *);
+bool is_self_call(comp_state_t *, comp_node_t *);
+bool is_fixnum_expr(comp_state_t *, comp_node_t *);
+bool use_stable_global(comp_state_t *, env_node_t *);
 
 bool gen_top_scope(comp_node_t*, comp_state_t*, scope_t*, scm_value_t, unsigned);
+bool gen_sub_scope(comp_node_t*, comp_state_t*, scope_t*, scm_value_t, unsigned);
+scope_node_t *scope_add_node(scope_t *, scm_value_t, unsigned, unsigned);
+comp_node_t *wrap_comp_values(scm_value_t);
+bool is_assigned(comp_state_t *, scm_value_t);
+scope_node_t *scope_resolve(comp_state_t *, scope_t *, scm_value_t);
+bool capture_var(comp_state_t *, scope_t *, scm_value_t, vm_capture_t *);
+bool compile_nested_lambda(comp_state_t *, scope_t *, comp_node_t *,
+                           scm_value_t, comp_node_t *);
+void vm_count_compile_failure(vm_t *, vm_lambda_t *);
 unsigned add_closure_node(comp_state_t *, env_node_t *, scm_value_t);
+env_node_t *closure_var_ref(comp_state_t *, unsigned);
+bool is_unstable_var(comp_state_t *, env_node_t *);
 
 static inline bool is_runtime_token(environment_t *env,
                                     scm_value_t sym,
@@ -119,6 +316,18 @@ static inline bool is_begin_token(environment_t *env, scm_value_t sym) {
 	return is_runtime_token(env, sym, RUN_TYPE_BEGIN);
 }
 
+static inline bool is_lambda_token(environment_t *env, scm_value_t sym) {
+	return is_runtime_token(env, sym, RUN_TYPE_LAMBDA);
+}
+
+static inline bool is_set_token(environment_t *env, scm_value_t sym) {
+	return is_runtime_token(env, sym, RUN_TYPE_SET);
+}
+
+static inline bool is_quote_token(environment_t *env, scm_value_t sym) {
+	return is_runtime_token(env, sym, RUN_TYPE_QUOTE);
+}
+
 typedef bool (*runtype_checker)(environment_t *env, scm_value_t sym);
 
 static inline bool is_run_statement(environment_t *env,
@@ -142,4 +351,24 @@ static inline bool is_begin_statement(environment_t *env, comp_node_t *node) {
 	return is_run_statement(env, node, is_begin_token);
 }
 
+static inline bool is_lambda_statement(environment_t *env, comp_node_t *node) {
+	return is_run_statement(env, node, is_lambda_token);
+}
+
+static inline bool is_set_statement(environment_t *env, comp_node_t *node) {
+	return is_run_statement(env, node, is_set_token);
+}
+
+static inline bool is_quote_statement(environment_t *env, comp_node_t *node) {
+	return is_run_statement(env, node, is_quote_token);
+}
+
+static inline bool is_local_scope(unsigned type) {
+	return type == SCOPE_LOCAL || type == SCOPE_MUTABLE_LOCAL;
+}
+
+static inline bool is_mutable_scope(unsigned type) {
+	return type == SCOPE_MUTABLE_PARAMETER || type == SCOPE_MUTABLE_LOCAL;
+}
+
 #endif
@@ -1,11 +1,23 @@
 #ifndef _NSCHEME_ENV_H
 #define _NSCHEME_ENV_H 1
 #include <nscheme/values.h>
+#include <stdbool.h>
 
 typedef struct env_node {
 	scm_value_t key;
 	scm_value_t value;
 
+	// times the variable was defined again or assigned to after it was
+	// first defined. global variables which never were can be embedded in
+	// optimized code as constants, which is then watched for writes to them,
+	// see vm_var_written()
+	unsigned writes;
+	bool watched;
+	// written to since the last collection, see env_write_barrier()
+	bool remembered;
+	// the last collection which traced the variable, see gc.c
+	unsigned gc_mark;
+
 	struct env_node *left;
 	struct env_node *right;
 } env_node_t;
@@ -13,12 +25,25 @@ typedef struct env_node {
 typedef struct environment {
 	struct env_node *root;
 	struct environment *last;
+	// the last collection which traced the environment, see gc.c
+	unsigned gc_mark;
 } environment_t;
 
 environment_t *env_create(environment_t *last);
-void env_set(environment_t *env, scm_value_t key, scm_value_t value);
-void env_set_recurse(environment_t *env, scm_value_t key, scm_value_t value);
+env_node_t *env_set(environment_t *env, scm_value_t key, scm_value_t value);
+env_node_t *env_set_recurse(environment_t *env, scm_value_t key, scm_value_t value);
 env_node_t *env_find(environment_t *env, scm_value_t key);
 env_node_t *env_find_recurse(environment_t *env, scm_value_t key);
 
+void gc_remember_variable(env_node_t *var);
+
+// called whenever `var` is given a value. the first write since the last
+// collection remembers the variable, since it could now reference a block
+// in the nursery which nothing else in the old generation does
+static inline void env_write_barrier(env_node_t *var) {
+	if (!var->remembered) {
+		gc_remember_variable(var);
+	}
+}
+
 #endif
@@ -186,7 +186,8 @@ static inline bool is_character(scm_value_t value) {
 
 // data retrieving functions
 static inline long int get_integer(scm_value_t value) {
-	return value >> 2;
+	// arithmetic shift, so negative integers keep their sign
+	return (long int)value >> 2;
 }
 
 static inline unsigned get_parse_val(scm_value_t value) {
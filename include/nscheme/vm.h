@@ -19,6 +19,34 @@ enum {
 	RUN_MODE_COMPILED,
 };
 
+// engines used to execute compiled closures, see vm_run()
+enum {
+	// each op is a call through vm_op_t.func, portable fallback
+	VM_ENGINE_CALL_THREADED,
+	// ops are decoded to label addresses and run by vm_run_direct()
+	VM_ENGINE_DIRECT_THREADED,
+	// ops are lowered to x86-64 machine code, see vm_native.c
+	VM_ENGINE_NATIVE,
+};
+
+// computed gotos (`&&label`) are a GNU extension
+#if defined(__GNUC__)
+#define VM_HAVE_DIRECT_THREADING 1
+#endif
+
+// the native backend is only built when configured with --native-jit
+#if defined(VM_NATIVE_JIT) && defined(__x86_64__) && defined(__unix__)
+#define VM_HAVE_NATIVE_JIT 1
+#endif
+
+#if defined(VM_HAVE_NATIVE_JIT)
+#define VM_DEFAULT_ENGINE VM_ENGINE_NATIVE
+#elif defined(VM_HAVE_DIRECT_THREADING)
+#define VM_DEFAULT_ENGINE VM_ENGINE_DIRECT_THREADED
+#else
+#define VM_DEFAULT_ENGINE VM_ENGINE_CALL_THREADED
+#endif
+
 struct vm;
 
 typedef bool (*vm_func)(struct vm *vm, uintptr_t arg);
@@ -28,76 +56,488 @@ typedef struct vm_op {
 	uintptr_t arg;
 } vm_op_t;
 
-typedef struct scm_closure {
-	// compiled instructions for vm
-	vm_op_t *code;
+// decoded form of a vm_op_t, used by the direct-threaded engine
+typedef struct vm_direct_op {
+	const void *label;
+	uintptr_t arg;
+} vm_direct_op_t;
 
-	// array of variable references closed at compile time
-	env_node_t **closures;
+/*
+ * Compiled code and profiling state, shared by every closure made from the
+ * same lambda expression. Closures only carry the variables they refer to,
+ * see vm_lambda_for() and vm_bind_closure().
+ */
+typedef struct vm_lambda {
+	// the body of the lambda expression, which the lambda is looked up by.
+	// used for debugging, printing, and recompilation
+	scm_value_t definition;
+	scm_value_t args;
+	// next lambda in the same bucket of `vm->lambdas`
+	struct vm_lambda *next;
 
-	// array of variable names corresponding to entries in `closures`
+	// compiled instructions for vm
+	vm_op_t *code;
+	// the number of ops contained in `code[]`
+	unsigned num_ops;
+	// `code[]` decoded for the direct-threaded engine, built on first entry
+	vm_direct_op_t *direct_code;
+	// machine code lowered from `code[]` by the native backend
+	struct vm_native *native;
+
+	// array of variable names corresponding to closure slots
 	scm_value_t *varnames;
+	// the number of entries in `varnames` and `guard_misses`
+	unsigned num_slots;
 
-	// the original definition of the function, used for debugging, printing,
-	// and recompilation in the future
-	scm_value_t definition;
-
-	// true if the closure has been compiled to threaded code,
+	// true if the lambda has been compiled to threaded code,
 	// false otherwise.
 	bool compiled;
+	// true if closures of it are made by INSTR_MAKE_CLOSURE, which sizes
+	// them for the slots the code had then, so the code can't add any
+	bool nested;
+
+	// which of the VM_TIER_* levels `code[]` was compiled at
+	unsigned tier;
 
-	// how many times this closure has been called. this determines when
-	// the JIT compiler will be called, and at which optimization levels.
+	// how many times closures of this lambda have been called since it
+	// was last compiled. this determines when the JIT compiler will be
+	// called, and at which optimization levels.
 	unsigned num_calls;
+	// number of loops taken by the baseline code
+	unsigned back_edges;
+	// number of times compiling the lambda failed, see vm_tier_up()
+	unsigned compile_failures;
+	// VM_COMPILE_FAIL_* reason of the last failure
+	unsigned compile_failure;
+	// number of times the optimized code was thrown out because a
+	// variable it depended on changed, see vm_deoptimize()
+	unsigned deopts;
+	// what the code folded calls to builtins, and inlined procedures,
+	// through, or NULL
+	struct vm_fold_guard *fold_guard;
+
+	// per closure slot counts of failed inline guards in baseline code,
+	// the optimizing tier doesn't inline through slots which have any
+	uint32_t *guard_misses;
+	// VM_TYPE_* flags of the arguments each parameter was given in calls
+	// to baseline code, the optimizing tier assumes that parameters which
+	// only held fixnums go on doing so
+	uint8_t *arg_types;
+	// per closure slot, the global variable the optimized code embedded
+	// the value of, or NULL. closures which find other variables under
+	// those names can't run the code, see vm_bind_closure()
+	env_node_t **stable_vars;
+
+	// op at which each expression of the body starts, for tree walker
+	// activations moving over to compiled code (see vm_osr_enter()), or
+	// VM_NO_OSR_ENTRY if that isn't possible there
+	unsigned *osr_entries;
+	unsigned num_osr_entries;
+
+	// the last collection which traced the lambda, see gc.c
+	unsigned gc_mark;
+} vm_lambda_t;
+
+// what evaluating an expression, or calling a procedure, can do. pure code
+// does none of these, see effects.c
+enum {
+	// makes new objects, so the results of two calls aren't the same
+	VM_EFFECT_ALLOC = 1 << 0,
+	// reads variables which might be assigned to in between
+	VM_EFFECT_READ  = 1 << 1,
+	// assigns to or defines variables which outlive the call
+	VM_EFFECT_WRITE = 1 << 2,
+	// input or output
+	VM_EFFECT_IO    = 1 << 3,
+	// can raise an error
+	VM_EFFECT_FAIL  = 1 << 4,
+
+	// calls to procedures which aren't known
+	VM_EFFECT_ANY   = (1 << 5) - 1,
+};
+
+// the effects of calling a closure, worked out from its body and from the
+// procedures it calls, see vm_closure_effects()
+typedef struct vm_effects {
+	// VM_EFFECT_* flags
+	unsigned flags;
+
+	// the variables the procedures it calls were found in, and what they
+	// held. the flags only hold while the variables do
+	unsigned num_deps;
+	struct {
+		env_node_t *var;
+		scm_value_t value;
+	} deps[];
+} vm_effects_t;
+
+// true if code with these effects can be left out when its value isn't
+// used
+static inline bool vm_effects_removable(unsigned flags) {
+	return !(flags & (VM_EFFECT_WRITE | VM_EFFECT_IO | VM_EFFECT_FAIL));
+}
+
+// true if code with these effects gives the same result each time it's run
+// with the same arguments, and can be run in any order with other code
+static inline bool vm_effects_pure(unsigned flags) {
+	return !(flags & ~VM_EFFECT_FAIL);
+}
+
+typedef struct scm_closure {
+	vm_lambda_t *lambda;
+
+	// array of variable references used by the compiled code, and the
+	// number of them. arrays made by the compiler are on the heap
+	env_node_t **closures;
+	unsigned num_slots;
+	// the `lambda->varnames` that `closures` was looked up for, closures
+	// of a lambda compiled through another closure look the names up in
+	// `env` when they're first entered
+	scm_value_t *bound;
 
-	union {
-		// this struct will be used when `is_compiled` is true
-		struct {
-			// number of arguments the closure requires when called
-			unsigned num_args;
-			// the number of ops contained in `code[]`
-			unsigned num_ops;
-			// the number of closed variables in `closure`,
-			unsigned num_closed;
-			// number of stack slots required to call this procedure, not
-			// including the arguments passed by the caller
-			unsigned required_stack;
-		};
-
-		// this one is used otherwise
-		struct {
-			environment_t *env;
-			scm_value_t args;
-		};
-	};
+	// environment the closure was created in
+	environment_t *env;
+
+	// what calling the closure does, worked out when it's first asked
+	// for, see vm_closure_effects()
+	vm_effects_t *effects;
+
+	// the last collection which traced the closure, see gc.c
+	unsigned gc_mark;
 } scm_closure_t;
 
+// where INSTR_MAKE_CLOSURE gets each variable of the closure it makes
+enum {
+	// a new variable holding the value of stack[fp + index]
+	VM_CAPTURE_STACK,
+	// the same variable as slot `index` of the running closure
+	VM_CAPTURE_CLOSURE,
+	// the variable boxed in stack[fp + index], see vm_op_box()
+	VM_CAPTURE_BOX,
+};
+
+typedef struct vm_capture {
+	unsigned type;
+	unsigned index;
+} vm_capture_t;
+
+// operand of INSTR_MAKE_CLOSURE, closures of `lambda` are made with one
+// capture per slot of the lambda's code
+typedef struct vm_closure_proto {
+	vm_lambda_t *lambda;
+	unsigned num_slots;
+	vm_capture_t slots[];
+} vm_closure_proto_t;
+
+// operand of INSTR_FOLD_GUARD, the closure slots holding builtins which the
+// optimizer folded calls to, or procedures it inlined, and the values they
+// held at the time. slots with a `var` are variables outside the closure,
+// which the procedures it relied on the effects of call through.
+// `fixnum_args` has a bit set for each parameter the code assumes holds a
+// fixnum, the lowest for the first
+typedef struct vm_fold_guard {
+	uint32_t fixnum_args;
+	unsigned num_slots;
+	struct {
+		unsigned index;
+		env_node_t *var;
+		scm_value_t value;
+	} slots[];
+} vm_fold_guard_t;
+
+// closures a call site's inline cache remembers, sites which call more
+// than this many different ones are megamorphic
+#define VM_CALL_CACHE_WAYS 4
+
+// callee of unused cache entries, no closure lives at address 0
+#define VM_CALL_CACHE_EMPTY ((scm_value_t)SCM_TYPE_CLOSURE)
+
+/*
+ * Inline cache of a call site in direct-threaded or native code. It holds
+ * the closures the site called which could be entered without going
+ * through vm_call_apply(), see vm_call_cacheable(), and where their code
+ * starts in the engine's form of it. The entries are only valid while
+ * `epoch` matches `vm->code_epoch`, which changes whenever code is thrown
+ * out, see vm_call_cache_fill().
+ */
+typedef struct vm_call_cache {
+	unsigned epoch;
+	unsigned num_entries;
+	// set once the site called too many closures, it isn't cached then
+	bool megamorphic;
+
+	struct {
+		scm_value_t callee;
+		const void *code;
+	} entries[VM_CALL_CACHE_WAYS];
+
+	// calls which were, and weren't, found in the cache
+	uint64_t hits;
+	uint64_t misses;
+
+	// neighbours in `vm->call_caches`
+	struct vm_call_cache *next;
+	struct vm_call_cache *prev;
+} vm_call_cache_t;
+
+// a variable which the optimized code of `lambda` relies on not changing,
+// see vm_var_written(). entries for code which has since been replaced are
+// dropped along the way
+typedef struct vm_var_watch {
+	env_node_t *var;
+	vm_lambda_t *lambda;
+	vm_op_t *code;
+	struct vm_var_watch *next;
+} vm_var_watch_t;
+
+// kinds of values, for the types of arguments seen by baseline code
+enum {
+	VM_TYPE_FIXNUM  = 1 << 0,
+	VM_TYPE_PAIR    = 1 << 1,
+	VM_TYPE_NULL    = 1 << 2,
+	VM_TYPE_CLOSURE = 1 << 3,
+	VM_TYPE_OTHER   = 1 << 4,
+};
+
+// compilation tiers, closures start out run by the tree walker
+enum {
+	VM_TIER_INTERP,
+	// compiled quickly without the peephole pass, counts calls and
+	// loops and records guard failures for the optimizing tier
+	VM_TIER_BASELINE,
+	VM_TIER_OPTIMIZED,
+};
+
+// default thresholds, see vm_tier_settings_t
+#define VM_DEFAULT_COMPILE_CALLS   3
+#define VM_DEFAULT_OPTIMIZE_CALLS  100
+#define VM_DEFAULT_OPTIMIZE_LOOPS  1000
+
+// after this many failed attempts at compiling a closure it's left alone
+#define VM_MAX_COMPILE_FAILURES    4
+
+// why a lambda couldn't be compiled
+enum {
+	// refers to a variable which isn't defined, or isn't yet
+	VM_COMPILE_FAIL_UNDEFINED,
+	// a special form with the wrong shape
+	VM_COMPILE_FAIL_SYNTAX,
+	// uses a macro, or defines syntax
+	VM_COMPILE_FAIL_MACRO,
+	// a definition which isn't at the start of a body
+	VM_COMPILE_FAIL_DEFINITION,
+	// a lambda expression in it couldn't be compiled
+	VM_COMPILE_FAIL_NESTED,
+
+	VM_COMPILE_NUM_FAILS,
+};
+
+// counts of compiler results, printed with `-s`
+typedef struct vm_compile_stats {
+	// lambdas compiled, at any tier
+	unsigned compiled;
+	// failed attempts at compiling a lambda, by reason
+	unsigned failed[VM_COMPILE_NUM_FAILS];
+	// lambdas left to the tree walker after VM_MAX_COMPILE_FAILURES
+	// attempts, by the reason of the last one
+	unsigned given_up[VM_COMPILE_NUM_FAILS];
+	// uses of global variables built into optimized code, and the times
+	// code was thrown out for a write to one, see vm_var_written()
+	unsigned stable_uses;
+	unsigned stable_writes;
+	// what the call site caches of code which was freed counted
+	uint64_t freed_hits;
+	uint64_t freed_misses;
+} vm_compile_stats_t;
+
+// when closures move up tiers, a threshold of 0 disables that tier
+typedef struct vm_tier_settings {
+	// compile closures to baseline code when they're created
+	bool eager;
+	// calls before an interpreted closure is compiled
+	unsigned compile_calls;
+	// calls to baseline code before it's recompiled by the optimizing tier
+	unsigned optimize_calls;
+	// loops taken by baseline code before it's recompiled, on its next call
+	unsigned optimize_loops;
+} vm_tier_settings_t;
+
+// how top-level forms are run, see vm_evaluate_expr()
+enum {
+	// by the tree walker
+	VM_TOPLEVEL_INTERP,
+	// each form is compiled as a closure taking no arguments
+	VM_TOPLEVEL_FORMS,
+	// the expressions between definitions in a file are compiled
+	// together, see vm_evaluate_body()
+	VM_TOPLEVEL_FILE,
+};
+
+#define VM_NO_OSR_ENTRY (~0u)
+
+// `ip` of call frames which return into the tree walker, the rest of the
+// state for those is kept on the `interp_calls` stack
+#define VM_FRAME_INTERP (~0u)
+
 typedef struct vm_frame {
 	scm_closure_t *closure;
+	// op to return to, or VM_FRAME_INTERP
+	unsigned ip;
+	// frame pointer of the caller
+	unsigned fp;
+} vm_callframe_t;
 
-	unsigned sp;
-	unsigned argnum;
-	unsigned runmode;
+// tree walker state saved for call frames returning to it
+typedef struct vm_interp_frame {
+	// next token to evaluate
+	scm_value_t ptr;
+	environment_t *env;
+} vm_interp_frame_t;
+
+// default heap sizes, see vm_heap_settings_t
+#define VM_DEFAULT_HEAP_SIZE       0x8000
+#define VM_DEFAULT_MAX_HEAP_SIZE   ((size_t)1 << 32)
+#define VM_DEFAULT_HEAP_OCCUPANCY  50
+#define VM_DEFAULT_NURSERY_SIZE    0x40000
+#define VM_DEFAULT_GC_THREADS      1
+#define VM_GC_MAX_THREADS          64
+
+typedef struct vm_heap_settings {
+	// bytes the old generation starts out with, and the most it can grow to
+	size_t initial_size;
+	size_t max_size;
+	// percentage of the old generation that live data should take up after
+	// a collection. it grows when there's more, and shrinks when there's
+	// less than half as much
+	unsigned target_occupancy;
+	// bytes new blocks are allocated in before they're promoted
+	size_t nursery_size;
+	// microseconds a collection should pause the program for at most. the
+	// old generation is collected incrementally alongside minor collections
+	// when it's set, and all at once when it's 0
+	unsigned pause_target;
+	// threads collections of the whole heap mark and compact it with,
+	// counting the one the program runs on
+	unsigned threads;
+} vm_heap_settings_t;
+
+// phases of an incremental collection of the old generation, see gc.c
+enum {
+	GC_IDLE,
+	GC_PREPARE,
+	GC_MARK,
+	GC_SWEEP,
+};
 
-	union {
-		// similar to above, ip is used when `runmode` is true
-		unsigned ip;
-		// and `ptr` is used when the tree walker is used, to keep track
-		// of the next token to evaluate
-		struct {
-			scm_value_t ptr;
-			environment_t *env;
-		};
-	};
-} vm_callframe_t;
+// pauses are counted by the power of two microseconds they took under
+#define VM_GC_PAUSE_BUCKETS 24
 
-typedef struct scm_gc_context {
-	// start of the heap
-	uint8_t *base;
-	// end of the heap
+// part of the heap blocks are allocated in, see gc.c
+typedef struct vm_gc_space {
+	uint8_t *start;
 	uint8_t *end;
-	// current end of the allocations in the heap
+	// current end of the allocations in the space, and where the space
+	// they're made in ends. that's the end of the space, or a gap between
+	// blocks which couldn't be moved by the last collection
 	uint8_t *allocend;
+	uint8_t *limit;
+	// end of the last block, while there are gaps left
+	uint8_t *top;
+	// gaps left to allocate in after the current one, linked through the
+	// fillers in them
+	uint8_t *gaps;
+} vm_gc_space_t;
+
+typedef struct scm_gc_context {
+	vm_heap_settings_t settings;
+
+	// start of the heap. `reserved` bytes of address space from `base` are
+	// reserved when the heap is made, the nursery takes up the start of it
+	// and the old generation grows into the rest
+	uint8_t *base;
+	size_t reserved;
+	vm_gc_space_t nursery;
+	vm_gc_space_t old;
+
+	// highest address of the C stack, which is scanned for values held by
+	// C code that allocates
+	uintptr_t stack_base;
+
+	// state of the collection in progress, see gc.c
+	unsigned cycle;
+	// whether only the nursery is being collected
+	bool minor;
+	// set when promoted blocks didn't fit the old generation, which is
+	// collected next
+	bool old_full;
+	// bitmap of where blocks start, one bit for every 16 bytes of the heap
+	uint64_t *starts;
+	size_t starts_size;
+	// blocks which were marked but not yet scanned, linked by their headers
+	void *queue_head;
+	void *queue_tail;
+	// closures, lambdas, environments and variables traced, tagged with
+	// their kind in the low bits
+	uintptr_t *objects;
+	size_t num_objects;
+	size_t max_objects;
+	size_t scanned;
+	// closures and variables made by compiled code, tagged like `objects`,
+	// which are freed once a collection of the whole heap doesn't trace
+	// them. `owned_bytes` were made since the last one, which left
+	// `owned_live`, and `owned_sliced` of those were at the last slice,
+	// see vm_check_owned()
+	uintptr_t *owned;
+	size_t num_owned;
+	size_t max_owned;
+	size_t owned_bytes;
+	size_t owned_live;
+	size_t owned_sliced;
+	// helper threads for collections of the whole heap, started by the
+	// first one with more than one thread set, see gc.c
+	void *helpers;
+	// what might reference young blocks from outside the nursery, see
+	// gc_write_barrier()
+	uintptr_t *remembered;
+	size_t num_remembered;
+	size_t max_remembered;
+
+	// state of the incremental collection in progress, if `phase` isn't
+	// GC_IDLE. it collects the old blocks before `mark_top`, what's
+	// allocated after is live and scanned from `tail_scan` on. `cursor` is
+	// how far the block starts were found or the heap was swept, see
+	// run_slice()
+	unsigned phase;
+	uint8_t *mark_top;
+	uint8_t *tail_scan;
+	uint8_t *cursor;
+	uint8_t *sweep_to;
+	uint8_t *last_gap;
+	size_t cleared;
+	// bytes allocated in the old generation since the last collection, and
+	// as of the last incremental slice. slices do `pace` steps of work for
+	// every kilobyte allocated
+	size_t allocated;
+	size_t sliced;
+	size_t pace;
+
+	// totals for the stats printed with `-s`
+	unsigned collections;
+	unsigned minor_collections;
+	size_t reclaimed;
+	size_t promoted;
+	size_t pinned;
+	// bytes of live blocks left in the old generation by the last collection
+	size_t live;
+	unsigned grown;
+	unsigned shrunk;
+	size_t peak_size;
+	unsigned incremental_collections;
+	unsigned pauses[VM_GC_PAUSE_BUCKETS];
+	uint64_t pause_total;
+	uint64_t pause_max;
+	size_t stolen;
+	size_t freed;
 } vm_gc_context_t;
 
 typedef struct vm_handle {
@@ -117,6 +557,9 @@ typedef struct vm {
 	// data for threaded interpreter
 	unsigned ip;
 	unsigned sp;
+	// base of the current frame, the procedure being applied is at
+	// `stack[fp]` followed by its arguments
+	unsigned fp;
 	unsigned callp;
 	bool running;
 
@@ -128,12 +571,31 @@ typedef struct vm {
 	// data for interpreter
 	environment_t *env;
 	scm_value_t ptr;
+	vm_interp_frame_t *interp_calls;
+	unsigned interp_callp;
 
 	// general
-	unsigned argnum;
 	unsigned stack_size;
 	unsigned calls_size;
 	unsigned runmode;
+	unsigned engine;
+	vm_tier_settings_t tiers;
+	// one of the VM_TOPLEVEL_* modes
+	unsigned toplevel;
+	vm_compile_stats_t compile_stats;
+
+	// hash table of lambdas by definition, see vm_lambda_for()
+	vm_lambda_t **lambdas;
+	unsigned lambdas_size;
+	unsigned num_lambdas;
+
+	// bumped when compiled code is replaced, which empties the inline
+	// caches of call sites, see vm_call_cache_t
+	unsigned code_epoch;
+	// every call site's cache, for the stats printed with `-s`
+	vm_call_cache_t *call_caches;
+	// variables optimized code embedded the values of
+	vm_var_watch_t *var_watches;
 
 	vm_gc_context_t gc;
 	const char *errormsg;
@@ -147,14 +609,44 @@ typedef struct vm {
 vm_t *vm_init(void);
 void  vm_free(vm_t *vm);
 void  vm_run(vm_t *vm);
+void  vm_run_direct(vm_t *vm);
+bool  vm_run_native(vm_t *vm);
+void  vm_direct_free(vm_t *vm, vm_lambda_t *lambda);
+void  vm_native_free(vm_t *vm, vm_lambda_t *lambda);
+size_t vm_native_size(vm_lambda_t *lambda);
 void  vm_error(vm_t *vm, const char *msg);
 void  vm_panic(vm_t *vm, const char *msg);
 void  vm_clear_error(vm_t *vm);
 
 void  *vm_alloc(vm_t *vm, size_t n);
-void   gc_init(vm_gc_context_t *gc, size_t initial_size);
+void  *vm_alloc_tenured(vm_t *vm, size_t n);
+void   vm_check_owned(vm_t *vm);
+void   gc_init(vm_gc_context_t *gc);
+void   gc_apply_settings(vm_gc_context_t *gc);
+void   gc_free(vm_gc_context_t *gc);
 void  *gc_alloc(vm_gc_context_t *gc, size_t n);
+void  *gc_alloc_tenured(vm_gc_context_t *gc, size_t n);
 size_t gc_collect_vm(vm_gc_context_t *gc, vm_t *vm);
+size_t gc_collect_young(vm_gc_context_t *gc, vm_t *vm);
+void   gc_write_barrier(vm_gc_context_t *gc, void *ptr, scm_value_t value);
+void   gc_remember_closure(vm_gc_context_t *gc, scm_closure_t *clsr);
+void   gc_remember_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda);
+void   gc_own_closure(vm_gc_context_t *gc, scm_closure_t *clsr);
+void   gc_own_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda);
+void   gc_own_variable(vm_gc_context_t *gc, env_node_t *var);
+
+#include <stdio.h>
+void vm_dump_compile_stats(vm_t *vm, FILE *fp);
+void gc_dump_stats(vm_gc_context_t *gc, FILE *fp);
+
+vm_effects_t *vm_closure_effects(vm_t *vm, scm_closure_t *clsr);
+unsigned vm_call_effects(vm_t *vm, scm_value_t proc, unsigned nargs,
+                         vm_effects_t **deps);
+
+#ifdef VM_PROFILE_OPS
+void vm_profile_op(vm_func func);
+void vm_profile_dump(FILE *fp);
+#endif
 
 void vm_handles_init(vm_handle_stack_t *stack, size_t initial_size);
 int  vm_handle_alloc(vm_t *vm);
@@ -164,6 +656,10 @@ scm_value_t vm_handle_get(vm_t *vm, int handle);
 void        vm_handle_set(vm_t *vm, int handle, scm_value_t);
 
 scm_value_t vm_evaluate_expr(vm_t *vm, scm_value_t expr);
+scm_value_t vm_evaluate_body(vm_t *vm, scm_value_t body);
+bool vm_is_definition(vm_t *vm, scm_value_t expr);
+
+vm_lambda_t *vm_lambda_for(vm_t *vm, scm_value_t args, scm_value_t body);
 
 static inline scm_value_t construct_pair(vm_t *vm, scm_value_t car, scm_value_t cdr) {
 	scm_pair_t *pair = vm_alloc(vm, sizeof(scm_pair_t));
@@ -174,4 +670,17 @@ static inline scm_value_t construct_pair(vm_t *vm, scm_value_t car, scm_value_t
 	return tag_pair(pair);
 }
 
+// pairs of code are kept for as long as the lambdas made from them, so
+// they're made in the old generation straight away
+static inline scm_value_t construct_tenured_pair(vm_t *vm, scm_value_t car, scm_value_t cdr) {
+	scm_pair_t *pair = vm_alloc_tenured(vm, sizeof(scm_pair_t));
+
+	pair->car = car;
+	pair->cdr = cdr;
+	gc_write_barrier(&vm->gc, pair, car);
+	gc_write_barrier(&vm->gc, pair, cdr);
+
+	return tag_pair(pair);
+}
+
 #endif
@@ -7,51 +7,127 @@
 
 static inline void vm_stack_push(vm_t *vm, scm_value_t value) {
 	vm->stack[vm->sp++] = value;
-	vm->argnum++;
 }
 
 static inline scm_value_t vm_stack_pop(vm_t *vm) {
-	vm->argnum--;
 	return vm->stack[--vm->sp];
 }
 
+// number of values in the current frame, including the procedure
+static inline unsigned vm_argnum(vm_t *vm) {
+	return vm->sp - vm->fp;
+}
+
 static inline scm_value_t vm_stack_peek(vm_t *vm) {
 	return vm->stack[vm->sp - 1];
 }
 
+// superinstructions which take two small operands (stack slots, closure
+// indexes, call offsets) pack them into the low and high halves of the arg
+static inline uintptr_t vm_pack_args(unsigned low, unsigned high) {
+	return (uintptr_t)low | ((uintptr_t)high << 32);
+}
+
+static inline unsigned vm_arg_low(uintptr_t arg) {
+	return arg & 0xffffffff;
+}
+
+static inline unsigned vm_arg_high(uintptr_t arg) {
+	return arg >> 32;
+}
+
+// true if `value` is the builtin procedure implemented by `func`,
+// see vm_add_arithmetic_op()
+static inline bool vm_is_builtin(scm_value_t value, vm_func func) {
+	if (!is_closure(value)) {
+		return false;
+	}
+
+	scm_closure_t *closure = get_closure(value);
+	return closure->lambda->compiled && closure->lambda->code[0].func == func;
+}
+
+// guard for inlined builtins: `index` is the closure slot that the builtin
+// was referenced through, which might have been redefined since compiling
+static inline bool vm_inline_guard(vm_t *vm, uintptr_t index, vm_func func) {
+	return vm_is_builtin(vm->closure->closures[index]->value, func);
+}
+
+// true if calls to `closure` can skip vm_call_apply() and start at its
+// first op: it's compiled, bound, and not baseline code, which counts its
+// calls there
+static inline bool vm_call_cacheable(scm_closure_t *closure) {
+	vm_lambda_t *lambda = closure->lambda;
+
+	return lambda->compiled && lambda->tier != VM_TIER_BASELINE
+	    && closure->bound == lambda->varnames;
+}
+
+// where the code of `callee` starts if the call site's cache has it, or
+// NULL if it has to be called the long way and maybe added with
+// vm_call_cache_fill()
+static inline const void *vm_call_cache_lookup(vm_t *vm, vm_call_cache_t *cache,
+                                               scm_value_t callee)
+{
+	// unused entries hold a callee nothing is equal to
+	for (unsigned i = 0; i < VM_CALL_CACHE_WAYS; i++) {
+		if (cache->entries[i].callee == callee
+		    && cache->epoch == vm->code_epoch)
+		{
+			cache->hits++;
+			return cache->entries[i].code;
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
 // this routine will always be called from an interpreting context,
 // a compiled closure will call a different procedure
 //
 // TODO: insert routine compiled closures will call, for reference
 static inline void vm_call_eval(vm_t *vm, scm_value_t ptr) {
 	vm_callframe_t *frame = vm->calls + vm->callp++;
+	vm_interp_frame_t *iframe = vm->interp_calls + vm->interp_callp++;
 
 	frame->closure = vm->closure;
-	frame->sp      = vm->sp;
-	frame->argnum  = vm->argnum;
-	frame->ptr     = vm->ptr;
-	frame->env     = vm->env;
-	frame->runmode = RUN_MODE_INTERP;
+	frame->ip      = VM_FRAME_INTERP;
+	frame->fp      = vm->fp;
+	iframe->ptr    = vm->ptr;
+	iframe->env    = vm->env;
 
-	vm->argnum = 0;
-	vm->ptr    = ptr;
+	vm->fp  = vm->sp;
+	vm->ptr = ptr;
 }
 
+bool vm_osr_enter(vm_t *vm);
+
 static inline void vm_call_return(vm_t *vm) {
 	if (vm->callp > 0) {
 		vm_callframe_t *frame = vm->calls + --vm->callp;
 
-		vm->sp      = frame->sp + 1;
+		// the return value is left at the base of the returning frame
+		vm->sp      = vm->fp + 1;
+		vm->fp      = frame->fp;
 		vm->closure = frame->closure;
-		vm->argnum  = frame->argnum + 1;
-		vm->runmode = frame->runmode;
 
-		if (vm->runmode == RUN_MODE_COMPILED) {
-			vm->ip = frame->ip;
+		if (frame->ip != VM_FRAME_INTERP) {
+			vm->runmode = RUN_MODE_COMPILED;
+			vm->ip      = frame->ip;
 
 		} else {
-			vm->ptr = frame->ptr;
-			vm->env = frame->env;
+			vm_interp_frame_t *iframe = vm->interp_calls + --vm->interp_callp;
+
+			vm->runmode = RUN_MODE_INTERP;
+			vm->ptr     = iframe->ptr;
+			vm->env     = iframe->env;
+
+			// the closure might have been compiled since the
+			// activation started
+			if (vm->closure->lambda->osr_entries) {
+				vm_osr_enter(vm);
+			}
 		}
 
 	} else {
@@ -60,12 +136,22 @@ static inline void vm_call_return(vm_t *vm) {
 	}
 }
 
+scm_closure_t *vm_make_builtin(vm_func func, vm_func next);
 scm_value_t vm_func_return_last(void);
 scm_value_t vm_func_intern_define(void);
 scm_value_t vm_func_intern_set(void);
 scm_value_t vm_func_intern_if(void);
 
 void vm_call_apply(vm_t *vm);
+void vm_call_cache_init(vm_t *vm, vm_call_cache_t *cache);
+void vm_call_cache_fill(vm_t *vm, vm_call_cache_t *cache,
+                        scm_value_t callee, const void *code);
+void vm_call_cache_unlink(vm_t *vm, vm_call_cache_t *cache);
+bool vm_tier_up(vm_t *vm, scm_closure_t *clsr, unsigned tier);
+bool vm_bind_closure(vm_t *vm, scm_closure_t *clsr);
+void vm_watch_var(vm_t *vm, env_node_t *var, scm_closure_t *clsr);
+void vm_var_written(vm_t *vm, env_node_t *var);
+void vm_free_lambda(vm_t *vm, vm_lambda_t *lambda);
 
 bool vm_op_return(vm_t *vm, uintptr_t arg);
 bool vm_op_return_last(vm_t *vm, uintptr_t arg);
@@ -75,9 +161,131 @@ bool vm_op_jump_if_false(vm_t *vm, uintptr_t arg);
 bool vm_op_closure_ref(vm_t *vm, uintptr_t arg);
 bool vm_op_stack_ref(vm_t *vm, uintptr_t arg);
 bool vm_op_push_const(vm_t *vm, uintptr_t arg);
+bool vm_op_make_closure(vm_t *vm, uintptr_t arg);
+
+// boxes are tagged as external pointers. they're never seen outside of
+// the frame they're in and closures capturing them, but the collector
+// has to find the values in them
+static inline scm_value_t vm_tag_box(env_node_t *box) {
+	return tag_heap_type(box, SCM_TYPE_EXTERNAL_PTR);
+}
+
+static inline env_node_t *vm_get_box(scm_value_t value) {
+	return get_heap_tagged_value(value);
+}
+
+bool vm_op_box(vm_t *vm, uintptr_t arg);
+bool vm_op_box_ref(vm_t *vm, uintptr_t arg);
+bool vm_op_box_set(vm_t *vm, uintptr_t arg);
+bool vm_op_closure_set(vm_t *vm, uintptr_t arg);
+bool vm_op_box_init(vm_t *vm, uintptr_t arg);
+bool vm_op_drop(vm_t *vm, uintptr_t arg);
+bool vm_op_slide(vm_t *vm, uintptr_t arg);
+bool vm_op_stack_set(vm_t *vm, uintptr_t arg);
+bool vm_op_set_sp(vm_t *vm, uintptr_t arg);
+
+// true if the builtins folded, and the procedures inlined, into the code of
+// `clsr` are still there
+static inline bool vm_fold_guard_holds(scm_closure_t *clsr, vm_fold_guard_t *guard) {
+	for (unsigned i = 0; i < guard->num_slots; i++) {
+		env_node_t *var = guard->slots[i].var;
+
+		if (!var) {
+			var = clsr->closures[guard->slots[i].index];
+		}
+
+		if (var->value != guard->slots[i].value) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// the VM_TYPE_* kind of `value`
+static inline unsigned vm_value_type(scm_value_t value) {
+	return is_integer(value)? VM_TYPE_FIXNUM
+	     : is_pair(value)?    VM_TYPE_PAIR
+	     : is_null(value)?    VM_TYPE_NULL
+	     : is_closure(value)? VM_TYPE_CLOSURE
+	     :                    VM_TYPE_OTHER;
+}
+
+// true if the arguments with bits set in `mask` are fixnums, see
+// vm_fold_guard_t
+static inline bool vm_fixnum_args_hold(scm_value_t *args, uint32_t mask) {
+	for (unsigned i = 0; mask; i++, mask >>= 1) {
+		if ((mask & 1) && !is_integer(args[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool vm_op_fold_guard(vm_t *vm, uintptr_t arg);
+bool vm_op_profile_args(vm_t *vm, uintptr_t arg);
 bool vm_op_do_call(vm_t *vm, uintptr_t arg);
 bool vm_op_do_tailcall(vm_t *vm, uintptr_t arg);
 
+void vm_inline_fallback(vm_t *vm, uintptr_t index, unsigned nargs, unsigned retip);
+
+// records a failed guard on closure slot `index`, for the optimizing tier
+static inline void vm_guard_missed(vm_t *vm, uintptr_t index) {
+	uint32_t *misses = vm->closure->lambda->guard_misses;
+
+	if (misses) {
+		misses[index]++;
+	}
+}
+
+// superinstructions, see peephole_optimize() in compiler.c
+bool vm_op_stack_ref2(vm_t *vm, uintptr_t arg);
+bool vm_op_closure_ref2(vm_t *vm, uintptr_t arg);
+bool vm_op_closure_stack_ref(vm_t *vm, uintptr_t arg);
+bool vm_op_stack_ref_call(vm_t *vm, uintptr_t arg);
+bool vm_op_ref_const_call(vm_t *vm, uintptr_t arg);
+
+// inlined builtins, see inline_primitive() in compiler.c
+bool vm_op_inline_add(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_sub(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_lessthan(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_greaterthan(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_equal(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_car(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_cdr(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_is_null(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_is_pair(vm_t *vm, uintptr_t arg);
+bool vm_op_inline_cons(vm_t *vm, uintptr_t arg);
+bool vm_op_lt_jump(vm_t *vm, uintptr_t arg);
+bool vm_op_gt_jump(vm_t *vm, uintptr_t arg);
+bool vm_op_null_jump(vm_t *vm, uintptr_t arg);
+
+// the same for operands known to be fixnums, which the forms above check
+// for, see is_fixnum_expr() in optimize.c
+bool vm_op_fix_add(vm_t *vm, uintptr_t arg);
+bool vm_op_fix_sub(vm_t *vm, uintptr_t arg);
+bool vm_op_fix_lessthan(vm_t *vm, uintptr_t arg);
+bool vm_op_fix_greaterthan(vm_t *vm, uintptr_t arg);
+bool vm_op_fix_lt_jump(vm_t *vm, uintptr_t arg);
+bool vm_op_fix_gt_jump(vm_t *vm, uintptr_t arg);
+
+// self tail calls, see compile_self_tail_call() in compiler.c
+static inline bool vm_tail_skipped(uintptr_t arg, unsigned i) {
+	return i < 32 && (vm_arg_high(arg) & (1u << i));
+}
+
+bool vm_op_self_tail_guard(vm_t *vm, uintptr_t arg);
+bool vm_op_store_args(vm_t *vm, uintptr_t arg);
+bool vm_op_loop_guard(vm_t *vm, uintptr_t arg);
+
+// true once baseline code has looped `back_edges` times and should be
+// replaced, see vm_op_loop_guard()
+static inline bool vm_loop_is_hot(vm_t *vm, unsigned back_edges) {
+	return vm->tiers.optimize_loops
+	    && back_edges >= vm->tiers.optimize_loops;
+}
+
 bool vm_op_add(vm_t *vm, uintptr_t arg);
 bool vm_op_sub(vm_t *vm, uintptr_t arg);
 bool vm_op_mul(vm_t *vm, uintptr_t arg);
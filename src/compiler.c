@@ -98,6 +98,161 @@ static inline instr_node_t *add_instr_node(comp_state_t *state,
 	return node;
 }
 
+env_node_t *closure_var_ref(comp_state_t *state, unsigned index) {
+	closure_node_t *temp = state->closed_vars;
+
+	// the closure list is kept newest-first
+	for (unsigned i = state->closure_ptr - 1; temp && i != index; i--) {
+		temp = temp->next;
+	}
+
+	return temp? temp->var_ref : NULL;
+}
+
+static inline unsigned comp_list_length(comp_node_t *comp) {
+	unsigned length = 0;
+
+	for (; comp && comp->car; comp = comp->cdr) {
+		length++;
+	}
+
+	return length;
+}
+
+// true if guards on `var` failed in the baseline code being replaced, the
+// optimizing tier calls through those variables instead of inlining them
+bool is_unstable_var(comp_state_t *state, env_node_t *var) {
+	vm_lambda_t *lambda = state->closure->lambda;
+
+	if (state->tier != VM_TIER_OPTIMIZED || !lambda->guard_misses) {
+		return false;
+	}
+
+	for (unsigned i = 0; i < lambda->num_slots; i++) {
+		if (lambda->varnames[i] == var->key && lambda->guard_misses[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static const struct {
+	vm_func  builtin;
+	unsigned num_args;
+	unsigned instr;
+} inline_prims[] = {
+	{ vm_op_add,         2, INSTR_ADD2 },
+	{ vm_op_sub,         2, INSTR_SUB2 },
+	{ vm_op_lessthan,    2, INSTR_LT },
+	{ vm_op_greaterthan, 2, INSTR_GT },
+	{ vm_op_equal,       2, INSTR_EQ },
+	{ vm_op_car,         1, INSTR_CAR },
+	{ vm_op_cdr,         1, INSTR_CDR },
+	{ vm_op_is_null,     1, INSTR_IS_NULL },
+	{ vm_op_is_pair,     1, INSTR_IS_PAIR },
+	{ vm_op_cons,        2, INSTR_CONS },
+};
+
+// returns the instruction to open-code a call with, if the procedure
+// currently resolves to a builtin with an inline form, or INSTR_NONE
+static inline unsigned inline_primitive(comp_state_t *state, comp_node_t *call) {
+	comp_node_t *func = call->car;
+
+	if (!func || !func->node || func->node->type != SCOPE_CLOSURE) {
+		return INSTR_NONE;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+	unsigned num_args = comp_list_length(call->cdr);
+
+	if (var && is_unstable_var(state, var)) {
+		return INSTR_NONE;
+	}
+
+	for (unsigned i = 0; var && i < sizeof(inline_prims) / sizeof(inline_prims[0]); i++) {
+		if (vm_is_builtin(var->value, inline_prims[i].builtin)
+		    && num_args == inline_prims[i].num_args)
+		{
+			return inline_prims[i].instr;
+		}
+	}
+
+	return INSTR_NONE;
+}
+
+static const struct {
+	unsigned instr;
+	unsigned fixnum_instr;
+} fixnum_prims[] = {
+	{ INSTR_ADD2, INSTR_FIX_ADD },
+	{ INSTR_SUB2, INSTR_FIX_SUB },
+	{ INSTR_LT,   INSTR_FIX_LT },
+	{ INSTR_GT,   INSTR_FIX_GT },
+};
+
+// open-coded arithmetic checks that it's given fixnums, unless the
+// optimizer knows that the arguments are
+static inline unsigned specialize_primitive(comp_state_t *state,
+                                            comp_node_t *call,
+                                            unsigned prim)
+{
+	if (state->tier != VM_TIER_OPTIMIZED) {
+		return prim;
+	}
+
+	for (unsigned i = 0; i < sizeof(fixnum_prims) / sizeof(fixnum_prims[0]); i++) {
+		if (fixnum_prims[i].instr == prim
+		    && is_fixnum_expr(state, call->cdr->car)
+		    && is_fixnum_expr(state, call->cdr->cdr->car))
+		{
+			return fixnum_prims[i].fixnum_instr;
+		}
+	}
+
+	return prim;
+}
+
+// if the test of an `if` was open-coded, it can branch directly
+static inline void fuse_branch_test(comp_state_t *state) {
+	instr_node_t *test = state->last_instr;
+
+	switch (test? test->instr : INSTR_NONE) {
+		case INSTR_LT:      test->instr = INSTR_LT_JUMP;     break;
+		case INSTR_GT:      test->instr = INSTR_GT_JUMP;     break;
+		case INSTR_FIX_LT:  test->instr = INSTR_FIX_LT_JUMP; break;
+		case INSTR_FIX_GT:  test->instr = INSTR_FIX_GT_JUMP; break;
+		case INSTR_IS_NULL: test->instr = INSTR_NULL_JUMP;   break;
+		default: break;
+	}
+}
+
+static inline bool is_proper_list(scm_value_t value) {
+	while (is_pair(value)) {
+		value = get_pair(value)->cdr;
+	}
+
+	return is_null(value);
+}
+
+// true if `call` calls the closure being compiled through its own binding,
+// with as many arguments as it takes
+bool is_self_call(comp_state_t *state, comp_node_t *call) {
+	comp_node_t *func = call->car;
+
+	if (!func || !func->node || func->node->type != SCOPE_CLOSURE) {
+		return false;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+
+	return var
+	    && var->value == tag_closure(state->closure)
+	    && !is_unstable_var(state, var)
+	    && is_proper_list(state->closure->lambda->args)
+	    && comp_list_length(call->cdr) == list_length(state->closure->lambda->args);
+}
+
 static inline void compile_value(comp_state_t *state,
                                  comp_node_t *comp)
 {
@@ -106,6 +261,7 @@ static inline void compile_value(comp_state_t *state,
 	//if ( is_symbol( comp->value )){
 	if (comp->node) {
 		unsigned loc = comp->node->location;
+		env_node_t *var;
 
 		switch (comp->node->type) {
 		case SCOPE_PARAMETER:
@@ -120,7 +276,25 @@ static inline void compile_value(comp_state_t *state,
 
 		case SCOPE_CLOSURE:
 			DEBUG_PRINTF("c closure ref %u  : ", loc);
-			add_instr_node(state, INSTR_CLOSURE_REF, loc);
+
+			// procedures are still called through their slots, which
+			// the call ops are specialized for. pairs could be moved by
+			// a collection before the code is stored and pins them
+			var = closure_var_ref(state, loc);
+
+			if (var && !is_closure(var->value) && !is_pair(var->value)
+			    && use_stable_global(state, var))
+			{
+				add_instr_node(state, INSTR_PUSH_CONSTANT, var->value);
+			} else {
+				add_instr_node(state, INSTR_CLOSURE_REF, loc);
+			}
+			break;
+
+		case SCOPE_MUTABLE_PARAMETER:
+		case SCOPE_MUTABLE_LOCAL:
+			DEBUG_PRINTF("b     box ref %u  : ", loc);
+			add_instr_node(state, INSTR_BOX_REF, loc);
 			break;
 
 		default:
@@ -142,10 +316,140 @@ static inline void compile_if_expression(comp_state_t *state,
         comp_node_t *comp,
         bool tail);
 
+// stores the value on top of the stack into `target`, which stays there as
+// the value of the set!
+static inline void compile_assignment(comp_state_t *state, comp_node_t *target) {
+	scope_node_t *node = target->node;
+
+	if (node->type == SCOPE_CLOSURE) {
+		add_instr_node(state, INSTR_CLOSURE_SET, node->location);
+
+	} else {
+		// anything on the stack that's assigned to is boxed, see
+		// find_assigned() in scope.c
+		add_instr_node(state, INSTR_BOX_SET, node->location);
+	}
+}
+
 static inline void compile_expression_list(comp_state_t *state,
         comp_node_t *comp,
         bool tail);
 
+// returns the number of values left on the stack, the value of the local
+// stays there as its slot unless the slot was made up front
+static inline unsigned compile_definition(comp_state_t *state, comp_node_t *form) {
+	scope_node_t *local = form->cdr->car->node;
+
+	if (form->proto) {
+		// (define (name . args) body ...)
+		add_instr_node(state, INSTR_MAKE_CLOSURE, (uintptr_t)form->proto);
+
+	} else {
+		compile_expression_list(state, form->cdr->cdr, false);
+	}
+
+	if (state->letrec) {
+		add_instr_node(state, INSTR_BOX_INIT, local->location);
+		return 0;
+	}
+
+	if (local->type == SCOPE_MUTABLE_LOCAL) {
+		add_instr_node(state, INSTR_BOX, local->location);
+	}
+
+	return 1;
+}
+
+// only the value of the last expression in a begin is kept
+static inline void compile_begin(comp_state_t *state, comp_node_t *exprs, bool tail) {
+	for (; exprs && exprs->car; exprs = exprs->cdr) {
+		if (exprs->cdr && exprs->cdr->car) {
+			comp_node_t single = { .car = exprs->car, .cdr = NULL };
+
+			compile_expression_list(state, &single, false);
+			add_instr_node(state, INSTR_DROP, 0);
+			state->stack_ptr--;
+
+		} else {
+			// the rest of the list ends here, so it's still in tail
+			// position
+			compile_expression_list(state, exprs, tail);
+		}
+	}
+}
+
+// a call to a procedure whose body optimize_tree() put in its place. the
+// arguments are pushed into the slots of its parameters, and the value of
+// the body is moved down over them. arguments which were propagated into
+// the body aren't pushed at all
+static inline void compile_inlined_call(comp_state_t *state,
+                                        comp_node_t *call,
+                                        bool tail)
+{
+	comp_inline_t *inlined = call->inlined;
+	unsigned base = state->stack_ptr;
+	unsigned pushed = 0;
+	unsigned i = 0;
+
+	for (comp_node_t *arg = call->cdr; arg && arg->car; arg = arg->cdr, i++) {
+		comp_node_t single = { .car = arg->car, .cdr = NULL };
+
+		if (inlined->params[i]) {
+			inlined->params[i]->location = base + pushed++;
+			compile_expression_list(state, &single, false);
+		}
+	}
+
+	// tail calls in the body replace the frame, arguments and all
+	compile_begin(state, inlined->body, tail);
+
+	if (pushed) {
+		add_instr_node(state, INSTR_SLIDE, pushed);
+	}
+}
+
+// self tail calls loop back to the start of the closure, instead of
+// going through a call. arguments that are the parameter in the same
+// position are left where they are, see vm_op_self_tail_guard()
+static inline void compile_self_tail_call(comp_state_t *state, comp_node_t *call) {
+	unsigned nparams = 0;
+	uint32_t skipped = 0;
+	uint32_t retyped = 0;
+
+	for (comp_node_t *arg = call->cdr; arg && arg->car; arg = arg->cdr) {
+		comp_node_t *value = arg->car;
+
+		if (nparams < 32 && value->node
+		    && value->node->type == SCOPE_PARAMETER
+		    && value->node->location == nparams + 1)
+		{
+			skipped |= 1u << nparams;
+
+		} else {
+			if (nparams < 32 && (state->fixnum_args & (1u << nparams))
+			    && !is_fixnum_expr(state, value))
+			{
+				retyped |= 1u << nparams;
+			}
+
+			comp_node_t single = { .car = value, .cdr = NULL };
+			compile_expression_list(state, &single, false);
+		}
+
+		nparams++;
+	}
+
+	// baseline code counts its loops, see vm_call_apply()
+	add_instr_node(state,
+	               (state->tier == VM_TIER_BASELINE)
+	               ? INSTR_LOOP_GUARD
+	               : INSTR_SELF_TAIL_GUARD,
+	               call->car->node->location);
+	add_instr_node(state, INSTR_STORE_ARGS, vm_pack_args(nparams, skipped));
+	add_instr_node(state, INSTR_JUMP,
+	               retyped ? state->loop_entry : state->typed_entry);
+}
+
 static inline void compile_if_expression(comp_state_t *state,
         comp_node_t *comp,
         bool tail)
@@ -168,6 +472,7 @@ static inline void compile_if_expression(comp_state_t *state,
 
 	sp = state->stack_ptr;
 	compile_expression_list(state, &codebuf, false);
+	fuse_branch_test(state);
 
 	instr_node_t *false_jump = add_instr_node(state, INSTR_JUMP_IF_FALSE, 0);
 	codebuf.car = comp->cdr->cdr->car;
@@ -198,6 +503,8 @@ static inline void compile_expression_list(comp_state_t *state,
 	while (comp) {
 		if (comp->car && is_pair(comp->car->value)) {
 			unsigned sp = state->stack_ptr;
+			unsigned pushed = 1;
+			unsigned prim;
 
 			bool is_tail_call;
 			is_tail_call = tail && comp->cdr
@@ -213,18 +520,44 @@ static inline void compile_expression_list(comp_state_t *state,
 				compile_if_expression(state, comp->car, is_tail_call);
 
 			} else if (is_define_statement(state->env, comp->car)) {
-				// TODO: doesn't handle (define (...) ...) expressions yet,
-				//       will need to make a seperate function to handle define
-				//       compilation
 				DEBUG_PRINTF("    | emitting definition, sp: %u\n", sp);
-				compile_expression_list(state, comp->car->cdr->cdr, false);
+				pushed = compile_definition(state, comp->car);
 				DEBUG_PRINTF("    | done definition, sp: %u\n", sp);
 
+			} else if (is_quote_statement(state->env, comp->car)) {
+				add_instr_node(state, INSTR_PUSH_CONSTANT,
+				               comp->car->cdr->car->value);
+
+			} else if (is_set_statement(state->env, comp->car)) {
+				DEBUG_PRINTF("    | emitting assignment, sp: %u\n", sp);
+				compile_expression_list(state, comp->car->cdr->cdr, false);
+				compile_assignment(state, comp->car->cdr->car);
+
+			} else if (is_lambda_statement(state->env, comp->car)) {
+				DEBUG_PRINTF("    | making closure, sp: %u\n", sp);
+				add_instr_node(state, INSTR_MAKE_CLOSURE,
+				               (uintptr_t)comp->car->proto);
+
 			} else if (is_begin_statement(state->env, comp->car)) {
 				DEBUG_PRINTF("    | emitting begin form 1, sp: %u\n", sp);
-				compile_expression_list(state, comp->car->cdr, is_tail_call);
+				compile_begin(state, comp->car->cdr, is_tail_call);
 				DEBUG_PRINTF("    | done begin, sp: %u\n", sp);
 
+			} else if (is_tail_call && is_self_call(state, comp->car)) {
+				DEBUG_PRINTF("    | looping self tail call, sp: %u\n", sp);
+				compile_self_tail_call(state, comp->car);
+
+			} else if (comp->car->inlined) {
+				DEBUG_PRINTF("    | inlining procedure body, sp: %u\n", sp);
+				compile_inlined_call(state, comp->car, is_tail_call);
+
+			} else if ((prim = inline_primitive(state, comp->car))) {
+				DEBUG_PRINTF("    | inlining builtin call, sp: %u\n", sp);
+
+				compile_expression_list(state, comp->car->cdr, false);
+				add_instr_node(state, specialize_primitive(state, comp->car, prim),
+				               comp->car->car->node->location);
+
 			} else {
 
 				DEBUG_PRINTF("    | starting call,"
@@ -249,7 +582,13 @@ static inline void compile_expression_list(comp_state_t *state,
 				}
 			}
 
-			state->stack_ptr = sp + 1;
+			// kept for a later use of the same value, see cse.c
+			if (comp->car->saves) {
+				add_instr_node(state, INSTR_STACK_SET,
+				               comp->car->saves->location);
+			}
+
+			state->stack_ptr = sp + pushed;
 
 		} else if (comp->car) {
 			compile_value(state, comp->car);
@@ -259,13 +598,289 @@ static inline void compile_expression_list(comp_state_t *state,
 	}
 }
 
+// compiles the expressions of a closure's body, marking where each one
+// starts. the tree walker leaves the value of each expression on the stack
+// above the frame, same as compiled code, so an activation of the closure
+// can continue in compiled code from any of these
+static inline void compile_body(comp_state_t *state, comp_node_t *body) {
+	unsigned base = state->stack_ptr;
+
+	for (comp_node_t *expr = body; expr && expr->car; expr = expr->cdr) {
+		unsigned k = state->body_exprs++;
+		bool valid = state->stack_ptr == base + k;
+		instr_node_t *last = state->last_instr;
+
+		// the last expression is compiled with the terminator after it,
+		// so that it's seen as being in tail position
+		comp_node_t single = { .car = expr->car, .cdr = NULL };
+		bool is_last = expr->cdr && !expr->cdr->car;
+
+		comp_temps_t *temps = expr->car->temps;
+
+		// slots for values the expression uses more than once are
+		// reserved under it, and dropped with its value
+		if (temps) {
+			for (unsigned i = 0; i < temps->num_slots; i++) {
+				temps->slots[i]->location = state->stack_ptr;
+				add_instr_node(state, INSTR_PUSH_CONSTANT, tag_boolean(false));
+				state->stack_ptr++;
+			}
+		}
+
+		compile_expression_list(state, is_last? expr : &single, true);
+
+		if (temps) {
+			add_instr_node(state, INSTR_SLIDE, temps->num_slots);
+			state->stack_ptr -= temps->num_slots;
+		}
+
+		instr_node_t *entry = last? last->next : state->instrs;
+
+		// the tree walker keeps assigned variables in its environment
+		// rather than in boxes, so those activations stay there. values
+		// hoisted out of the loop aren't on its stack either
+		if (valid && entry && !entry->osr_entry
+		    && !state->has_boxes && !state->num_hoisted)
+		{
+			entry->osr_entry = k + 1;
+			// keeps the peephole pass from fusing the entry into the
+			// instruction before it
+			entry->is_target = true;
+		}
+	}
+}
+
+// computes the values hoist_invariants() moved out of the self tail call
+// loop into slots above the parameters, which self tail calls jump back
+// past. the guard is checked again on each trip, so the code can still be
+// thrown out while the frame holds nothing else
+static inline void compile_hoisted(comp_state_t *state, vm_fold_guard_t *guard) {
+	for (unsigned i = 0; i < state->num_hoisted; i++) {
+		comp_node_t single = { .car = state->hoisted[i], .cdr = NULL };
+
+		state->hoisted_slots[i]->location = state->stack_ptr;
+		compile_expression_list(state, &single, false);
+	}
+
+	instr_node_t *skip = add_instr_node(state, INSTR_JUMP, 0);
+	state->loop_entry = state->instr_ptr;
+	state->typed_entry = state->instr_ptr;
+
+	if (guard) {
+		add_instr_node(state, INSTR_FOLD_GUARD, (uintptr_t)guard);
+	}
+
+	if (guard && guard->num_slots == 0) {
+		state->typed_entry = state->instr_ptr;
+	}
+
+	add_instr_node(state, INSTR_SET_SP, state->stack_ptr);
+	skip->op = state->instr_ptr;
+}
+
+// closures made by the local definitions at the start of `body` capture
+// some of them, so each local gets its slot and box before any of the
+// definitions run, like letrec*. the definitions fill the boxes in
+static inline void compile_letrec_slots(comp_state_t *state, comp_node_t *body) {
+	for (; is_define_statement(state->env, body->car); body = body->cdr) {
+		scope_node_t *local = body->car->cdr->car->node;
+
+		// referring to a local before it's defined gives #f
+		add_instr_node(state, INSTR_PUSH_CONSTANT, tag_boolean(false));
+		add_instr_node(state, INSTR_BOX, local->location);
+		state->stack_ptr++;
+	}
+}
+
+static inline bool is_jump_instr(instr_node_t *node) {
+	return node->instr == INSTR_JUMP
+	    || node->instr == INSTR_JUMP_IF_FALSE;
+}
+
+// a node can only be folded into the instruction before it if nothing
+// jumps to it
+static inline bool is_fusable(instr_node_t *node, unsigned instr) {
+	return node && node->instr == instr && !node->is_target;
+}
+
+static inline void remove_instr_node(comp_state_t *state, instr_node_t *node) {
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		state->instrs = node->next;
+	}
+
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		state->last_instr = node->prev;
+	}
+
+	state->instr_ptr--;
+	free(node);
+}
+
+static inline void resolve_jump_targets(comp_state_t *state) {
+	instr_node_t **nodes = calloc(1, sizeof(instr_node_t *[state->instr_ptr]));
+	unsigned i = 0;
+
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		nodes[i++] = node;
+	}
+
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		if (is_jump_instr(node)) {
+			node->target = nodes[node->op];
+			node->target->is_target = true;
+		}
+	}
+
+	free(nodes);
+}
+
+static inline void renumber_jump_targets(comp_state_t *state) {
+	unsigned i = 0;
+
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		node->index = i++;
+	}
+
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		if (is_jump_instr(node)) {
+			node->op = node->target->index;
+		}
+	}
+}
+
+// jumps which land on a return can just return, and jumps to
+// unconditional jumps can go straight to the final target
+static inline void thread_jumps(comp_state_t *state) {
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		if (!is_jump_instr(node)) {
+			continue;
+		}
+
+		while (node->target->instr == INSTR_JUMP
+		       && node->target != node->target->target)
+		{
+			node->target = node->target->target;
+		}
+
+		if (node->instr == INSTR_JUMP && node->target->instr == INSTR_RETURN) {
+			node->instr = INSTR_RETURN;
+			node->op = 0;
+		}
+	}
+}
+
+// fuses the sequence of `count` instructions starting at `node` into `instr`
+static inline void fuse_instrs(comp_state_t *state,
+                               instr_node_t *node,
+                               unsigned count,
+                               unsigned instr,
+                               uintptr_t op)
+{
+	for (unsigned i = 1; i < count; i++) {
+		remove_instr_node(state, node->next);
+	}
+
+	node->instr = instr;
+	node->op    = op;
+}
+
+static inline void fuse_ref_const_call(comp_state_t *state) {
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		if (node->instr == INSTR_STACK_REF
+		    && is_fusable(node->next, INSTR_PUSH_CONSTANT)
+		    && is_fusable(node->next->next, INSTR_DO_CALL))
+		{
+			uintptr_t constant = node->next->op;
+			uintptr_t start    = node->next->next->op;
+
+			// the constant is kept in a data slot after the instruction
+			node->next->instr = INSTR_DATA;
+			node->next->op    = constant;
+			remove_instr_node(state, node->next->next);
+
+			node->instr = INSTR_REF_CONST_CALL;
+			node->op    = vm_pack_args(node->op, start);
+			node = node->next;
+		}
+	}
+}
+
+static inline void fuse_pairs(comp_state_t *state,
+                              unsigned first,
+                              unsigned second,
+                              unsigned fused)
+{
+	for (instr_node_t *node = state->instrs; node; node = node->next) {
+		if (node->instr == first && is_fusable(node->next, second)) {
+			fuse_instrs(state, node, 2, fused,
+			            vm_pack_args(node->op, node->next->op));
+		}
+	}
+}
+
+/*
+ * Rewrites common instruction sequences into superinstructions. The fused
+ * set comes from op pair/triple counts gathered with `./configure -P` over
+ * tests/bench and tests/src:
+ *
+ *   closure_ref stack_ref            10-14% of dispatched ops
+ *   stack_ref push_const do_call     ~11%, eg. (f (- n 1))
+ *   stack_ref stack_ref              ~9%
+ *   stack_ref do_call                ~9%
+ *   closure_ref closure_ref          4-8%
+ *
+ * Longer sequences are matched first, so that pairs don't split them up.
+ */
+static void peephole_optimize(comp_state_t *state) {
+	resolve_jump_targets(state);
+	thread_jumps(state);
+
+	fuse_ref_const_call(state);
+	fuse_pairs(state, INSTR_STACK_REF, INSTR_DO_CALL, INSTR_STACK_REF_CALL);
+	fuse_pairs(state, INSTR_CLOSURE_REF, INSTR_STACK_REF, INSTR_CLOSURE_STACK_REF);
+	fuse_pairs(state, INSTR_STACK_REF, INSTR_STACK_REF, INSTR_STACK_REF2);
+	fuse_pairs(state, INSTR_CLOSURE_REF, INSTR_CLOSURE_REF, INSTR_CLOSURE_REF2);
+
+	renumber_jump_targets(state);
+}
+
+// the slots holding variables the code has the values of built in, which
+// closures binding to the code have to find too, see vm_bind_closure()
+static inline env_node_t **store_stable_vars(comp_state_t *state,
+                                             scm_closure_t *closure)
+{
+	if (!state->stable_uses) {
+		return NULL;
+	}
+
+	env_node_t **ret = calloc(state->closure_ptr, sizeof(env_node_t *));
+
+	for (unsigned i = 0; i < state->closure_ptr; i++) {
+		for (unsigned k = 0; k < state->num_stable; k++) {
+			if (closure->closures[i] == state->stable[k]) {
+				ret[i] = state->stable[k];
+			}
+		}
+	}
+
+	return ret;
+}
+
 static inline void store_closed_vars(comp_state_t *state,
                                      scm_closure_t *closure)
 {
 	DEBUG_PRINTF("    | - closure ptr: %u\n", state->closure_ptr);
 
+	vm_lambda_t *lambda = closure->lambda;
+
 	//closure->closures = calloc(1, sizeof(env_node_t *[state->closure_ptr]));
-	closure->closures = vm_alloc(state->vm, sizeof(env_node_t *[state->closure_ptr]));
+	closure->closures = vm_alloc_tenured(state->vm, sizeof(env_node_t *[state->closure_ptr]));
+	closure->num_slots = state->closure_ptr;
+	scm_value_t *varnames = calloc(1, sizeof(scm_value_t[state->closure_ptr]));
 
 	closure_node_t *temp = state->closed_vars;
 	unsigned i = state->closure_ptr - 1;
@@ -276,11 +891,42 @@ static inline void store_closed_vars(comp_state_t *state,
 		DEBUG_PRINTF("    | - closure ref: %p : %s\n",
 		             temp->var_ref, get_symbol(temp->sym));
 
+		varnames[i]   = temp->sym;
 		closure->closures[i--] = temp->var_ref;
 
 		free(temp);
 		temp = next;
 	}
+
+	// closures bound to the code being replaced stay bound if the slots
+	// didn't change, which they don't when recompiling. they have to
+	// find the same variables as this one if the code relies on them
+	if (lambda->varnames && lambda->num_slots == state->closure_ptr
+	    && !state->stable_uses
+	    && memcmp(lambda->varnames, varnames,
+	              sizeof(scm_value_t[state->closure_ptr])) == 0)
+	{
+		free(varnames);
+
+	} else {
+		lambda->varnames = varnames;
+	}
+
+	lambda->num_slots = state->closure_ptr;
+	lambda->guard_misses = (state->tier == VM_TIER_BASELINE)
+	                       ? calloc(1, sizeof(uint32_t[state->closure_ptr]))
+	                       : NULL;
+	lambda->stable_vars = store_stable_vars(state, closure);
+	closure->bound = lambda->varnames;
+}
+
+static inline void free_closed_vars(comp_state_t *state) {
+	while (state->closed_vars) {
+		closure_node_t *next = state->closed_vars->next;
+
+		free(state->closed_vars);
+		state->closed_vars = next;
+	}
 }
 
 static inline void store_instructions(comp_state_t *state,
@@ -288,7 +934,10 @@ static inline void store_instructions(comp_state_t *state,
 {
 	DEBUG_PRINTF("    | - instruction ptr: %u\n", state->instr_ptr);
 
-	closure->code = calloc(1, sizeof(vm_op_t[state->instr_ptr]));
+	vm_lambda_t *lambda = closure->lambda;
+
+	lambda->code = calloc(1, sizeof(vm_op_t[state->instr_ptr]));
+	lambda->num_ops = state->instr_ptr;
 
 	unsigned i = 0;
 	for (instr_node_t *node = state->instrs; node;) {
@@ -303,6 +952,46 @@ static inline void store_instructions(comp_state_t *state,
 			"closure_ref",
 			"stack_ref",
 			"return",
+			"stack_ref2",
+			"closure_ref2",
+			"closure_stack_ref",
+			"stack_ref_call",
+			"ref_const_call",
+			"data",
+			"add2",
+			"sub2",
+			"lt",
+			"gt",
+			"eq",
+			"car",
+			"cdr",
+			"is_null",
+			"is_pair",
+			"cons",
+			"lt_jump",
+			"gt_jump",
+			"null_jump",
+			"self_tail_guard",
+			"store_args",
+			"loop_guard",
+			"make_closure",
+			"box",
+			"box_ref",
+			"box_set",
+			"closure_set",
+			"box_init",
+			"drop",
+			"fold_guard",
+			"slide",
+			"stack_set",
+			"set_sp",
+			"profile_args",
+			"fix_add",
+			"fix_sub",
+			"fix_lt",
+			"fix_gt",
+			"fix_lt_jump",
+			"fix_gt_jump",
 		};
 
 		vm_func opfuncs[] = {
@@ -315,10 +1004,55 @@ static inline void store_instructions(comp_state_t *state,
 			vm_op_closure_ref,
 			vm_op_stack_ref,
 			vm_op_return_last,
+			vm_op_stack_ref2,
+			vm_op_closure_ref2,
+			vm_op_closure_stack_ref,
+			vm_op_stack_ref_call,
+			vm_op_ref_const_call,
+			NULL,
+			vm_op_inline_add,
+			vm_op_inline_sub,
+			vm_op_inline_lessthan,
+			vm_op_inline_greaterthan,
+			vm_op_inline_equal,
+			vm_op_inline_car,
+			vm_op_inline_cdr,
+			vm_op_inline_is_null,
+			vm_op_inline_is_pair,
+			vm_op_inline_cons,
+			vm_op_lt_jump,
+			vm_op_gt_jump,
+			vm_op_null_jump,
+			vm_op_self_tail_guard,
+			vm_op_store_args,
+			vm_op_loop_guard,
+			vm_op_make_closure,
+			vm_op_box,
+			vm_op_box_ref,
+			vm_op_box_set,
+			vm_op_closure_set,
+			vm_op_box_init,
+			vm_op_drop,
+			vm_op_fold_guard,
+			vm_op_slide,
+			vm_op_stack_set,
+			vm_op_set_sp,
+			vm_op_profile_args,
+			vm_op_fix_add,
+			vm_op_fix_sub,
+			vm_op_fix_lessthan,
+			vm_op_fix_greaterthan,
+			vm_op_fix_lt_jump,
+			vm_op_fix_gt_jump,
 		};
 
-		closure->code[i].func = opfuncs[node->instr];
-		closure->code[i].arg  = node->op;
+		lambda->code[i].func = opfuncs[node->instr];
+		lambda->code[i].arg  = node->op;
+
+		if (node->osr_entry) {
+			lambda->osr_entries[node->osr_entry - 1] = i;
+		}
+
 		i += 1;
 
 		DEBUG_PRINTF("    | - instruction %3u: %14s : %lu\n",
@@ -331,7 +1065,7 @@ static inline void store_instructions(comp_state_t *state,
 	}
 }
 
-static inline comp_node_t *wrap_comp_values(scm_value_t value) {
+comp_node_t *wrap_comp_values(scm_value_t value) {
 	comp_node_t *ret = calloc(1, sizeof(comp_node_t));
 
 	ret->value = value;
@@ -367,52 +1101,293 @@ static inline void free_comp_values(comp_node_t *comp) {
 	if (comp) {
 		free_comp_values(comp->car);
 		free_comp_values(comp->cdr);
+		free_comp_temps(comp->temps);
+
+		if (comp->inlined) {
+			free_comp_values(comp->inlined->body);
+			free(comp->inlined->params);
+			free(comp->inlined);
+		}
 	}
 
 	free(comp);
 }
 
-scm_closure_t *vm_compile_closure(vm_t *vm, scm_closure_t *closure) {
+static scm_closure_t *compile_closure(vm_t *vm,
+                                      scm_closure_t *closure,
+                                      unsigned tier,
+                                      comp_state_t *parent,
+                                      scope_t *parent_scope)
+{
 	//scm_closure_t *ret = NULL;
+	vm_lambda_t *lambda = closure->lambda;
 	comp_state_t state;
 
-	DEBUG_PRINTF("    + compiling closure at %p\n", closure);
-	DEBUG_PRINTF("    | closure args: (%u) ", list_length(closure->args));
-	DEBUG_WRITEVAL(closure->args);
+	DEBUG_PRINTF("    + compiling closure at %p (tier %u)\n", closure, tier);
+	DEBUG_PRINTF("    | closure args: (%u) ", list_length(lambda->args));
+	DEBUG_WRITEVAL(lambda->args);
 	DEBUG_PRINTF("\n");
 
 	memset(&state, 0, sizeof(state));
 	state.closure = closure;
 	state.env = closure->env;
 	state.closed_vars = NULL;
-	state.stack_ptr = list_length(closure->args) + 1;
+	state.stack_ptr = list_length(lambda->args) + 1;
 	state.vm = vm;
+	state.tier = tier;
+	state.parent = parent;
+	state.parent_scope = parent_scope;
+
+	// recompiled code keeps the slots of the code it replaces, the
+	// variables of closures made by INSTR_MAKE_CLOSURE can't be looked
+	// up anywhere else
+	if (lambda->compiled && closure->bound == lambda->varnames) {
+		for (unsigned i = 0; i < lambda->num_slots; i++) {
+			add_closure_node(&state, closure->closures[i], lambda->varnames[i]);
+		}
+	}
 
-	comp_node_t *values = wrap_comp_values(closure->definition);
+	comp_node_t *values = wrap_comp_values(lambda->definition);
 
-	if (!gen_top_scope(values, &state, NULL, closure->args, 1)) {
+	if (!gen_top_scope(values, &state, NULL, lambda->args, 1)) {
 		// TODO: better errors
-		vm_error(vm, "Couldn't define the top scope!");
 		DEBUG_PRINTF("    | couldn't define the top scope!\n");
+		lambda->compile_failure = state.failure;
+		free_closed_vars(&state);
+		free_comp_values(values);
+		free(state.assigned);
 		return NULL;
 	}
 	//dump_comp_values(values, 0);
 
-	compile_expression_list(&state, values, true);
+	if (tier == VM_TIER_OPTIMIZED) {
+		optimize_tree(&state, values);
+	}
+
+	// checked first, self tail calls jump back to it
+	vm_fold_guard_t *fold_guard = make_fold_guard(&state);
+
+	if (fold_guard) {
+		add_instr_node(&state, INSTR_FOLD_GUARD, (uintptr_t)fold_guard);
+	}
+
+	// nothing the guard checks besides the types of the parameters can
+	// change while looping
+	if (fold_guard && fold_guard->num_slots == 0) {
+		state.typed_entry = state.instr_ptr;
+	}
+
+	// baseline code records the types of the arguments it's called with,
+	// and looped back to with, for the optimizing tier
+	unsigned nargs = list_length(lambda->args);
+
+	if (tier == VM_TIER_BASELINE && nargs && is_proper_list(lambda->args)) {
+		if (!lambda->arg_types) {
+			lambda->arg_types = calloc(nargs, sizeof(uint8_t));
+		}
+
+		add_instr_node(&state, INSTR_PROFILE_ARGS, nargs);
+	}
+
+	// assigned parameters are boxed on entry, self tail calls jump back
+	// here with the new values
+	unsigned slot = 1;
+	for (scm_value_t arg = lambda->args; is_pair(arg); arg = get_pair(arg)->cdr) {
+		if (is_assigned(&state, get_pair(arg)->car)) {
+			add_instr_node(&state, INSTR_BOX, slot);
+		}
+
+		slot++;
+	}
+
+	if (state.letrec) {
+		compile_letrec_slots(&state, values);
+	}
+
+	if (state.num_hoisted) {
+		compile_hoisted(&state, fold_guard);
+	}
+
+	compile_body(&state, values);
 	add_instr_node(&state, INSTR_RETURN, 0);
 
+	// only the parameters the code ended up relying on the types of are
+	// checked
+	if (fold_guard) {
+		fold_guard->fixnum_args = state.fixnum_used;
+	}
+
+	// the baseline tier only runs for a little while, so it isn't worth
+	// the time
+	if (tier == VM_TIER_OPTIMIZED) {
+		peephole_optimize(&state);
+	}
+
 	DEBUG_PRINTF("    | returning from closure\n");
 
+	lambda->osr_entries = malloc(sizeof(unsigned[state.body_exprs + 1]));
+	lambda->num_osr_entries = state.body_exprs;
+
+	for (unsigned k = 0; k < state.body_exprs; k++) {
+		lambda->osr_entries[k] = VM_NO_OSR_ENTRY;
+	}
+
 	store_closed_vars(&state, closure);
 	store_instructions(&state, closure);
 
+	// the code is thrown out when any of the variables it has the values
+	// of built in are written to
+	if (state.stable_uses) {
+		for (unsigned i = 0; i < state.num_stable; i++) {
+			vm_watch_var(vm, state.stable[i], closure);
+		}
+
+		vm->compile_stats.stable_uses += state.stable_uses;
+	}
+
 	free_comp_values(values);
+	free(state.assigned);
+	free(state.folded);
+	free(state.guard_vars);
+	free(state.stable);
+
+	for (unsigned i = 0; i < state.num_hoisted; i++) {
+		free_comp_values(state.hoisted[i]);
+		free(state.hoisted_slots[i]);
+	}
+
+	free(state.hoisted);
+	free(state.hoisted_slots);
 
 	DEBUG_PRINTF("    + done\n");
 
-	closure->compiled = true;
+	lambda->fold_guard = fold_guard;
+	lambda->compiled = true;
+	lambda->tier = tier;
+	vm->compile_stats.compiled++;
+	// the code and guard can have young constants
+	gc_remember_lambda(&vm->gc, lambda);
 
 	//return ret;
 	//return NULL;
 	return closure;
 }
+
+// compiles the lambda of `closure` at the given VM_TIER_* level, resolving
+// variables in the closure's environment. the code is shared with the other
+// closures of the lambda. returns NULL and leaves the closure as it was if
+// it can't be compiled (yet), eg. because it refers to variables which
+// aren't defined
+scm_closure_t *vm_compile_closure(vm_t *vm, scm_closure_t *closure, unsigned tier) {
+	return compile_closure(vm, closure, tier, NULL, NULL);
+}
+
+void vm_count_compile_failure(vm_t *vm, vm_lambda_t *lambda) {
+	unsigned reason = lambda->compile_failure;
+
+	lambda->compile_failures++;
+	vm->compile_stats.failed[reason]++;
+
+	if (lambda->compile_failures == VM_MAX_COMPILE_FAILURES) {
+		vm->compile_stats.given_up[reason]++;
+	}
+}
+
+void vm_dump_compile_stats(vm_t *vm, FILE *fp) {
+	static const char *reasons[VM_COMPILE_NUM_FAILS] = {
+		[VM_COMPILE_FAIL_UNDEFINED]  = "undefined variable",
+		[VM_COMPILE_FAIL_SYNTAX]     = "malformed special form",
+		[VM_COMPILE_FAIL_MACRO]      = "macro",
+		[VM_COMPILE_FAIL_DEFINITION] = "definition outside of a body",
+		[VM_COMPILE_FAIL_NESTED]     = "nested lambda",
+	};
+
+	vm_compile_stats_t *stats = &vm->compile_stats;
+
+	fprintf(fp, "compiled: %u\n", stats->compiled);
+	fprintf(fp, "%-30s %8s %8s\n", "failures:", "attempts", "given up");
+
+	for (unsigned i = 0; i < VM_COMPILE_NUM_FAILS; i++) {
+		fprintf(fp, "  %-28s %8u %8u\n",
+		        reasons[i], stats->failed[i], stats->given_up[i]);
+	}
+
+	// call sites by the state of their inline cache, see vm_call_cache_t
+	unsigned sites[3] = {0};
+	uint64_t hits = stats->freed_hits, misses = stats->freed_misses;
+
+	for (vm_call_cache_t *cache = vm->call_caches; cache; cache = cache->next) {
+		if (cache->megamorphic) {
+			sites[2]++;
+		} else if (cache->num_entries) {
+			sites[cache->num_entries > 1]++;
+		}
+
+		hits   += cache->hits;
+		misses += cache->misses;
+	}
+
+	fprintf(fp, "call sites: %u monomorphic, %u polymorphic, %u megamorphic\n",
+	        sites[0], sites[1], sites[2]);
+	fprintf(fp, "call cache: %llu hits, %llu misses\n",
+	        (unsigned long long)hits, (unsigned long long)misses);
+	fprintf(fp, "stable globals: %u uses built in, %u thrown out by writes\n",
+	        stats->stable_uses, stats->stable_writes);
+}
+
+/*
+ * Closure conversion for a lambda expression `form` in the code compiled by
+ * `state`, in `scope` there, taking `args` and running `body`. `form` can
+ * also be a (define (name . args) body ...) form. The lambda is compiled to
+ * baseline code unless it already was, and its free variables are looked
+ * up around the expression, so that INSTR_MAKE_CLOSURE can make flat
+ * closures of it without an environment. Returns false if the lambda, or
+ * any of the variables it refers to, can't be compiled.
+ */
+bool compile_nested_lambda(comp_state_t *state,
+                           scope_t      *scope,
+                           comp_node_t  *form,
+                           scm_value_t  args,
+                           comp_node_t  *body)
+{
+	vm_t *vm = state->vm;
+	vm_lambda_t *lambda = vm_lambda_for(vm, args, body->value);
+
+	if (!lambda->compiled) {
+		// closures made from the code don't exist yet, this only keeps
+		// the slots the compiler fills in
+		scm_closure_t proto = {
+			.lambda = lambda,
+			.env    = state->env,
+		};
+
+		if (lambda->compile_failures >= VM_MAX_COMPILE_FAILURES) {
+			state->failure = VM_COMPILE_FAIL_NESTED;
+			return false;
+		}
+
+		if (!compile_closure(vm, &proto, VM_TIER_BASELINE, state, scope)) {
+			vm_count_compile_failure(vm, lambda);
+			state->failure = VM_COMPILE_FAIL_NESTED;
+			return false;
+		}
+	}
+
+	vm_closure_proto_t *make =
+		calloc(1, sizeof(vm_closure_proto_t)
+		          + sizeof(vm_capture_t[lambda->num_slots]));
+
+	make->lambda    = lambda;
+	make->num_slots = lambda->num_slots;
+	lambda->nested  = true;
+
+	for (unsigned i = 0; i < lambda->num_slots; i++) {
+		if (!capture_var(state, scope, lambda->varnames[i], make->slots + i)) {
+			free(make);
+			return false;
+		}
+	}
+
+	form->proto = make;
+	return true;
+}
@@ -0,0 +1,504 @@
+#include <nscheme/compiler.h>
+
+/*
+ * Common subexpression elimination and loop-invariant code motion, run on
+ * the tree by optimize_tree() once it's folded and inlined what it could.
+ *
+ * Parameters and locals which aren't assigned to are bound once for each
+ * activation, so for those the tree is already in SSA form: two calls to
+ * the same procedure with the same such variables and constants give the
+ * same result, if the procedure has no effects other than failing. Calls
+ * are numbered by their structure in the order they're evaluated, and a
+ * call which was evaluated on every path to an equal one gives its value to
+ * it. The first stores its value into a slot reserved around the body
+ * expression they're in (INSTR_STACK_SET), and the second reads the slot.
+ *
+ * Self tail calls loop back to the start of the closure. The parameters
+ * which every one of them passes along unchanged stay the same through the
+ * loop, and pure calls on those are computed once before it, into slots
+ * above the parameters which the loop keeps (INSTR_SET_SP).
+ */
+
+// slots reserved for each body expression, and for hoisted values
+#define CSE_MAX_TEMPS 16
+// calls kept track of as available while walking a body expression
+#define CSE_MAX_AVAIL 64
+
+typedef struct cse_ctx {
+	comp_state_t *state;
+
+	// calls evaluated on every path to where the walk is
+	comp_node_t *avail[CSE_MAX_AVAIL];
+	unsigned num_avail;
+
+	// slots reserved for the body expression being walked, and the calls
+	// which store into them
+	comp_temps_t *temps;
+	comp_node_t *defs[CSE_MAX_TEMPS];
+} cse_ctx_t;
+
+static inline bool is_call_node(comp_node_t *expr) {
+	return is_pair(expr->value) && expr->car;
+}
+
+static inline scope_node_t *new_temp_slot(void) {
+	scope_node_t *slot = calloc(1, sizeof(scope_node_t));
+
+	slot->type = SCOPE_LOCAL;
+	return slot;
+}
+
+// turns `expr` into a reference to the value kept in `slot`
+static inline void use_temp_slot(comp_node_t *expr, scope_node_t *slot) {
+	expr->car   = NULL;
+	expr->cdr   = NULL;
+	expr->node  = slot;
+	expr->value = SCM_TYPE_NULL;
+}
+
+// the call computing the value of `expr`, if it reads a kept value
+static comp_node_t *resolve_temp(cse_ctx_t *ctx, comp_node_t *expr) {
+	comp_state_t *state = ctx->state;
+
+	if (is_call_node(expr) || !expr->node) {
+		return expr;
+	}
+
+	for (unsigned i = 0; ctx->temps && i < ctx->temps->num_slots; i++) {
+		if (ctx->temps->slots[i] == expr->node) {
+			return ctx->defs[i];
+		}
+	}
+
+	for (unsigned i = 0; i < state->num_hoisted; i++) {
+		if (state->hoisted_slots[i] == expr->node) {
+			return state->hoisted[i];
+		}
+	}
+
+	return expr;
+}
+
+static inline bool same_var(scope_node_t *a, scope_node_t *b) {
+	if (a == b) {
+		return true;
+	}
+
+	// parameters and closure slots are the same variable wherever
+	// they're found, locals are told apart by their nodes
+	return a->type == b->type
+	    && (a->type == SCOPE_PARAMETER || a->type == SCOPE_CLOSURE)
+	    && a->location == b->location;
+}
+
+static bool same_expr(cse_ctx_t *ctx, comp_node_t *a, comp_node_t *b) {
+	a = resolve_temp(ctx, a);
+	b = resolve_temp(ctx, b);
+
+	if (a == b) {
+		return true;
+	}
+
+	if (is_call_node(a) != is_call_node(b)) {
+		return false;
+	}
+
+	if (!is_call_node(a)) {
+		if (a->node || b->node) {
+			return a->node && b->node && same_var(a->node, b->node);
+		}
+
+		return a->value == b->value;
+	}
+
+	for (; a && a->car && b && b->car; a = a->cdr, b = b->cdr) {
+		if (!same_expr(ctx, a->car, b->car)) {
+			return false;
+		}
+	}
+
+	return !(a && a->car) && !(b && b->car);
+}
+
+// true if `expr` calls a procedure from a closure slot which the code can
+// depend on, rather than being a special form
+static bool is_plain_call(comp_state_t *state, comp_node_t *expr) {
+	environment_t *env = state->env;
+
+	if (!is_call_node(expr) || expr->inlined
+	    || is_if_statement(env, expr) || is_begin_statement(env, expr)
+	    || is_quote_statement(env, expr) || is_lambda_statement(env, expr)
+	    || is_define_statement(env, expr) || is_set_statement(env, expr))
+	{
+		return false;
+	}
+
+	comp_node_t *func = expr->car;
+
+	if (!func->node || func->node->type != SCOPE_CLOSURE
+	    || state->closure->lambda->deopts)
+	{
+		return false;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+
+	return var && !is_unstable_var(state, var);
+}
+
+// parameters and locals in plain slots, and constants, can't change while
+// the code they're in runs
+static inline bool is_stable_leaf(comp_node_t *expr) {
+	if (is_call_node(expr)) {
+		return false;
+	}
+
+	return !expr->node
+	    || expr->node->type == SCOPE_PARAMETER
+	    || expr->node->type == SCOPE_LOCAL;
+}
+
+// true if `expr` gives the same value each time it's evaluated in the
+// same activation
+static bool is_cse_candidate(comp_state_t *state, comp_node_t *expr) {
+	const unsigned changing = VM_EFFECT_ALLOC | VM_EFFECT_READ
+	                        | VM_EFFECT_WRITE | VM_EFFECT_IO;
+
+	if (!is_plain_call(state, expr)) {
+		return false;
+	}
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		if (!is_stable_leaf(arg->car) && !is_cse_candidate(state, arg->car)) {
+			return false;
+		}
+	}
+
+	return !(tree_effects(state, expr, false) & changing);
+}
+
+// has `later` read the value `first` computes, returns false if there
+// aren't any slots left to keep it in
+static bool reuse_value(cse_ctx_t *ctx, comp_node_t *first, comp_node_t *later) {
+	comp_temps_t *temps = ctx->temps;
+	scope_node_t *slot = first->saves;
+
+	if (!slot) {
+		if (temps->num_slots == CSE_MAX_TEMPS) {
+			return false;
+		}
+
+		slot = new_temp_slot();
+		temps->slots = realloc(temps->slots,
+		                       sizeof(scope_node_t *[temps->num_slots + 1]));
+		ctx->defs[temps->num_slots] = first;
+		temps->slots[temps->num_slots++] = slot;
+		first->saves = slot;
+	}
+
+	DEBUG_PRINTF("    | reusing the value of an earlier call\n");
+
+	// what the call does is relied on now
+	tree_effects(ctx->state, first, true);
+
+	free_dead_tree(later->car);
+	free_dead_tree(later->cdr);
+	use_temp_slot(later, slot);
+
+	return true;
+}
+
+static void cse_walk(cse_ctx_t *ctx, comp_node_t *expr);
+
+static inline void cse_walk_list(cse_ctx_t *ctx, comp_node_t *list) {
+	for (; list && list->car; list = list->cdr) {
+		cse_walk(ctx, list->car);
+	}
+}
+
+// walks `expr` in the order it's evaluated in
+static void cse_walk(cse_ctx_t *ctx, comp_node_t *expr) {
+	comp_state_t *state = ctx->state;
+
+	if (!is_call_node(expr)
+	    || is_quote_statement(state->env, expr)
+	    || is_lambda_statement(state->env, expr))
+	{
+		return;
+	}
+
+	if (is_if_statement(state->env, expr)) {
+		comp_node_t *test = expr->cdr;
+		unsigned avail;
+
+		cse_walk(ctx, test->car);
+		avail = ctx->num_avail;
+
+		// neither branch is evaluated on every path through the
+		// other, or past the if
+		for (comp_node_t *branch = test->cdr; branch && branch->car; branch = branch->cdr) {
+			cse_walk(ctx, branch->car);
+			ctx->num_avail = avail;
+		}
+
+		return;
+	}
+
+	if (is_define_statement(state->env, expr)) {
+		// procedure definitions are compiled on their own
+		if (!expr->proto) {
+			cse_walk_list(ctx, expr->cdr->cdr);
+		}
+
+		return;
+	}
+
+	bool candidate = is_cse_candidate(state, expr);
+
+	if (candidate) {
+		for (unsigned i = 0; i < ctx->num_avail; i++) {
+			if (same_expr(ctx, ctx->avail[i], expr)
+			    && reuse_value(ctx, ctx->avail[i], expr))
+			{
+				return;
+			}
+		}
+	}
+
+	if (expr->inlined) {
+		cse_walk_list(ctx, expr->cdr);
+		cse_walk_list(ctx, expr->inlined->body);
+
+	} else {
+		cse_walk_list(ctx, expr);
+	}
+
+	if (candidate && ctx->num_avail < CSE_MAX_AVAIL) {
+		ctx->avail[ctx->num_avail++] = expr;
+	}
+}
+
+void eliminate_common_subexprs(comp_state_t *state, comp_node_t *body) {
+	for (comp_node_t *expr = body; expr && expr->car; expr = expr->cdr) {
+		// local definitions keep their values in their own slots
+		if (is_define_statement(state->env, expr->car)) {
+			continue;
+		}
+
+		cse_ctx_t ctx = {
+			.state = state,
+			.temps = calloc(1, sizeof(comp_temps_t)),
+		};
+
+		cse_walk(&ctx, expr->car);
+
+		if (ctx.temps->num_slots) {
+			expr->car->temps = ctx.temps;
+
+		} else {
+			free(ctx.temps);
+		}
+	}
+}
+
+// clears the bits of `invariant` for parameters which a self tail call in
+// `expr` passes something else in
+static void find_loop_params(comp_state_t *state, comp_node_t *expr, bool tail,
+                             uint32_t *invariant, bool *loops)
+{
+	environment_t *env = state->env;
+
+	if (!tail || !is_call_node(expr)
+	    || is_quote_statement(env, expr) || is_lambda_statement(env, expr)
+	    || is_define_statement(env, expr) || is_set_statement(env, expr))
+	{
+		return;
+	}
+
+	comp_node_t *last = NULL;
+
+	if (is_if_statement(env, expr)) {
+		for (comp_node_t *branch = expr->cdr->cdr; branch && branch->car; branch = branch->cdr) {
+			find_loop_params(state, branch->car, true, invariant, loops);
+		}
+
+		return;
+
+	} else if (is_begin_statement(env, expr) || expr->inlined) {
+		comp_node_t *list = expr->inlined? expr->inlined->body : expr->cdr;
+
+		for (; list && list->car; list = list->cdr) {
+			last = list->car;
+		}
+
+		if (last) {
+			find_loop_params(state, last, true, invariant, loops);
+		}
+
+		return;
+	}
+
+	if (!is_self_call(state, expr)) {
+		return;
+	}
+
+	unsigned i = 0;
+	*loops = true;
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr, i++) {
+		scope_node_t *node = arg->car->node;
+
+		if (i >= 32) {
+			break;
+		}
+
+		if (is_call_node(arg->car) || !node
+		    || node->type != SCOPE_PARAMETER || node->location != i + 1)
+		{
+			*invariant &= ~(1u << i);
+		}
+	}
+}
+
+static inline bool is_builtin_call(comp_state_t *state, comp_node_t *expr) {
+	env_node_t *var = closure_var_ref(state, expr->car->node->location);
+
+	// builtins don't have an environment
+	return is_closure(var->value) && !((scm_closure_t *)get_closure(var->value))->env;
+}
+
+// true if `expr` gives the same value on every trip through the loop, and
+// is worth computing before it. calls in branches are only hoisted if
+// they're to builtins, which always return
+static bool is_invariant(comp_state_t *state, comp_node_t *expr,
+                         uint32_t invariant, bool conditional)
+{
+	if (!is_plain_call(state, expr)
+	    || (conditional && !is_builtin_call(state, expr)))
+	{
+		return false;
+	}
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		comp_node_t *value = arg->car;
+		scope_node_t *node = value->node;
+
+		if (is_call_node(value)) {
+			if (!is_invariant(state, value, invariant, conditional)) {
+				return false;
+			}
+
+		} else if (node && (node->type != SCOPE_PARAMETER
+		                    || node->location > 32
+		                    || !(invariant & (1u << (node->location - 1)))))
+		{
+			return false;
+		}
+	}
+
+	return tree_effects(state, expr, false) == 0;
+}
+
+static void hoist(comp_state_t *state, comp_node_t *expr) {
+	cse_ctx_t ctx = { .state = state };
+	scope_node_t *slot = NULL;
+
+	for (unsigned i = 0; i < state->num_hoisted; i++) {
+		if (same_expr(&ctx, state->hoisted[i], expr)) {
+			slot = state->hoisted_slots[i];
+		}
+	}
+
+	if (slot) {
+		free_dead_tree(expr->car);
+		free_dead_tree(expr->cdr);
+
+	} else if (state->num_hoisted < CSE_MAX_TEMPS) {
+		unsigned n = state->num_hoisted++;
+		comp_node_t *moved = malloc(sizeof(comp_node_t));
+
+		*moved = *expr;
+		slot = new_temp_slot();
+
+		state->hoisted = realloc(state->hoisted, sizeof(comp_node_t *[n + 1]));
+		state->hoisted_slots = realloc(state->hoisted_slots,
+		                               sizeof(scope_node_t *[n + 1]));
+		state->hoisted[n] = moved;
+		state->hoisted_slots[n] = slot;
+
+		tree_effects(state, moved, true);
+
+	} else {
+		return;
+	}
+
+	DEBUG_PRINTF("    | hoisted loop-invariant call\n");
+	use_temp_slot(expr, slot);
+}
+
+static void hoist_walk(comp_state_t *state, comp_node_t *expr,
+                       uint32_t invariant, bool conditional);
+
+static inline void hoist_walk_list(comp_state_t *state, comp_node_t *list,
+                                   uint32_t invariant, bool conditional)
+{
+	for (; list && list->car; list = list->cdr) {
+		hoist_walk(state, list->car, invariant, conditional);
+	}
+}
+
+static void hoist_walk(comp_state_t *state, comp_node_t *expr,
+                       uint32_t invariant, bool conditional)
+{
+	environment_t *env = state->env;
+
+	if (!is_call_node(expr)
+	    || is_quote_statement(env, expr) || is_lambda_statement(env, expr)
+	    || (is_define_statement(env, expr) && expr->proto))
+	{
+		return;
+	}
+
+	if (is_if_statement(env, expr)) {
+		hoist_walk(state, expr->cdr->car, invariant, conditional);
+		hoist_walk_list(state, expr->cdr->cdr, invariant, true);
+
+	} else if (is_invariant(state, expr, invariant, conditional)) {
+		hoist(state, expr);
+
+	} else if (expr->inlined) {
+		hoist_walk_list(state, expr->cdr, invariant, conditional);
+		hoist_walk_list(state, expr->inlined->body, invariant, conditional);
+
+	} else {
+		hoist_walk_list(state, expr, invariant, conditional);
+	}
+}
+
+/*
+ * Moves calls which give the same value on every trip through the self
+ * tail call loop of the closure, if it has one, out of the body. They're
+ * compiled before the loop by compile_hoisted() in compiler.c.
+ */
+void hoist_invariants(comp_state_t *state, comp_node_t *body) {
+	uint32_t invariant = ~0u;
+	bool loops = false;
+	comp_node_t *last = NULL;
+
+	// boxes are made on entry, and self tail calls go back for new ones
+	if (state->has_boxes || state->letrec) {
+		return;
+	}
+
+	for (comp_node_t *expr = body; expr && expr->car; expr = expr->cdr) {
+		last = expr->car;
+	}
+
+	if (last) {
+		find_loop_params(state, last, true, &invariant, &loops);
+	}
+
+	if (loops && invariant) {
+		hoist_walk_list(state, body, invariant, false);
+	}
+}
@@ -0,0 +1,443 @@
+#include <nscheme/compiler.h>
+
+#include <limits.h>
+
+/*
+ * Effect analysis: what calling a procedure can do, as VM_EFFECT_* flags.
+ * Builtins are classified by the table below. Closures are classified by
+ * walking their bodies, where calls to procedures found in variables take
+ * on the effects of those procedures, and calls to anything else could do
+ * anything. The results for closures are kept on the closures along with
+ * the variables the procedures were found in, and worked out again once
+ * any of those change.
+ *
+ * Assignments to a closure's own parameters and locals aren't effects of
+ * calling it, since nothing outside the call can see them.
+ */
+
+// closures called by closures are looked at this deep
+#define EFFECTS_MAX_DEPTH  8
+// parameters and local definitions of a closure that are kept track of
+#define EFFECTS_MAX_LOCALS 32
+
+static const struct {
+	vm_func builtin;
+	// number of arguments it takes, or -1 for any number
+	int num_args;
+	unsigned flags;
+} builtin_effects[] = {
+	// arithmetic fails on anything but fixnums
+	{ vm_op_add,         -1, VM_EFFECT_FAIL },
+	{ vm_op_mul,         -1, VM_EFFECT_FAIL },
+	{ vm_op_sub,         -1, VM_EFFECT_FAIL },
+	{ vm_op_div,         -1, VM_EFFECT_FAIL },
+	{ vm_op_lessthan,     2, VM_EFFECT_FAIL },
+	{ vm_op_greaterthan,  2, VM_EFFECT_FAIL },
+	{ vm_op_equal,        2, 0 },
+	{ vm_op_is_null,      1, 0 },
+	{ vm_op_is_pair,      1, 0 },
+	{ vm_op_cons,         2, VM_EFFECT_ALLOC },
+	{ vm_op_car,          1, VM_EFFECT_FAIL },
+	{ vm_op_cdr,          1, VM_EFFECT_FAIL },
+	{ vm_op_display,     -1, VM_EFFECT_IO },
+	{ vm_op_newline,     -1, VM_EFFECT_IO },
+	{ vm_op_read,        -1, VM_EFFECT_IO | VM_EFFECT_ALLOC },
+};
+
+typedef struct effects_ctx {
+	vm_t *vm;
+	// closures being looked at, outermost first. calls back into one of
+	// these add nothing to what's already being collected for it
+	scm_closure_t *open[EFFECTS_MAX_DEPTH];
+	unsigned depth;
+	// the outermost of those which was called back into, or UINT_MAX
+	unsigned called_open;
+} effects_ctx_t;
+
+typedef struct effects_body {
+	scm_closure_t *clsr;
+	scm_value_t locals[EFFECTS_MAX_LOCALS];
+	unsigned num_locals;
+} effects_body_t;
+
+// `deps` is NULL when they aren't wanted
+static inline void add_dep(vm_effects_t **deps, env_node_t *var, scm_value_t value) {
+	if (!deps) {
+		return;
+	}
+
+	vm_effects_t *list = *deps;
+	unsigned n = list? list->num_deps : 0;
+
+	for (unsigned i = 0; i < n; i++) {
+		if (list->deps[i].var == var) {
+			return;
+		}
+	}
+
+	list = realloc(list, sizeof(vm_effects_t) + sizeof(list->deps[0]) * (n + 1));
+
+	if (n == 0) {
+		list->flags = 0;
+	}
+
+	list->deps[n].var   = var;
+	list->deps[n].value = value;
+	list->num_deps = n + 1;
+	*deps = list;
+}
+
+static inline void merge_deps(vm_effects_t **deps, vm_effects_t *from) {
+	for (unsigned i = 0; from && i < from->num_deps; i++) {
+		add_dep(deps, from->deps[i].var, from->deps[i].value);
+	}
+}
+
+// true if none of the variables the effects were worked out from changed
+static inline bool effects_hold(vm_effects_t *effects) {
+	for (unsigned i = 0; i < effects->num_deps; i++) {
+		if (effects->deps[i].var->value != effects->deps[i].value) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static inline bool is_body_local(effects_body_t *body, scm_value_t sym) {
+	for (unsigned i = 0; i < body->num_locals; i++) {
+		if (body->locals[i] == sym) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline bool add_body_local(effects_body_t *body, scm_value_t sym) {
+	if (body->num_locals == EFFECTS_MAX_LOCALS) {
+		return false;
+	}
+
+	body->locals[body->num_locals++] = sym;
+	return true;
+}
+
+// the variable `sym` refers to in the body of `clsr`, which isn't one of
+// its parameters or locals
+static env_node_t *closure_var(scm_closure_t *clsr, scm_value_t sym) {
+	vm_lambda_t *lambda = clsr->lambda;
+
+	// closures made by INSTR_MAKE_CLOSURE only have their slots
+	if (clsr->bound && clsr->bound == lambda->varnames) {
+		for (unsigned i = 0; i < lambda->num_slots; i++) {
+			if (lambda->varnames[i] == sym) {
+				return clsr->closures[i];
+			}
+		}
+	}
+
+	return env_find_recurse(clsr->env, sym);
+}
+
+static unsigned closure_effects(effects_ctx_t *ctx, scm_closure_t *clsr,
+                                unsigned nargs, vm_effects_t **deps);
+
+static unsigned proc_effects(effects_ctx_t *ctx, scm_value_t proc,
+                             unsigned nargs, vm_effects_t **deps)
+{
+	if (!is_closure(proc)) {
+		// special forms are handled before getting here
+		return is_run_type(proc)? VM_EFFECT_ANY : VM_EFFECT_FAIL;
+	}
+
+	scm_closure_t *clsr = get_closure(proc);
+
+	for (unsigned i = 0; i < sizeof(builtin_effects) / sizeof(builtin_effects[0]); i++) {
+		if (vm_is_builtin(proc, builtin_effects[i].builtin)) {
+			int num_args = builtin_effects[i].num_args;
+
+			if (num_args >= 0 && (unsigned)num_args != nargs) {
+				return VM_EFFECT_FAIL;
+			}
+
+			// (-) reads past its arguments
+			if (builtin_effects[i].builtin == vm_op_sub && nargs == 0) {
+				return VM_EFFECT_ANY;
+			}
+
+			return builtin_effects[i].flags;
+		}
+	}
+
+	// builtins without a table entry don't have an environment
+	if (!clsr->env) {
+		return VM_EFFECT_ANY;
+	}
+
+	return closure_effects(ctx, clsr, nargs, deps);
+}
+
+static unsigned expr_effects(effects_ctx_t *ctx, effects_body_t *body,
+                             scm_value_t expr, vm_effects_t **deps);
+
+static unsigned list_effects(effects_ctx_t *ctx, effects_body_t *body,
+                             scm_value_t list, vm_effects_t **deps)
+{
+	unsigned flags = 0;
+
+	for (; is_pair(list); list = get_pair(list)->cdr) {
+		flags |= expr_effects(ctx, body, get_pair(list)->car, deps);
+	}
+
+	return flags;
+}
+
+static unsigned expr_effects(effects_ctx_t *ctx, effects_body_t *body,
+                             scm_value_t expr, vm_effects_t **deps)
+{
+	environment_t *env = body->clsr->env;
+
+	if (is_symbol(expr)) {
+		if (is_body_local(body, expr)) {
+			return 0;
+		}
+
+		env_node_t *var = closure_var(body->clsr, expr);
+
+		return (!var || is_run_type(var->value))
+		       ? VM_EFFECT_ANY
+		       : VM_EFFECT_READ;
+	}
+
+	if (!is_pair(expr)) {
+		return 0;
+	}
+
+	scm_value_t head = get_pair(expr)->car;
+	scm_value_t rest = get_pair(expr)->cdr;
+	unsigned nargs = 0;
+
+	if (!is_symbol(head) || is_body_local(body, head)) {
+		// calls to procedures made at run time
+		return VM_EFFECT_ANY;
+	}
+
+	if (is_quote_token(env, head)) {
+		return 0;
+
+	} else if (is_lambda_token(env, head)) {
+		return VM_EFFECT_ALLOC;
+
+	} else if (is_if_token(env, head) || is_begin_token(env, head)) {
+		return list_effects(ctx, body, rest, deps);
+
+	} else if (is_set_token(env, head) || is_define_token(env, head)) {
+		scm_value_t name  = is_pair(rest)? get_pair(rest)->car : SCM_TYPE_NULL;
+		scm_value_t value = is_pair(rest)? get_pair(rest)->cdr : SCM_TYPE_NULL;
+		unsigned flags = 0;
+
+		if (is_pair(name)) {
+			// (define (name . args) body ...) makes a closure
+			return is_body_local(body, get_pair(name)->car)
+			       ? VM_EFFECT_ALLOC
+			       : VM_EFFECT_ANY;
+		}
+
+		if (!is_body_local(body, name)) {
+			// definitions past the start of the body go in the
+			// environment of the call
+			if (!is_set_token(env, head)) {
+				return VM_EFFECT_ANY;
+			}
+
+			flags = VM_EFFECT_WRITE;
+		}
+
+		return flags | list_effects(ctx, body, value, deps);
+	}
+
+	env_node_t *var = closure_var(body->clsr, head);
+
+	if (!var) {
+		return VM_EFFECT_ANY;
+	}
+
+	for (scm_value_t arg = rest; is_pair(arg); arg = get_pair(arg)->cdr) {
+		nargs++;
+	}
+
+	add_dep(deps, var, var->value);
+
+	return list_effects(ctx, body, rest, deps)
+	     | proc_effects(ctx, var->value, nargs, deps);
+}
+
+// the parameters and local definitions of `clsr`, false if there are too
+// many to keep track of
+static bool find_body_locals(effects_body_t *body, scm_closure_t *clsr) {
+	vm_lambda_t *lambda = clsr->lambda;
+	scm_value_t arg = lambda->args;
+
+	body->clsr = clsr;
+	body->num_locals = 0;
+
+	for (; is_pair(arg); arg = get_pair(arg)->cdr) {
+		if (!add_body_local(body, get_pair(arg)->car)) {
+			return false;
+		}
+	}
+
+	// rest arguments
+	if (is_symbol(arg) && !add_body_local(body, arg)) {
+		return false;
+	}
+
+	for (scm_value_t expr = lambda->definition; is_pair(expr); expr = get_pair(expr)->cdr) {
+		scm_value_t form = get_pair(expr)->car;
+
+		if (!is_pair(form) || !is_define_token(clsr->env, get_pair(form)->car)
+		    || !is_pair(get_pair(form)->cdr))
+		{
+			break;
+		}
+
+		scm_value_t name = get_pair(get_pair(form)->cdr)->car;
+
+		if (is_pair(name)) {
+			name = get_pair(name)->car;
+		}
+
+		if (!add_body_local(body, name)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static unsigned closure_effects(effects_ctx_t *ctx, scm_closure_t *clsr,
+                                unsigned nargs, vm_effects_t **deps)
+{
+	vm_lambda_t *lambda = clsr->lambda;
+	scm_value_t arg = lambda->args;
+	unsigned nparams = 0;
+
+	for (; is_pair(arg); arg = get_pair(arg)->cdr) {
+		nparams++;
+	}
+
+	if (nargs < nparams || (is_null(arg) && nargs > nparams)) {
+		return VM_EFFECT_FAIL;
+	}
+
+	if (clsr->effects && effects_hold(clsr->effects)) {
+		merge_deps(deps, clsr->effects);
+		return clsr->effects->flags;
+	}
+
+	for (unsigned i = 0; i < ctx->depth; i++) {
+		if (ctx->open[i] == clsr) {
+			// what it does is being collected further out
+			if (i < ctx->called_open) {
+				ctx->called_open = i;
+			}
+
+			return 0;
+		}
+	}
+
+	effects_body_t body;
+
+	if (ctx->depth == EFFECTS_MAX_DEPTH || !find_body_locals(&body, clsr)) {
+		return VM_EFFECT_ANY;
+	}
+
+	unsigned depth = ctx->depth++;
+	unsigned called_open = ctx->called_open;
+	vm_effects_t *effects = calloc(1, sizeof(vm_effects_t));
+
+	ctx->open[depth] = clsr;
+	ctx->called_open = UINT_MAX;
+
+	// collecting the variables can move `effects`
+	unsigned flags = list_effects(ctx, &body, lambda->definition, &effects);
+
+	effects->flags = flags;
+	ctx->depth--;
+
+	merge_deps(deps, effects);
+
+	// if it called back into a closure further out, the flags are missing
+	// what that closure does, so they're only good for this analysis
+	if (ctx->called_open < depth) {
+		free(effects);
+
+	} else {
+		free(clsr->effects);
+		clsr->effects = effects;
+		// which keep the values of the variables they depend on
+		gc_remember_closure(&ctx->vm->gc, clsr);
+	}
+
+	if (ctx->called_open < called_open && ctx->called_open < depth) {
+		called_open = ctx->called_open;
+	}
+
+	ctx->called_open = called_open;
+
+	return flags;
+}
+
+/*
+ * The effects of calling `clsr`, kept on the closure until one of the
+ * variables they were worked out from changes.
+ */
+vm_effects_t *vm_closure_effects(vm_t *vm, scm_closure_t *clsr) {
+	effects_ctx_t ctx = {
+		.vm          = vm,
+		.called_open = UINT_MAX,
+	};
+
+	if (!clsr->env) {
+		return NULL;
+	}
+
+	if (!clsr->effects || !effects_hold(clsr->effects)) {
+		// arguments don't matter to what's kept
+		scm_value_t arg = clsr->lambda->args;
+		unsigned nargs = 0;
+
+		for (; is_pair(arg); arg = get_pair(arg)->cdr) {
+			nargs++;
+		}
+
+		closure_effects(&ctx, clsr, nargs, NULL);
+	}
+
+	return clsr->effects;
+}
+
+/*
+ * The effects of calling the procedure `proc` with `nargs` arguments. If
+ * `deps` isn't NULL, the variables the result depends on are added to it,
+ * not including the one `proc` was found in.
+ */
+unsigned vm_call_effects(vm_t *vm, scm_value_t proc, unsigned nargs,
+                         vm_effects_t **deps)
+{
+	effects_ctx_t ctx = {
+		.vm          = vm,
+		.called_open = UINT_MAX,
+	};
+
+	vm_effects_t *collected = NULL;
+	unsigned flags = proc_effects(&ctx, proc, nargs, &collected);
+
+	if (deps) {
+		merge_deps(deps, collected);
+	}
+
+	free(collected);
+	return flags;
+}
@@ -9,7 +9,8 @@ environment_t *env_create(environment_t *last) {
 	return ret;
 }
 
-void env_set(environment_t *env, scm_value_t key, scm_value_t value) {
+// returns the variable, which callers check for watches on
+env_node_t *env_set(environment_t *env, scm_value_t key, scm_value_t value) {
 	env_node_t *node = env->root;
 
 	if (!env->root) {
@@ -30,23 +31,33 @@ void env_set(environment_t *env, scm_value_t key, scm_value_t value) {
 		} else if (key > node->key) {
 			node->right = calloc(1, sizeof(env_node_t));
 			node = node->right;
+
+		} else {
+			node->writes++;
 		}
 	}
 
 	node->key   = key;
 	node->value = value;
+	env_write_barrier(node);
+
+	return node;
 }
 
-void env_set_recurse(environment_t *env, scm_value_t key, scm_value_t value) {
+env_node_t *env_set_recurse(environment_t *env, scm_value_t key, scm_value_t value) {
 	env_node_t *node = env_find_recurse(env, key);
 
 	if (node) {
 		node->key   = key;
 		node->value = value;
+		node->writes++;
+		env_write_barrier(node);
 
 	} else {
-		env_set(env, key, value);
+		node = env_set(env, key, value);
 	}
+
+	return node;
 }
 
 env_node_t *env_find(environment_t *env, scm_value_t key) {
@@ -1,45 +1,295 @@
+#define _GNU_SOURCE
 #include <nscheme/vm.h>
+#include <nscheme/vm_ops.h>
 #include <nscheme/values.h>
 
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Mark-compact collector for the heap.
+ *
+ * Pairs and the slot arrays of compiled closures live on the heap, everything
+ * else (closures, lambdas, environments, variables) is malloc'd and only
+ * traced through. A collection marks what's reachable, works out where each
+ * live block slides down to, updates every reference to the blocks, then
+ * moves them. Closures and variables made by compiled code, and top level
+ * bodies, are owned by the collector, which frees the ones a collection of
+ * the whole heap didn't trace, see free_untraced().
+ *
+ * Roots are found precisely except for the C stack, which is scanned
+ * conservatively since C code holds values in locals while it allocates
+ * (the parser, macro expansion, the compiler). Blocks found from there are
+ * pinned, they can't move since the words pointing at them can't be told
+ * apart from integers. So are blocks referenced by code: compiled code and
+ * lambdas are found by the definitions they were made from, and native code
+ * has constants built into the instructions. Pinning is transitive through
+ * the pairs of code, which is a tree of them. Pinned blocks stay where they
+ * are and the compacted blocks flow around them, with dead filler blocks in
+ * the gaps. Objects the collector owns which are found from the C stack are
+ * traced, so that they aren't freed.
+ *
+ * The heap can't be moved as a whole either, so the address space it can
+ * grow into is reserved up front. After each collection it's resized so
+ * that live data takes up the target share of it, see resize_heap().
+ *
+ * Most blocks don't live long, so they're made in a nursery at the start of
+ * the heap, which is collected on its own whenever it fills up. Minor
+ * collections like that take everything outside the nursery to be live,
+ * and copy what's reachable in it to the old generation after it, where
+ * the blocks above are collected. The roots of a minor collection are the
+ * VM's, and the remembered set of what was written to since the last
+ * collection, so that it costs as much as the young data which survives
+ * it. The only things written to after they're made are variables, see
+ * env_write_barrier(), but closures and lambdas are remembered when they
+ * start referencing values, and old blocks when they're given young ones,
+ * see gc_write_barrier(). Young blocks which are pinned are promoted where
+ * they are, and new blocks are made around them until they die.
+ *
+ * With a pause target set, the old generation is collected a slice at a time
+ * after minor collections instead, see run_slice(). Blocks after the ones
+ * being collected are made while it's in progress, and are live. What they
+ * reference is marked by scanning them in the order they were made. Marking
+ * stops for an incremental update: the remembered set is marked again after
+ * each minor collection, and roots and the nursery at the end. Blocks aren't
+ * moved, so the dead ones are swept into fillers to allocate in, and only
+ * collections of the whole heap at once compact it.
+ *
+ * Collections of the whole heap at once can run on several threads, see
+ * collect_in_parallel(). Each marks what's in its own deque, and steals from
+ * the others' once it runs out. The old generation is then split into
+ * regions compacted at the same time, blocks only slide down within theirs
+ * and the room left at the end of each is a gap to allocate in.
+ */
 
 enum block_flags {
 	FLAG_MARKED = 1 << 0,
 	FLAG_GREY   = 1 << 1,
+	// referenced from somewhere which can't be updated if it moved
+	FLAG_PINNED = 1 << 2,
+	// part of code, so what it references is pinned too
+	FLAG_CODE   = 1 << 3,
+	// filler for a gap between blocks, never scanned
+	FLAG_FILLER = 1 << 4,
+	// promoted in place in the nursery
+	FLAG_OLD    = 1 << 5,
+	// in the remembered set, see gc_write_barrier()
+	FLAG_REMEMBERED = 1 << 6,
 };
 
 typedef struct scm_gc_block {
 	union {
-		// lowest 4 bits of the pointer field to be used for GC state flags
-		void *ptr;
-		uintptr_t uintptr;
+		// next block in the mark queue while marking
+		struct scm_gc_block *next;
+		// where the block is moved to once marking is done
+		uint8_t *forward;
 	};
 
-	// TODO: bitfield, 4 bits or so for flags, rest for size
-	size_t flags;
-	size_t size;
+	union {
+		struct {
+			size_t flags : 7;
+			size_t size  : 57;
+		};
+		// both at once, for the flags to be changed atomically while
+		// several threads mark
+		size_t header;
+	};
 } scm_gc_block_t;
 
+// kinds of objects traced off the heap, kept in the low bits of their
+// entries in `gc->objects` and `gc->remembered`. old blocks in the latter
+// are told apart by their address
+enum {
+	OBJ_CLOSURE,
+	OBJ_LAMBDA,
+	OBJ_ENVIRONMENT,
+	OBJ_VARIABLE,
+	OBJ_MASK = 3,
+};
+
+// a thread of a parallel collection. what it marks is pushed to the bottom
+// of its deque and popped from there, the other threads steal from the top
+// once they run out
+typedef struct gc_worker {
+	vm_gc_context_t *gc;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	uintptr_t *deque;
+	size_t top;
+	size_t bottom;
+	size_t size;
+	// objects the thread traced, listed in `gc->objects` after marking
+	uintptr_t *objects;
+	size_t num_objects;
+	size_t max_objects;
+	size_t stolen;
+} gc_worker_t;
+
+// blocks compacted on their own, from the one after the end of the block at
+// `start` to the one before the block at `stop`
+typedef struct gc_region {
+	uint8_t *start;
+	uint8_t *stop;
+	// end of the live blocks once they're moved, and the gaps left before
+	// the pinned ones
+	uint8_t *to;
+	uint8_t *gaps;
+	uint8_t *last_gap;
+	size_t live;
+	size_t reclaimed;
+	size_t pinned;
+} gc_region_t;
+
+// threads helping with collections of the whole heap, which wait for a task
+// to run on each of them in between
+typedef struct gc_helpers {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	void (*task)(gc_worker_t *worker);
+	unsigned round;
+	unsigned running;
+	bool quit;
+	// threads out of blocks to mark, which is done when all of them are
+	unsigned idle;
+	// next region or run of objects a thread takes
+	size_t next;
+	gc_region_t *regions;
+	size_t num_regions;
+	size_t max_regions;
+	unsigned num_workers;
+	gc_worker_t workers[];
+} gc_helpers_t;
+
+// the thread marking on this one, if the collection is parallel
+static __thread gc_worker_t *marker;
+
+static bool grow_heap(vm_gc_context_t *gc, size_t n);
+static void *alloc_in(vm_gc_space_t *space, size_t n);
+static void stop_helpers(vm_gc_context_t *gc);
+
+// blocks the nursery can't make room for are made in the old generation,
+// which is collected as a whole and then grown if it's full too. it's grown
+// first if it's being collected incrementally, to leave that to finish
+static void *alloc_old(vm_t *vm, size_t n) {
+	vm_gc_context_t *gc = &vm->gc;
+	void *ret = gc_alloc_tenured(gc, n);
+
+	if (ret == NULL && gc->phase != GC_IDLE && grow_heap(gc, n)) {
+		ret = gc_alloc_tenured(gc, n);
+	}
+
+	if (ret == NULL) {
+		gc_collect_vm(&vm->gc, vm);
+
+		while ((ret = gc_alloc_tenured(&vm->gc, n)) == NULL) {
+			if (!grow_heap(&vm->gc, n)) {
+				vm_panic(vm, "allocation failure! heap is at its maximum size");
+			}
+		}
+	}
+
+	return ret;
+}
+
+static inline bool fits_nursery(vm_gc_context_t *gc, size_t n) {
+	return n <= (size_t)(gc->nursery.end - gc->nursery.start) / 4;
+}
+
+#ifdef VM_GC_STRESS
+// incremental collections only make progress alongside minor ones
+static void stress_collect(vm_gc_context_t *gc, vm_t *vm) {
+	if (gc->settings.pause_target) {
+		gc_collect_young(gc, vm);
+
+	} else {
+		gc_collect_vm(gc, vm);
+	}
+}
+#endif
+
 void *vm_alloc(vm_t *vm, size_t n) {
+	vm_gc_context_t *gc = &vm->gc;
 	void *ret = NULL;
 
-	//return calloc(1, n);
+#ifdef VM_GC_STRESS
+	stress_collect(gc, vm);
+#endif
 
-	if ((ret = gc_alloc(&vm->gc, n)) == NULL) {
-		puts("Starting garbage collection...");
-		gc_collect_vm(&vm->gc, vm);
+	// only pairs are allocated here, which are small enough
+	if (!fits_nursery(gc, n)) {
+		return alloc_old(vm, n);
+	}
 
-		if ((ret = gc_alloc(&vm->gc, n)) == NULL) {
-			vm_panic(vm, "allocation failure! heap is full (TODO: expand heap)");
+	if ((ret = alloc_in(&gc->nursery, n)) == NULL) {
+		gc_collect_young(gc, vm);
 
-		} else {
-			puts("Allocated successfully?");
+		// pinned blocks can leave the nursery full. whatever the caller
+		// holds was promoted by the collection, so the block doesn't
+		// reference anything young from the old generation
+		if ((ret = alloc_in(&gc->nursery, n)) == NULL) {
+			ret = alloc_old(vm, n);
 		}
 	}
 
 	return ret;
 }
 
+void *vm_alloc_tenured(vm_t *vm, size_t n) {
+#ifdef VM_GC_STRESS
+	stress_collect(&vm->gc, vm);
+#endif
+
+	return alloc_old(vm, n);
+}
+
+// bytes of owned objects which can be made before they're collected, as
+// many as the heap and the ones left by the last collection take up. a
+// small heap still leaves a nursery's worth, code takes up more than the
+// values it makes
+static inline size_t owned_room(vm_gc_context_t *gc) {
+	size_t heap = gc->old.end - gc->old.start;
+	size_t nursery = gc->nursery.end - gc->nursery.start;
+
+	return ((heap > nursery)? heap : nursery) + gc->owned_live;
+}
+
+// owned objects don't take up room in the heap, so code which makes them
+// without allocating wouldn't ever collect them. once more bytes of them
+// were made since they were last freed than owned_room(), the heap is
+// collected as if it had filled up. with a pause target there's a young
+// collection for each nursery's worth instead, which starts an incremental
+// one past that and gives it a slice. slices are paced by what's allocated
+// on the heap, so if twice as many were made the incremental collection is
+// finished all at once, like when the heap can't grow. called once what
+// was made is reachable
+void vm_check_owned(vm_t *vm) {
+	vm_gc_context_t *gc = &vm->gc;
+	size_t room = owned_room(gc);
+
+	if (gc->settings.pause_target) {
+		size_t nursery = gc->nursery.end - gc->nursery.start;
+
+		if (gc->owned_bytes - gc->owned_sliced >= nursery) {
+			gc->owned_sliced = gc->owned_bytes;
+			gc_collect_young(gc, vm);
+		}
+
+		if (gc->phase != GC_IDLE && gc->owned_bytes >= 2 * room) {
+			gc_collect_vm(gc, vm);
+		}
+
+	} else if (gc->owned_bytes >= room) {
+		gc_collect_vm(gc, vm);
+	}
+}
+
 size_t align_size(size_t size, size_t align) {
 	size_t off = size % align;
 	return size + (off > 0)*(align - off);
@@ -51,24 +301,194 @@ void *align_ptr(void *ptr, size_t align) {
 	return (void *)(temp + (off > 0)*(align - off));
 }
 
-void gc_init(vm_gc_context_t *gc, size_t initial_size) {
-	gc->base         = malloc(initial_size);
-	gc->end          = gc->base + initial_size;
-	gc->allocend     = align_ptr(gc->base, 16);
+static inline size_t page_size(void) {
+	return sysconf(_SC_PAGESIZE);
+}
+
+// the heap variables are remembered for. environments don't know which
+// VM they're part of, and there's only ever one anyway
+static vm_gc_context_t *barrier_gc;
 
-	printf("%p, %p\n", gc->base, gc->allocend);
+static void init_space(vm_gc_space_t *space, uint8_t *start, size_t size) {
+	space->start    = start;
+	space->end      = start + size;
+	space->allocend = start;
+	space->limit    = space->end;
+	space->top      = start;
+	space->gaps     = NULL;
 }
 
-void *gc_alloc(vm_gc_context_t *gc, size_t n) {
-	// adjust offset of GC block so that the end of the block has 16 byte alignment
-	uint8_t *block_end = align_ptr(gc->allocend + sizeof(scm_gc_block_t), 16);
+void gc_init(vm_gc_context_t *gc) {
+	vm_heap_settings_t *settings = &gc->settings;
+	size_t initial = align_size(settings->initial_size, page_size());
+	size_t nursery = align_size(settings->nursery_size, page_size());
+	size_t reserved = align_size(settings->max_size, page_size());
+	void *base;
 
-	if (block_end + n >= gc->end) {
-		// allocation failure, need to run the collector 
-		return NULL;
+	if (reserved < initial) {
+		reserved = initial;
+	}
+
+	// it's only address space, but that can be limited too
+	for (;;) {
+		base = mmap(NULL, nursery + reserved, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (base != MAP_FAILED || reserved == initial) {
+			break;
+		}
+
+		reserved = align_size(reserved / 2, page_size());
+		reserved = (reserved < initial)? initial : reserved;
+	}
+
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Panic! Fatal error: couldn't reserve the heap\n");
+		exit(EXIT_FAILURE);
+	}
+
+	settings->max_size = reserved;
+	settings->nursery_size = nursery;
+
+	gc->base      = base;
+	gc->reserved  = nursery + reserved;
+	gc->peak_size = initial;
+	init_space(&gc->nursery, gc->base, nursery);
+	init_space(&gc->old, gc->base + nursery, initial);
+	barrier_gc = gc;
+
+	pthread_attr_t attr;
+	void *stack;
+	size_t stack_size;
+
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		pthread_attr_getstack(&attr, &stack, &stack_size);
+		pthread_attr_destroy(&attr);
+		gc->stack_base = (uintptr_t)stack + stack_size;
+
+	} else {
+		// close enough, nothing above the caller allocates
+		gc->stack_base = (uintptr_t)__builtin_frame_address(0);
+	}
+}
+
+// the heap is made again for changed settings, which only works before
+// anything is allocated in it
+void gc_apply_settings(vm_gc_context_t *gc) {
+	if (gc->nursery.allocend == gc->nursery.start
+	    && gc->old.allocend == gc->old.start)
+	{
+		munmap(gc->base, gc->reserved);
+		gc_init(gc);
+	}
+}
+
+void gc_free(vm_gc_context_t *gc) {
+	stop_helpers(gc);
+	munmap(gc->base, gc->reserved);
+	free(gc->starts);
+	free(gc->objects);
+	free(gc->owned);
+	free(gc->remembered);
+}
+
+// data of the block placed after allocations ending at `end`, aligned
+// to 16 bytes with the header right before it
+static inline uint8_t *next_block(uint8_t *end) {
+	return align_ptr(end + sizeof(scm_gc_block_t), 16);
+}
+
+// end of the last block, allocation only moves it once the gaps between
+// pinned blocks have been used up
+static inline uint8_t *heap_top(vm_gc_space_t *space) {
+	return (space->limit == space->end)? space->allocend : space->top;
+}
+
+static inline
+scm_gc_block_t *gc_get_block(void *ptr) {
+	return (void *)((uint8_t*)ptr - sizeof(scm_gc_block_t));
+}
+
+// makes the block at `data` a dead one reaching up to the block at `before`,
+// if there's a gap between them
+static inline void set_filler(uint8_t *data, uint8_t *before) {
+	if (data != before) {
+		scm_gc_block_t *filler = gc_get_block(data);
+		filler->flags = FLAG_FILLER;
+		filler->size  = before - sizeof(scm_gc_block_t) - data;
+	}
+}
+
+// bytes a gap needs to be allocated in, smaller ones are left until the
+// blocks around them move
+#define MIN_GAP 64
+
+// leaves the space from the end of a block at `end` to the block at
+// `before` as a filler, and lists it after the gap at `*last`, or first in
+// `*gaps`, if it's worth allocating in. gaps are linked through their first
+// word
+static void add_gap(uint8_t **gaps, uint8_t **last, uint8_t *end, uint8_t *before) {
+	uint8_t *data = next_block(end);
+
+	set_filler(data, before);
+
+	if (data == before || gc_get_block(data)->size < MIN_GAP) {
+		return;
+	}
+
+	*(uint8_t **)data = NULL;
+
+	if (*last) {
+		*(uint8_t **)*last = data;
+
+	} else {
+		*gaps = data;
+	}
+
+	*last = data;
+}
+
+// allocation continues in the next gap listed, or after the last block
+static void take_gap(vm_gc_space_t *space) {
+	uint8_t *data = space->gaps;
+
+	if (!data) {
+		space->allocend = space->top;
+		space->limit = space->end;
+		return;
+	}
+
+	space->gaps = *(uint8_t **)data;
+	space->allocend = data - sizeof(scm_gc_block_t);
+	space->limit = next_block(data + gc_get_block(data)->size) - sizeof(scm_gc_block_t);
+}
+
+// leaves what's left of the gap being allocated in as a dead block, so
+// the heap can be walked, and moves on to the next one
+static bool next_region(vm_gc_space_t *space) {
+	if (space->limit == space->end) {
+		return false;
+	}
+
+	set_filler(next_block(space->allocend), space->limit + sizeof(scm_gc_block_t));
+	take_gap(space);
+
+	return true;
+}
+
+static void *alloc_in(vm_gc_space_t *space, size_t n) {
+	uint8_t *block_end = next_block(space->allocend);
+
+	while (block_end + n > space->limit) {
+		if (!next_region(space)) {
+			// allocation failure, need to run the collector
+			return NULL;
+		}
+
+		block_end = next_block(space->allocend);
 	}
 
-	gc->allocend = block_end + n;
+	space->allocend = block_end + n;
 	scm_gc_block_t *block = (void*)(block_end - sizeof(scm_gc_block_t));
 	block->flags = 0; // unmarked by default
 	block->size  = n;
@@ -76,177 +496,1970 @@ void *gc_alloc(vm_gc_context_t *gc, size_t n) {
 	return block_end;
 }
 
+void *gc_alloc(vm_gc_context_t *gc, size_t n) {
+	return fits_nursery(gc, n)? alloc_in(&gc->nursery, n) : gc_alloc_tenured(gc, n);
+}
+
+void *gc_alloc_tenured(vm_gc_context_t *gc, size_t n) {
+	void *ret = alloc_in(&gc->old, n);
+
+	gc->allocated += ret? sizeof(scm_gc_block_t) + n : 0;
+	return ret;
+}
+
 static inline bool is_heap_type(scm_value_t val) {
-	return (val & SCM_MASK_INTEGER) != 0 && (val & SCM_MASK_RUN_TYPE) != 0xff;
+	return (val & SCM_MASK_INTEGER) != 0 && (val & SCM_MASK_HEAP) != SCM_TYPE_CHAR;
 }
 
 // check whether the pointer is owned by the garbage collector
 // (there might be externally owned pointers referenced places)
 static inline bool is_gc_ptr(vm_gc_context_t *gc, void *ptr) {
 	uint8_t *temp = ptr;
-	return temp >= gc->base && temp < gc->allocend;
+	return temp >= gc->base && temp < gc->old.top;
 }
 
-static inline
-scm_gc_block_t *gc_get_block(void *ptr) {
-	return (void *)((uint8_t*)ptr - sizeof(scm_gc_block_t));
+static inline bool in_nursery(vm_gc_context_t *gc, void *ptr) {
+	uint8_t *temp = ptr;
+	return temp >= gc->nursery.start && temp < gc->nursery.end;
 }
 
-static inline
-void gc_mark_pointer(vm_gc_context_t *gc, void *ptr) {
-	if (is_gc_ptr(gc, ptr)) {
-		scm_gc_block_t *blk = gc_get_block(ptr);
-		blk->flags |= FLAG_MARKED;
-	}
+static inline bool is_young(vm_gc_context_t *gc, void *ptr) {
+	return in_nursery(gc, ptr) && !(gc_get_block(ptr)->flags & FLAG_OLD);
 }
 
-static inline
-void gc_mark_value(vm_gc_context_t *gc, scm_value_t val) {
-	if (is_heap_type(val)) {
-		gc_mark_pointer(gc, get_heap_tagged_value(val));
-		printf("marking value: %lx\n", val);
+// whether the block is collected by the collection in progress, minor ones
+// take the old generation to be live. incremental ones take what was
+// allocated after the old blocks since they started to be live
+static inline bool collected(vm_gc_context_t *gc, scm_gc_block_t *blk) {
+	uint8_t *data = (uint8_t *)(blk + 1);
+
+	if (gc->minor) {
+		return is_young(gc, data);
 	}
-}
 
-static inline
-void link_end(scm_value_t *end, scm_value_t next) {
-	scm_gc_block_t *blk = gc_get_block(get_heap_tagged_value(*end));
-	scm_gc_block_t *nextblk = gc_get_block(get_heap_tagged_value(next));
+	if (gc->phase == GC_IDLE) {
+		return true;
+	}
 
-	blk->uintptr = next;
-	nextblk->flags = FLAG_GREY;
-	nextblk->uintptr = 0;
-	*end = next;
+	return in_nursery(gc, data)? (blk->flags & FLAG_OLD) : data < gc->mark_top;
 }
 
-static inline
-scm_value_t link_next(scm_value_t val) {
-	if (val) {
-		scm_gc_block_t *blk = gc_get_block(get_heap_tagged_value(val));
-		return blk->uintptr;
-	} else {
-		return 0;
+static void remember(vm_gc_context_t *gc, uintptr_t entry) {
+	if (gc->num_remembered == gc->max_remembered) {
+		gc->max_remembered = gc->max_remembered? gc->max_remembered * 2 : 256;
+		gc->remembered = realloc(gc->remembered,
+		                         sizeof(uintptr_t[gc->max_remembered]));
 	}
+
+	gc->remembered[gc->num_remembered++] = entry;
 }
 
-static inline
-bool is_marked(scm_value_t val) {
-	scm_gc_block_t *blk = gc_get_block(get_heap_tagged_value(val));
-	return blk->flags & FLAG_MARKED;
+void gc_remember_variable(env_node_t *var) {
+	var->remembered = true;
+	remember(barrier_gc, (uintptr_t)var | OBJ_VARIABLE);
 }
 
-static inline
-bool is_unmarked_ptr(void *ptr) {
+// for closures given effects, which keep the values of the variables they
+// depend on
+void gc_remember_closure(vm_gc_context_t *gc, scm_closure_t *clsr) {
+	remember(gc, (uintptr_t)clsr | OBJ_CLOSURE);
+}
+
+// for lambdas given a definition or code, which might have young constants
+void gc_remember_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda) {
+	remember(gc, (uintptr_t)lambda | OBJ_LAMBDA);
+}
+
+// called after storing `value` in the block at `ptr`, which is remembered if
+// it's old and `value` isn't. pairs are only written to when they're made
+// for now, set-car! and vector-set! would go through this too
+void gc_write_barrier(vm_gc_context_t *gc, void *ptr, scm_value_t value) {
 	scm_gc_block_t *blk = gc_get_block(ptr);
-	return blk->flags == 0;
+
+	if (is_heap_type(value) && is_young(gc, get_heap_tagged_value(value))
+	    && !is_young(gc, ptr) && !(blk->flags & FLAG_REMEMBERED))
+	{
+		blk->flags |= FLAG_REMEMBERED;
+		remember(gc, (uintptr_t)ptr);
+	}
 }
 
-static inline
-bool is_unmarked(scm_value_t val) {
-	return is_unmarked_ptr(get_heap_tagged_value(val));
+static inline bool is_heap_address(vm_gc_context_t *gc, uintptr_t entry) {
+	return entry >= (uintptr_t)gc->base
+	       && entry < (uintptr_t)gc->base + gc->reserved;
 }
 
-static inline
-bool should_link(vm_gc_context_t *gc, scm_value_t val) {
-	return is_heap_type(val)
-	    && is_gc_ptr(gc, get_heap_tagged_value(val))
-	    && is_unmarked(val)
-	    ;
+// nothing old references young blocks after a collection
+static void forget_remembered(vm_gc_context_t *gc) {
+	for (size_t i = 0; i < gc->num_remembered; i++) {
+		uintptr_t entry = gc->remembered[i];
+
+		if (is_heap_address(gc, entry)) {
+			gc_get_block((void *)entry)->flags &= ~FLAG_REMEMBERED;
+
+		} else if ((entry & OBJ_MASK) == OBJ_VARIABLE) {
+			((env_node_t *)(entry & ~(uintptr_t)OBJ_MASK))->remembered = false;
+		}
+	}
+
+	gc->num_remembered = 0;
 }
 
-static inline
-void try_link(vm_gc_context_t *gc, scm_value_t *end, scm_value_t next) {
-	if (should_link(gc, next)) {
-		link_end(end, next);
+// what an owned lambda takes up, counting its code in each engine's form
+static inline size_t lambda_size(vm_lambda_t *lambda) {
+	size_t size = sizeof(vm_lambda_t) + sizeof(vm_op_t[lambda->num_ops]);
+
+	if (lambda->direct_code) {
+		size += sizeof(vm_direct_op_t[lambda->num_ops]);
 	}
+
+#ifdef VM_HAVE_NATIVE_JIT
+	size += vm_native_size(lambda);
+#endif
+
+	return size;
 }
 
-static void mark_traverse(vm_gc_context_t *gc, scm_value_t root) {
-	if (!should_link(gc, root)) {
-		// nothing to do here (external pointers have no block)
-		// TODO: second recursive marker to trace external pointers
-		return;
+// nothing can run the code of lambdas which weren't traced, so writes to
+// the variables it relies on don't matter. dropped in one go, freed bodies
+// leave a few each
+static void drop_watches(vm_gc_context_t *gc, vm_t *vm) {
+	vm_var_watch_t **link = &vm->var_watches;
+
+	while (*link) {
+		vm_var_watch_t *watch = *link;
+
+		if (watch->lambda->gc_mark != gc->cycle) {
+			*link = watch->next;
+			free(watch);
+
+		} else {
+			link = &watch->next;
+		}
 	}
+}
 
-	scm_value_t cur = root;
-	scm_value_t end = root;
+// frees the owned objects which the collection that just finished marking
+// didn't trace. their slot arrays are on the heap. what's remembered was
+// forgotten by then, and call sites cache closures by their address, which
+// a new one can be given now
+static void free_untraced(vm_gc_context_t *gc, vm_t *vm) {
+	size_t kept = 0;
+	bool closures = false;
 
-	while (cur != 0) {
-		gc_mark_value(gc, cur);
+	drop_watches(gc, vm);
+	gc->owned_live = 0;
 
-		// should only have heap types here, other types
-		// won't contain references to other values
-		switch (get_heap_type(cur)) {
-			case SCM_TYPE_PAIR: {
-				scm_pair_t *pair = get_heap_tagged_value(cur);
-				try_link(gc, &end, pair->car);
-				try_link(gc, &end, pair->cdr);
-				break;
+	for (size_t i = 0; i < gc->num_owned; i++) {
+		uintptr_t entry = gc->owned[i];
+		void *ptr = (void *)(entry & ~(uintptr_t)OBJ_MASK);
+
+		if ((entry & OBJ_MASK) == OBJ_CLOSURE) {
+			scm_closure_t *clsr = ptr;
+
+			if (clsr->gc_mark == gc->cycle) {
+				gc->owned[kept++] = entry;
+				gc->owned_live += sizeof(scm_closure_t);
+				continue;
 			}
 
-			case SCM_TYPE_VECTOR:
-			case SCM_TYPE_STRING:
-			case SCM_TYPE_CLOSURE:
-			case SCM_TYPE_SYMBOL:
-			case SCM_TYPE_SYNTAX_RULES:
-			case SCM_TYPE_EXTERNAL_PTR:
-			case SCM_TYPE_BIG_NUMBER:
-			default:
-				break;
+			free(clsr->effects);
+			free(clsr);
+			closures = true;
+
+		} else if ((entry & OBJ_MASK) == OBJ_LAMBDA) {
+			vm_lambda_t *lambda = ptr;
+
+			if (lambda->gc_mark == gc->cycle) {
+				gc->owned[kept++] = entry;
+				gc->owned_live += lambda_size(lambda);
+				continue;
+			}
+
+			vm_free_lambda(vm, lambda);
+			closures = true;
+
+		} else {
+			env_node_t *var = ptr;
+
+			if (var->gc_mark == gc->cycle) {
+				gc->owned[kept++] = entry;
+				gc->owned_live += sizeof(env_node_t);
+				continue;
+			}
+
+			free(var);
 		}
 
-		cur = link_next(cur);
+		gc->freed++;
+	}
+
+	gc->num_owned = kept;
+	gc->owned_bytes = 0;
+	gc->owned_sliced = 0;
+
+	if (closures) {
+		vm->code_epoch++;
 	}
 }
 
-static void mark_closure(vm_gc_context_t *gc, scm_closure_t *clsr) {
-	mark_traverse(gc, clsr->definition);
-	gc_mark_pointer(gc, clsr->closures);
-	// TODO: mark other
+static inline size_t start_index(vm_gc_context_t *gc, uint8_t *data) {
+	return (data - gc->base) / 16;
 }
 
-static void mark_env_node(vm_gc_context_t *gc, env_node_t *node) {
-	if (node && is_unmarked_ptr(node)) {
-		puts("huh?");
-		gc_mark_pointer(gc, node);
-		mark_traverse(gc, node->key);
-		mark_traverse(gc, node->value);
-		// TODO: should be using a balanced tree for environment
-		//       nodes, so stack depth shouldn't be an issue
-		mark_env_node(gc, node->left);
-		mark_env_node(gc, node->right);
+static void add_block_starts(vm_gc_context_t *gc, vm_gc_space_t *space) {
+	for (uint8_t *end = space->start; end < space->top;) {
+		uint8_t *data = next_block(end);
+		size_t index = start_index(gc, data);
+
+		gc->starts[index / 64] |= 1ULL << (index % 64);
+		end = data + gc_get_block(data)->size;
 	}
 }
 
-static void mark_environment(vm_gc_context_t *gc, environment_t *env) {
-	for (environment_t *cur = env; env && is_unmarked_ptr(env); env = env->last) {
-		gc_mark_pointer(gc, cur);
-		mark_env_node(gc, cur->root);
+// makes the bitmap of block starts cover the whole heap, keeping the bits
+// an incremental collection found
+static void reserve_starts(vm_gc_context_t *gc) {
+	size_t size = (gc->old.end - gc->base) / 16 / 64 + 1;
+
+	if (size > gc->starts_size) {
+		gc->starts = realloc(gc->starts, sizeof(uint64_t[size]));
+		memset(gc->starts + gc->starts_size, 0,
+		       sizeof(uint64_t[size - gc->starts_size]));
+		gc->starts_size = size;
 	}
 }
 
-static void mark_vm(vm_gc_context_t *gc, vm_t *vm) {
-	printf("got here too? %u, %u\n", vm->sp, vm->callp);
-	for (unsigned i = 0; i < vm->sp; i++) {
-		mark_traverse(gc, vm->stack[i]);
-		printf("asdf: %u\n", i);
+// fills the bitmap of block starts, which words that might be references
+// are checked against. minor collections only look blocks up in the nursery
+static void find_block_starts(vm_gc_context_t *gc) {
+	size_t cleared = (gc->nursery.end - gc->base) / 16 / 64;
+
+	reserve_starts(gc);
+	memset(gc->starts, 0, sizeof(uint64_t[gc->minor? cleared : gc->starts_size]));
+	add_block_starts(gc, &gc->nursery);
+
+	if (!gc->minor) {
+		add_block_starts(gc, &gc->old);
 	}
+}
 
-	for (unsigned i = 0; i < vm->callp; i++) {
-		if (vm->calls[i].runmode == false /* TODO: 'INTERPRETED' constant */) {
-			mark_traverse(gc, vm->calls[i].ptr);
-			// TODO: mark environment
+// the live block starting at `ptr`, or NULL if there isn't one
+static inline scm_gc_block_t *block_at(vm_gc_context_t *gc, void *ptr) {
+	uint8_t *data = ptr;
+
+	if (!is_gc_ptr(gc, data) || (uintptr_t)data % 16 != 0) {
+		return NULL;
+	}
+
+	size_t index = start_index(gc, data);
+
+	if (!(gc->starts[index / 64] & (1ULL << (index % 64)))) {
+		return NULL;
+	}
+
+	// other threads could be marking it
+	scm_gc_block_t *blk = gc_get_block(data);
+	size_t flags = __atomic_load_n(&blk->header, __ATOMIC_RELAXED);
+	return (flags & FLAG_FILLER)? NULL : blk;
+}
+
+// the block `ptr` points somewhere into, or NULL
+static scm_gc_block_t *block_containing(vm_gc_context_t *gc, uintptr_t ptr) {
+	uint8_t *start = gc->base;
+	uint8_t *top = gc->minor? gc->nursery.top
+	             : (gc->phase != GC_IDLE)? gc->mark_top : gc->old.top;
+
+	if (ptr < (uintptr_t)start || ptr >= (uintptr_t)top) {
+		return NULL;
+	}
+
+	size_t index = start_index(gc, (uint8_t *)ptr);
+	size_t word = index / 64;
+	uint64_t bits = gc->starts[word] & (~0ULL >> (63 - index % 64));
+
+	while (!bits && word > 0) {
+		bits = gc->starts[--word];
+	}
+
+	if (!bits) {
+		return NULL;
+	}
+
+	uint8_t *data = start + (word * 64 + 63 - __builtin_clzll(bits)) * 16;
+	scm_gc_block_t *blk = gc_get_block(data);
+	size_t size = (blk->size < 16)? 16 : blk->size;
+
+	if ((blk->flags & FLAG_FILLER) || ptr >= (uintptr_t)data + size) {
+		return NULL;
+	}
+
+	return blk;
+}
+
+static void push_work(gc_worker_t *worker, uintptr_t entry) {
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->bottom == worker->size) {
+		// what was stolen leaves room at the top, unless it's little
+		if (worker->top > 0 && worker->top >= worker->size / 2) {
+			worker->bottom -= worker->top;
+			memmove(worker->deque, worker->deque + worker->top,
+			        sizeof(uintptr_t[worker->bottom]));
+			worker->top = 0;
+
+		} else {
+			worker->size = worker->size? worker->size * 2 : 256;
+			worker->deque = realloc(worker->deque, sizeof(uintptr_t[worker->size]));
 		}
+	}
+
+	worker->deque[worker->bottom++] = entry;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static bool pop_work(gc_worker_t *worker, uintptr_t *entry) {
+	bool found = false;
 
-		mark_closure(gc, vm->calls[i].closure);
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->bottom > worker->top) {
+		*entry = worker->deque[--worker->bottom];
+		found = true;
+	}
+
+	if (worker->bottom == worker->top) {
+		worker->bottom = worker->top = 0;
 	}
 
-	mark_environment(gc, vm->env);
-	mark_traverse(gc, vm->ptr);
+	pthread_mutex_unlock(&worker->lock);
+	return found;
 }
 
-size_t gc_collect_vm(vm_gc_context_t *gc, vm_t *vm) {
-	puts("got here");
-	mark_vm(gc, vm);
-	return 0;
+static bool steal_work(gc_worker_t *victim, uintptr_t *entry) {
+	bool found = false;
+
+	pthread_mutex_lock(&victim->lock);
+
+	if (victim->bottom > victim->top) {
+		*entry = victim->deque[victim->top++];
+		found = true;
+	}
+
+	pthread_mutex_unlock(&victim->lock);
+	return found;
+}
+
+// the next block or object for the thread to scan. marking is done once
+// every thread has run out and there's nothing left to steal
+static bool take_work(gc_worker_t *worker, uintptr_t *entry) {
+	gc_helpers_t *helpers = worker->gc->helpers;
+	unsigned num = helpers->num_workers;
+	unsigned id = worker - helpers->workers;
+	bool idle = false;
+
+	if (pop_work(worker, entry)) {
+		return true;
+	}
+
+	for (;;) {
+		for (unsigned i = 1; i < num; i++) {
+			if (steal_work(&helpers->workers[(id + i) % num], entry)) {
+				if (idle) {
+					__atomic_sub_fetch(&helpers->idle, 1, __ATOMIC_RELAXED);
+				}
+
+				worker->stolen++;
+				return true;
+			}
+		}
+
+		if (!idle) {
+			idle = true;
+			__atomic_add_fetch(&helpers->idle, 1, __ATOMIC_RELAXED);
+		}
+
+		if (__atomic_load_n(&helpers->idle, __ATOMIC_RELAXED) == num) {
+			return false;
+		}
+
+		sched_yield();
+	}
+}
+
+// marks the block for a parallel collection, where other threads could be
+// marking it too. the one which greys it scans it
+static void shade_block(gc_worker_t *worker, scm_gc_block_t *blk, size_t pin) {
+	size_t header = __atomic_load_n(&blk->header, __ATOMIC_RELAXED);
+	size_t flags;
+
+	do {
+		size_t added = (FLAG_MARKED | pin) & ~header;
+
+		if (!added) {
+			return;
+		}
+
+		flags = header | added;
+
+		if ((added & (FLAG_MARKED | FLAG_CODE)) && !(header & FLAG_GREY)) {
+			flags |= FLAG_GREY;
+		}
+	} while (!__atomic_compare_exchange_n(&blk->header, &header, flags, true,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (flags & ~header & FLAG_GREY) {
+		push_work(worker, (uintptr_t)(blk + 1));
+	}
+}
+
+// `pin` is FLAG_PINNED, optionally with FLAG_CODE, or 0
+static void mark_block(vm_gc_context_t *gc, scm_gc_block_t *blk, size_t pin) {
+	if (marker) {
+		if (collected(gc, blk)) {
+			shade_block(marker, blk, pin);
+		}
+
+		return;
+	}
+
+	size_t added = (FLAG_MARKED | pin) & ~blk->flags;
+
+	if (!added || !collected(gc, blk)) {
+		return;
+	}
+
+	blk->flags |= added;
+
+	// blocks found to be code after they were scanned are scanned again,
+	// so that what they reference is pinned too
+	if ((added & (FLAG_MARKED | FLAG_CODE)) && !(blk->flags & FLAG_GREY)) {
+		blk->flags |= FLAG_GREY;
+		blk->next = NULL;
+
+		if (gc->queue_tail) {
+			((scm_gc_block_t *)gc->queue_tail)->next = blk;
+
+		} else {
+			gc->queue_head = blk;
+		}
+
+		gc->queue_tail = blk;
+	}
+}
+
+static inline size_t code_pin(bool code) {
+	return code? FLAG_PINNED | FLAG_CODE : 0;
+}
+
+static inline void mark_pointer(vm_gc_context_t *gc, void *ptr, bool code) {
+	if (ptr && is_gc_ptr(gc, ptr)) {
+		mark_block(gc, gc_get_block(ptr), code_pin(code));
+	}
+}
+
+static void list_object(uintptr_t **objects, size_t *num, size_t *max, uintptr_t entry) {
+	if (*num == *max) {
+		*max = *max? *max * 2 : 256;
+		*objects = realloc(*objects, sizeof(uintptr_t[*max]));
+	}
+
+	(*objects)[(*num)++] = entry;
+}
+
+// objects are scanned in the order they're added, or by the thread which
+// traced them in a parallel collection
+static void add_object(vm_gc_context_t *gc, void *ptr, unsigned kind) {
+	uintptr_t entry = (uintptr_t)ptr | kind;
+
+	if (marker) {
+		list_object(&marker->objects, &marker->num_objects, &marker->max_objects, entry);
+		push_work(marker, entry);
+
+	} else {
+		list_object(&gc->objects, &gc->num_objects, &gc->max_objects, entry);
+	}
+}
+
+// compiled code can make closures and boxes in loops, and top level forms
+// can each be compiled into a body, those are freed once they're dead. the
+// rest is made by the tree walker or the compiler, which hold it in C
+// locals that aren't traced
+void gc_own_closure(vm_gc_context_t *gc, scm_closure_t *clsr) {
+	list_object(&gc->owned, &gc->num_owned, &gc->max_owned,
+	            (uintptr_t)clsr | OBJ_CLOSURE);
+	gc->owned_bytes += sizeof(scm_closure_t);
+}
+
+void gc_own_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda) {
+	list_object(&gc->owned, &gc->num_owned, &gc->max_owned,
+	            (uintptr_t)lambda | OBJ_LAMBDA);
+	gc->owned_bytes += lambda_size(lambda);
+}
+
+void gc_own_variable(vm_gc_context_t *gc, env_node_t *var) {
+	list_object(&gc->owned, &gc->num_owned, &gc->max_owned,
+	            (uintptr_t)var | OBJ_VARIABLE);
+	gc->owned_bytes += sizeof(env_node_t);
+}
+
+// whether the object wasn't traced yet by this collection, the threads of a
+// parallel one race to it
+static inline bool claim_object(vm_gc_context_t *gc, unsigned *mark) {
+	if (marker) {
+		return __atomic_load_n(mark, __ATOMIC_RELAXED) != gc->cycle
+		       && __atomic_exchange_n(mark, gc->cycle, __ATOMIC_RELAXED) != gc->cycle;
+	}
+
+	if (*mark == gc->cycle) {
+		return false;
+	}
+
+	*mark = gc->cycle;
+	return true;
+}
+
+// each object is added once per collection, so the references in it are
+// only updated once. minor collections only scan what was remembered
+#define TRACE_OBJECT(gc, obj, kind) \
+	do { \
+		if (!(gc)->minor && (obj) && claim_object(gc, &(obj)->gc_mark)) { \
+			add_object(gc, obj, kind); \
+		} \
+	} while (0)
+
+static inline void trace_closure(vm_gc_context_t *gc, scm_closure_t *clsr) {
+	TRACE_OBJECT(gc, clsr, OBJ_CLOSURE);
+}
+
+static inline void trace_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda) {
+	TRACE_OBJECT(gc, lambda, OBJ_LAMBDA);
+}
+
+static inline void trace_environment(vm_gc_context_t *gc, environment_t *env) {
+	TRACE_OBJECT(gc, env, OBJ_ENVIRONMENT);
+}
+
+static inline void trace_variable(vm_gc_context_t *gc, env_node_t *var) {
+	TRACE_OBJECT(gc, var, OBJ_VARIABLE);
+}
+
+// `code` is true for values referenced by code
+static void mark_value(vm_gc_context_t *gc, scm_value_t value, bool code) {
+	if (!is_heap_type(value)) {
+		return;
+	}
+
+	void *ptr = get_heap_tagged_value(value);
+
+	if (is_gc_ptr(gc, ptr)) {
+		mark_block(gc, gc_get_block(ptr), code_pin(code));
+		return;
+	}
+
+	switch (get_heap_type(value)) {
+		case SCM_TYPE_CLOSURE:
+			trace_closure(gc, ptr);
+			break;
+
+		case SCM_TYPE_EXTERNAL_PTR:
+			// boxes, see vm_tag_box()
+			trace_variable(gc, ptr);
+			break;
+
+		case SCM_TYPE_SYNTAX_RULES: {
+			// patterns are code, and referenced by untagged pointers
+			scm_syntax_rules_t *rules = ptr;
+			mark_pointer(gc, rules->keywords, true);
+			mark_pointer(gc, rules->patterns, true);
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+// stack slots, handles, op operands and unfilled slot arrays can hold
+// words which aren't values, so they're checked against the blocks which
+// exist before they're followed
+static inline void mark_word(vm_gc_context_t *gc, scm_value_t value, bool code) {
+	if (!is_heap_type(value) || !is_gc_ptr(gc, get_heap_tagged_value(value))
+	    || block_at(gc, get_heap_tagged_value(value)))
+	{
+		mark_value(gc, value, code);
+	}
+}
+
+// pairs hold values, and slot arrays hold variable pointers, which look
+// like integers. slot arrays of closures which couldn't be bound aren't
+// filled in, they're only found from the C stack
+static void scan_words(vm_gc_context_t *gc, scm_value_t *words, size_t size, bool code) {
+	for (size_t i = 0; i < size / sizeof(scm_value_t); i++) {
+		mark_word(gc, words[i], code);
+	}
+}
+
+static void scan_block(vm_gc_context_t *gc, scm_gc_block_t *blk) {
+	scan_words(gc, (scm_value_t *)(blk + 1), blk->size, blk->flags & FLAG_CODE);
+}
+
+static void scan_closure(vm_gc_context_t *gc, scm_closure_t *clsr) {
+	trace_lambda(gc, clsr->lambda);
+	trace_environment(gc, clsr->env);
+	mark_pointer(gc, clsr->closures, false);
+
+	for (unsigned i = 0; clsr->closures && i < clsr->num_slots; i++) {
+		trace_variable(gc, clsr->closures[i]);
+	}
+
+	for (unsigned i = 0; clsr->effects && i < clsr->effects->num_deps; i++) {
+		trace_variable(gc, clsr->effects->deps[i].var);
+		mark_value(gc, clsr->effects->deps[i].value, false);
+	}
+}
+
+static void scan_lambda(vm_gc_context_t *gc, vm_lambda_t *lambda) {
+	mark_value(gc, lambda->definition, true);
+	mark_value(gc, lambda->args, true);
+
+	// constants are built into the threaded and native code made from
+	// the ops, and the ops of constants fused into calls don't run
+	for (unsigned i = 0; lambda->code && i < lambda->num_ops; i++) {
+		vm_op_t *op = lambda->code + i;
+
+		if (op->func == vm_op_push_const || op->func == NULL) {
+			mark_word(gc, op->arg, true);
+
+		} else if (op->func == vm_op_make_closure) {
+			trace_lambda(gc, ((vm_closure_proto_t *)op->arg)->lambda);
+		}
+	}
+
+	// guards compare against what the code was optimized with
+	vm_fold_guard_t *guard = lambda->fold_guard;
+
+	for (unsigned i = 0; guard && i < guard->num_slots; i++) {
+		trace_variable(gc, guard->slots[i].var);
+		mark_value(gc, guard->slots[i].value, true);
+	}
+}
+
+static void trace_env_nodes(vm_gc_context_t *gc, env_node_t *node) {
+	// recursing on one side only, the nodes are ordered by address and
+	// tend to run off to the right
+	for (; node; node = node->right) {
+		trace_variable(gc, node);
+		trace_env_nodes(gc, node->left);
+	}
+}
+
+static void scan_object(vm_gc_context_t *gc, uintptr_t obj) {
+	void *ptr = (void *)(obj & ~(uintptr_t)OBJ_MASK);
+
+	switch (obj & OBJ_MASK) {
+		case OBJ_CLOSURE:
+			scan_closure(gc, ptr);
+			break;
+
+		case OBJ_LAMBDA:
+			scan_lambda(gc, ptr);
+			break;
+
+		case OBJ_ENVIRONMENT: {
+			environment_t *env = ptr;
+			trace_env_nodes(gc, env->root);
+			trace_environment(gc, env->last);
+			break;
+		}
+
+		case OBJ_VARIABLE:
+			mark_value(gc, ((env_node_t *)ptr)->value, false);
+			break;
+	}
+}
+
+// scans a block or object that was marked, false if there are none left.
+// objects and blocks made since an incremental collection started are left
+// to it by minor collections
+static bool mark_step(vm_gc_context_t *gc) {
+	if (gc->queue_head) {
+		scm_gc_block_t *blk = gc->queue_head;
+
+		gc->queue_head = blk->next;
+		if (!gc->queue_head) {
+			gc->queue_tail = NULL;
+		}
+
+		blk->flags &= ~FLAG_GREY;
+		scan_block(gc, blk);
+		return true;
+	}
+
+	if (gc->minor) {
+		return false;
+	}
+
+	if (gc->scanned < gc->num_objects) {
+		scan_object(gc, gc->objects[gc->scanned++]);
+		return true;
+	}
+
+	if (gc->phase == GC_MARK && gc->tail_scan < heap_top(&gc->old)) {
+		uint8_t *data = next_block(gc->tail_scan);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		gc->tail_scan = data + blk->size;
+		scan_block(gc, blk);
+		return true;
+	}
+
+	return false;
+}
+
+static void mark_all(vm_gc_context_t *gc) {
+	while (mark_step(gc));
+}
+
+static int compare_entries(const void *a, const void *b) {
+	uintptr_t x = *(const uintptr_t *)a;
+	uintptr_t y = *(const uintptr_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static inline void trace_owned(vm_gc_context_t *gc, uintptr_t entry) {
+	void *ptr = (void *)(entry & ~(uintptr_t)OBJ_MASK);
+
+	switch (entry & OBJ_MASK) {
+		case OBJ_CLOSURE:
+			trace_closure(gc, ptr);
+			break;
+
+		case OBJ_LAMBDA:
+			trace_lambda(gc, ptr);
+			break;
+
+		case OBJ_VARIABLE:
+			trace_variable(gc, ptr);
+			break;
+	}
+}
+
+// the entry of the owned object `word` points to, or is a value of, in the
+// sorted `gc->owned`. 0 if there isn't one
+static uintptr_t find_owned(vm_gc_context_t *gc, uintptr_t word) {
+	uintptr_t ptr = word & ~(uintptr_t)SCM_MASK_HEAP;
+	size_t low = 0;
+	size_t high = gc->num_owned;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		uintptr_t start = gc->owned[mid] & ~(uintptr_t)OBJ_MASK;
+
+		if (start < ptr) {
+			low = mid + 1;
+
+		} else if (start > ptr) {
+			high = mid;
+
+		} else {
+			return gc->owned[mid];
+		}
+	}
+
+	return 0;
+}
+
+// callee-saved registers are spilled into `regs` by setjmp(), everything
+// else C code holds is in the frames above. owned objects are only freed
+// by collections of the whole heap, which trace the ones found here, eg.
+// the values of a pair being made
+__attribute__((noinline, no_sanitize_address))
+static void mark_c_stack(vm_gc_context_t *gc) {
+	jmp_buf regs;
+	setjmp(regs);
+
+	uintptr_t *ptr = (uintptr_t *)((uintptr_t)&regs & ~(uintptr_t)7);
+	bool owned = !gc->minor && gc->num_owned;
+
+	if (owned) {
+		qsort(gc->owned, gc->num_owned, sizeof(uintptr_t), compare_entries);
+	}
+
+	for (; (uintptr_t)ptr < gc->stack_base; ptr++) {
+		scm_gc_block_t *blk = block_containing(gc, *ptr);
+		uintptr_t entry = 0;
+
+		if (blk) {
+			mark_block(gc, blk, FLAG_PINNED);
+
+		} else if (owned && (entry = find_owned(gc, *ptr))) {
+			trace_owned(gc, entry);
+		}
+	}
+}
+
+static void mark_roots(vm_gc_context_t *gc, vm_t *vm) {
+	mark_c_stack(gc);
+
+	for (unsigned i = 0; i < vm->sp; i++) {
+		mark_word(gc, vm->stack[i], false);
+	}
+
+	for (unsigned i = 0; i < vm->handles.max_avail; i++) {
+		if (vm->handles.slots[i].used) {
+			mark_word(gc, vm->handles.slots[i].value, false);
+		}
+	}
+
+	// the tree walker's position in code
+	mark_value(gc, vm->ptr, true);
+	for (unsigned i = 0; i < vm->interp_callp; i++) {
+		mark_value(gc, vm->interp_calls[i].ptr, true);
+		trace_environment(gc, vm->interp_calls[i].env);
+	}
+
+	if (gc->minor) {
+		for (size_t i = 0; i < gc->num_remembered; i++) {
+			uintptr_t entry = gc->remembered[i];
+
+			if (is_heap_address(gc, entry)) {
+				scan_block(gc, gc_get_block((void *)entry));
+
+			} else {
+				scan_object(gc, entry);
+			}
+		}
+
+		return;
+	}
+
+	trace_closure(gc, vm->closure);
+	for (unsigned i = 0; i < vm->callp; i++) {
+		trace_closure(gc, vm->calls[i].closure);
+	}
+
+	trace_environment(gc, vm->env);
+
+	// lambdas are looked up by their body, which has to stay put
+	for (unsigned i = 0; i < vm->lambdas_size; i++) {
+		for (vm_lambda_t *lambda = vm->lambdas[i]; lambda; lambda = lambda->next) {
+			trace_lambda(gc, lambda);
+		}
+	}
+}
+
+static void mark_vm(vm_gc_context_t *gc, vm_t *vm) {
+	mark_roots(gc, vm);
+	mark_all(gc);
+}
+
+static void *run_helper(void *arg) {
+	gc_worker_t *worker = arg;
+	gc_helpers_t *helpers = worker->gc->helpers;
+	unsigned round = 0;
+
+	pthread_mutex_lock(&helpers->lock);
+
+	for (;;) {
+		while (helpers->round == round && !helpers->quit) {
+			pthread_cond_wait(&helpers->wake, &helpers->lock);
+		}
+
+		if (helpers->quit) {
+			break;
+		}
+
+		void (*task)(gc_worker_t *worker) = helpers->task;
+
+		round = helpers->round;
+		pthread_mutex_unlock(&helpers->lock);
+		task(worker);
+		pthread_mutex_lock(&helpers->lock);
+
+		if (--helpers->running == 0) {
+			pthread_cond_signal(&helpers->done);
+		}
+	}
+
+	pthread_mutex_unlock(&helpers->lock);
+	return NULL;
+}
+
+// starts the helper threads the first time they're needed, the thread
+// collecting is the first worker. fewer are used if they can't be started
+static gc_helpers_t *start_helpers(vm_gc_context_t *gc) {
+	unsigned num = gc->settings.threads;
+	gc_helpers_t *helpers = gc->helpers;
+
+	if (helpers) {
+		return helpers;
+	}
+
+	helpers = calloc(1, sizeof(gc_helpers_t) + sizeof(gc_worker_t[num]));
+	pthread_mutex_init(&helpers->lock, NULL);
+	pthread_cond_init(&helpers->wake, NULL);
+	pthread_cond_init(&helpers->done, NULL);
+	gc->helpers = helpers;
+
+	for (unsigned i = 0; i < num; i++) {
+		gc_worker_t *worker = &helpers->workers[i];
+
+		worker->gc = gc;
+		pthread_mutex_init(&worker->lock, NULL);
+
+		if (i > 0 && pthread_create(&worker->thread, NULL, run_helper, worker) != 0) {
+			pthread_mutex_destroy(&worker->lock);
+			break;
+		}
+
+		helpers->num_workers = i + 1;
+	}
+
+	return helpers;
+}
+
+static void stop_helpers(vm_gc_context_t *gc) {
+	gc_helpers_t *helpers = gc->helpers;
+
+	if (!helpers) {
+		return;
+	}
+
+	pthread_mutex_lock(&helpers->lock);
+	helpers->quit = true;
+	pthread_cond_broadcast(&helpers->wake);
+	pthread_mutex_unlock(&helpers->lock);
+
+	for (unsigned i = 0; i < helpers->num_workers; i++) {
+		gc_worker_t *worker = &helpers->workers[i];
+
+		if (i > 0) {
+			pthread_join(worker->thread, NULL);
+		}
+
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->deque);
+		free(worker->objects);
+	}
+
+	pthread_mutex_destroy(&helpers->lock);
+	pthread_cond_destroy(&helpers->wake);
+	pthread_cond_destroy(&helpers->done);
+	free(helpers->regions);
+	free(helpers);
+	gc->helpers = NULL;
+}
+
+// runs the task on every worker, and waits for all of them to finish it
+static void run_workers(vm_gc_context_t *gc, void (*task)(gc_worker_t *worker)) {
+	gc_helpers_t *helpers = gc->helpers;
+
+	pthread_mutex_lock(&helpers->lock);
+	helpers->task = task;
+	helpers->running = helpers->num_workers - 1;
+	helpers->idle = 0;
+	helpers->next = 0;
+	helpers->round++;
+	pthread_cond_broadcast(&helpers->wake);
+	pthread_mutex_unlock(&helpers->lock);
+
+	task(&helpers->workers[0]);
+
+	pthread_mutex_lock(&helpers->lock);
+
+	while (helpers->running > 0) {
+		pthread_cond_wait(&helpers->done, &helpers->lock);
+	}
+
+	pthread_mutex_unlock(&helpers->lock);
+}
+
+// index of the next region, or run of objects, for a worker to take
+static inline size_t take_next(gc_helpers_t *helpers) {
+	return __atomic_fetch_add(&helpers->next, 1, __ATOMIC_RELAXED);
+}
+
+static void mark_task(gc_worker_t *worker) {
+	vm_gc_context_t *gc = worker->gc;
+	uintptr_t entry;
+
+	marker = worker;
+
+	while (take_work(worker, &entry)) {
+		if (is_heap_address(gc, entry)) {
+			// it's greyed and scanned again if it's found to be code after
+			// the flags are read
+			scm_gc_block_t *blk = gc_get_block((void *)entry);
+			scm_gc_block_t seen;
+
+			seen.header = __atomic_fetch_and(&blk->header, ~(size_t)FLAG_GREY,
+			                                 __ATOMIC_RELAXED);
+			scan_words(gc, (scm_value_t *)entry, seen.size, seen.flags & FLAG_CODE);
+
+		} else {
+			scan_object(gc, entry);
+		}
+	}
+
+	marker = NULL;
+}
+
+// marks what the roots reference on every thread, each starting off with a
+// share of what they marked. the objects traced are listed together after
+static void mark_in_parallel(vm_gc_context_t *gc, gc_helpers_t *helpers) {
+	unsigned num = helpers->num_workers;
+	size_t i = 0;
+
+	for (scm_gc_block_t *blk = gc->queue_head; blk; blk = blk->next) {
+		push_work(&helpers->workers[i++ % num], (uintptr_t)(blk + 1));
+	}
+
+	while (gc->scanned < gc->num_objects) {
+		push_work(&helpers->workers[i++ % num], gc->objects[gc->scanned++]);
+	}
+
+	gc->queue_head = gc->queue_tail = NULL;
+	run_workers(gc, mark_task);
+
+	for (unsigned k = 0; k < num; k++) {
+		gc_worker_t *worker = &helpers->workers[k];
+
+		for (size_t j = 0; j < worker->num_objects; j++) {
+			list_object(&gc->objects, &gc->num_objects, &gc->max_objects,
+			            worker->objects[j]);
+		}
+
+		gc->stolen += worker->stolen;
+		worker->num_objects = 0;
+		worker->stolen = 0;
+	}
+
+	gc->scanned = gc->num_objects;
+}
+
+static inline scm_value_t forward_value(vm_gc_context_t *gc, scm_value_t value) {
+	if (is_heap_type(value) && is_gc_ptr(gc, get_heap_tagged_value(value))) {
+		scm_gc_block_t *blk = gc_get_block(get_heap_tagged_value(value));
+
+		if (collected(gc, blk)) {
+			return tag_heap_type(blk->forward, get_heap_type(value));
+		}
+	}
+
+	return value;
+}
+
+static inline void forward_word(vm_gc_context_t *gc, scm_value_t *value) {
+	if (is_heap_type(*value) && block_at(gc, get_heap_tagged_value(*value))) {
+		*value = forward_value(gc, *value);
+	}
+}
+
+// the old generation as a single region, for collections on one thread
+static inline gc_region_t whole_heap(vm_gc_context_t *gc) {
+	return (gc_region_t){ .start = gc->old.start, .stop = next_block(gc->old.top) };
+}
+
+// the first block starting at `ptr` or after it in the old generation, or
+// NULL if there isn't one
+static uint8_t *block_after(vm_gc_context_t *gc, uint8_t *ptr) {
+	size_t index = start_index(gc, align_ptr(ptr, 16));
+	size_t word = index / 64;
+	size_t last = start_index(gc, gc->old.top) / 64;
+	uint64_t bits = gc->starts[word] & (~0ULL << (index % 64));
+
+	while (!bits && word < last) {
+		bits = gc->starts[++word];
+	}
+
+	if (!bits) {
+		return NULL;
+	}
+
+	uint8_t *data = gc->base + (word * 64 + __builtin_ctzll(bits)) * 16;
+	return (data < gc->old.top)? data : NULL;
+}
+
+// bytes of the old generation a thread compacts at a time
+#define REGION_SIZE ((size_t)256 << 10)
+
+// splits the old generation at blocks at least REGION_SIZE bytes apart
+static void split_regions(vm_gc_context_t *gc, gc_helpers_t *helpers) {
+	vm_gc_space_t *old = &gc->old;
+	size_t max = (old->top - old->start) / REGION_SIZE + 1;
+	uint8_t *start = old->start;
+	uint8_t *data;
+
+	if (max > helpers->max_regions) {
+		helpers->max_regions = max;
+		helpers->regions = realloc(helpers->regions, sizeof(gc_region_t[max]));
+	}
+
+	helpers->num_regions = 0;
+
+	for (uint8_t *at = old->start + REGION_SIZE;
+	     at < old->top && (data = block_after(gc, at));
+	     at = data + REGION_SIZE)
+	{
+		helpers->regions[helpers->num_regions++] =
+			(gc_region_t){ .start = start, .stop = data };
+		start = (uint8_t *)gc_get_block(data);
+	}
+
+	helpers->regions[helpers->num_regions++] =
+		(gc_region_t){ .start = start, .stop = next_block(old->top) };
+}
+
+static void count_region(vm_gc_context_t *gc, gc_region_t *region) {
+	gc->live += region->live;
+	gc->reclaimed += region->reclaimed;
+	gc->pinned += region->pinned;
+}
+
+// blocks left in the nursery stay where they are
+static void forward_nursery(vm_gc_context_t *gc) {
+	for (uint8_t *end = gc->nursery.start; end < gc->nursery.top;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		end = data + blk->size;
+
+		if (blk->flags & FLAG_MARKED) {
+			blk->forward = data;
+		}
+	}
+}
+
+// works out where the live blocks in the region go, they slide down to the
+// start of it around the pinned ones
+static void forward_region(gc_region_t *region) {
+	uint8_t *to = region->start;
+
+	for (uint8_t *end = region->start; next_block(end) < region->stop;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		end = data + blk->size;
+
+		if (!(blk->flags & FLAG_MARKED)) {
+			if (!(blk->flags & FLAG_FILLER)) {
+				region->reclaimed += blk->size;
+			}
+
+		} else if (blk->flags & FLAG_PINNED) {
+			blk->forward = data;
+			to = end;
+			region->pinned++;
+			region->live += sizeof(scm_gc_block_t) + blk->size;
+
+		} else {
+			blk->forward = next_block(to);
+			to = blk->forward + blk->size;
+			region->live += sizeof(scm_gc_block_t) + blk->size;
+		}
+	}
+}
+
+// works out where live blocks go
+static void compute_forwarding(vm_gc_context_t *gc) {
+	gc_region_t region = whole_heap(gc);
+
+	gc->live = 0;
+	forward_nursery(gc);
+	forward_region(&region);
+	count_region(gc, &region);
+}
+
+// moves live young blocks to the old generation, unless they're pinned or
+// it's out of room, then they're promoted where they are
+static void promote_blocks(vm_gc_context_t *gc) {
+	vm_gc_space_t *nursery = &gc->nursery;
+
+	for (uint8_t *end = nursery->start; end < nursery->top;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+		uint8_t *dest = NULL;
+
+		end = data + blk->size;
+
+		// old blocks can be marked by an incremental collection
+		if ((blk->flags & (FLAG_MARKED | FLAG_OLD)) != FLAG_MARKED) {
+			continue;
+		}
+
+		if (!(blk->flags & FLAG_PINNED)) {
+			dest = gc_alloc_tenured(gc, blk->size);
+
+			// with room for whatever else is live in the nursery, the
+			// old generation is collected right after this then
+			if (!dest && grow_heap(gc, nursery->end - nursery->start)) {
+				gc->old_full = true;
+				dest = gc_alloc_tenured(gc, blk->size);
+			}
+		}
+
+		if (dest) {
+			memcpy(dest, data, blk->size);
+			blk->forward = dest;
+			gc->promoted += blk->size;
+
+		} else {
+			blk->flags |= FLAG_PINNED;
+			blk->forward = data;
+		}
+	}
+}
+
+static void update_words(vm_gc_context_t *gc, scm_value_t *words, size_t size) {
+	for (size_t i = 0; i < size / sizeof(scm_value_t); i++) {
+		forward_word(gc, words + i);
+	}
+}
+
+static void update_blocks(vm_gc_context_t *gc, vm_gc_space_t *space) {
+	for (uint8_t *end = space->start; end < space->top;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		end = data + blk->size;
+
+		if (gc->minor && (blk->flags & FLAG_OLD)) {
+			// old blocks in the nursery are remembered if they need it
+			continue;
+		}
+
+		if (blk->flags & FLAG_MARKED) {
+			// blocks promoted by a minor collection were already copied
+			uint8_t *words = gc->minor? blk->forward : data;
+			update_words(gc, (scm_value_t *)words, blk->size);
+		}
+	}
+}
+
+static void update_region(vm_gc_context_t *gc, gc_region_t *region) {
+	for (uint8_t *end = region->start; next_block(end) < region->stop;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		end = data + blk->size;
+
+		if (blk->flags & FLAG_MARKED) {
+			update_words(gc, (scm_value_t *)data, blk->size);
+		}
+	}
+}
+
+// code and the tree walker only reference pinned blocks, which don't move
+static void update_object(vm_gc_context_t *gc, uintptr_t obj) {
+	void *ptr = (void *)(obj & ~(uintptr_t)OBJ_MASK);
+
+	if (is_heap_address(gc, obj)) {
+		update_words(gc, ptr, gc_get_block(ptr)->size);
+
+	} else if ((obj & OBJ_MASK) == OBJ_CLOSURE) {
+		scm_closure_t *clsr = ptr;
+
+		if (clsr->closures && is_gc_ptr(gc, clsr->closures)
+		    && collected(gc, gc_get_block(clsr->closures)))
+		{
+			clsr->closures = (void *)gc_get_block(clsr->closures)->forward;
+		}
+
+		for (unsigned k = 0; clsr->effects && k < clsr->effects->num_deps; k++) {
+			clsr->effects->deps[k].value =
+				forward_value(gc, clsr->effects->deps[k].value);
+		}
+
+	} else if ((obj & OBJ_MASK) == OBJ_VARIABLE) {
+		env_node_t *var = ptr;
+		var->value = forward_value(gc, var->value);
+	}
+}
+
+static void update_roots(vm_gc_context_t *gc, vm_t *vm) {
+	for (unsigned i = 0; i < vm->sp; i++) {
+		forward_word(gc, vm->stack + i);
+	}
+
+	for (unsigned i = 0; i < vm->handles.max_avail; i++) {
+		if (vm->handles.slots[i].used) {
+			forward_word(gc, &vm->handles.slots[i].value);
+		}
+	}
+
+	update_blocks(gc, &gc->nursery);
+}
+
+static void update_references(vm_gc_context_t *gc, vm_t *vm) {
+	update_roots(gc, vm);
+
+	if (gc->minor) {
+		for (size_t i = 0; i < gc->num_remembered; i++) {
+			update_object(gc, gc->remembered[i]);
+		}
+
+	} else {
+		gc_region_t region = whole_heap(gc);
+
+		update_region(gc, &region);
+
+		for (size_t i = 0; i < gc->num_objects; i++) {
+			update_object(gc, gc->objects[i]);
+		}
+	}
+}
+
+// slides the live blocks in the region down to where they were forwarded to
+static void move_region(gc_region_t *region) {
+	uint8_t *to = region->start;
+
+	for (uint8_t *end = region->start; next_block(end) < region->stop;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+		size_t flags = blk->flags;
+		size_t size = blk->size;
+
+		end = data + size;
+
+		if (!(flags & FLAG_MARKED)) {
+			continue;
+		}
+
+		if (flags & FLAG_PINNED) {
+			// new blocks are allocated in the gaps left before pinned
+			// blocks first
+			add_gap(&region->gaps, &region->last_gap, to, data);
+			blk->flags = 0;
+			to = end;
+
+		} else {
+			uint8_t *dest = blk->forward;
+
+			memmove(dest, data, size);
+			blk = gc_get_block(dest);
+			blk->flags = 0;
+			blk->size  = size;
+			to = dest + size;
+		}
+	}
+
+	region->to = to;
+}
+
+static void move_blocks(vm_gc_context_t *gc) {
+	gc_region_t region = whole_heap(gc);
+
+	move_region(&region);
+	gc->old.gaps = region.gaps;
+	gc->old.top = region.to;
+	take_gap(&gc->old);
+}
+
+// leaves the blocks promoted in place in the nursery, with the gaps
+// between them to allocate new blocks in. minor collections keep the marks
+// of an incremental one on the blocks which were already old
+static void sweep_nursery(vm_gc_context_t *gc) {
+	vm_gc_space_t *nursery = &gc->nursery;
+	uint8_t *to = nursery->start;
+	uint8_t *last = NULL;
+
+	nursery->gaps = NULL;
+
+	for (uint8_t *end = nursery->start; end < nursery->top;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+		size_t flags = blk->flags;
+		bool kept = gc->minor? (flags & (FLAG_OLD | FLAG_PINNED))
+		                     : (flags & FLAG_MARKED);
+
+		end = data + blk->size;
+
+		if (!kept) {
+			if (!(flags & (FLAG_MARKED | FLAG_FILLER))) {
+				gc->reclaimed += blk->size;
+			}
+
+			continue;
+		}
+
+		add_gap(&nursery->gaps, &last, to, data);
+
+		if (gc->minor && (flags & FLAG_OLD)) {
+			blk->flags = flags & (FLAG_OLD | FLAG_MARKED | FLAG_GREY);
+
+		} else {
+			blk->flags = FLAG_OLD;
+		}
+
+		to = end;
+	}
+
+	nursery->top = to;
+	take_gap(nursery);
+}
+
+// the pages from `start` to `end` are given back, and come back as zeros
+// if they're used again
+static bool release_pages(uint8_t *start, uint8_t *end) {
+	start = align_ptr(start, page_size());
+	end -= (uintptr_t)end % page_size();
+
+	if (start < end) {
+		madvise(start, end - start, MADV_DONTNEED);
+		return true;
+	}
+
+	return false;
+}
+
+static void set_heap_size(vm_gc_context_t *gc, size_t size) {
+	vm_gc_space_t *old = &gc->old;
+	uint8_t *end = old->start + size;
+
+	if (end < old->end) {
+		release_pages(end, old->end);
+	}
+
+	if (old->limit == old->end) {
+		old->limit = end;
+	}
+
+	old->end = end;
+	gc->peak_size = (size > gc->peak_size)? size : gc->peak_size;
+}
+
+// blocks which couldn't be moved keep the gaps before them in the heap,
+// but not in memory
+static bool release_gaps(vm_gc_context_t *gc) {
+	bool released = false;
+
+	for (uint8_t *end = gc->old.start; end < gc->old.top;) {
+		uint8_t *data = next_block(end);
+		scm_gc_block_t *blk = gc_get_block(data);
+
+		end = data + blk->size;
+
+		// keeping the link to the next gap
+		if (blk->flags & FLAG_FILLER) {
+			released |= release_pages(data + sizeof(uint8_t *), end);
+		}
+	}
+
+	return released;
+}
+
+// address space the old generation can grow into
+static inline size_t old_reserved(vm_gc_context_t *gc) {
+	return gc->base + gc->reserved - gc->old.start;
+}
+
+// the size the old generation should have for `used` bytes to take up the
+// target share of it, or the nearest it can have
+static size_t target_size(vm_gc_context_t *gc, size_t used) {
+	vm_heap_settings_t *settings = &gc->settings;
+	size_t size = align_size(used * 100 / settings->target_occupancy, page_size());
+	// pinned blocks can be left anywhere in it
+	size_t top = align_size(heap_top(&gc->old) - gc->old.start, page_size());
+
+	size = (size < settings->initial_size)? settings->initial_size : size;
+	size = (size < top)? top : size;
+	size = (size > old_reserved(gc))? old_reserved(gc) : size;
+
+	return size;
+}
+
+// after a collection, grows the heap if live data takes up more than the
+// target share of it, and shrinks it if there's less than half that. the
+// gaps are only given back if `release` is set, that takes a walk over it
+static void resize_heap(vm_gc_context_t *gc, bool release) {
+	size_t size = gc->old.end - gc->old.start;
+	size_t occupancy = gc->live * 100 / size;
+	size_t target = gc->settings.target_occupancy;
+	size_t new_size = target_size(gc, gc->live);
+
+	if (occupancy > target && new_size > size) {
+		set_heap_size(gc, new_size);
+		gc->grown++;
+
+	} else if (occupancy < target / 2) {
+		bool shrunk = new_size < size;
+
+		if (shrunk) {
+			set_heap_size(gc, new_size);
+		}
+
+		if ((release && release_gaps(gc)) || shrunk) {
+			gc->shrunk++;
+		}
+	}
+}
+
+// makes room for a block of `n` bytes after the last one, if the heap can
+// grow that far
+static bool grow_heap(vm_gc_context_t *gc, size_t n) {
+	size_t header = sizeof(scm_gc_block_t);
+	size_t needed = align_size(heap_top(&gc->old) - gc->old.start + 2*header + n,
+	                           page_size());
+	size_t size = target_size(gc, gc->live + header + n);
+
+	if (needed > old_reserved(gc)) {
+		return false;
+	}
+
+	set_heap_size(gc, (size > needed)? size : needed);
+	gc->grown++;
+	return true;
+}
+
+// the rest of the gap being allocated in is dead
+static void close_region(vm_gc_space_t *space) {
+	space->top = heap_top(space);
+
+	if (space->limit != space->end) {
+		set_filler(next_block(space->allocend), space->limit + sizeof(scm_gc_block_t));
+	}
+}
+
+static void begin_collection(vm_gc_context_t *gc, bool minor) {
+	gc->minor = minor;
+
+	// the objects an incremental collection traced are kept for it
+	if (!minor) {
+		gc->cycle++;
+		gc->num_objects = 0;
+		gc->scanned = 0;
+	}
+
+	close_region(&gc->nursery);
+
+	if (minor) {
+		// promoted blocks go where allocation left off
+		gc->old.top = heap_top(&gc->old);
+
+	} else {
+		close_region(&gc->old);
+	}
+
+	find_block_starts(gc);
+}
+
+// what was written to since the last minor collection is marked for the
+// incremental one, which might have scanned it before the write
+static void shade_remembered(vm_gc_context_t *gc) {
+	gc->minor = false;
+
+	for (size_t i = 0; i < gc->num_remembered; i++) {
+		uintptr_t entry = gc->remembered[i];
+
+		if (is_heap_address(gc, entry)) {
+			scan_block(gc, gc_get_block((void *)entry));
+
+		} else {
+			scan_object(gc, entry);
+		}
+	}
+}
+
+static void collect_young(vm_gc_context_t *gc, vm_t *vm) {
+	// an incremental collection's queue is put aside
+	void *queue_head = gc->queue_head;
+	void *queue_tail = gc->queue_tail;
+
+	gc->queue_head = gc->queue_tail = NULL;
+	gc->minor_collections++;
+	begin_collection(gc, true);
+	mark_vm(gc, vm);
+
+	promote_blocks(gc);
+	update_references(gc, vm);
+	sweep_nursery(gc);
+
+	gc->queue_head = queue_head;
+	gc->queue_tail = queue_tail;
+
+	if (gc->phase != GC_IDLE) {
+		// what the incremental collection finds in the nursery is checked
+		// against the blocks left in it
+		memset(gc->starts, 0, sizeof(uint64_t[(gc->nursery.end - gc->base) / 16 / 64]));
+		add_block_starts(gc, &gc->nursery);
+	}
+
+	if (gc->phase == GC_MARK) {
+		shade_remembered(gc);
+	}
+
+	forget_remembered(gc);
+}
+
+static void forward_task(gc_worker_t *worker) {
+	gc_helpers_t *helpers = worker->gc->helpers;
+
+	for (size_t i; (i = take_next(helpers)) < helpers->num_regions;) {
+		forward_region(&helpers->regions[i]);
+	}
+}
+
+// objects are updated a run at a time, after the regions
+#define OBJECT_RUN 256
+
+static void update_task(gc_worker_t *worker) {
+	vm_gc_context_t *gc = worker->gc;
+	gc_helpers_t *helpers = gc->helpers;
+	size_t runs = (gc->num_objects + OBJECT_RUN - 1) / OBJECT_RUN;
+
+	for (size_t i; (i = take_next(helpers)) < helpers->num_regions + runs;) {
+		if (i < helpers->num_regions) {
+			update_region(gc, &helpers->regions[i]);
+			continue;
+		}
+
+		size_t first = (i - helpers->num_regions) * OBJECT_RUN;
+
+		for (size_t k = first; k < gc->num_objects && k < first + OBJECT_RUN; k++) {
+			update_object(gc, gc->objects[k]);
+		}
+	}
+}
+
+static void move_task(gc_worker_t *worker) {
+	gc_helpers_t *helpers = worker->gc->helpers;
+
+	for (size_t i; (i = take_next(helpers)) < helpers->num_regions;) {
+		move_region(&helpers->regions[i]);
+	}
+}
+
+// marks and compacts the heap on every thread. blocks don't move between
+// regions, so that they can be compacted at once, and the room left at the
+// end of each but the last one is a gap to allocate in
+static void collect_in_parallel(vm_gc_context_t *gc, vm_t *vm) {
+	gc_helpers_t *helpers = start_helpers(gc);
+	vm_gc_space_t *old = &gc->old;
+	uint8_t *last = NULL;
+
+	mark_roots(gc, vm);
+	mark_in_parallel(gc, helpers);
+
+	forward_nursery(gc);
+	split_regions(gc, helpers);
+	run_workers(gc, forward_task);
+	gc->live = 0;
+
+	for (size_t i = 0; i < helpers->num_regions; i++) {
+		count_region(gc, &helpers->regions[i]);
+	}
+
+	update_roots(gc, vm);
+	run_workers(gc, update_task);
+	run_workers(gc, move_task);
+
+	old->gaps = NULL;
+
+	for (size_t i = 0; i < helpers->num_regions; i++) {
+		gc_region_t *region = &helpers->regions[i];
+
+		if (i + 1 < helpers->num_regions) {
+			add_gap(&region->gaps, &region->last_gap, region->to, region->stop);
+		}
+
+		if (!region->gaps) {
+			continue;
+		}
+
+		if (last) {
+			*(uint8_t **)last = region->gaps;
+
+		} else {
+			old->gaps = region->gaps;
+		}
+
+		last = region->last_gap;
+	}
+
+	old->top = helpers->regions[helpers->num_regions - 1].to;
+	take_gap(old);
+}
+
+static void collect_old(vm_gc_context_t *gc, vm_t *vm) {
+	gc->collections++;
+	gc->old_full = false;
+	begin_collection(gc, false);
+
+	if (gc->settings.threads > 1) {
+		collect_in_parallel(gc, vm);
+
+	} else {
+		mark_vm(gc, vm);
+		compute_forwarding(gc);
+		update_references(gc, vm);
+		move_blocks(gc);
+	}
+
+	sweep_nursery(gc);
+	resize_heap(gc, true);
+	forget_remembered(gc);
+	free_untraced(gc, vm);
+	gc->allocated = 0;
+	gc->sliced = 0;
+}
+
+static inline uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// starts an incremental collection of the blocks in the old generation so
+// far, new ones are allocated after them until it's done
+static void start_cycle(vm_gc_context_t *gc) {
+	vm_gc_space_t *old = &gc->old;
+
+	close_region(old);
+	old->allocend = old->top;
+	old->limit = old->end;
+	old->gaps = NULL;
+
+	// the blocks are walked twice and marked, which should be done before
+	// the room left after them is used up. that's a step per block, which
+	// are about 32 bytes
+	size_t work = 3 * (size_t)(old->top - old->start) / 32;
+	size_t room = old->end - old->top;
+
+	gc->pace = work * 1024 / (room? room : 1);
+	gc->phase = GC_PREPARE;
+	gc->sliced = gc->allocated;
+	gc->cycle++;
+	gc->num_objects = 0;
+	gc->scanned = 0;
+	gc->mark_top = old->top;
+	gc->tail_scan = old->top;
+	gc->cursor = old->start;
+	gc->cleared = start_index(gc, old->start) / 64;
+	reserve_starts(gc);
+}
+
+// finds the start of the next block, clearing what the bitmap had from
+// before as it goes
+static bool prepare_step(vm_gc_context_t *gc) {
+	if (gc->cursor >= gc->mark_top) {
+		return false;
+	}
+
+	uint8_t *data = next_block(gc->cursor);
+	size_t index = start_index(gc, data);
+
+	while (gc->cleared <= index / 64) {
+		gc->starts[gc->cleared++] = 0;
+	}
+
+	gc->starts[index / 64] |= 1ULL << (index % 64);
+	gc->cursor = data + gc_get_block(data)->size;
+	return true;
+}
+
+static void start_marking(vm_gc_context_t *gc, vm_t *vm) {
+	gc->phase = GC_MARK;
+	mark_roots(gc, vm);
+}
+
+// marking ends with the program stopped, the roots are marked again since
+// they aren't remembered. the nursery is swept then, nothing in it is young.
+// the minor collection before forgot what was remembered
+static void finish_marking(vm_gc_context_t *gc, vm_t *vm) {
+	mark_roots(gc, vm);
+	mark_all(gc);
+	sweep_nursery(gc);
+	free_untraced(gc, vm);
+
+	gc->phase = GC_SWEEP;
+	gc->cursor = gc->old.start;
+	gc->sweep_to = gc->old.start;
+	gc->last_gap = NULL;
+	gc->live = 0;
+}
+
+// turns the next block into a filler if it's dead, merging it with the
+// dead ones before it
+static bool sweep_step(vm_gc_context_t *gc) {
+	if (gc->cursor >= gc->mark_top) {
+		return false;
+	}
+
+	uint8_t *data = next_block(gc->cursor);
+	scm_gc_block_t *blk = gc_get_block(data);
+
+	gc->cursor = data + blk->size;
+
+	if (!(blk->flags & FLAG_MARKED)) {
+		if (!(blk->flags & FLAG_FILLER)) {
+			gc->reclaimed += blk->size;
+		}
+
+		return true;
+	}
+
+	add_gap(&gc->old.gaps, &gc->last_gap, gc->sweep_to, data);
+	blk->flags = 0;
+	gc->sweep_to = gc->cursor;
+	gc->live += sizeof(scm_gc_block_t) + blk->size;
+	return true;
+}
+
+// allocation goes back to the gaps once the heap is swept
+static void finish_sweep(vm_gc_context_t *gc) {
+	vm_gc_space_t *old = &gc->old;
+
+	gc->live += old->allocend - gc->mark_top;
+
+	if (old->allocend == gc->mark_top) {
+		old->allocend = gc->sweep_to;
+
+	} else {
+		add_gap(&old->gaps, &gc->last_gap, gc->sweep_to, next_block(gc->mark_top));
+	}
+
+	old->top = old->allocend;
+	take_gap(old);
+
+	gc->phase = GC_IDLE;
+	gc->incremental_collections++;
+	gc->allocated = 0;
+	gc->sliced = 0;
+	resize_heap(gc, false);
+}
+
+// does the incremental collection's work until `deadline`, or all of it if
+// that's 0. it runs right after minor collections, so the nursery only has
+// old blocks in it when marking ends. it does at least its share of the
+// work for what was allocated in the old generation since the last slice
+static void run_slice(vm_gc_context_t *gc, vm_t *vm, uint64_t deadline) {
+	size_t min_work = (gc->allocated - gc->sliced) * gc->pace / 1024;
+
+	gc->minor = false;
+	gc->sliced = gc->allocated;
+
+	for (unsigned work = 1; gc->phase != GC_IDLE; work++) {
+		switch (gc->phase) {
+			case GC_PREPARE:
+				if (!prepare_step(gc)) {
+					start_marking(gc, vm);
+				}
+				break;
+
+			case GC_MARK:
+				if (!mark_step(gc)) {
+					finish_marking(gc, vm);
+				}
+				break;
+
+			case GC_SWEEP:
+				if (!sweep_step(gc)) {
+					finish_sweep(gc);
+				}
+				break;
+		}
+
+		// the clock is read every so often, it costs more than a step
+		if (deadline && work >= min_work && work % 64 == 0 && now_us() >= deadline) {
+			break;
+		}
+	}
+}
+
+static void record_pause(vm_gc_context_t *gc, uint64_t start) {
+	uint64_t pause = now_us() - start;
+	unsigned bucket = pause? 64 - __builtin_clzll(pause) : 0;
+
+	bucket = (bucket < VM_GC_PAUSE_BUCKETS)? bucket : VM_GC_PAUSE_BUCKETS - 1;
+	gc->pauses[bucket]++;
+	gc->pause_total += pause;
+	gc->pause_max = (pause > gc->pause_max)? pause : gc->pause_max;
+}
+
+// collects the nursery, and the old generation too if promoting filled it.
+// with a pause target, the old generation is collected incrementally once
+// three quarters of it are taken up, or as many bytes of owned objects were
+// made as for vm_check_owned(), for whatever time is left. it's only
+// finished all at once if the heap can't grow
+size_t gc_collect_young(vm_gc_context_t *gc, vm_t *vm) {
+	uint64_t start = now_us();
+	size_t before = gc->reclaimed;
+	size_t size = gc->old.end - gc->old.start;
+
+	collect_young(gc, vm);
+
+	if (gc->old_full && gc->phase != GC_IDLE) {
+		// the heap was grown for the incremental collection to catch up
+		gc->old_full = false;
+	}
+
+	if (gc->old_full) {
+		collect_old(gc, vm);
+
+	} else if (gc->settings.pause_target) {
+		if (gc->phase == GC_IDLE
+		    && ((gc->live + gc->allocated) * 4 >= size * 3
+		        || gc->owned_bytes >= owned_room(gc)))
+		{
+			start_cycle(gc);
+		}
+
+		if (gc->phase != GC_IDLE) {
+			run_slice(gc, vm, start + gc->settings.pause_target);
+		}
+	}
+
+	record_pause(gc, start);
+	return gc->reclaimed - before;
+}
+
+// collects the whole heap, the nursery is emptied into the old generation
+// first. an incremental collection in progress is finished before, its
+// marks would be taken for this one's
+size_t gc_collect_vm(vm_gc_context_t *gc, vm_t *vm) {
+	uint64_t start = now_us();
+	size_t before = gc->reclaimed;
+
+	collect_young(gc, vm);
+
+	if (gc->phase != GC_IDLE) {
+		run_slice(gc, vm, 0);
+	}
+
+	collect_old(gc, vm);
+
+	record_pause(gc, start);
+	return gc->reclaimed - before;
+}
+
+void gc_dump_stats(vm_gc_context_t *gc, FILE *fp) {
+	fprintf(fp, "gc: %u collections, %zu bytes reclaimed, %zu blocks pinned\n",
+	        gc->collections, gc->reclaimed, gc->pinned);
+	fprintf(fp, "gc: %u minor collections, %zu bytes promoted from a %zu byte nursery\n",
+	        gc->minor_collections, gc->promoted,
+	        (size_t)(gc->nursery.end - gc->nursery.start));
+	fprintf(fp, "gc: %zu bytes live after the last collection, in a %zu byte heap\n",
+	        gc->live, (size_t)(gc->old.end - gc->old.start));
+	fprintf(fp, "gc: heap grew %u times and shrank %u times, at most %zu bytes\n",
+	        gc->grown, gc->shrunk, gc->peak_size);
+	fprintf(fp, "gc: %zu closures, variables and lambdas freed, %zu left\n",
+	        gc->freed, gc->num_owned);
+	fprintf(fp, "gc: %u incremental collections, paused for %llu us in total and %llu us at most\n",
+	        gc->incremental_collections, (unsigned long long)gc->pause_total,
+	        (unsigned long long)gc->pause_max);
+
+	if (gc->settings.threads > 1) {
+		fprintf(fp, "gc: %zu blocks and objects stolen between %u threads\n",
+		        gc->stolen, gc->settings.threads);
+	}
+
+	for (unsigned i = 0; i < VM_GC_PAUSE_BUCKETS; i++) {
+		if (gc->pauses[i]) {
+			fprintf(fp, "gc:   %u pauses under %llu us\n",
+			        gc->pauses[i], 1ULL << i);
+		}
+	}
 }
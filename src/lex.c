@@ -24,6 +24,13 @@ static inline bool matches(int c, const char *str) {
 	return ret;
 }
 
+static inline bool next_is_digit(parse_state_t *state) {
+	int c = fgetc(state->fp);
+
+	ungetc(c, state->fp);
+	return matches(c, DIGITS);
+}
+
 scm_value_t read_number(parse_state_t *state);
 scm_value_t read_symbol(parse_state_t *state);
 
@@ -64,6 +71,10 @@ scm_value_t read_next_token(parse_state_t *state) {
 			ungetc(c, state->fp);
 			return read_number(state);
 
+		} else if (c == '-' && next_is_digit(state)) {
+			// negative integer literal, a lone '-' is still read as a symbol
+			return tag_integer(-get_integer(read_number(state)));
+
 		} else if (matches(c, ALPHABET SYMBOLS)) {
 			ungetc(c, state->fp);
 			return read_symbol(state);
@@ -2,8 +2,12 @@
 #include <nscheme/vm.h>
 #include <nscheme/write.h>
 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 void repl(vm_t *vm, parse_state_t *input) {
 	scm_value_t temp = 0;
@@ -27,10 +31,48 @@ void repl(vm_t *vm, parse_state_t *input) {
 	}
 }
 
+// runs of expressions between definitions are compiled together, a
+// definition might change what the expressions after it refer to
+static void evaluate_file_compiled(vm_t *vm, parse_state_t *input) {
+	scm_value_t body = SCM_TYPE_NULL;
+	scm_value_t *tail = &body;
+	scm_value_t temp;
+
+	do {
+		temp = parse_expression(input);
+
+		if (is_eof(temp) || vm_is_definition(vm, temp)) {
+			if (!is_null(body)) {
+				vm_evaluate_body(vm, body);
+				body = SCM_TYPE_NULL;
+				tail = &body;
+			}
+
+			if (!vm->errormsg && !is_eof(temp)) {
+				vm_evaluate_expr(vm, temp);
+			}
+
+		} else {
+			*tail = construct_tenured_pair(vm, temp, SCM_TYPE_NULL);
+			tail = &get_pair(*tail)->cdr;
+		}
+
+		if (vm->errormsg) {
+			fprintf(stderr, "error: %s\n", vm->errormsg);
+			return;
+		}
+	} while (!is_eof(temp));
+}
+
 // TODO: find a better place to put this function
 void evaluate_file(vm_t *vm, parse_state_t *input) {
 	scm_value_t temp = 0;
 
+	if (vm->toplevel == VM_TOPLEVEL_FILE) {
+		evaluate_file_compiled(vm, input);
+		return;
+	}
+
 	while (!is_eof(temp)) {
 		temp = parse_expression(input);
 		temp = vm_evaluate_expr(vm, temp);
@@ -46,14 +88,109 @@ static inline void print_help(void) {
 	printf(
 	    "usage: nscheme [options] files ...\n"
 	    "   -h: print this help and exit\n"
+	    "   -e [engine]: set the engine used to run compiled code, one of\n"
+	    "                'native' (when built with --native-jit), 'direct'\n"
+	    "                or 'call'\n"
+	    "   -E: compile closures to baseline code as soon as they're created\n"
+	    "   -c [n]: calls before a closure is compiled to baseline code,\n"
+	    "           at least 1 (%u)\n"
+	    "   -O [n]: calls to baseline code before it's optimized (%u)\n"
+	    "   -l [n]: loops in baseline code before it's optimized (%u)\n"
+	    "           -O 0 or -l 0 disables optimizing on that\n"
+	    "   -t: compile each top-level form before running it\n"
+	    "   -f: compile the top-level expressions between definitions in\n"
+	    "       files together\n"
+	    "   -s: print how many closures were compiled, why the rest\n"
+	    "       couldn't be, how the call site caches did, and what the\n"
+	    "       garbage collector did, on exit\n"
+	    "   -H [size]: initial heap size in bytes, or with a k, m or g\n"
+	    "              suffix (%zuk)\n"
+	    "   -M [size]: largest size the heap can grow to (%zum)\n"
+	    "   -o [n]: percentage of the heap live data should take up after\n"
+	    "           a collection, it's resized to keep to that (%u)\n"
+	    "   -n [size]: size of the nursery new blocks are made in (%zuk)\n"
+	    "   -p [us]: microseconds a collection should pause for at most,\n"
+	    "            the heap is collected incrementally with a target set\n"
+	    "   -j [n]: threads collections of the whole heap are run on (%u)\n",
+	    VM_DEFAULT_COMPILE_CALLS,
+	    VM_DEFAULT_OPTIMIZE_CALLS,
+	    VM_DEFAULT_OPTIMIZE_LOOPS,
+	    (size_t)VM_DEFAULT_HEAP_SIZE >> 10,
+	    VM_DEFAULT_MAX_HEAP_SIZE >> 20,
+	    VM_DEFAULT_HEAP_OCCUPANCY,
+	    (size_t)VM_DEFAULT_NURSERY_SIZE >> 10,
+	    VM_DEFAULT_GC_THREADS
 	);
 
 	exit(1);
 }
 
+static inline void set_engine(vm_t *vm, const char *name) {
+	if (name && strcmp(name, "call") == 0) {
+		vm->engine = VM_ENGINE_CALL_THREADED;
+
+#ifdef VM_HAVE_DIRECT_THREADING
+	} else if (name && strcmp(name, "direct") == 0) {
+		vm->engine = VM_ENGINE_DIRECT_THREADED;
+#endif
+
+#ifdef VM_HAVE_NATIVE_JIT
+	} else if (name && strcmp(name, "native") == 0) {
+		vm->engine = VM_ENGINE_NATIVE;
+#endif
+
+	} else {
+		fprintf(stderr, "warning: unknown engine %s\n", name? name : "(none)");
+	}
+}
+
+static inline unsigned parse_count(const char *arg, unsigned fallback) {
+	char *end;
+	unsigned long count;
+
+	errno = 0;
+	count = arg? strtoul(arg, &end, 10) : 0;
+
+	// anything that doesn't fit would wrap around to a small count
+	if (!arg || *end || errno == ERANGE || count > UINT_MAX) {
+		fprintf(stderr, "warning: invalid count %s\n", arg? arg : "(none)");
+		return fallback;
+	}
+
+	return count;
+}
+
+static inline size_t parse_size(const char *arg, size_t fallback) {
+	char *end;
+	unsigned long long size;
+	unsigned shift = 0;
+
+	errno = 0;
+	size = arg? strtoull(arg, &end, 10) : 0;
+
+	if (arg && *end && !end[1]) {
+		switch (*end++) {
+			case 'k': case 'K': shift = 10; break;
+			case 'm': case 'M': shift = 20; break;
+			case 'g': case 'G': shift = 30; break;
+			default:            end--;      break;
+		}
+	}
+
+	// sizes that overflow would wrap around, possibly to 0
+	if (!arg || *end || size == 0 || errno == ERANGE || size > (SIZE_MAX >> shift)) {
+		fprintf(stderr, "warning: invalid size %s\n", arg? arg : "(none)");
+		return fallback;
+	}
+
+	return size << shift;
+}
+
 int main(int argc, char *argv[]) {
 	parse_state_t *foo;
 	vm_t *vm = vm_init();
+	bool compile_stats = false;
+	bool heap_settings = false;
 
 	if (argc == 1) {
 		foo = make_parse_state(vm, stdin);
@@ -68,6 +205,109 @@ int main(int argc, char *argv[]) {
 				print_help();
 				break;
 
+			case 'e':
+				set_engine(vm, (i + 1 < argc)? argv[++i] : NULL);
+				break;
+
+			case 'E':
+				vm->tiers.eager = true;
+				break;
+
+			case 'c': {
+				unsigned calls =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->tiers.compile_calls);
+
+				// the tree walker has no tail calls, loops need compiling
+				if (calls == 0) {
+					fprintf(stderr, "warning: calls before compiling must be at least 1\n");
+
+				} else {
+					vm->tiers.compile_calls = calls;
+				}
+				break;
+			}
+
+			case 'O':
+				vm->tiers.optimize_calls =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->tiers.optimize_calls);
+				break;
+
+			case 'l':
+				vm->tiers.optimize_loops =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->tiers.optimize_loops);
+				break;
+
+			case 't':
+				vm->toplevel = VM_TOPLEVEL_FORMS;
+				break;
+
+			case 'f':
+				vm->toplevel = VM_TOPLEVEL_FILE;
+				break;
+
+			case 's':
+				compile_stats = true;
+				break;
+
+			case 'H':
+				vm->gc.settings.initial_size =
+				    parse_size((i + 1 < argc)? argv[++i] : NULL,
+				               vm->gc.settings.initial_size);
+				heap_settings = true;
+				break;
+
+			case 'M':
+				vm->gc.settings.max_size =
+				    parse_size((i + 1 < argc)? argv[++i] : NULL,
+				               vm->gc.settings.max_size);
+				heap_settings = true;
+				break;
+
+			case 'n':
+				vm->gc.settings.nursery_size =
+				    parse_size((i + 1 < argc)? argv[++i] : NULL,
+				               vm->gc.settings.nursery_size);
+				heap_settings = true;
+				break;
+
+			case 'p':
+				vm->gc.settings.pause_target =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->gc.settings.pause_target);
+				break;
+
+			case 'j': {
+				unsigned threads =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->gc.settings.threads);
+
+				if (threads == 0 || threads > VM_GC_MAX_THREADS) {
+					fprintf(stderr, "warning: threads must be from 1 to %u\n",
+					        VM_GC_MAX_THREADS);
+
+				} else {
+					vm->gc.settings.threads = threads;
+				}
+				break;
+			}
+
+			case 'o': {
+				unsigned target =
+				    parse_count((i + 1 < argc)? argv[++i] : NULL,
+				                vm->gc.settings.target_occupancy);
+
+				if (target == 0 || target > 100) {
+					fprintf(stderr, "warning: occupancy must be from 1 to 100\n");
+
+				} else {
+					vm->gc.settings.target_occupancy = target;
+				}
+				break;
+			}
+
 			default:
 				fprintf(stderr, "warning: unknown option %c\n",
 				        *(argv[i] + 1));
@@ -75,6 +315,19 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
+		vm_heap_settings_t *settings = &vm->gc.settings;
+
+		// the heap can't start out larger than it can grow to
+		if (settings->initial_size > settings->max_size) {
+			fprintf(stderr, "warning: heap size %zu is larger than the maximum, using %zu\n",
+			        settings->initial_size, settings->max_size);
+			settings->initial_size = settings->max_size;
+		}
+
+		if (heap_settings) {
+			gc_apply_settings(&vm->gc);
+		}
+
 		for (; i < argc; i++) {
 			FILE *fp = fopen(argv[i], "r");
 
@@ -83,6 +336,15 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (compile_stats) {
+		vm_dump_compile_stats(vm, stderr);
+		gc_dump_stats(&vm->gc, stderr);
+	}
+
+#ifdef VM_PROFILE_OPS
+	vm_profile_dump(stderr);
+#endif
+
 	vm_free(vm);
 
 	return 0;
@@ -0,0 +1,900 @@
+#include <nscheme/compiler.h>
+
+/*
+ * Optimizations on the comp_node_t tree of a closure's body, run on code
+ * for the optimizing tier once gen_top_scope() has resolved the variables
+ * in it:
+ *
+ *   - calls to arithmetic and comparison builtins with literal fixnum
+ *     arguments are folded into their results
+ *   - calls to small compiled procedures are replaced by their bodies, see
+ *     try_inline_call()
+ *   - `if` expressions with constant tests are replaced by the branch
+ *     that's taken
+ *   - expressions in a `begin` whose values are discarded are dropped if
+ *     they have no effects, see tree_effects()
+ *   - repeated calls are computed once, and calls which don't change in
+ *     a self tail call loop are computed before it, see cse.c
+ *
+ * Builtins and procedures can be redefined, so folded and inlined calls,
+ * and calls dropped for having no effects, depend on the closure slots
+ * they were made through. Those are checked on entry to the code by
+ * INSTR_FOLD_GUARD, see make_fold_guard(), unless they're global variables
+ * which were never written to, see use_stable_global().
+ */
+
+// size budget for inlined bodies, in tree nodes, and how many inlined bodies
+// deep calls are still inlined
+#define INLINE_MAX_NODES  40
+#define INLINE_MAX_DEPTH  2
+#define INLINE_MAX_PARAMS 8
+
+// the builtins which can be folded, see fold_call()
+static const vm_func foldable_prims[] = {
+	vm_op_add,
+	vm_op_sub,
+	vm_op_mul,
+	vm_op_lessthan,
+	vm_op_greaterthan,
+	vm_op_equal,
+};
+
+// frees a subtree which was optimized out, along with the closures of any
+// lambda expressions in it
+void free_dead_tree(comp_node_t *comp) {
+	if (comp) {
+		free_dead_tree(comp->car);
+		free_dead_tree(comp->cdr);
+		free(comp->proto);
+		free_comp_temps(comp->temps);
+
+		if (comp->inlined) {
+			free_dead_tree(comp->inlined->body);
+			free(comp->inlined->params);
+			free(comp->inlined);
+		}
+
+		free(comp);
+	}
+}
+
+// replaces `node` with `with`, which is somewhere in the tree under it
+static void replace_node(comp_node_t *node, comp_node_t *with) {
+	comp_node_t copy = *with;
+
+	// leaves an empty node in its place, freed with the rest
+	with->car     = NULL;
+	with->cdr     = NULL;
+	with->proto   = NULL;
+	with->inlined = NULL;
+
+	free_dead_tree(node->car);
+	free_dead_tree(node->cdr);
+	*node = copy;
+}
+
+// true if `expr` is a constant, stored in `value`
+static inline bool constant_value(comp_state_t *state,
+                                  comp_node_t *expr,
+                                  scm_value_t *value)
+{
+	if (!is_pair(expr->value) && !expr->node) {
+		*value = expr->value;
+		return true;
+	}
+
+	if (is_quote_statement(state->env, expr)) {
+		*value = expr->cdr->car->value;
+		return true;
+	}
+
+	return false;
+}
+
+static inline bool is_fixnum_literal(comp_node_t *expr) {
+	return expr && !expr->node && is_integer(expr->value);
+}
+
+// computes what `func` would return for `args`, the same way the builtin
+// does. returns false if it can't be folded
+static bool fold_call(vm_func func, scm_value_t *args, unsigned n, scm_value_t *ret) {
+	if (func == vm_op_add) {
+		scm_value_t sum = 0;
+
+		for (unsigned i = 0; i < n; i++) {
+			sum += args[i];
+		}
+
+		*ret = sum;
+
+	} else if (func == vm_op_sub && n >= 1) {
+		scm_value_t sum = args[0];
+
+		for (unsigned i = 1; i < n; i++) {
+			sum -= args[i];
+		}
+
+		*ret = sum;
+
+	} else if (func == vm_op_mul) {
+		uintptr_t sum = 1;
+
+		for (unsigned i = 0; i < n; i++) {
+			sum *= get_integer(args[i]);
+		}
+
+		*ret = tag_integer(sum);
+
+	} else if (func == vm_op_lessthan && n == 2) {
+		*ret = tag_boolean((long int)args[0] < (long int)args[1]);
+
+	} else if (func == vm_op_greaterthan && n == 2) {
+		*ret = tag_boolean((long int)args[0] > (long int)args[1]);
+
+	} else if (func == vm_op_equal && n == 2) {
+		*ret = tag_boolean(args[0] == args[1]);
+
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static inline void add_folded_slot(comp_state_t *state, unsigned index) {
+	for (unsigned i = 0; i < state->num_folded; i++) {
+		if (state->folded[i] == index) {
+			return;
+		}
+	}
+
+	state->folded = realloc(state->folded,
+	                        sizeof(unsigned[state->num_folded + 1]));
+	state->folded[state->num_folded++] = index;
+}
+
+static inline void add_guard_vars(comp_state_t *state, vm_effects_t *deps) {
+	for (unsigned i = 0; deps && i < deps->num_deps; i++) {
+		vm_effects_t *vars = state->guard_vars;
+		unsigned n = vars? vars->num_deps : 0;
+		unsigned k = 0;
+
+		while (k < n && vars->deps[k].var != deps->deps[i].var) {
+			k++;
+		}
+
+		if (k == n) {
+			vars = realloc(vars, sizeof(vm_effects_t) + sizeof(vars->deps[0]) * (n + 1));
+			vars->deps[n] = deps->deps[i];
+			vars->num_deps = n + 1;
+			state->guard_vars = vars;
+		}
+	}
+}
+
+static inline unsigned tree_list_effects(comp_state_t *state,
+                                         comp_node_t *list,
+                                         bool commit)
+{
+	unsigned flags = 0;
+
+	for (; list && list->car; list = list->cdr) {
+		flags |= tree_effects(state, list->car, commit);
+	}
+
+	return flags;
+}
+
+// builtins which only fail when given something other than fixnums, and
+// the ones of those which give fixnums
+static const struct {
+	vm_func builtin;
+	bool gives_fixnum;
+} fixnum_prims[] = {
+	{ vm_op_add,         true },
+	{ vm_op_sub,         true },
+	{ vm_op_mul,         true },
+	{ vm_op_lessthan,    false },
+	{ vm_op_greaterthan, false },
+};
+
+// index into fixnum_prims of the builtin which the call `expr` calls, or -1
+static int fixnum_prim(comp_state_t *state, comp_node_t *expr) {
+	comp_node_t *func = expr->car;
+	unsigned nargs = 0;
+
+	if (expr->inlined || !func->node || func->node->type != SCOPE_CLOSURE) {
+		return -1;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+
+	if (!var || is_unstable_var(state, var)) {
+		return -1;
+	}
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		nargs++;
+	}
+
+	for (int i = 0; i < (int)(sizeof(fixnum_prims) / sizeof(fixnum_prims[0])); i++) {
+		if (vm_is_builtin(var->value, fixnum_prims[i].builtin)) {
+			// comparisons take two arguments, and subtraction one or more
+			bool arity_ok = fixnum_prims[i].gives_fixnum
+			              ? fixnum_prims[i].builtin != vm_op_sub || nargs > 0
+			              : nargs == 2;
+
+			return arity_ok? i : -1;
+		}
+	}
+
+	return -1;
+}
+
+static inline bool fixnum_args(comp_state_t *state, comp_node_t *expr) {
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		if (!is_fixnum_expr(state, arg->car)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// true if `var` is the variable of its name in the top level environment
+static bool is_global_var(comp_state_t *state, env_node_t *var) {
+	environment_t *env = state->env;
+
+	while (env->last) {
+		env = env->last;
+	}
+
+	return env_find(env, var->key) == var;
+}
+
+static void add_stable_var(comp_state_t *state, env_node_t *var) {
+	for (unsigned i = 0; i < state->num_stable; i++) {
+		if (state->stable[i] == var) {
+			return;
+		}
+	}
+
+	state->stable = realloc(state->stable,
+	                        sizeof(env_node_t *[state->num_stable + 1]));
+	state->stable[state->num_stable++] = var;
+}
+
+// the code can have the values of global variables built in if nothing it
+// does writes to variables, so that it's never running when one of them is
+// written to. what it does depends on the procedures it calls, which are
+// watched along with the variables
+static void find_stable_globals(comp_state_t *state) {
+	if (state->closure->lambda->nested) {
+		return;
+	}
+
+	vm_effects_t *effects = vm_closure_effects(state->vm, state->closure);
+
+	if (!effects || (effects->flags & VM_EFFECT_WRITE)) {
+		return;
+	}
+
+	for (unsigned i = 0; i < effects->num_deps; i++) {
+		// boxed variables are written to without checking for watches
+		if (!is_global_var(state, effects->deps[i].var)) {
+			free(state->stable);
+			state->stable = NULL;
+			state->num_stable = 0;
+			return;
+		}
+
+		add_stable_var(state, effects->deps[i].var);
+	}
+
+	state->embed_globals = true;
+}
+
+/*
+ * Global variables which were never written to since being defined are
+ * assumed to keep their values. Returns true if `var` is one, which the
+ * code can then have the value of built in, and it's watched for writes
+ * once the code is compiled, see vm_var_written().
+ */
+static bool is_stable_global(comp_state_t *state, env_node_t *var) {
+	return state->embed_globals && !var->writes
+	    && !is_unstable_var(state, var) && is_global_var(state, var);
+}
+
+bool use_stable_global(comp_state_t *state, env_node_t *var) {
+	if (!is_stable_global(state, var)) {
+		return false;
+	}
+
+	add_stable_var(state, var);
+	state->stable_uses++;
+
+	return true;
+}
+
+// the variable of a reference to a stable global holding a fixnum, which
+// can be folded like a literal
+static env_node_t *fixnum_global(comp_state_t *state, comp_node_t *expr) {
+	if (!expr->node || expr->node->type != SCOPE_CLOSURE) {
+		return NULL;
+	}
+
+	env_node_t *var = closure_var_ref(state, expr->node->location);
+
+	return (var && is_integer(var->value) && is_stable_global(state, var))? var : NULL;
+}
+
+/*
+ * True if `expr` always gives a fixnum: fixnum constants, parameters
+ * assumed to hold fixnums, arithmetic on those, and `if`s and inlined
+ * bodies ending in them. Parameters found here are checked by the fold
+ * guard, see speculate_arg_types().
+ */
+bool is_fixnum_expr(comp_state_t *state, comp_node_t *expr) {
+	if (!is_pair(expr->value) || !expr->car) {
+		scope_node_t *node = expr->node;
+
+		if (!node) {
+			return is_integer(expr->value);
+		}
+
+		if (node->type == SCOPE_PARAMETER) {
+			uint32_t bit = (node->location <= 32)? 1u << (node->location - 1) : 0;
+
+			state->fixnum_used |= state->fixnum_args & bit;
+			return state->fixnum_args & bit;
+		}
+
+		env_node_t *global = fixnum_global(state, expr);
+
+		if (global) {
+			return use_stable_global(state, global);
+		}
+
+		// values hoisted out of a loop
+		for (unsigned i = 0; i < state->num_hoisted; i++) {
+			if (state->hoisted_slots[i] == node) {
+				return is_fixnum_expr(state, state->hoisted[i]);
+			}
+		}
+
+		return false;
+	}
+
+	if (is_if_statement(state->env, expr)) {
+		comp_node_t *branches = expr->cdr->cdr;
+
+		return branches->cdr && branches->cdr->car
+		    && is_fixnum_expr(state, branches->car)
+		    && is_fixnum_expr(state, branches->cdr->car);
+
+	} else if (expr->inlined || is_begin_statement(state->env, expr)) {
+		comp_node_t *last = NULL;
+
+		for (comp_node_t *list = expr->inlined? expr->inlined->body : expr->cdr;
+		     list && list->car; list = list->cdr)
+		{
+			last = list->car;
+		}
+
+		return last && is_fixnum_expr(state, last);
+	}
+
+	int prim = fixnum_prim(state, expr);
+
+	return prim >= 0 && fixnum_prims[prim].gives_fixnum && fixnum_args(state, expr);
+}
+
+/*
+ * VM_EFFECT_* flags of evaluating `expr`, see effects.c. Calls through
+ * closure slots have the effects of the procedures in them, which can be
+ * redefined, so with `commit` set the slots and the variables the
+ * procedures' effects were worked out from are guarded, for code that
+ * relies on the result.
+ */
+unsigned tree_effects(comp_state_t *state, comp_node_t *expr, bool commit) {
+	if (!is_pair(expr->value) || !expr->car) {
+		if (!expr->node) {
+			return 0;
+		}
+
+		// parameters and locals in plain slots can't change
+		return (expr->node->type == SCOPE_PARAMETER
+		        || expr->node->type == SCOPE_LOCAL)
+		       ? 0
+		       : VM_EFFECT_READ;
+	}
+
+	if (is_quote_statement(state->env, expr)) {
+		return 0;
+
+	} else if (is_lambda_statement(state->env, expr)) {
+		return VM_EFFECT_ALLOC;
+
+	} else if (is_if_statement(state->env, expr)
+	           || is_begin_statement(state->env, expr))
+	{
+		return tree_list_effects(state, expr->cdr, commit);
+
+	} else if (is_set_statement(state->env, expr)
+	           || is_define_statement(state->env, expr))
+	{
+		return VM_EFFECT_ANY;
+	}
+
+	comp_node_t *func = expr->car;
+	unsigned flags = tree_list_effects(state, expr->cdr, commit);
+	unsigned nargs = 0;
+
+	if (expr->inlined) {
+		return flags | tree_list_effects(state, expr->inlined->body, commit);
+	}
+
+	if (!func->node || func->node->type != SCOPE_CLOSURE
+	    || state->closure->lambda->deopts)
+	{
+		return VM_EFFECT_ANY;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+
+	if (!var || is_unstable_var(state, var)) {
+		return VM_EFFECT_ANY;
+	}
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		nargs++;
+	}
+
+	vm_effects_t *deps = NULL;
+	unsigned call = vm_call_effects(state->vm, var->value, nargs, commit? &deps : NULL);
+
+	if ((call & VM_EFFECT_FAIL) && fixnum_prim(state, expr) >= 0
+	    && fixnum_args(state, expr))
+	{
+		call &= ~VM_EFFECT_FAIL;
+	}
+
+	flags |= call;
+
+	if (commit) {
+		add_folded_slot(state, func->node->location);
+		add_guard_vars(state, deps);
+		free(deps);
+	}
+
+	return flags;
+}
+
+// folds the call `expr` if it calls a foldable builtin with fixnums
+static void try_fold_call(comp_state_t *state, comp_node_t *expr) {
+	comp_node_t *func = expr->car;
+
+	// code which was thrown out once isn't folded again, see
+	// vm_deoptimize()
+	if (!func || !func->node || func->node->type != SCOPE_CLOSURE
+	    || state->closure->lambda->deopts)
+	{
+		return;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+	vm_func builtin = NULL;
+
+	if (!var || is_unstable_var(state, var)) {
+		return;
+	}
+
+	for (unsigned i = 0; i < sizeof(foldable_prims) / sizeof(foldable_prims[0]); i++) {
+		if (vm_is_builtin(var->value, foldable_prims[i])) {
+			builtin = foldable_prims[i];
+		}
+	}
+
+	unsigned n = 0;
+	scm_value_t args[8];
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		env_node_t *global = fixnum_global(state, arg->car);
+
+		if (!builtin || n >= 8 || !(global || is_fixnum_literal(arg->car))) {
+			return;
+		}
+
+		args[n++] = global? global->value : arg->car->value;
+	}
+
+	scm_value_t result;
+
+	if (!fold_call(builtin, args, n, &result)) {
+		return;
+	}
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		env_node_t *global = fixnum_global(state, arg->car);
+
+		if (global) {
+			use_stable_global(state, global);
+		}
+	}
+
+	DEBUG_PRINTF("    | folded call to builtin in slot %u\n", func->node->location);
+	add_folded_slot(state, func->node->location);
+
+	free_dead_tree(expr->car);
+	free_dead_tree(expr->cdr);
+	expr->car   = NULL;
+	expr->cdr   = NULL;
+	expr->node  = NULL;
+	expr->value = result;
+}
+
+static void optimize_expr(comp_state_t *state, comp_node_t *expr);
+
+static inline void optimize_list(comp_state_t *state, comp_node_t *list) {
+	for (; list && list->car; list = list->cdr) {
+		optimize_expr(state, list->car);
+	}
+}
+
+static inline closure_node_t *find_closed_var(comp_state_t *state, scm_value_t sym) {
+	for (closure_node_t *temp = state->closed_vars; temp; temp = temp->next) {
+		if (temp->sym == sym) {
+			return temp;
+		}
+	}
+
+	return NULL;
+}
+
+// counts the nodes of `comp` against `budget`. returns false if it runs out,
+// or if there are forms which can't be moved into other code: definitions
+// and lambdas would need slots of their own, and set! would need the
+// parameters boxed
+static bool fits_inline_budget(comp_state_t *state, comp_node_t *comp, unsigned *budget) {
+	for (; comp; comp = comp->cdr) {
+		if (*budget == 0
+		    || is_define_statement(state->env, comp)
+		    || is_lambda_statement(state->env, comp)
+		    || is_set_statement(state->env, comp))
+		{
+			return false;
+		}
+
+		(*budget)--;
+
+		if (comp->car && !fits_inline_budget(state, comp->car, budget)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// true if the free variables of `callee` are the ones the code being
+// compiled would find under the same names, so that its body means the same
+// thing there
+static bool shares_free_vars(comp_state_t *state, scm_closure_t *callee) {
+	vm_lambda_t *lambda = callee->lambda;
+
+	for (unsigned i = 0; i < lambda->num_slots; i++) {
+		closure_node_t *closed = find_closed_var(state, lambda->varnames[i]);
+		env_node_t *var;
+
+		if (closed) {
+			var = closed->var_ref;
+
+		} else if (state->closure->lambda->nested) {
+			// closures of nested lambdas are made with as many slots
+			// as they have now, see vm_op_make_closure()
+			return false;
+
+		} else {
+			var = env_find_recurse(state->env, lambda->varnames[i]);
+		}
+
+		// recursive procedures aren't unrolled into their callers
+		if (!var || var != callee->closures[i]
+		    || var->value == tag_closure(callee))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// true if the argument `arg` can stand in for the parameter it's bound to
+// wherever the parameter is used: constants, and variables which can't
+// change while the inlined body runs
+static inline bool is_copyable(comp_node_t *arg) {
+	if (is_pair(arg->value) && arg->car) {
+		return false;
+	}
+
+	if (!arg->node) {
+		return !is_pair(arg->value);
+	}
+
+	return arg->node->type == SCOPE_PARAMETER
+	    || arg->node->type == SCOPE_LOCAL;
+}
+
+static void replace_param(comp_node_t *comp, scope_node_t *param, comp_node_t *arg) {
+	for (; comp; comp = comp->cdr) {
+		if (comp->node == param) {
+			comp->node  = arg->node;
+			comp->value = arg->node? comp->value : arg->value;
+		}
+
+		if (comp->car) {
+			replace_param(comp->car, param, arg);
+		}
+	}
+}
+
+// replaces the parameters of the inlined call `expr` which are bound to
+// copyable arguments with the arguments, so that folding and the passes in
+// cse.c see through them. the parameters are left NULL, and
+// compile_inlined_call() doesn't push their arguments
+static void propagate_copies(comp_node_t *expr) {
+	comp_inline_t *inlined = expr->inlined;
+	comp_node_t *arg = expr->cdr;
+
+	for (unsigned i = 0; i < inlined->num_params; i++, arg = arg->cdr) {
+		if (is_copyable(arg->car)) {
+			replace_param(inlined->body, inlined->params[i], arg->car);
+			inlined->params[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Replaces the call `expr` with the body of the procedure it calls, if that
+ * is a compiled closure with a body under the size budget which is in the
+ * closure slot it's called through. The body is resolved again as though
+ * it were written in place: the parameters become locals in stack slots
+ * above the call, filled in with the arguments by compile_inlined_call(),
+ * and its free variables become closure slots of the code it's inlined
+ * into. Procedures can be redefined, so the slot is guarded like the slots
+ * of folded builtins.
+ */
+static void try_inline_call(comp_state_t *state, comp_node_t *expr) {
+	comp_node_t *func = expr->car;
+
+	if (!func || !func->node || func->node->type != SCOPE_CLOSURE
+	    || state->closure->lambda->deopts
+	    || state->inline_depth >= INLINE_MAX_DEPTH)
+	{
+		return;
+	}
+
+	env_node_t *var = closure_var_ref(state, func->node->location);
+
+	if (!var || !is_closure(var->value) || is_unstable_var(state, var)) {
+		return;
+	}
+
+	scm_closure_t *callee = get_closure(var->value);
+	vm_lambda_t *lambda = callee->lambda;
+	unsigned nargs = 0;
+	unsigned nparams = 0;
+	scm_value_t param = lambda->args;
+
+	for (comp_node_t *arg = expr->cdr; arg && arg->car; arg = arg->cdr) {
+		nargs++;
+	}
+
+	for (; is_pair(param); param = get_pair(param)->cdr) {
+		nparams++;
+	}
+
+	if (callee == state->closure || !lambda->compiled
+	    || callee->bound != lambda->varnames
+	    || !is_null(param) || nparams != nargs
+	    || nparams > INLINE_MAX_PARAMS
+	    || !shares_free_vars(state, callee))
+	{
+		return;
+	}
+
+	unsigned budget = INLINE_MAX_NODES;
+	comp_node_t *body = wrap_comp_values(lambda->definition);
+
+	if (!fits_inline_budget(state, body, &budget)) {
+		free_dead_tree(body);
+		return;
+	}
+
+	scope_t *scope = calloc(1, sizeof(scope_t));
+	scope_node_t **params = calloc(nparams, sizeof(scope_node_t *));
+	unsigned failure = state->failure;
+	unsigned i = 0;
+
+	for (param = lambda->args; is_pair(param); param = get_pair(param)->cdr) {
+		params[i++] = scope_add_node(scope, get_pair(param)->car, SCOPE_LOCAL, 0);
+	}
+
+	// the scope has nothing around it, so nothing in the body is found
+	// among the locals of the code it's inlined into
+	if (!gen_sub_scope(body, state, scope, SCM_TYPE_NULL, 0)) {
+		state->failure = failure;
+		free_dead_tree(body);
+		free(params);
+		return;
+	}
+
+	DEBUG_PRINTF("    | inlined call to procedure in slot %u\n", func->node->location);
+
+	comp_inline_t *inlined = calloc(1, sizeof(comp_inline_t));
+	inlined->body       = body;
+	inlined->params     = params;
+	inlined->num_params = nparams;
+	expr->inlined = inlined;
+
+	add_folded_slot(state, func->node->location);
+	propagate_copies(expr);
+
+	state->inline_depth++;
+	optimize_list(state, body);
+	state->inline_depth--;
+}
+
+static void optimize_if(comp_state_t *state, comp_node_t *expr) {
+	comp_node_t *test = expr->cdr->car;
+	comp_node_t *branches = expr->cdr->cdr;
+	scm_value_t value;
+
+	optimize_list(state, expr->cdr);
+
+	if (!constant_value(state, test, &value)
+	    || !branches->cdr || !branches->cdr->car)
+	{
+		return;
+	}
+
+	DEBUG_PRINTF("    | removing the branch that isn't taken\n");
+	replace_node(expr, (value != tag_boolean(false))
+	                   ? branches->car
+	                   : branches->cdr->car);
+}
+
+static void optimize_begin(comp_state_t *state, comp_node_t *expr) {
+	optimize_list(state, expr->cdr);
+
+	comp_node_t **link = &expr->cdr;
+
+	while (*link && (*link)->car) {
+		comp_node_t *item = *link;
+		bool is_last = !item->cdr || !item->cdr->car;
+
+		if (!is_last && vm_effects_removable(tree_effects(state, item->car, false))) {
+			DEBUG_PRINTF("    | dropping discarded value in begin\n");
+			tree_effects(state, item->car, true);
+			*link = item->cdr;
+			item->cdr = NULL;
+			free_dead_tree(item);
+
+		} else {
+			link = &item->cdr;
+		}
+	}
+
+	// (begin expr) is just expr
+	comp_node_t *first = expr->cdr;
+
+	if (first && first->car && (!first->cdr || !first->cdr->car)) {
+		replace_node(expr, first->car);
+	}
+}
+
+static void optimize_expr(comp_state_t *state, comp_node_t *expr) {
+	if (!is_pair(expr->value) || !expr->car) {
+		return;
+	}
+
+	if (is_quote_statement(state->env, expr)
+	    || is_lambda_statement(state->env, expr))
+	{
+		// lambdas are compiled, and optimized, on their own
+		return;
+
+	} else if (is_define_statement(state->env, expr)) {
+		if (!expr->proto) {
+			optimize_list(state, expr->cdr->cdr);
+		}
+
+	} else if (is_set_statement(state->env, expr)) {
+		optimize_list(state, expr->cdr->cdr);
+
+	} else if (is_if_statement(state->env, expr)) {
+		optimize_if(state, expr);
+
+	} else if (is_begin_statement(state->env, expr)) {
+		optimize_begin(state, expr);
+
+	} else {
+		optimize_list(state, expr);
+		try_fold_call(state, expr);
+		try_inline_call(state, expr);
+	}
+}
+
+// parameters which only held fixnums in calls to the baseline code are
+// assumed to go on doing so, unless the optimized code has been thrown out
+// before. the ones the code ends up relying on are checked on entry
+static void speculate_arg_types(comp_state_t *state) {
+	vm_lambda_t *lambda = state->closure->lambda;
+	unsigned i = 0;
+
+	if (!lambda->arg_types || lambda->deopts) {
+		return;
+	}
+
+	for (scm_value_t arg = lambda->args; is_pair(arg) && i < 32; arg = get_pair(arg)->cdr) {
+		if (lambda->arg_types[i] == VM_TYPE_FIXNUM
+		    && !is_assigned(state, get_pair(arg)->car))
+		{
+			state->fixnum_args |= 1u << i;
+		}
+
+		i++;
+	}
+}
+
+// optimizes the expressions of `body` in place, the expressions themselves
+// stay where they are so that the body still lines up with the tree
+// walker's, see compile_body()
+void optimize_tree(comp_state_t *state, comp_node_t *body) {
+	find_stable_globals(state);
+	speculate_arg_types(state);
+	optimize_list(state, body);
+	hoist_invariants(state, body);
+	eliminate_common_subexprs(state, body);
+}
+
+// the guard for the builtins and procedures the code relies on, or NULL if
+// there aren't any
+vm_fold_guard_t *make_fold_guard(comp_state_t *state) {
+	vm_effects_t *vars = state->guard_vars;
+	unsigned num_vars = vars? vars->num_deps : 0;
+
+	if (!state->num_folded && !num_vars && !state->fixnum_args) {
+		return NULL;
+	}
+
+	vm_fold_guard_t *guard =
+		calloc(1, sizeof(vm_fold_guard_t)
+		          + sizeof(guard->slots[0]) * (state->num_folded + num_vars));
+
+	// variables which can't change without the code being thrown out
+	// don't need checking
+	for (unsigned i = 0; i < state->num_folded; i++) {
+		env_node_t *var = closure_var_ref(state, state->folded[i]);
+
+		if (!use_stable_global(state, var)) {
+			guard->slots[guard->num_slots].index = state->folded[i];
+			guard->slots[guard->num_slots].value = var->value;
+			guard->num_slots++;
+		}
+	}
+
+	for (unsigned i = 0; i < num_vars; i++) {
+		if (!use_stable_global(state, vars->deps[i].var)) {
+			guard->slots[guard->num_slots].var   = vars->deps[i].var;
+			guard->slots[guard->num_slots].value = vars->deps[i].value;
+			guard->num_slots++;
+		}
+	}
+
+	if (!guard->num_slots && !state->fixnum_args) {
+		free(guard);
+		return NULL;
+	}
+
+	return guard;
+}
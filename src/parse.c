@@ -131,9 +131,9 @@ scm_value_t parse_quoted(parse_state_t *state) {
 
 	parse_expect(state, is_apostrophe, "apostrophe");
 
-	return construct_pair(state->vm,
+	return construct_tenured_pair(state->vm,
 	           quoted,
-	           construct_pair(state->vm,
+	           construct_tenured_pair(state->vm,
 	               parse_expression(state),
 	               SCM_TYPE_NULL));
 }
@@ -175,7 +175,7 @@ scm_value_t parse_list_tokens(parse_state_t *state) {
 		return parse_pair_token(state);
 
 	} else if (!is_none_type(temp)) {
-		return construct_pair(state->vm, temp, parse_list_tokens(state));
+		return construct_tenured_pair(state->vm, temp, parse_list_tokens(state));
 
 	} else {
 		return SCM_TYPE_NULL;
@@ -0,0 +1,194 @@
+#include <nscheme/vm.h>
+#include <nscheme/vm_ops.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef VM_PROFILE_OPS
+
+/*
+ * Counts of executed ops and of op pairs/triples, used to pick which
+ * sequences are worth fusing into superinstructions. Ops are counted as
+ * they're dispatched by vm_step_compiled(), so profile with `-e call`.
+ */
+
+static const struct {
+	vm_func func;
+	const char *name;
+} profile_ops[] = {
+	{ vm_op_return,        "return" },
+	{ vm_op_return_last,   "return_last" },
+	{ vm_op_jump,          "jump" },
+	{ vm_op_jump_if_false, "jump_if_false" },
+	{ vm_op_closure_ref,   "closure_ref" },
+	{ vm_op_stack_ref,     "stack_ref" },
+	{ vm_op_push_const,    "push_const" },
+	{ vm_op_make_closure,  "make_closure" },
+	{ vm_op_box,           "box" },
+	{ vm_op_box_ref,       "box_ref" },
+	{ vm_op_box_set,       "box_set" },
+	{ vm_op_closure_set,   "closure_set" },
+	{ vm_op_box_init,      "box_init" },
+	{ vm_op_drop,          "drop" },
+	{ vm_op_fold_guard,    "fold_guard" },
+	{ vm_op_slide,         "slide" },
+	{ vm_op_stack_set,     "stack_set" },
+	{ vm_op_set_sp,        "set_sp" },
+	{ vm_op_profile_args,  "profile_args" },
+	{ vm_op_do_call,       "do_call" },
+	{ vm_op_do_tailcall,   "do_tailcall" },
+	{ vm_op_stack_ref2,        "stack_ref2" },
+	{ vm_op_closure_ref2,      "closure_ref2" },
+	{ vm_op_closure_stack_ref, "closure_stack_ref" },
+	{ vm_op_stack_ref_call,    "stack_ref_call" },
+	{ vm_op_ref_const_call,    "ref_const_call" },
+	{ vm_op_inline_add,         "inline_add" },
+	{ vm_op_inline_sub,         "inline_sub" },
+	{ vm_op_inline_lessthan,    "inline_lessthan" },
+	{ vm_op_inline_greaterthan, "inline_greaterthan" },
+	{ vm_op_inline_equal,       "inline_equal" },
+	{ vm_op_inline_car,         "inline_car" },
+	{ vm_op_inline_cdr,         "inline_cdr" },
+	{ vm_op_inline_is_null,     "inline_is_null" },
+	{ vm_op_inline_is_pair,     "inline_is_pair" },
+	{ vm_op_inline_cons,        "inline_cons" },
+	{ vm_op_lt_jump,            "lt_jump" },
+	{ vm_op_gt_jump,            "gt_jump" },
+	{ vm_op_null_jump,          "null_jump" },
+	{ vm_op_fix_add,            "fix_add" },
+	{ vm_op_fix_sub,            "fix_sub" },
+	{ vm_op_fix_lessthan,       "fix_lessthan" },
+	{ vm_op_fix_greaterthan,    "fix_greaterthan" },
+	{ vm_op_fix_lt_jump,        "fix_lt_jump" },
+	{ vm_op_fix_gt_jump,        "fix_gt_jump" },
+	{ vm_op_self_tail_guard,    "self_tail_guard" },
+	{ vm_op_store_args,         "store_args" },
+	{ vm_op_loop_guard,         "loop_guard" },
+	{ vm_op_add,           "add" },
+	{ vm_op_sub,           "sub" },
+	{ vm_op_mul,           "mul" },
+	{ vm_op_div,           "div" },
+	{ vm_op_cons,          "cons" },
+	{ vm_op_car,           "car" },
+	{ vm_op_cdr,           "cdr" },
+	{ vm_op_lessthan,      "lessthan" },
+	{ vm_op_equal,         "equal" },
+	{ vm_op_greaterthan,   "greaterthan" },
+	{ vm_op_is_null,       "is_null" },
+	{ vm_op_is_pair,       "is_pair" },
+	{ vm_op_intern_define, "intern_define" },
+	{ vm_op_intern_set,    "intern_set" },
+	{ vm_op_intern_if,     "intern_if" },
+	{ vm_op_display,       "display" },
+	{ vm_op_newline,       "newline" },
+	{ vm_op_read,          "read" },
+};
+
+#define NUM_PROFILE_OPS (sizeof(profile_ops) / sizeof(profile_ops[0]))
+// index used for ops not in the table above, and for "no previous op"
+#define PROFILE_OTHER   NUM_PROFILE_OPS
+#define PROFILE_SLOTS   (NUM_PROFILE_OPS + 1)
+
+static unsigned long op_counts[PROFILE_SLOTS];
+static unsigned long pair_counts[PROFILE_SLOTS][PROFILE_SLOTS];
+static unsigned long triple_counts[PROFILE_SLOTS][PROFILE_SLOTS][PROFILE_SLOTS];
+
+static unsigned last_ops[2] = { PROFILE_OTHER, PROFILE_OTHER };
+
+static inline unsigned profile_lookup(vm_func func) {
+	for (unsigned i = 0; i < NUM_PROFILE_OPS; i++) {
+		if (profile_ops[i].func == func) {
+			return i;
+		}
+	}
+
+	return PROFILE_OTHER;
+}
+
+static inline const char *profile_name(unsigned id) {
+	return (id < NUM_PROFILE_OPS)? profile_ops[id].name : "<other>";
+}
+
+void vm_profile_op(vm_func func) {
+	unsigned id = profile_lookup(func);
+
+	op_counts[id]++;
+	pair_counts[last_ops[1]][id]++;
+	triple_counts[last_ops[0]][last_ops[1]][id]++;
+
+	last_ops[0] = last_ops[1];
+	last_ops[1] = id;
+}
+
+typedef struct profile_entry {
+	unsigned long count;
+	unsigned ops[3];
+} profile_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+	const profile_entry_t *x = a;
+	const profile_entry_t *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static void dump_entries(FILE *fp, profile_entry_t *entries, size_t n,
+                         unsigned width, unsigned long total)
+{
+	qsort(entries, n, sizeof(profile_entry_t), compare_entries);
+
+	for (size_t i = 0; i < n && i < 16 && entries[i].count; i++) {
+		fprintf(fp, "  %10lu %5.1f%% ", entries[i].count,
+		        100.0 * entries[i].count / (total? total : 1));
+
+		for (unsigned k = 0; k < width; k++) {
+			fprintf(fp, " %s", profile_name(entries[i].ops[k]));
+		}
+
+		fprintf(fp, "\n");
+	}
+}
+
+void vm_profile_dump(FILE *fp) {
+	const size_t npairs = PROFILE_SLOTS * PROFILE_SLOTS;
+	const size_t ntriples = npairs * PROFILE_SLOTS;
+	profile_entry_t *entries = calloc(ntriples, sizeof(profile_entry_t));
+	unsigned long total = 0;
+	size_t n = 0;
+
+	for (unsigned i = 0; i < PROFILE_SLOTS; i++) {
+		total += op_counts[i];
+		entries[n++] = (profile_entry_t){ op_counts[i], { i } };
+	}
+
+	fprintf(fp, "op profile: %lu ops dispatched\n", total);
+	dump_entries(fp, entries, n, 1, total);
+
+	n = 0;
+	for (unsigned i = 0; i < PROFILE_SLOTS; i++) {
+		for (unsigned j = 0; j < PROFILE_SLOTS; j++) {
+			entries[n++] = (profile_entry_t){ pair_counts[i][j], { i, j } };
+		}
+	}
+
+	fprintf(fp, "op pairs:\n");
+	dump_entries(fp, entries, n, 2, total);
+
+	n = 0;
+	for (unsigned i = 0; i < PROFILE_SLOTS; i++) {
+		for (unsigned j = 0; j < PROFILE_SLOTS; j++) {
+			for (unsigned k = 0; k < PROFILE_SLOTS; k++) {
+				entries[n++] = (profile_entry_t){
+					triple_counts[i][j][k], { i, j, k }
+				};
+			}
+		}
+	}
+
+	fprintf(fp, "op triples:\n");
+	dump_entries(fp, entries, n, 3, total);
+
+	free(entries);
+}
+
+#endif
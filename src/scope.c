@@ -51,42 +51,206 @@ scope_node_t *scope_add_node(scope_t     *scope,
 	return node;
 }
 
+static inline bool has_closure_node(comp_state_t *state, scm_value_t sym) {
+	for (closure_node_t *temp = state->closed_vars; temp; temp = temp->next) {
+		if (temp->sym == sym) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// finds where code in `scope` gets `sym` from, adding a closure slot for
+// it if it isn't a parameter or local. returns NULL if it can't be found
+scope_node_t *scope_resolve(comp_state_t *state,
+                            scope_t      *scope,
+                            scm_value_t  sym)
+{
+	scope_node_t *temp = scope_find(scope, sym, true);
+
+	if (temp) {
+		DEBUG_PRINTF("found as %s:%u\n",
+		             loc_strs[temp->type], temp->location);
+
+		return temp;
+	}
+
+	env_node_t *var = NULL;
+
+	if (has_closure_node(state, sym)) {
+		// already has a slot, eg. when recompiling a closure that
+		// keeps its slot layout
+
+	} else if (state->parent) {
+		// free variables of nested lambdas are captured from the code
+		// around them when the closure is made
+		vm_capture_t capture;
+
+		if (!capture_var(state->parent, state->parent_scope, sym, &capture)) {
+			state->failure = state->parent->failure;
+			return NULL;
+		}
+
+		if (capture.type == VM_CAPTURE_CLOSURE) {
+			var = closure_var_ref(state->parent, capture.index);
+		}
+
+	} else {
+		var = env_find_recurse(state->env, sym);
+
+		if (!var) {
+			DEBUG_PRINTF("could not resolve, error out or something\n");
+			state->failure = VM_COMPILE_FAIL_UNDEFINED;
+			return NULL;
+		}
+
+		// macros are left to the tree walker, and so are special forms
+		// anywhere gen_sub_scope() doesn't expect them
+		if (is_syntax_rules(var->value)
+		    || var->value == tag_run_type(RUN_TYPE_DEFINE_SYNTAX)
+		    || var->value == tag_run_type(RUN_TYPE_SYNTAX_RULES))
+		{
+			DEBUG_PRINTF("macro, can't compile\n");
+			state->failure = VM_COMPILE_FAIL_MACRO;
+			return NULL;
+		}
+
+		if (is_run_type(var->value) && !is_begin_token(state->env, sym)) {
+			DEBUG_PRINTF("special form, can't compile\n");
+			state->failure = VM_COMPILE_FAIL_SYNTAX;
+			return NULL;
+		}
+	}
+
+	unsigned index = add_closure_node(state, var, sym);
+
+	DEBUG_PRINTF("adding as closure:%u\n", index);
+	return scope_add_node(scope, sym, SCOPE_CLOSURE, index);
+}
+
+// where a closure made in `scope` gets `sym` from, returns false if it
+// can't be captured
+bool capture_var(comp_state_t *state,
+                 scope_t      *scope,
+                 scm_value_t  sym,
+                 vm_capture_t *capture)
+{
+	scope_node_t *node = scope_resolve(state, scope, sym);
+
+	if (!node) {
+		return false;
+	}
+
+	// locals captured while the definitions run might not have their
+	// values yet, so the closure shares a box which gets them later
+	if (is_local_scope(node->type) && state->defining) {
+		state->letrec = true;
+	}
+
+	bool boxed = is_mutable_scope(node->type)
+	          || (is_local_scope(node->type) && state->letrec);
+
+	capture->type  = (node->type == SCOPE_CLOSURE)? VM_CAPTURE_CLOSURE
+	               : boxed?                         VM_CAPTURE_BOX
+	               :                                VM_CAPTURE_STACK;
+	capture->index = node->location;
+
+	return true;
+}
+
 // returns true if successfully found
 bool scope_handle_symbol(comp_state_t *state,
                          scope_t      *scope,
                          comp_node_t  *comp)
 {
 	scm_value_t sym = comp->car->value;
-	scope_node_t *temp = scope_find(scope, sym, true);
 
 	comp->car->scope = scope;
 
 	DEBUG_PRINTF("    | » looking up symbol %s... ", get_symbol(sym));
 
-	if (temp) {
-		DEBUG_PRINTF("found as %s:%u\n",
-		             loc_strs[temp->type], temp->location);
+	comp->car->node = scope_resolve(state, scope, sym);
 
-		comp->car->node = temp;
-		return true;
+	return comp->car->node != NULL;
+}
 
-	} else {
-		env_node_t *env = env_find_recurse(state->env, sym);
+#include <nscheme/write.h>
 
-		if (!env) {
-			DEBUG_PRINTF("could not resolve, error out or something\n");
-			return false;
+bool is_assigned(comp_state_t *state, scm_value_t sym) {
+	for (unsigned i = 0; i < state->num_assigned; i++) {
+		if (state->assigned[i] == sym) {
+			return true;
 		}
+	}
 
-		unsigned index = add_closure_node(state, env, sym);
+	return false;
+}
 
-		DEBUG_PRINTF("adding as closure:%u\n", index);
-		comp->car->node = scope_add_node(scope, sym, SCOPE_CLOSURE, index);
-		return true;
+// assignment conversion: collects the variables set! anywhere in `comp`,
+// including in nested lambdas, which might share them. parameters and
+// locals with these names are boxed, the rest stay in plain stack slots.
+// names shadowed in nested lambdas are boxed too, which is harmless
+static void find_assigned(comp_state_t *state, comp_node_t *comp) {
+	if (is_set_statement(state->env, comp)
+	    && comp->cdr && comp->cdr->car
+	    && is_symbol(comp->cdr->car->value)
+	    && !is_assigned(state, comp->cdr->car->value))
+	{
+		state->assigned = realloc(state->assigned,
+		                          sizeof(scm_value_t[state->num_assigned + 1]));
+		state->assigned[state->num_assigned++] = comp->cdr->car->value;
+	}
+
+	for (; comp; comp = comp->cdr) {
+		if (comp->car && is_pair(comp->car->value)) {
+			find_assigned(state, comp->car);
+		}
 	}
 }
 
-#include <nscheme/write.h>
+// (set! name value)
+static inline bool is_valid_set(comp_node_t *comp) {
+	return comp->cdr && comp->cdr->car
+	    && is_symbol(comp->cdr->car->value)
+	    && comp->cdr->cdr && comp->cdr->cdr->car
+	    && !(comp->cdr->cdr->cdr && comp->cdr->cdr->cdr->car);
+}
+
+// (quote datum)
+static inline bool is_valid_quote(comp_node_t *comp) {
+	return comp->cdr && comp->cdr->car
+	    && !(comp->cdr->cdr && comp->cdr->cdr->car);
+}
+
+// (lambda args body ...)
+static inline bool is_valid_lambda(comp_node_t *comp) {
+	return comp->cdr && comp->cdr->car
+	    && comp->cdr->cdr && comp->cdr->cdr->car;
+}
+
+// (define name value) or (define (name . args) body ...)
+static inline bool is_valid_define(comp_node_t *comp) {
+	comp_node_t *name = comp->cdr? comp->cdr->car : NULL;
+
+	if (!name || !comp->cdr->cdr || !comp->cdr->cdr->car) {
+		return false;
+	}
+
+	if (is_pair(name->value)) {
+		return name->car && is_symbol(name->car->value);
+	}
+
+	return is_symbol(name->value)
+	    && !(comp->cdr->cdr->cdr && comp->cdr->cdr->cdr->car);
+}
+
+// the symbol node a definition binds
+static inline comp_node_t *define_name(comp_node_t *comp) {
+	comp_node_t *name = comp->cdr->car;
+
+	return is_pair(name->value)? name->car : name;
+}
 
 // return false on failure:
 // - illegal (define ...) expression
@@ -98,6 +262,19 @@ bool gen_sub_scope(comp_node_t  *comp,
                    scm_value_t  syms,
                    unsigned     sp)
 {
+	// quoted data is pushed as it is, nothing in it is looked up
+	if (is_quote_statement(state->env, comp)) {
+		DEBUG_PRINTF("    | » have quote\n");
+		comp->scope = cur_scope;
+
+		if (!is_valid_quote(comp)) {
+			state->failure = VM_COMPILE_FAIL_SYNTAX;
+			return false;
+		}
+
+		return true;
+	}
+
 	for (; comp; comp = comp->cdr) {
 		comp->scope = cur_scope;
 
@@ -105,8 +282,18 @@ bool gen_sub_scope(comp_node_t  *comp,
 			if (is_if_token(state->env, comp->car->value)) {
 				DEBUG_PRINTF("    | » have if statement\n");
 
+			} else if (is_set_token(state->env, comp->car->value)) {
+				DEBUG_PRINTF("    | » have set! statement\n");
+
+				// the name is resolved like any other symbol
+				if (!is_valid_set(comp)) {
+					state->failure = VM_COMPILE_FAIL_SYNTAX;
+					return false;
+				}
+
 			} else if (is_define_statement(state->env, comp)) {
 				DEBUG_PRINTF("    | » define statement only allowed at top-level!\n");
+				state->failure = VM_COMPILE_FAIL_DEFINITION;
 				return false;
 
 			} else {
@@ -115,6 +302,24 @@ bool gen_sub_scope(comp_node_t  *comp,
 				}
 			}
 
+		} else if (is_lambda_statement(state->env, comp->car)) {
+			DEBUG_PRINTF("    | » have nested lambda\n");
+			comp->car->scope = cur_scope;
+			sp++;
+
+			if (!is_valid_lambda(comp->car)) {
+				state->failure = VM_COMPILE_FAIL_SYNTAX;
+				return false;
+			}
+
+			comp_node_t *args = comp->car->cdr;
+
+			if (!compile_nested_lambda(state, cur_scope, comp->car,
+			                           args->car->value, args->cdr))
+			{
+				return false;
+			}
+
 		} else if (is_pair(comp->value)) {
 			if (!gen_sub_scope(comp->car, state, cur_scope, syms, sp++)) {
 				return false;
@@ -137,41 +342,86 @@ bool gen_top_scope(comp_node_t  *comp,
 	new_scope->last = cur_scope;
 	cur_scope = new_scope;
 
+	if (is_root_scope) {
+		find_assigned(state, comp);
+	}
+
 	for (; is_pair(syms); syms = scm_cdr(syms)) {
 		unsigned type = is_root_scope? SCOPE_PARAMETER : SCOPE_LOCAL;
 
+		if (is_assigned(state, scm_car(syms))) {
+			type = is_root_scope? SCOPE_MUTABLE_PARAMETER : SCOPE_MUTABLE_LOCAL;
+			state->has_boxes = true;
+		}
+
 		scope_add_node(cur_scope, scm_car(syms), type, sp++);
 	}
 
 	comp_node_t *start = comp;
 	unsigned orig_sp = sp;
 
-	// TODO: this doesn't handle (define (...) ...) expressions yet
 	for (; is_define_statement(state->env, comp->car); comp = comp->cdr) {
-		scm_value_t name = comp->car->cdr->car->value;
+		if (!is_valid_define(comp->car)) {
+			state->failure = VM_COMPILE_FAIL_SYNTAX;
+			return false;
+		}
+
+		comp_node_t *name = define_name(comp->car);
+		unsigned type = SCOPE_LOCAL;
 
 		DEBUG_PRINTF("    | » found a define statement, name: ");
-		DEBUG_WRITEVAL(name);
+		DEBUG_WRITEVAL(name->value);
 		DEBUG_PRINTF("\n");
 
-		scope_add_node(cur_scope, name, SCOPE_LOCAL, sp++);
+		if (is_assigned(state, name->value)) {
+			type = SCOPE_MUTABLE_LOCAL;
+			state->has_boxes = true;
+		}
+
+		// the compiler boxes mutable locals once they're defined. the
+		// node is kept with the name as written, which is the
+		// (name . args) list for procedure definitions
+		comp->car->cdr->car->node =
+			scope_add_node(cur_scope, name->value, type, sp++);
 	}
 
 	comp = start;
 	sp = orig_sp;
+	state->defining = true;
 
 	for (; is_define_statement(state->env, comp->car); comp = comp->cdr) {
-		scm_value_t name = comp->car->cdr->car->value;
+		comp_node_t *name = comp->car->cdr->car;
 		comp_node_t *body = comp->car->cdr->cdr;
 
 		DEBUG_PRINTF("    | » generating scope for define statement ");
-		DEBUG_WRITEVAL(name);
+		DEBUG_WRITEVAL(name->value);
 		DEBUG_PRINTF("\n");
 
-		if (!gen_sub_scope(body, state, cur_scope, SCM_TYPE_NULL, sp++)) {
+		if (is_pair(name->value)) {
+			// (define (name . args) body ...) is made into a closure
+			// like the lambda expression it stands for
+			comp->car->scope = cur_scope;
+
+			if (!compile_nested_lambda(state, cur_scope, comp->car,
+			                           name->cdr->value, body))
+			{
+				return false;
+			}
+
+		} else if (!gen_sub_scope(body, state, cur_scope, SCM_TYPE_NULL, sp++)) {
 			return false;
 		}
 	}
 
+	state->defining = false;
+
+	if (state->letrec) {
+		for (comp_node_t *def = start; def != comp; def = def->cdr) {
+			def->car->cdr->car->node->type = SCOPE_MUTABLE_LOCAL;
+		}
+
+		state->has_boxes = true;
+	}
+
 	return gen_sub_scope(comp, state, cur_scope, SCM_TYPE_NULL, sp++);
 }
@@ -241,7 +241,7 @@ scm_value_t expand(vm_t *vm,
 
 	// TODO: does this need to handle improper lists?
 
-	return construct_pair(vm, retcar, retcdr);
+	return construct_tenured_pair(vm, retcar, retcdr);
 }
 
 scm_value_t expand_syntax_rules(vm_t *vm,
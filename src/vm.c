@@ -6,21 +6,77 @@
 #include <stdio.h>
 
 static inline void vm_step_compiled(vm_t *vm) {
-	vm_op_t *code = vm->closure->code + vm->ip;
+	vm_op_t *code = vm->closure->lambda->code + vm->ip;
+
+#ifdef VM_PROFILE_OPS
+	vm_profile_op(code->func);
+#endif
 
 	vm->ip += code->func(vm, code->arg);
 }
 
-static scm_closure_t *vm_make_closure(scm_value_t args,
+static inline unsigned lambda_hash(scm_value_t body, unsigned size) {
+	return (body >> 4) & (size - 1);
+}
+
+/*
+ * Returns the lambda for the lambda expression with the body `body`,
+ * creating it if this is the first closure made from that expression.
+ * Closures made from it later share its compiled code and call counts.
+ */
+vm_lambda_t *vm_lambda_for(vm_t *vm, scm_value_t args, scm_value_t body) {
+	unsigned i = lambda_hash(body, vm->lambdas_size);
+
+	for (vm_lambda_t *lambda = vm->lambdas[i]; lambda; lambda = lambda->next) {
+		if (lambda->definition == body) {
+			return lambda;
+		}
+	}
+
+	if (vm->num_lambdas >= vm->lambdas_size) {
+		unsigned size = vm->lambdas_size * 2;
+		vm_lambda_t **lambdas = calloc(1, sizeof(vm_lambda_t *[size]));
+
+		for (unsigned k = 0; k < vm->lambdas_size; k++) {
+			while (vm->lambdas[k]) {
+				vm_lambda_t *lambda = vm->lambdas[k];
+				unsigned n = lambda_hash(lambda->definition, size);
+
+				vm->lambdas[k] = lambda->next;
+				lambda->next = lambdas[n];
+				lambdas[n] = lambda;
+			}
+		}
+
+		free(vm->lambdas);
+		vm->lambdas = lambdas;
+		vm->lambdas_size = size;
+		i = lambda_hash(body, size);
+	}
+
+	vm_lambda_t *ret = calloc(1, sizeof(vm_lambda_t));
+
+	ret->definition = body;
+	ret->args       = args;
+	ret->compiled   = false;
+	ret->next       = vm->lambdas[i];
+
+	vm->lambdas[i] = ret;
+	vm->num_lambdas++;
+	gc_remember_lambda(&vm->gc, ret);
+
+	return ret;
+}
+
+static scm_closure_t *vm_make_closure(vm_t *vm,
+                                      scm_value_t args,
                                       scm_value_t body,
                                       environment_t *env)
 {
 	scm_closure_t *ret = calloc(1, sizeof(scm_closure_t));
 
-	ret->definition  = body;
-	ret->args        = args;
-	ret->env         = env;
-	ret->compiled    = false;
+	ret->lambda = vm_lambda_for(vm, args, body);
+	ret->env    = env;
 
 	return ret;
 }
@@ -43,7 +99,11 @@ static inline void vm_handle_lambda(vm_t *vm,
 	if (is_valid_lambda(pair)) {
 		scm_value_t args = pair->car;
 		scm_value_t body = pair->cdr;
-		scm_closure_t *tmp = vm_make_closure(args, body, vm->env);
+		scm_closure_t *tmp = vm_make_closure(vm, args, body, vm->env);
+
+		if (vm->tiers.eager) {
+			vm_tier_up(vm, tmp, VM_TIER_BASELINE);
+		}
 
 		vm_stack_push(vm, tag_closure(tmp));
 		vm_call_return(vm);
@@ -76,7 +136,13 @@ static inline void vm_handle_define(vm_t *vm,
 	} else if (is_pair(pair->car)) {
 		scm_pair_t *temp = get_pair(pair->car);
 		scm_closure_t *clsr =
-		    vm_make_closure(temp->cdr, pair->cdr, vm->env);
+		    vm_make_closure(vm, temp->cdr, pair->cdr, vm->env);
+
+		// self-recursive procedures can't be compiled until they're
+		// defined, those are tried again when they're first called
+		if (vm->tiers.eager) {
+			vm_tier_up(vm, clsr, VM_TIER_BASELINE);
+		}
 
 		vm_stack_push(vm, temp->car);
 		vm_stack_push(vm, tag_closure(clsr));
@@ -208,12 +274,11 @@ static inline void vm_step_interpreter(vm_t *vm) {
 			env_node_t *foo = env_find_recurse(vm->env, pair->car);
 
 			if (foo) {
-				if (vm->argnum == 0) {
+				if (vm->sp == vm->fp) {
 					// only try to expand special forms and macros
 					// if this is the first element in the list
 					if (is_special_form(foo->value)) {
 						vm_handle_sform(vm, foo->value, pair->cdr);
-						puts("have sform");
 
 					} else if (is_syntax_rules(foo->value)) {
 						scm_syntax_rules_t *rules = get_syntax_rules(foo->value);
@@ -276,19 +341,26 @@ static inline void vm_step_interpreter(vm_t *vm) {
 }
 
 void vm_run(vm_t *vm) {
-	//void (*stepfuncs[2])(vm_t *) = { step_vm_interpreter, step_vm_compiled };
-
 	while (vm->running) {
-		//if ( vm->closure->is_compiled ){
 		if (vm->runmode == RUN_MODE_COMPILED) {
+#ifdef VM_HAVE_NATIVE_JIT
+			// closures which can't be lowered fall through to threaded code
+			if (vm->engine == VM_ENGINE_NATIVE && vm_run_native(vm)) {
+				continue;
+			}
+#endif
+#ifdef VM_HAVE_DIRECT_THREADING
+			if (vm->engine != VM_ENGINE_CALL_THREADED) {
+				// runs until control leaves compiled code
+				vm_run_direct(vm);
+				continue;
+			}
+#endif
 			vm_step_compiled(vm);
+
 		} else {
 			vm_step_interpreter(vm);
 		}
-
-		// TODO: do some benchmarks to see if indexing into an array of function
-		//       pointers is faster than branching, once things are working
-		//stepfuncs[vm->closure->is_compiled]( vm );
 	}
 }
 
@@ -326,15 +398,140 @@ static environment_t *vm_r7rs_environment(void) {
 	return ret;
 }
 
+static inline bool is_form_of_type(vm_t *vm, scm_value_t expr, unsigned type) {
+	if (!is_pair(expr) || !is_symbol(get_pair(expr)->car)) {
+		return false;
+	}
+
+	env_node_t *var = env_find_recurse(vm->env, get_pair(expr)->car);
+
+	return var && var->value == tag_run_type(type);
+}
+
+// true for (define ...) and (define-syntax ...) forms, which change what
+// the forms after them refer to
+bool vm_is_definition(vm_t *vm, scm_value_t expr) {
+	return is_form_of_type(vm, expr, RUN_TYPE_DEFINE)
+	    || is_form_of_type(vm, expr, RUN_TYPE_DEFINE_SYNTAX);
+}
+
+/*
+ * Compiles `body` as the body of a closure taking no arguments and runs it,
+ * leaving the value of the last expression in `ret`. Returns false without
+ * running anything if it can't be compiled, eg. because it uses special
+ * forms the compiler doesn't handle.
+ *
+ * The code is compiled at the optimizing tier straight away, since it only
+ * runs once there's nothing to gain from profiling it first.
+ */
+static bool vm_run_compiled_body(vm_t *vm, scm_value_t body, scm_value_t *ret) {
+	scm_closure_t *clsr = calloc(1, sizeof(scm_closure_t));
+
+	clsr->lambda = calloc(1, sizeof(vm_lambda_t));
+	clsr->lambda->definition = body;
+	clsr->lambda->args       = SCM_TYPE_NULL;
+	clsr->env = vm_r7rs_environment();
+
+	// nothing else references the closure while it's compiled
+	int handle = vm_handle_alloc(vm);
+	vm_handle_set(vm, handle, tag_closure(clsr));
+
+	bool compiled = vm_tier_up(vm, clsr, VM_TIER_OPTIMIZED);
+	vm_handle_free(vm, handle);
+
+	if (!compiled) {
+		free(clsr->lambda);
+		free(clsr);
+		return false;
+	}
+
+	unsigned fp = vm->sp;
+
+	vm->running = true;
+	vm->closure = clsr;
+	vm->env = vm_r7rs_environment();
+	vm->fp = fp;
+	vm->stack[fp] = tag_closure(clsr);
+	vm->sp = fp + 1;
+	vm->ip = 0;
+	vm->runmode = RUN_MODE_COMPILED;
+
+	vm_run(vm);
+
+	*ret = vm->stack[fp];
+
+	// freed with its code once nothing runs it anymore, each top level
+	// form would leave one behind otherwise. the engines have made their
+	// forms of the code by now, which counts towards collecting
+	gc_own_closure(&vm->gc, clsr);
+	gc_own_lambda(&vm->gc, clsr->lambda);
+	vm_check_owned(vm);
+
+	return true;
+}
+
+// (define name value) with a value that has to be computed, the value is
+// run as compiled code and then defined like the tree walker would
+static bool vm_run_compiled_definition(vm_t *vm, scm_value_t expr, scm_value_t *ret) {
+	scm_value_t args = get_pair(expr)->cdr;
+
+	if (!is_pair(args) || !is_symbol(get_pair(args)->car)) {
+		return false;
+	}
+
+	scm_value_t name  = get_pair(args)->car;
+	scm_value_t value = get_pair(args)->cdr;
+
+	if (!is_pair(value) || !is_null(get_pair(value)->cdr)
+	    || !is_pair(get_pair(value)->car)
+	    || is_form_of_type(vm, get_pair(value)->car, RUN_TYPE_LAMBDA))
+	{
+		return false;
+	}
+
+	if (!vm_run_compiled_body(vm, value, ret)) {
+		return false;
+	}
+
+	if (!vm->errormsg) {
+		env_node_t *var = env_set(vm_r7rs_environment(), name, *ret);
+
+		if (var->watched) {
+			vm_var_written(vm, var);
+		}
+	}
+
+	return true;
+}
+
+static bool vm_run_compiled_expr(vm_t *vm, scm_value_t expr, scm_value_t *ret) {
+	if (is_form_of_type(vm, expr, RUN_TYPE_DEFINE)) {
+		return vm_run_compiled_definition(vm, expr, ret);
+	}
+
+	// atoms aren't worth compiling
+	if (!is_pair(expr) || vm_is_definition(vm, expr)) {
+		return false;
+	}
+
+	return vm_run_compiled_body(vm, construct_tenured_pair(vm, expr, SCM_TYPE_NULL), ret);
+}
+
 /*
  * This function assumes that the VM has stack pointers that are all zero
  */
 scm_value_t vm_evaluate_expr(vm_t *vm, scm_value_t expr) {
+	scm_value_t ret;
+
+	if (vm->toplevel != VM_TOPLEVEL_INTERP && vm_run_compiled_expr(vm, expr, &ret)) {
+		return ret;
+	}
+
 	vm->ptr = expr;
 	vm->running = true;
 	vm->closure = root_closure;
-	vm->closure->definition = expr;
-	vm->argnum = 0;
+	vm->closure->lambda->definition = expr;
+	vm->fp = vm->sp;
 	vm->env = vm_r7rs_environment();
 	vm->runmode = RUN_MODE_INTERP;
 
@@ -343,16 +540,31 @@ scm_value_t vm_evaluate_expr(vm_t *vm, scm_value_t expr) {
 	return vm->stack[0];
 }
 
+/*
+ * Evaluates a list of top-level expressions, compiled together as one
+ * closure if possible. Expressions which can't be compiled together are
+ * evaluated one by one instead. The list shouldn't contain definitions,
+ * since the expressions are resolved before any of them run.
+ */
+scm_value_t vm_evaluate_body(vm_t *vm, scm_value_t body) {
+	scm_value_t ret = SCM_TYPE_NULL;
+
+	if (vm_run_compiled_body(vm, body, &ret)) {
+		return ret;
+	}
+
+	for (; is_pair(body) && !vm->errormsg; body = get_pair(body)->cdr) {
+		ret = vm_evaluate_expr(vm, get_pair(body)->car);
+	}
+
+	return ret;
+}
+
 #include <nscheme/symbols.h>
 #include <string.h>
 
 static void vm_add_arithmetic_op(vm_t *vm, char *name, vm_func func) {
-	scm_closure_t *meh = calloc(1, sizeof(scm_closure_t));
-	meh->code = calloc(1, sizeof(vm_op_t[2]));
-
-	meh->code[0].func = func;
-	meh->code[1].func = vm_op_return;
-	meh->compiled = true;
+	scm_closure_t *meh = vm_make_builtin(func, vm_op_return);
 
 	// TODO: find some place to put environment init stuff
 	scm_value_t foo  = tag_symbol(store_symbol(strdup(name)));
@@ -378,7 +590,7 @@ int vm_handle_alloc(vm_t *vm) {
 		return -1;
 	}
 
-	int ret = --vm->handles.num_avail;
+	int ret = vm->handles.avail[--vm->handles.num_avail];
 	if (vm->handles.slots[ret].used) {
 		// TODO: fatal error, double allocation
 		//       (probably the result of a double free)
@@ -405,7 +617,7 @@ void vm_handle_free(vm_t *vm, int handle) {
 		return;
 	}
 
-	vm->handles.slots[handle].used = true;
+	vm->handles.slots[handle].used = false;
 	vm->handles.avail[vm->handles.num_avail++] = handle;
 }
 
@@ -436,18 +648,33 @@ void vm_handle_set(vm_t *vm, int handle, scm_value_t value) {
 
 vm_t *vm_init(void) {
 	vm_t *ret = calloc(1, sizeof(vm_t));
-	gc_init(&ret->gc, 0x8000);
+	ret->gc.settings.initial_size     = VM_DEFAULT_HEAP_SIZE;
+	ret->gc.settings.max_size         = VM_DEFAULT_MAX_HEAP_SIZE;
+	ret->gc.settings.target_occupancy = VM_DEFAULT_HEAP_OCCUPANCY;
+	ret->gc.settings.nursery_size     = VM_DEFAULT_NURSERY_SIZE;
+	ret->gc.settings.threads          = VM_DEFAULT_GC_THREADS;
+	gc_init(&ret->gc);
 	vm_handles_init(&ret->handles, 0x1000);
 
 	//scm_closure_t *root_closure = calloc( 1, sizeof( scm_closure_t ));
 	root_closure = calloc(1, sizeof(scm_closure_t));
+	root_closure->lambda = calloc(1, sizeof(vm_lambda_t));
 
 	ret->stack_size = 0x1000;
 	ret->calls_size = 0x1000;
 	ret->stack = calloc(1, sizeof(scm_value_t[ret->stack_size]));
 	ret->calls = calloc(1, sizeof(vm_callframe_t[ret->calls_size]));
+	ret->interp_calls = calloc(1, sizeof(vm_interp_frame_t[ret->calls_size]));
 	ret->closure = root_closure;
 	ret->env = vm_r7rs_environment();
+	ret->engine = VM_DEFAULT_ENGINE;
+
+	ret->tiers.compile_calls  = VM_DEFAULT_COMPILE_CALLS;
+	ret->tiers.optimize_calls = VM_DEFAULT_OPTIMIZE_CALLS;
+	ret->tiers.optimize_loops = VM_DEFAULT_OPTIMIZE_LOOPS;
+
+	ret->lambdas_size = 0x100;
+	ret->lambdas = calloc(1, sizeof(vm_lambda_t *[ret->lambdas_size]));
 
 	// TODO: find some place to put environment init stuff
 
@@ -503,6 +730,9 @@ void  vm_free(vm_t *vm) {
 	if (vm) {
 		free(vm->stack);
 		free(vm->calls);
+		free(vm->interp_calls);
+		free(vm->lambdas);
+		gc_free(&vm->gc);
 		free(vm);
 	}
 }
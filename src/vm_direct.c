@@ -0,0 +1,654 @@
+#include <nscheme/vm.h>
+#include <nscheme/vm_ops.h>
+
+#include <stdlib.h>
+
+#ifdef VM_HAVE_DIRECT_THREADING
+
+/*
+ * Direct-threaded engine for compiled closures.
+ *
+ * The `code[]` array of a lambda is decoded once into label addresses in
+ * `direct_code[]`, and each op ends by jumping straight to the label of the
+ * next one. `ip`, `sp` and the frame base are kept in locals here, and are
+ * only written back to the vm struct when control leaves this function or
+ * when an op without a label here has to be called through `vm_op_t.func`.
+ */
+
+enum {
+	DOP_GENERIC,
+	DOP_DO_CALL,
+	DOP_DO_TAILCALL,
+	DOP_JUMP_IF_FALSE,
+	DOP_JUMP,
+	DOP_PUSH_CONST,
+	DOP_CLOSURE_REF,
+	DOP_STACK_REF,
+	DOP_RETURN_LAST,
+	DOP_RETURN,
+	DOP_STACK_REF2,
+	DOP_CLOSURE_REF2,
+	DOP_CLOSURE_STACK_REF,
+	DOP_STACK_REF_CALL,
+	DOP_REF_CONST_CALL,
+	DOP_BOX_REF,
+	DOP_BOX_SET,
+	DOP_CLOSURE_SET,
+	DOP_DROP,
+	DOP_SLIDE,
+	DOP_STACK_SET,
+	DOP_SET_SP,
+	DOP_FOLD_GUARD,
+
+	DOP_ADD2,
+	DOP_SUB2,
+	DOP_LT,
+	DOP_GT,
+	DOP_EQ,
+	DOP_CAR,
+	DOP_CDR,
+	DOP_IS_NULL,
+	DOP_IS_PAIR,
+	DOP_LT_JUMP,
+	DOP_GT_JUMP,
+	DOP_NULL_JUMP,
+	DOP_FIX_ADD,
+	DOP_FIX_SUB,
+	DOP_FIX_LT,
+	DOP_FIX_GT,
+	DOP_FIX_LT_JUMP,
+	DOP_FIX_GT_JUMP,
+
+	DOP_SELF_TAIL_GUARD,
+	DOP_STORE_ARGS,
+	DOP_LOOP_GUARD,
+};
+
+static const struct {
+	vm_func func;
+	unsigned dop;
+} direct_ops[] = {
+	{ vm_op_do_call,       DOP_DO_CALL },
+	{ vm_op_do_tailcall,   DOP_DO_TAILCALL },
+	{ vm_op_jump_if_false, DOP_JUMP_IF_FALSE },
+	{ vm_op_jump,          DOP_JUMP },
+	{ vm_op_push_const,    DOP_PUSH_CONST },
+	{ vm_op_closure_ref,   DOP_CLOSURE_REF },
+	{ vm_op_stack_ref,     DOP_STACK_REF },
+	{ vm_op_return_last,   DOP_RETURN_LAST },
+	{ vm_op_return,        DOP_RETURN },
+
+	{ vm_op_stack_ref2,        DOP_STACK_REF2 },
+	{ vm_op_closure_ref2,      DOP_CLOSURE_REF2 },
+	{ vm_op_closure_stack_ref, DOP_CLOSURE_STACK_REF },
+	{ vm_op_stack_ref_call,    DOP_STACK_REF_CALL },
+	{ vm_op_ref_const_call,    DOP_REF_CONST_CALL },
+	{ vm_op_box_ref,           DOP_BOX_REF },
+	{ vm_op_box_set,           DOP_BOX_SET },
+	{ vm_op_closure_set,       DOP_CLOSURE_SET },
+	{ vm_op_drop,              DOP_DROP },
+	{ vm_op_slide,             DOP_SLIDE },
+	{ vm_op_stack_set,         DOP_STACK_SET },
+	{ vm_op_set_sp,            DOP_SET_SP },
+	{ vm_op_fold_guard,        DOP_FOLD_GUARD },
+
+	{ vm_op_inline_add,         DOP_ADD2 },
+	{ vm_op_inline_sub,         DOP_SUB2 },
+	{ vm_op_inline_lessthan,    DOP_LT },
+	{ vm_op_inline_greaterthan, DOP_GT },
+	{ vm_op_inline_equal,       DOP_EQ },
+	{ vm_op_inline_car,         DOP_CAR },
+	{ vm_op_inline_cdr,         DOP_CDR },
+	{ vm_op_inline_is_null,     DOP_IS_NULL },
+	{ vm_op_inline_is_pair,     DOP_IS_PAIR },
+	{ vm_op_lt_jump,            DOP_LT_JUMP },
+	{ vm_op_gt_jump,            DOP_GT_JUMP },
+	{ vm_op_null_jump,          DOP_NULL_JUMP },
+	{ vm_op_fix_add,            DOP_FIX_ADD },
+	{ vm_op_fix_sub,            DOP_FIX_SUB },
+	{ vm_op_fix_lessthan,       DOP_FIX_LT },
+	{ vm_op_fix_greaterthan,    DOP_FIX_GT },
+	{ vm_op_fix_lt_jump,        DOP_FIX_LT_JUMP },
+	{ vm_op_fix_gt_jump,        DOP_FIX_GT_JUMP },
+
+	{ vm_op_self_tail_guard,    DOP_SELF_TAIL_GUARD },
+	{ vm_op_store_args,         DOP_STORE_ARGS },
+	{ vm_op_loop_guard,         DOP_LOOP_GUARD },
+};
+
+static inline unsigned direct_lookup(vm_func func) {
+	for (unsigned i = 0; i < sizeof(direct_ops) / sizeof(direct_ops[0]); i++) {
+		if (direct_ops[i].func == func) {
+			return direct_ops[i].dop;
+		}
+	}
+
+	// anything else (builtins, mostly) is called through the function pointer
+	return DOP_GENERIC;
+}
+
+// decoded operand of the call ops, which each get an inline cache
+typedef struct direct_call {
+	uintptr_t arg;
+	vm_call_cache_t cache;
+} direct_call_t;
+
+static inline bool is_call_dop(unsigned dop) {
+	return dop == DOP_DO_CALL || dop == DOP_DO_TAILCALL
+	    || dop == DOP_STACK_REF_CALL || dop == DOP_REF_CONST_CALL;
+}
+
+static inline vm_direct_op_t *direct_decode(vm_t *vm, scm_closure_t *closure,
+                                            const void **labels)
+{
+	vm_lambda_t *lambda = closure->lambda;
+
+	if (!lambda->direct_code) {
+		vm_direct_op_t *dcode = calloc(1, sizeof(vm_direct_op_t[lambda->num_ops]));
+
+		for (unsigned i = 0; i < lambda->num_ops; i++) {
+			unsigned dop = direct_lookup(lambda->code[i].func);
+
+			dcode[i].label = labels[dop];
+			dcode[i].arg   = lambda->code[i].arg;
+
+			if (is_call_dop(dop)) {
+				direct_call_t *call = malloc(sizeof(direct_call_t));
+
+				call->arg   = lambda->code[i].arg;
+				vm_call_cache_init(vm, &call->cache);
+				dcode[i].arg = (uintptr_t)call;
+			}
+		}
+
+		lambda->direct_code = dcode;
+	}
+
+	return lambda->direct_code;
+}
+
+// frees the decoded code of `lambda`, and the caches of its call sites
+void vm_direct_free(vm_t *vm, vm_lambda_t *lambda) {
+	vm_direct_op_t *dcode = lambda->direct_code;
+
+	if (!dcode) {
+		return;
+	}
+
+	for (unsigned i = 0; i < lambda->num_ops; i++) {
+		if (is_call_dop(direct_lookup(lambda->code[i].func))) {
+			direct_call_t *call = (direct_call_t *)dcode[i].arg;
+
+			vm_call_cache_unlink(vm, &call->cache);
+			free(call);
+		}
+	}
+
+	free(dcode);
+	lambda->direct_code = NULL;
+}
+
+// baseline code is entered through vm_call_apply() instead, which counts
+// calls for the optimizing tier, as are closures which still need to be
+// bound to code compiled through another closure
+static inline bool is_direct_closure(scm_value_t value) {
+	return is_closure(value) && vm_call_cacheable(get_closure(value));
+}
+
+void vm_run_direct(vm_t *vm) {
+	static const void *labels[] = {
+		[DOP_GENERIC]       = &&op_generic,
+		[DOP_DO_CALL]       = &&op_do_call,
+		[DOP_DO_TAILCALL]   = &&op_do_tailcall,
+		[DOP_JUMP_IF_FALSE] = &&op_jump_if_false,
+		[DOP_JUMP]          = &&op_jump,
+		[DOP_PUSH_CONST]    = &&op_push_const,
+		[DOP_CLOSURE_REF]   = &&op_closure_ref,
+		[DOP_STACK_REF]     = &&op_stack_ref,
+		[DOP_RETURN_LAST]   = &&op_return_last,
+		[DOP_RETURN]        = &&op_return,
+
+		[DOP_STACK_REF2]        = &&op_stack_ref2,
+		[DOP_CLOSURE_REF2]      = &&op_closure_ref2,
+		[DOP_CLOSURE_STACK_REF] = &&op_closure_stack_ref,
+		[DOP_STACK_REF_CALL]    = &&op_stack_ref_call,
+		[DOP_REF_CONST_CALL]    = &&op_ref_const_call,
+		[DOP_BOX_REF]           = &&op_box_ref,
+		[DOP_BOX_SET]           = &&op_box_set,
+		[DOP_CLOSURE_SET]       = &&op_closure_set,
+		[DOP_DROP]              = &&op_drop,
+		[DOP_SLIDE]             = &&op_slide,
+		[DOP_STACK_SET]         = &&op_stack_set,
+		[DOP_SET_SP]            = &&op_set_sp,
+		[DOP_FOLD_GUARD]        = &&op_fold_guard,
+
+		[DOP_ADD2]      = &&op_add2,
+		[DOP_SUB2]      = &&op_sub2,
+		[DOP_LT]        = &&op_lt,
+		[DOP_GT]        = &&op_gt,
+		[DOP_EQ]        = &&op_eq,
+		[DOP_CAR]       = &&op_car,
+		[DOP_CDR]       = &&op_cdr,
+		[DOP_IS_NULL]   = &&op_is_null,
+		[DOP_IS_PAIR]   = &&op_is_pair,
+		[DOP_LT_JUMP]   = &&op_lt_jump,
+		[DOP_GT_JUMP]   = &&op_gt_jump,
+		[DOP_NULL_JUMP] = &&op_null_jump,
+		[DOP_FIX_ADD]     = &&op_fix_add,
+		[DOP_FIX_SUB]     = &&op_fix_sub,
+		[DOP_FIX_LT]      = &&op_fix_lt,
+		[DOP_FIX_GT]      = &&op_fix_gt,
+		[DOP_FIX_LT_JUMP] = &&op_fix_lt_jump,
+		[DOP_FIX_GT_JUMP] = &&op_fix_gt_jump,
+
+		[DOP_SELF_TAIL_GUARD] = &&op_self_tail_guard,
+		[DOP_STORE_ARGS]      = &&op_store_args,
+		[DOP_LOOP_GUARD]      = &&op_loop_guard,
+	};
+
+	scm_value_t *stack = vm->stack;
+	scm_closure_t *closure;
+	vm_direct_op_t *code;
+	unsigned ip, sp, fp;
+
+#define LOAD_STATE() \
+	{ \
+		closure = vm->closure; \
+		code    = direct_decode(vm, closure, labels); \
+		ip      = vm->ip; \
+		sp      = vm->sp; \
+		fp      = vm->fp; \
+	}
+
+#define SAVE_STATE() \
+	{ \
+		vm->closure = closure; \
+		vm->ip      = ip; \
+		vm->sp      = sp; \
+		vm->fp      = fp; \
+	}
+
+#define DISPATCH() goto *code[ip].label
+#define NEXT()     { ip++; DISPATCH(); }
+
+// inlined builtins leave redefinitions and type errors to the vm_op_* version
+#define GUARD(FUNC) \
+	if (!vm_is_builtin(closure->closures[code[ip].arg]->value, FUNC)) { \
+		goto op_generic; \
+	}
+
+#define BINARY_OP(FUNC, EXPR) \
+	{ \
+		GUARD(FUNC); \
+		long int op1 = stack[sp - 1]; \
+		long int op2 = stack[sp - 2]; \
+		sp--; \
+		stack[sp - 1] = (EXPR); \
+		NEXT(); \
+	}
+
+// arithmetic on operands which aren't both fixnums goes through the builtin
+#define FIXNUMS() \
+	if (!is_integer(stack[sp - 1] | stack[sp - 2])) { \
+		goto op_generic; \
+	}
+
+// compare-and-branch ops skip or take the jump_if_false that follows them
+#define BRANCH(TEST) \
+	{ \
+		ip = (TEST)? ip + 2 : code[ip + 1].arg; \
+		DISPATCH(); \
+	}
+
+	LOAD_STATE();
+	DISPATCH();
+
+op_stack_ref:
+	stack[sp] = stack[fp + code[ip].arg];
+	sp++;
+	NEXT();
+
+op_push_const:
+	stack[sp++] = code[ip].arg;
+	NEXT();
+
+op_closure_ref:
+	stack[sp++] = closure->closures[code[ip].arg]->value;
+	NEXT();
+
+op_box_ref:
+	stack[sp++] = vm_get_box(stack[fp + code[ip].arg])->value;
+	NEXT();
+
+op_box_set: {
+		env_node_t *box = vm_get_box(stack[fp + code[ip].arg]);
+
+		box->value = stack[sp - 1];
+		env_write_barrier(box);
+		NEXT();
+	}
+
+op_closure_set: {
+		env_node_t *var = closure->closures[code[ip].arg];
+
+		// variables other code relies on go through vm_op_closure_set()
+		if (var->watched) {
+			goto op_generic;
+		}
+
+		var->value = stack[sp - 1];
+		var->writes++;
+		env_write_barrier(var);
+		NEXT();
+	}
+
+op_drop:
+	sp--;
+	NEXT();
+
+op_slide:
+	stack[sp - 1 - code[ip].arg] = stack[sp - 1];
+	sp -= code[ip].arg;
+	NEXT();
+
+op_stack_set:
+	stack[fp + code[ip].arg] = stack[sp - 1];
+	NEXT();
+
+op_set_sp:
+	sp = fp + code[ip].arg;
+	NEXT();
+
+	// vm_op_fold_guard() throws the code out if this fails
+op_fold_guard: {
+		vm_fold_guard_t *guard = (vm_fold_guard_t *)code[ip].arg;
+
+		if (!vm_fold_guard_holds(closure, guard)
+		    || !vm_fixnum_args_hold(stack + fp + 1, guard->fixnum_args))
+		{
+			goto op_generic;
+		}
+
+		NEXT();
+	}
+
+op_jump:
+	ip = code[ip].arg;
+	DISPATCH();
+
+op_jump_if_false:
+	if (stack[--sp] == tag_boolean(false)) {
+		ip = code[ip].arg;
+		DISPATCH();
+	}
+
+	NEXT();
+
+op_stack_ref2: {
+		uintptr_t arg = code[ip].arg;
+
+		stack[sp]     = stack[fp + vm_arg_low(arg)];
+		stack[sp + 1] = stack[fp + vm_arg_high(arg)];
+		sp += 2;
+		NEXT();
+	}
+
+op_closure_ref2: {
+		uintptr_t arg = code[ip].arg;
+
+		stack[sp]     = closure->closures[vm_arg_low(arg)]->value;
+		stack[sp + 1] = closure->closures[vm_arg_high(arg)]->value;
+		sp += 2;
+		NEXT();
+	}
+
+op_closure_stack_ref: {
+		uintptr_t arg = code[ip].arg;
+
+		stack[sp]     = closure->closures[vm_arg_low(arg)]->value;
+		stack[sp + 1] = stack[fp + vm_arg_high(arg)];
+		sp += 2;
+		NEXT();
+	}
+
+	// the checked forms fall through into the fixnum ones
+op_add2:
+	FIXNUMS();
+op_fix_add:
+	BINARY_OP(vm_op_add, op2 + op1);
+
+op_sub2:
+	FIXNUMS();
+op_fix_sub:
+	BINARY_OP(vm_op_sub, op2 - op1);
+
+op_lt:
+	FIXNUMS();
+op_fix_lt:
+	BINARY_OP(vm_op_lessthan, tag_boolean(op2 < op1));
+
+op_gt:
+	FIXNUMS();
+op_fix_gt:
+	BINARY_OP(vm_op_greaterthan, tag_boolean(op2 > op1));
+
+op_eq:
+	BINARY_OP(vm_op_equal, tag_boolean(op2 == op1));
+
+op_car:
+	GUARD(vm_op_car);
+	if (!is_pair(stack[sp - 1])) {
+		goto op_generic;
+	}
+
+	stack[sp - 1] = get_pair(stack[sp - 1])->car;
+	NEXT();
+
+op_cdr:
+	GUARD(vm_op_cdr);
+	if (!is_pair(stack[sp - 1])) {
+		goto op_generic;
+	}
+
+	stack[sp - 1] = get_pair(stack[sp - 1])->cdr;
+	NEXT();
+
+op_is_null:
+	GUARD(vm_op_is_null);
+	stack[sp - 1] = tag_boolean(is_null(stack[sp - 1]));
+	NEXT();
+
+op_is_pair:
+	GUARD(vm_op_is_pair);
+	stack[sp - 1] = tag_boolean(is_pair(stack[sp - 1]));
+	NEXT();
+
+op_lt_jump:
+	FIXNUMS();
+op_fix_lt_jump:
+	GUARD(vm_op_lessthan);
+	sp -= 2;
+	BRANCH((long int)stack[sp] < (long int)stack[sp + 1]);
+
+op_gt_jump:
+	FIXNUMS();
+op_fix_gt_jump:
+	GUARD(vm_op_greaterthan);
+	sp -= 2;
+	BRANCH((long int)stack[sp] > (long int)stack[sp + 1]);
+
+op_null_jump:
+	GUARD(vm_op_is_null);
+	sp -= 1;
+	BRANCH(is_null(stack[sp]));
+
+	// the compiler always emits self_tail_guard, store_args and the jump
+	// back together, so they're chained here without dispatching
+op_loop_guard:
+	// hot loops are moved over to optimized code by vm_op_loop_guard()
+	if (vm_loop_is_hot(vm, closure->lambda->back_edges + 1)) {
+		goto op_generic;
+	}
+
+	closure->lambda->back_edges++;
+	goto op_self_tail_guard;
+
+op_self_tail_guard:
+	if (closure->closures[code[ip].arg]->value != tag_closure(closure)) {
+		goto op_generic;
+	}
+
+	ip++;
+	goto op_store_args;
+
+op_store_args: {
+		uintptr_t arg = code[ip].arg;
+		unsigned nparams = vm_arg_low(arg);
+
+		for (unsigned i = nparams; i > 0; i--) {
+			if (!vm_tail_skipped(arg, i - 1)) {
+				stack[fp + i] = stack[--sp];
+			}
+		}
+
+		sp = fp + 1 + nparams;
+		ip = code[ip + 1].arg;
+		DISPATCH();
+	}
+
+	// calls return to `retip`, with the callee at `fp + offset`, and look
+	// it up in the call site's `cache` first
+	unsigned retip;
+	uintptr_t offset;
+	direct_call_t *call;
+
+op_stack_ref_call:
+	call = (direct_call_t *)code[ip].arg;
+	stack[sp] = stack[fp + vm_arg_low(call->arg)];
+	sp++;
+	offset = vm_arg_high(call->arg);
+	retip  = ip + 1;
+	goto do_call;
+
+op_ref_const_call:
+	// the constant lives in the following data slot
+	call = (direct_call_t *)code[ip].arg;
+	stack[sp]     = stack[fp + vm_arg_low(call->arg)];
+	stack[sp + 1] = code[ip + 1].arg;
+	sp += 2;
+	offset = vm_arg_high(call->arg);
+	retip  = ip + 2;
+	goto do_call;
+
+op_do_call:
+	call   = (direct_call_t *)code[ip].arg;
+	offset = call->arg;
+	retip  = ip + 1;
+	goto do_call;
+
+do_call: {
+		unsigned start = fp + offset;
+		vm_callframe_t *frame = vm->calls + vm->callp++;
+
+		frame->closure = closure;
+		frame->ip      = retip;
+		frame->fp      = fp;
+
+		fp = start;
+		goto enter_closure;
+	}
+
+op_do_tailcall: {
+		call = (direct_call_t *)code[ip].arg;
+		unsigned start = fp + call->arg;
+		unsigned argnum = sp - start;
+
+		for (unsigned i = 0; i < argnum; i++) {
+			stack[fp + i] = stack[start + i];
+		}
+
+		sp = fp + argnum;
+		goto enter_closure;
+	}
+
+enter_closure: {
+		const void *entry = vm_call_cache_lookup(vm, &call->cache, stack[fp]);
+
+		if (entry) {
+			closure = get_closure(stack[fp]);
+			code    = (vm_direct_op_t *)entry;
+			ip      = 0;
+			DISPATCH();
+		}
+	}
+
+	if (is_direct_closure(stack[fp])) {
+		closure = get_closure(stack[fp]);
+		code    = direct_decode(vm, closure, labels);
+		ip      = 0;
+		vm_call_cache_fill(vm, &call->cache, stack[fp], code);
+		DISPATCH();
+	}
+
+	// interpreted closures and other applicable values take the
+	// generic path, which might switch over to the tree walker
+	ip = 0;
+	SAVE_STATE();
+	vm_call_apply(vm);
+
+	if (!vm->running || vm->runmode != RUN_MODE_COMPILED) {
+		return;
+	}
+
+	LOAD_STATE();
+	DISPATCH();
+
+op_return_last:
+	sp--;
+	stack[fp] = stack[sp];
+	goto do_return;
+
+op_return:
+	goto do_return;
+
+do_return:
+	if (vm->callp > 0 && vm->calls[vm->callp - 1].ip != VM_FRAME_INTERP) {
+		vm_callframe_t *frame = vm->calls + --vm->callp;
+
+		closure = frame->closure;
+		code    = direct_decode(vm, closure, labels);
+		ip      = frame->ip;
+		sp      = fp + 1;
+		fp      = frame->fp;
+		DISPATCH();
+	}
+
+	// returning into the tree walker, or from the top level
+	SAVE_STATE();
+	vm_call_return(vm);
+	return;
+
+op_generic: {
+		SAVE_STATE();
+
+		bool next = closure->lambda->code[ip].func(vm, code[ip].arg);
+		vm->ip += next;
+
+		if (!vm->running || vm->runmode != RUN_MODE_COMPILED) {
+			return;
+		}
+
+		LOAD_STATE();
+		DISPATCH();
+	}
+
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef DISPATCH
+#undef NEXT
+#undef GUARD
+#undef BINARY_OP
+#undef BRANCH
+}
+
+#endif
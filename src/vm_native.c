@@ -0,0 +1,1026 @@
+#include <nscheme/vm.h>
+#include <nscheme/vm_ops.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef VM_HAVE_NATIVE_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * x86-64 backend for compiled closures.
+ *
+ * The `code[]` array of a lambda is lowered once into machine code, one
+ * block per op, so that jumps and returns can land on any op. While native
+ * code runs the VM state lives in callee-saved registers:
+ *
+ *     r12 = vm
+ *     r13 = vm->stack
+ *     rbx = &vm->stack[vm->sp]            (next free slot)
+ *     r14 = &vm->stack[vm->fp]            (frame base)
+ *     r15 = vm->closure->closures
+ *
+ * Stack and closure refs, jumps, and the fast paths of inlined builtins are
+ * open-coded, as are calls which hit the call site's inline cache. Everything
+ * else, including returns, writes the state back to the vm struct and calls
+ * the op's `vm_op_*` function through native_step(), which returns the
+ * address of the native code to continue at, possibly in another closure,
+ * or NULL when control leaves native code.
+ */
+
+typedef struct vm_native {
+	uint8_t *code;
+	size_t size;
+	// offset of the machine code for each op in `lambda->code[]`
+	uint32_t *offsets;
+	// inline caches of the call sites, see emit_cached_call()
+	vm_call_cache_t **caches;
+	size_t num_caches;
+} vm_native_t;
+
+// marks lambdas which couldn't be lowered, these run threaded code
+static vm_native_t native_failed;
+
+// displacements of the fields of a box from its tagged pointer
+#define BOX_VALUE ((int32_t)offsetof(env_node_t, value) - SCM_TYPE_EXTERNAL_PTR)
+#define BOX_REMEMBERED ((int32_t)offsetof(env_node_t, remembered) - SCM_TYPE_EXTERNAL_PTR)
+
+typedef void (*native_entry_t)(vm_t *vm, const void *target);
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8,  R9,  R10, R11, R12, R13, R14, R15,
+};
+
+// condition codes, added to the 0x0f 0x80 jcc opcode
+enum {
+	CC_O  = 0x0,
+	CC_B  = 0x2,
+	CC_AE = 0x3,
+	CC_E  = 0x4,
+	CC_NE = 0x5,
+	CC_L  = 0xc,
+	CC_GE = 0xd,
+	CC_LE = 0xe,
+	CC_G  = 0xf,
+	// not a real condition code, used for unconditional jumps
+	CC_ALWAYS = 0x10,
+};
+
+typedef struct emit_fixup {
+	uint32_t pos;
+	unsigned target;
+} emit_fixup_t;
+
+typedef struct emit_buf {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+
+	// rel32 jumps to ops, patched once all ops are emitted
+	emit_fixup_t *fixups;
+	size_t num_fixups;
+	size_t max_fixups;
+
+	// caches the code refers to, freed along with it
+	vm_call_cache_t **caches;
+	size_t num_caches;
+	size_t max_caches;
+
+	// offset of the shared epilogue
+	uint32_t epilogue;
+} emit_buf_t;
+
+static void emit_byte(emit_buf_t *buf, uint8_t byte) {
+	if (buf->len == buf->cap) {
+		buf->cap  = buf->cap? buf->cap * 2 : 256;
+		buf->data = realloc(buf->data, buf->cap);
+	}
+
+	buf->data[buf->len++] = byte;
+}
+
+static void emit_bytes(emit_buf_t *buf, const uint8_t *bytes, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		emit_byte(buf, bytes[i]);
+	}
+}
+
+#define EMIT(BUF, ...) \
+	emit_bytes(BUF, (const uint8_t[]){ __VA_ARGS__ }, \
+	           sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void emit_u32(emit_buf_t *buf, uint32_t value) {
+	for (unsigned i = 0; i < 4; i++) {
+		emit_byte(buf, value >> (i * 8));
+	}
+}
+
+static void emit_u64(emit_buf_t *buf, uint64_t value) {
+	for (unsigned i = 0; i < 8; i++) {
+		emit_byte(buf, value >> (i * 8));
+	}
+}
+
+static void patch_u32(emit_buf_t *buf, size_t pos, uint32_t value) {
+	for (unsigned i = 0; i < 4; i++) {
+		buf->data[pos + i] = value >> (i * 8);
+	}
+}
+
+// `opcode reg, [base + disp]`, 64 bit operands if `wide`
+static void emit_mem(emit_buf_t *buf, bool wide, uint8_t opcode,
+                     unsigned reg, unsigned base, int32_t disp)
+{
+	uint8_t rex = (wide? 0x48 : 0x40) | ((reg & 8)? 4 : 0) | ((base & 8)? 1 : 0);
+
+	if (rex != 0x40) {
+		emit_byte(buf, rex);
+	}
+
+	emit_byte(buf, opcode);
+
+	if (disp >= -128 && disp < 128) {
+		emit_byte(buf, 0x40 | ((reg & 7) << 3) | (base & 7));
+	} else {
+		emit_byte(buf, 0x80 | ((reg & 7) << 3) | (base & 7));
+	}
+
+	// rsp and r12 as a base need a SIB byte
+	if ((base & 7) == RSP) {
+		emit_byte(buf, 0x24);
+	}
+
+	if (disp >= -128 && disp < 128) {
+		emit_byte(buf, disp);
+	} else {
+		emit_u32(buf, disp);
+	}
+}
+
+// `opcode rm, reg` between registers, 64 bit
+static void emit_rr(emit_buf_t *buf, uint8_t opcode, unsigned reg, unsigned rm) {
+	emit_byte(buf, 0x48 | ((reg & 8)? 4 : 0) | ((rm & 8)? 1 : 0));
+	emit_byte(buf, opcode);
+	emit_byte(buf, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_load(emit_buf_t *buf, unsigned reg, unsigned base, int32_t disp) {
+	emit_mem(buf, true, 0x8b, reg, base, disp);
+}
+
+static void emit_store(emit_buf_t *buf, unsigned base, int32_t disp, unsigned reg) {
+	emit_mem(buf, true, 0x89, reg, base, disp);
+}
+
+static void emit_load_u32(emit_buf_t *buf, unsigned reg, unsigned base, int32_t disp) {
+	emit_mem(buf, false, 0x8b, reg, base, disp);
+}
+
+static void emit_store_u32(emit_buf_t *buf, unsigned base, int32_t disp, unsigned reg) {
+	emit_mem(buf, false, 0x89, reg, base, disp);
+}
+
+static void emit_mov_imm(emit_buf_t *buf, unsigned reg, uint64_t value) {
+	emit_byte(buf, 0x48 | ((reg & 8)? 1 : 0));
+	emit_byte(buf, 0xb8 + (reg & 7));
+	emit_u64(buf, value);
+}
+
+// rbx += slots * 8, with an imm8 when the offset fits in one
+static void emit_adjust_sp(emit_buf_t *buf, int slots) {
+	int32_t offset = slots * 8;
+
+	if (offset == 0) {
+		return;
+	}
+
+	if (offset >= -128 && offset <= 127) {
+		EMIT(buf, 0x48, 0x83, 0xc3, (uint8_t)offset);
+	} else {
+		EMIT(buf, 0x48, 0x81, 0xc3);
+		emit_u32(buf, (uint32_t)offset);
+	}
+}
+
+static void emit_call(emit_buf_t *buf, const void *func) {
+	emit_mov_imm(buf, RAX, (uintptr_t)func);
+	EMIT(buf, 0xff, 0xd0);
+}
+
+// emits a jump with an unpatched rel32, and returns the position of it
+static size_t emit_jump_rel(emit_buf_t *buf, unsigned cc) {
+	if (cc == CC_ALWAYS) {
+		emit_byte(buf, 0xe9);
+	} else {
+		EMIT(buf, 0x0f, 0x80 + cc);
+	}
+
+	size_t pos = buf->len;
+	emit_u32(buf, 0);
+
+	return pos;
+}
+
+// points the jump at `pos` to the current position
+static void patch_here(emit_buf_t *buf, size_t pos) {
+	patch_u32(buf, pos, buf->len - (pos + 4));
+}
+
+static void emit_jump_to(emit_buf_t *buf, unsigned cc, uint32_t offset) {
+	size_t pos = emit_jump_rel(buf, cc);
+	patch_u32(buf, pos, offset - (pos + 4));
+}
+
+static void emit_jump_op(emit_buf_t *buf, unsigned cc, unsigned target) {
+	size_t pos = emit_jump_rel(buf, cc);
+
+	if (buf->num_fixups == buf->max_fixups) {
+		buf->max_fixups = buf->max_fixups? buf->max_fixups * 2 : 16;
+		buf->fixups = realloc(buf->fixups,
+		                      sizeof(emit_fixup_t[buf->max_fixups]));
+	}
+
+	buf->fixups[buf->num_fixups++] = (emit_fixup_t){ pos, target };
+}
+
+// loads the registers listed at the top from the vm struct
+static void emit_load_state(emit_buf_t *buf) {
+	emit_load(buf, R13, R12, offsetof(vm_t, stack));
+	emit_load_u32(buf, RAX, R12, offsetof(vm_t, sp));
+	// lea rbx, [r13 + rax*8]
+	EMIT(buf, 0x49, 0x8d, 0x5c, 0xc5, 0x00);
+	emit_load_u32(buf, RAX, R12, offsetof(vm_t, fp));
+	// lea r14, [r13 + rax*8]
+	EMIT(buf, 0x4d, 0x8d, 0x74, 0xc5, 0x00);
+	emit_load(buf, RCX, R12, offsetof(vm_t, closure));
+	emit_load(buf, R15, RCX, offsetof(scm_closure_t, closures));
+}
+
+// writes sp, fp and ip back to the vm struct
+static void emit_save_state(emit_buf_t *buf, unsigned ip) {
+	emit_rr(buf, 0x89, RBX, RAX);
+	emit_rr(buf, 0x29, R13, RAX);
+	// shr rax, 3
+	EMIT(buf, 0x48, 0xc1, 0xe8, 0x03);
+	emit_store_u32(buf, R12, offsetof(vm_t, sp), RAX);
+
+	emit_rr(buf, 0x89, R14, RAX);
+	emit_rr(buf, 0x29, R13, RAX);
+	EMIT(buf, 0x48, 0xc1, 0xe8, 0x03);
+	emit_store_u32(buf, R12, offsetof(vm_t, fp), RAX);
+
+	// mov dword [r12 + ip], imm32
+	emit_mem(buf, false, 0xc7, 0, R12, offsetof(vm_t, ip));
+	emit_u32(buf, ip);
+}
+
+// continues at the address in rax, or leaves native code if it's NULL
+static void emit_resume(emit_buf_t *buf) {
+	// test rax, rax
+	emit_rr(buf, 0x85, RAX, RAX);
+	emit_jump_to(buf, CC_E, buf->epilogue);
+
+	// rax is clobbered by the state loads
+	emit_rr(buf, 0x89, RAX, RSI);
+	emit_load_state(buf);
+	EMIT(buf, 0xff, 0xe6);
+}
+
+static const void *vm_native_resume(vm_t *vm);
+static inline vm_native_t *native_code(vm_t *vm, scm_closure_t *closure);
+
+static const void *native_step(vm_t *vm, vm_func func, uintptr_t arg) {
+	vm->ip += func(vm, arg);
+
+	return vm_native_resume(vm);
+}
+
+// makes a call which missed the call site's cache, and adds the callee to
+// it if it went straight into native code
+static const void *native_call_miss(vm_t *vm, vm_call_cache_t *cache,
+                                    vm_func func, uintptr_t arg)
+{
+	func(vm, arg);
+	cache->misses++;
+
+	scm_closure_t *callee = vm->closure;
+
+	if (vm->running && vm->runmode == RUN_MODE_COMPILED && vm->ip == 0
+	    && vm->stack[vm->fp] == tag_closure(callee)
+	    && vm_call_cacheable(callee))
+	{
+		vm_native_t *native = native_code(vm, callee);
+
+		if (native) {
+			vm_call_cache_fill(vm, cache, tag_closure(callee),
+			                   native->code + native->offsets[0]);
+		}
+	}
+
+	return vm_native_resume(vm);
+}
+
+// runs `code[ip]` through its vm_op_* function and continues wherever
+// that leaves the vm
+static void emit_generic(emit_buf_t *buf, vm_op_t *op, unsigned ip) {
+	emit_save_state(buf, ip);
+	emit_rr(buf, 0x89, R12, RDI);
+	emit_mov_imm(buf, RSI, (uintptr_t)op->func);
+	emit_mov_imm(buf, RDX, op->arg);
+	emit_call(buf, native_step);
+	emit_resume(buf);
+}
+
+// pushes the value of closure slot `index`
+static void emit_closure_ref(emit_buf_t *buf, unsigned index, int slot) {
+	emit_load(buf, RAX, R15, index * sizeof(env_node_t *));
+	emit_load(buf, RAX, RAX, offsetof(env_node_t, value));
+	emit_store(buf, RBX, slot * 8, RAX);
+}
+
+static void emit_stack_ref(emit_buf_t *buf, unsigned index, int slot) {
+	emit_load(buf, RAX, R14, index * 8);
+	emit_store(buf, RBX, slot * 8, RAX);
+}
+
+// jumps to the returned fixup unless closure slot `index` still holds `value`
+static size_t emit_guard(emit_buf_t *buf, unsigned index, scm_value_t value) {
+	emit_load(buf, RAX, R15, index * sizeof(env_node_t *));
+	emit_load(buf, RAX, RAX, offsetof(env_node_t, value));
+	emit_mov_imm(buf, RCX, value);
+	emit_rr(buf, 0x39, RCX, RAX);
+
+	return emit_jump_rel(buf, CC_NE);
+}
+
+// jumps to the returned fixup unless closure slot `index` still holds the
+// running closure, native code is shared by all closures of a lambda
+static size_t emit_self_guard(emit_buf_t *buf, unsigned index) {
+	emit_load(buf, RAX, R15, index * sizeof(env_node_t *));
+	emit_load(buf, RAX, RAX, offsetof(env_node_t, value));
+	emit_load(buf, RCX, R12, offsetof(vm_t, closure));
+	// or rcx, SCM_TYPE_CLOSURE
+	EMIT(buf, 0x48, 0x83, 0xc9, SCM_TYPE_CLOSURE);
+	emit_rr(buf, 0x39, RCX, RAX);
+
+	return emit_jump_rel(buf, CC_NE);
+}
+
+// converts the flag in al to a boolean in rax
+static void emit_tag_boolean(emit_buf_t *buf) {
+	// movzx eax, al; shl eax, 8; or eax, SCM_TYPE_BOOLEAN
+	EMIT(buf, 0x0f, 0xb6, 0xc0);
+	EMIT(buf, 0xc1, 0xe0, 0x08);
+	EMIT(buf, 0x83, 0xc8, SCM_TYPE_BOOLEAN);
+}
+
+// jumps to `fail` if rax isn't a pair, otherwise untags it into rcx
+static size_t emit_pair_check(emit_buf_t *buf) {
+	// mov ecx, eax; and ecx, 0xf; cmp ecx, SCM_TYPE_PAIR
+	EMIT(buf, 0x89, 0xc1);
+	EMIT(buf, 0x83, 0xe1, 0x0f);
+	EMIT(buf, 0x83, 0xf9, SCM_TYPE_PAIR);
+	size_t fail = emit_jump_rel(buf, CC_NE);
+
+	// lea rcx, [rax - SCM_TYPE_PAIR]
+	EMIT(buf, 0x48, 0x8d, 0x48, -SCM_TYPE_PAIR);
+
+	return fail;
+}
+
+static const struct {
+	vm_func func;
+	vm_func builtin;
+} inline_builtins[] = {
+	{ vm_op_inline_add,         vm_op_add },
+	{ vm_op_inline_sub,         vm_op_sub },
+	{ vm_op_inline_lessthan,    vm_op_lessthan },
+	{ vm_op_inline_greaterthan, vm_op_greaterthan },
+	{ vm_op_inline_equal,       vm_op_equal },
+	{ vm_op_inline_car,         vm_op_car },
+	{ vm_op_inline_cdr,         vm_op_cdr },
+	{ vm_op_inline_is_null,     vm_op_is_null },
+	{ vm_op_inline_is_pair,     vm_op_is_pair },
+	{ vm_op_lt_jump,            vm_op_lessthan },
+	{ vm_op_gt_jump,            vm_op_greaterthan },
+	{ vm_op_null_jump,          vm_op_is_null },
+	{ vm_op_fix_add,            vm_op_add },
+	{ vm_op_fix_sub,            vm_op_sub },
+	{ vm_op_fix_lessthan,       vm_op_lessthan },
+	{ vm_op_fix_greaterthan,    vm_op_greaterthan },
+	{ vm_op_fix_lt_jump,        vm_op_lessthan },
+	{ vm_op_fix_gt_jump,        vm_op_greaterthan },
+};
+
+// the inlined arithmetic which checks for fixnum operands
+static bool is_checked_arith(vm_func func) {
+	return func == vm_op_inline_add
+	    || func == vm_op_inline_sub
+	    || func == vm_op_inline_lessthan
+	    || func == vm_op_inline_greaterthan
+	    || func == vm_op_lt_jump
+	    || func == vm_op_gt_jump;
+}
+
+// jumps to the returned fixup unless the top two values are fixnums
+static size_t emit_fixnum_check(emit_buf_t *buf) {
+	// mov rax, [rbx - 16]; or rax, [rbx - 8]; test al, 3
+	emit_load(buf, RAX, RBX, -16);
+	emit_mem(buf, true, 0x0b, RAX, RBX, -8);
+	EMIT(buf, 0xa8, SCM_MASK_INTEGER);
+
+	return emit_jump_rel(buf, CC_NE);
+}
+
+// the builtin an inlined op is guarded on, or NULL for other ops
+static vm_func inline_builtin(vm_func func) {
+	for (unsigned i = 0; i < sizeof(inline_builtins) / sizeof(inline_builtins[0]); i++) {
+		if (inline_builtins[i].func == func) {
+			return inline_builtins[i].builtin;
+		}
+	}
+
+	return NULL;
+}
+
+// fast path of an inlined builtin, guard failures and type errors jump to
+// the generic version of the op emitted after this
+static void emit_inline_op(emit_buf_t *buf, scm_closure_t *closure,
+                           unsigned ip, scm_value_t builtin)
+{
+	vm_op_t *op = closure->lambda->code + ip;
+	vm_func func = op->func;
+	size_t fails[2];
+	unsigned num_fails = 0;
+
+	fails[num_fails++] = emit_guard(buf, op->arg, builtin);
+
+	if (is_checked_arith(func)) {
+		fails[num_fails++] = emit_fixnum_check(buf);
+	}
+
+	// the checked and fixnum forms are the same past the check
+	func = (func == vm_op_inline_add)? vm_op_fix_add
+	     : (func == vm_op_inline_sub)? vm_op_fix_sub
+	     : (func == vm_op_inline_lessthan)? vm_op_fix_lessthan
+	     : (func == vm_op_inline_greaterthan)? vm_op_fix_greaterthan
+	     : (func == vm_op_lt_jump)? vm_op_fix_lt_jump
+	     : (func == vm_op_gt_jump)? vm_op_fix_gt_jump
+	     : func;
+
+	if (func == vm_op_fix_add || func == vm_op_fix_sub) {
+		// tagged fixnums can be added and subtracted as they are
+		emit_load(buf, RAX, RBX, -16);
+		emit_load(buf, RCX, RBX, -8);
+		emit_rr(buf, (func == vm_op_fix_add)? 0x01 : 0x29, RCX, RAX);
+		emit_store(buf, RBX, -16, RAX);
+		emit_adjust_sp(buf, -1);
+
+	} else if (func == vm_op_fix_lessthan
+	        || func == vm_op_fix_greaterthan
+	        || func == vm_op_inline_equal)
+	{
+		uint8_t setcc = (func == vm_op_fix_lessthan)? 0x9c
+		              : (func == vm_op_fix_greaterthan)? 0x9f
+		              : 0x94;
+
+		emit_load(buf, RCX, RBX, -16);
+		emit_load(buf, RDX, RBX, -8);
+		emit_rr(buf, 0x39, RDX, RCX);
+		EMIT(buf, 0x0f, setcc, 0xc0);
+		emit_tag_boolean(buf);
+		emit_store(buf, RBX, -16, RAX);
+		emit_adjust_sp(buf, -1);
+
+	} else if (func == vm_op_inline_car || func == vm_op_inline_cdr) {
+		emit_load(buf, RAX, RBX, -8);
+		fails[num_fails++] = emit_pair_check(buf);
+		emit_load(buf, RAX, RCX, (func == vm_op_inline_car)
+		                         ? offsetof(scm_pair_t, car)
+		                         : offsetof(scm_pair_t, cdr));
+		emit_store(buf, RBX, -8, RAX);
+
+	} else if (func == vm_op_inline_is_null) {
+		// cmp qword [rbx - 8], SCM_TYPE_NULL; sete al
+		emit_mem(buf, true, 0x83, 7, RBX, -8);
+		emit_byte(buf, SCM_TYPE_NULL);
+		EMIT(buf, 0x0f, 0x94, 0xc0);
+		emit_tag_boolean(buf);
+		emit_store(buf, RBX, -8, RAX);
+
+	} else if (func == vm_op_inline_is_pair) {
+		// mov rax, [rbx - 8]; and eax, 0xf; cmp eax, SCM_TYPE_PAIR; sete al
+		emit_load(buf, RAX, RBX, -8);
+		EMIT(buf, 0x83, 0xe0, 0x0f);
+		EMIT(buf, 0x83, 0xf8, SCM_TYPE_PAIR);
+		EMIT(buf, 0x0f, 0x94, 0xc0);
+		emit_tag_boolean(buf);
+		emit_store(buf, RBX, -8, RAX);
+
+	} else {
+		// compare-and-branch ops, which skip or take the jump_if_false
+		// following them
+		unsigned false_target = closure->lambda->code[ip + 1].arg;
+
+		if (func == vm_op_null_jump) {
+			emit_adjust_sp(buf, -1);
+			emit_mem(buf, true, 0x83, 7, RBX, 0);
+			emit_byte(buf, SCM_TYPE_NULL);
+			emit_jump_op(buf, CC_NE, false_target);
+
+		} else {
+			emit_load(buf, RCX, RBX, -16);
+			emit_load(buf, RDX, RBX, -8);
+			emit_adjust_sp(buf, -2);
+			emit_rr(buf, 0x39, RDX, RCX);
+			emit_jump_op(buf, (func == vm_op_fix_lt_jump)? CC_GE : CC_LE,
+			             false_target);
+		}
+
+		emit_jump_op(buf, CC_ALWAYS, ip + 2);
+	}
+
+	if (func != vm_op_fix_lt_jump
+	    && func != vm_op_fix_gt_jump
+	    && func != vm_op_null_jump)
+	{
+		emit_jump_op(buf, CC_ALWAYS, ip + 1);
+	}
+
+	for (unsigned i = 0; i < num_fails; i++) {
+		patch_here(buf, fails[i]);
+	}
+
+	emit_generic(buf, op, ip);
+}
+
+// checks of the slots and the argument types the optimized code relies on,
+// failures go through vm_op_fold_guard(), which throws the code out
+static void emit_fold_guard(emit_buf_t *buf, vm_op_t *op, unsigned ip) {
+	vm_fold_guard_t *guard = (vm_fold_guard_t *)op->arg;
+	size_t *fails = malloc(sizeof(size_t[guard->num_slots + 32]));
+	unsigned num_fails = 0;
+
+	for (unsigned i = 0; i < guard->num_slots; i++) {
+		if (guard->slots[i].var) {
+			emit_mov_imm(buf, RAX, (uintptr_t)guard->slots[i].var);
+			emit_load(buf, RAX, RAX, offsetof(env_node_t, value));
+			emit_mov_imm(buf, RCX, guard->slots[i].value);
+			emit_rr(buf, 0x39, RCX, RAX);
+			fails[num_fails++] = emit_jump_rel(buf, CC_NE);
+
+		} else {
+			fails[num_fails++] = emit_guard(buf, guard->slots[i].index,
+			                                guard->slots[i].value);
+		}
+	}
+
+	for (unsigned i = 0; i < 32; i++) {
+		if (guard->fixnum_args & (1u << i)) {
+			// test byte [r14 + (i + 1) * 8], SCM_MASK_INTEGER
+			emit_mem(buf, false, 0xf6, 0, R14, (i + 1) * 8);
+			emit_byte(buf, SCM_MASK_INTEGER);
+			fails[num_fails++] = emit_jump_rel(buf, CC_NE);
+		}
+	}
+
+	emit_jump_op(buf, CC_ALWAYS, ip + 1);
+
+	for (unsigned i = 0; i < num_fails; i++) {
+		patch_here(buf, fails[i]);
+	}
+
+	emit_generic(buf, op, ip);
+	free(fails);
+}
+
+/*
+ * Calls with the callee at `[r14 + offset * 8]` and the arguments above it,
+ * through the call site's inline cache. Hits push the call frame and jump
+ * straight into the callee's native code, or for tail calls move the callee
+ * and arguments down to the frame base first. Misses call `func` with `arg`
+ * through native_call_miss(), which is a do_call or do_tailcall op that
+ * makes the same call, and which fills the cache.
+ */
+static void emit_cached_call(vm_t *vm, emit_buf_t *buf, unsigned ip,
+                             unsigned offset, unsigned retip,
+                             vm_func func, uintptr_t arg)
+{
+	vm_call_cache_t *cache = malloc(sizeof(vm_call_cache_t));
+	vm_call_cache_init(vm, cache);
+	bool tail = func == vm_op_do_tailcall;
+	size_t hits[VM_CALL_CACHE_WAYS];
+
+	if (buf->num_caches == buf->max_caches) {
+		buf->max_caches = buf->max_caches? buf->max_caches * 2 : 16;
+		buf->caches = realloc(buf->caches,
+		                      sizeof(vm_call_cache_t *[buf->max_caches]));
+	}
+
+	buf->caches[buf->num_caches++] = cache;
+
+	emit_mov_imm(buf, RDX, (uintptr_t)cache);
+	// mov eax, [vm->code_epoch]; cmp eax, [cache->epoch]
+	emit_load_u32(buf, RAX, R12, offsetof(vm_t, code_epoch));
+	emit_mem(buf, false, 0x3b, RAX, RDX, offsetof(vm_call_cache_t, epoch));
+	size_t stale = emit_jump_rel(buf, CC_NE);
+
+	// unused entries hold a callee nothing is equal to
+	emit_load(buf, RAX, R14, offset * 8);
+
+	for (unsigned i = 0; i < VM_CALL_CACHE_WAYS; i++) {
+		emit_mem(buf, true, 0x3b, RAX, RDX,
+		         offsetof(vm_call_cache_t, entries[i].callee));
+		size_t next = emit_jump_rel(buf, CC_NE);
+		emit_load(buf, RSI, RDX, offsetof(vm_call_cache_t, entries[i].code));
+		hits[i] = emit_jump_rel(buf, CC_ALWAYS);
+		patch_here(buf, next);
+	}
+
+	patch_here(buf, stale);
+	// the miss returns to `retip` as if `code[retip - 1]` was the call
+	emit_save_state(buf, tail? ip : retip - 1);
+	emit_rr(buf, 0x89, R12, RDI);
+	emit_rr(buf, 0x89, RDX, RSI);
+	emit_mov_imm(buf, RDX, (uintptr_t)func);
+	emit_mov_imm(buf, RCX, arg);
+	emit_call(buf, native_call_miss);
+	emit_resume(buf);
+
+	for (unsigned i = 0; i < VM_CALL_CACHE_WAYS; i++) {
+		patch_here(buf, hits[i]);
+	}
+
+	// inc qword [cache->hits]
+	emit_mem(buf, true, 0xff, 0, RDX, offsetof(vm_call_cache_t, hits));
+
+	if (tail) {
+		// lea rcx, [r14 + offset * 8]; mov rdi, r14
+		emit_mem(buf, true, 0x8d, RCX, R14, offset * 8);
+		emit_rr(buf, 0x89, R14, RDI);
+
+		// copies [rcx, rbx) to rdi onwards
+		uint32_t loop = buf->len;
+		emit_rr(buf, 0x39, RBX, RCX);
+		size_t done = emit_jump_rel(buf, CC_AE);
+		emit_load(buf, R8, RCX, 0);
+		emit_store(buf, RDI, 0, R8);
+		// add rcx, 8; add rdi, 8
+		EMIT(buf, 0x48, 0x83, 0xc1, 0x08);
+		EMIT(buf, 0x48, 0x83, 0xc7, 0x08);
+		emit_jump_to(buf, CC_ALWAYS, loop);
+		patch_here(buf, done);
+		emit_rr(buf, 0x89, RDI, RBX);
+
+	} else {
+		// rcx = &vm->calls[vm->callp]
+		emit_load_u32(buf, RCX, R12, offsetof(vm_t, callp));
+		// shl rcx, 4
+		EMIT(buf, 0x48, 0xc1, 0xe1, 0x04);
+		emit_mem(buf, true, 0x03, RCX, R12, offsetof(vm_t, calls));
+
+		emit_load(buf, R8, R12, offsetof(vm_t, closure));
+		emit_store(buf, RCX, offsetof(vm_callframe_t, closure), R8);
+		// mov dword [rcx + ip], retip
+		emit_mem(buf, false, 0xc7, 0, RCX, offsetof(vm_callframe_t, ip));
+		emit_u32(buf, retip);
+		// the caller's fp: (r14 - r13) / 8
+		emit_rr(buf, 0x89, R14, R8);
+		emit_rr(buf, 0x29, R13, R8);
+		EMIT(buf, 0x49, 0xc1, 0xe8, 0x03);
+		emit_store_u32(buf, RCX, offsetof(vm_callframe_t, fp), R8);
+		// inc dword [vm->callp]
+		emit_mem(buf, false, 0xff, 0, R12, offsetof(vm_t, callp));
+
+		// lea r14, [r14 + offset * 8]
+		emit_mem(buf, true, 0x8d, R14, R14, offset * 8);
+	}
+
+	// and rax, ~SCM_MASK_HEAP
+	EMIT(buf, 0x48, 0x83, 0xe0, (uint8_t)~SCM_MASK_HEAP);
+	emit_store(buf, R12, offsetof(vm_t, closure), RAX);
+	emit_load(buf, R15, RAX, offsetof(scm_closure_t, closures));
+	// jmp rsi
+	EMIT(buf, 0xff, 0xe6);
+}
+
+static void emit_op(vm_t *vm, emit_buf_t *buf, scm_closure_t *closure, unsigned ip) {
+	vm_op_t *op = closure->lambda->code + ip;
+	uintptr_t arg = op->arg;
+	vm_func builtin = inline_builtin(op->func);
+
+	if (!op->func) {
+		// operand storage for the previous op, never executed
+
+	} else if (op->func == vm_op_stack_ref) {
+		emit_stack_ref(buf, arg, 0);
+		emit_adjust_sp(buf, 1);
+
+	} else if (op->func == vm_op_push_const) {
+		emit_mov_imm(buf, RAX, arg);
+		emit_store(buf, RBX, 0, RAX);
+		emit_adjust_sp(buf, 1);
+
+	} else if (op->func == vm_op_closure_ref) {
+		emit_closure_ref(buf, arg, 0);
+		emit_adjust_sp(buf, 1);
+
+	} else if (op->func == vm_op_box_ref) {
+		emit_load(buf, RAX, R14, arg * 8);
+		emit_load(buf, RAX, RAX, BOX_VALUE);
+		emit_store(buf, RBX, 0, RAX);
+		emit_adjust_sp(buf, 1);
+
+	} else if (op->func == vm_op_box_set) {
+		emit_load(buf, RAX, R14, arg * 8);
+
+		// the first write since the last collection is remembered by
+		// vm_op_box_set()
+		// cmp byte [rax + remembered], 0
+		emit_mem(buf, false, 0x80, 7, RAX, BOX_REMEMBERED);
+		emit_byte(buf, 0);
+		size_t unremembered = emit_jump_rel(buf, CC_E);
+
+		// the value is left on the stack as the result
+		emit_load(buf, RCX, RBX, -8);
+		emit_store(buf, RAX, BOX_VALUE, RCX);
+		emit_jump_op(buf, CC_ALWAYS, ip + 1);
+
+		patch_here(buf, unremembered);
+		emit_generic(buf, op, ip);
+
+	} else if (op->func == vm_op_drop) {
+		emit_adjust_sp(buf, -1);
+
+	} else if (op->func == vm_op_slide) {
+		emit_load(buf, RAX, RBX, -8);
+		emit_store(buf, RBX, -8 - (int32_t)arg * 8, RAX);
+		emit_adjust_sp(buf, -(int)arg);
+
+	} else if (op->func == vm_op_stack_set) {
+		emit_load(buf, RAX, RBX, -8);
+		emit_store(buf, R14, arg * 8, RAX);
+
+	} else if (op->func == vm_op_set_sp) {
+		// lea rbx, [r14 + arg * 8]
+		emit_mem(buf, true, 0x8d, RBX, R14, arg * 8);
+
+	} else if (op->func == vm_op_closure_set) {
+		emit_load(buf, RAX, R15, arg * sizeof(env_node_t *));
+
+		// variables other code relies on go through vm_op_closure_set(),
+		// and so does the first write since the last collection
+		// cmp byte [rax + watched], 0
+		emit_mem(buf, false, 0x80, 7, RAX, offsetof(env_node_t, watched));
+		emit_byte(buf, 0);
+		size_t watched = emit_jump_rel(buf, CC_NE);
+		// cmp byte [rax + remembered], 0
+		emit_mem(buf, false, 0x80, 7, RAX, offsetof(env_node_t, remembered));
+		emit_byte(buf, 0);
+		size_t unremembered = emit_jump_rel(buf, CC_E);
+
+		emit_load(buf, RCX, RBX, -8);
+		emit_store(buf, RAX, offsetof(env_node_t, value), RCX);
+		// inc dword [rax + writes]
+		emit_mem(buf, false, 0xff, 0, RAX, offsetof(env_node_t, writes));
+		emit_jump_op(buf, CC_ALWAYS, ip + 1);
+
+		patch_here(buf, watched);
+		patch_here(buf, unremembered);
+		emit_generic(buf, op, ip);
+
+	} else if (op->func == vm_op_stack_ref2) {
+		emit_stack_ref(buf, vm_arg_low(arg), 0);
+		emit_stack_ref(buf, vm_arg_high(arg), 1);
+		emit_adjust_sp(buf, 2);
+
+	} else if (op->func == vm_op_closure_ref2) {
+		emit_closure_ref(buf, vm_arg_low(arg), 0);
+		emit_closure_ref(buf, vm_arg_high(arg), 1);
+		emit_adjust_sp(buf, 2);
+
+	} else if (op->func == vm_op_closure_stack_ref) {
+		emit_closure_ref(buf, vm_arg_low(arg), 0);
+		emit_stack_ref(buf, vm_arg_high(arg), 1);
+		emit_adjust_sp(buf, 2);
+
+	} else if (op->func == vm_op_jump) {
+		emit_jump_op(buf, CC_ALWAYS, arg);
+
+	} else if (op->func == vm_op_jump_if_false) {
+		emit_adjust_sp(buf, -1);
+		// cmp qword [rbx], false
+		emit_mem(buf, true, 0x81, 7, RBX, 0);
+		emit_u32(buf, tag_boolean(false));
+		emit_jump_op(buf, CC_E, arg);
+
+	} else if (op->func == vm_op_self_tail_guard
+	           || op->func == vm_op_loop_guard)
+	{
+		size_t hot = 0;
+
+		if (op->func == vm_op_loop_guard) {
+			// mov edx, [lambda->back_edges]; inc edx
+			emit_mov_imm(buf, RAX, (uintptr_t)&closure->lambda->back_edges);
+			emit_mem(buf, false, 0x8b, RDX, RAX, 0);
+			EMIT(buf, 0xff, 0xc2);
+
+			// hot loops are moved over to optimized code by
+			// vm_op_loop_guard(), a threshold of 0 wraps around to
+			// never being reached:
+			// mov ecx, [vm->tiers.optimize_loops]; dec ecx; cmp ecx, edx
+			emit_mem(buf, false, 0x8b, RCX, R12,
+			         offsetof(vm_t, tiers.optimize_loops));
+			EMIT(buf, 0xff, 0xc9);
+			EMIT(buf, 0x39, 0xd1);
+			hot = emit_jump_rel(buf, CC_B);
+
+			// mov [lambda->back_edges], edx
+			emit_mem(buf, false, 0x89, RDX, RAX, 0);
+		}
+
+		// the loop was already counted, so don't go through loop_guard
+		vm_op_t guard = { vm_op_self_tail_guard, arg };
+
+		size_t fail = emit_self_guard(buf, arg);
+		emit_jump_op(buf, CC_ALWAYS, ip + 1);
+		patch_here(buf, fail);
+		emit_generic(buf, &guard, ip);
+
+		if (hot) {
+			patch_here(buf, hot);
+			emit_generic(buf, op, ip);
+		}
+
+	} else if (op->func == vm_op_store_args) {
+		unsigned nparams = vm_arg_low(arg);
+		int slot = 0;
+
+		for (unsigned i = nparams; i > 0; i--) {
+			if (!vm_tail_skipped(arg, i - 1)) {
+				emit_load(buf, RAX, RBX, --slot * 8);
+				emit_store(buf, R14, i * 8, RAX);
+			}
+		}
+
+		// lea rbx, [r14 + (nparams + 1) * 8]
+		emit_mem(buf, true, 0x8d, RBX, R14, (nparams + 1) * 8);
+		emit_jump_op(buf, CC_ALWAYS, closure->lambda->code[ip + 1].arg);
+
+	} else if (op->func == vm_op_fold_guard) {
+		emit_fold_guard(buf, op, ip);
+
+	} else if (op->func == vm_op_do_call || op->func == vm_op_do_tailcall) {
+		emit_cached_call(vm, buf, ip, arg, ip + 1, op->func, arg);
+
+	} else if (op->func == vm_op_stack_ref_call) {
+		emit_stack_ref(buf, vm_arg_low(arg), 0);
+		emit_adjust_sp(buf, 1);
+		emit_cached_call(vm, buf, ip, vm_arg_high(arg), ip + 1,
+		                 vm_op_do_call, vm_arg_high(arg));
+
+	} else if (op->func == vm_op_ref_const_call) {
+		// the constant is in the data op which follows
+		emit_stack_ref(buf, vm_arg_low(arg), 0);
+		emit_mov_imm(buf, RAX, closure->lambda->code[ip + 1].arg);
+		emit_store(buf, RBX, 8, RAX);
+		emit_adjust_sp(buf, 2);
+		emit_cached_call(vm, buf, ip, vm_arg_high(arg), ip + 2,
+		                 vm_op_do_call, vm_arg_high(arg));
+
+	} else if (builtin && vm_is_builtin(closure->closures[arg]->value, builtin)) {
+		emit_inline_op(buf, closure, ip, closure->closures[arg]->value);
+
+	} else {
+		emit_generic(buf, op, ip);
+	}
+}
+
+// lowered through whichever closure runs the code first, builtins it
+// refers to are still guarded for the others
+static vm_native_t *native_lower(vm_t *vm, scm_closure_t *closure) {
+	emit_buf_t buf;
+	unsigned num_ops = closure->lambda->num_ops;
+	uint32_t *offsets = calloc(1, sizeof(uint32_t[num_ops]));
+
+	memset(&buf, 0, sizeof(buf));
+
+	// entry point: push callee-saved registers, load the state and jump
+	// to the target address passed in rsi
+	EMIT(&buf, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+	emit_rr(&buf, 0x89, RDI, R12);
+	emit_load_state(&buf);
+	EMIT(&buf, 0xff, 0xe6);
+
+	buf.epilogue = buf.len;
+	EMIT(&buf, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+
+	for (unsigned ip = 0; ip < num_ops; ip++) {
+		offsets[ip] = buf.len;
+		emit_op(vm, &buf, closure, ip);
+	}
+
+	for (size_t i = 0; i < buf.num_fixups; i++) {
+		emit_fixup_t *fixup = buf.fixups + i;
+		patch_u32(&buf, fixup->pos, offsets[fixup->target] - (fixup->pos + 4));
+	}
+
+	uint8_t *code = mmap(NULL, buf.len, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (code == MAP_FAILED) {
+		free(buf.data);
+		free(buf.fixups);
+		free(buf.caches);
+		free(offsets);
+		return &native_failed;
+	}
+
+	memcpy(code, buf.data, buf.len);
+	mprotect(code, buf.len, PROT_READ | PROT_EXEC);
+
+	vm_native_t *ret = calloc(1, sizeof(vm_native_t));
+	ret->code       = code;
+	ret->size       = buf.len;
+	ret->offsets    = offsets;
+	ret->caches     = buf.caches;
+	ret->num_caches = buf.num_caches;
+
+	free(buf.data);
+	free(buf.fixups);
+
+	return ret;
+}
+
+// bytes the machine code of `lambda` takes up, it's mapped in whole pages
+size_t vm_native_size(vm_lambda_t *lambda) {
+	vm_native_t *native = lambda->native;
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (!native || native == &native_failed) {
+		return 0;
+	}
+
+	return (native->size + page - 1) / page * page
+	     + sizeof(uint32_t[lambda->num_ops])
+	     + sizeof(vm_call_cache_t[native->num_caches]);
+}
+
+// frees the machine code of `lambda`, and the caches of its call sites
+void vm_native_free(vm_t *vm, vm_lambda_t *lambda) {
+	vm_native_t *native = lambda->native;
+
+	if (!native || native == &native_failed) {
+		return;
+	}
+
+	for (size_t i = 0; i < native->num_caches; i++) {
+		vm_call_cache_unlink(vm, native->caches[i]);
+		free(native->caches[i]);
+	}
+
+	munmap(native->code, native->size);
+	free(native->caches);
+	free(native->offsets);
+	free(native);
+	lambda->native = NULL;
+}
+
+static inline vm_native_t *native_code(vm_t *vm, scm_closure_t *closure) {
+	vm_lambda_t *lambda = closure->lambda;
+
+	if (!lambda->native) {
+		lambda->native = native_lower(vm, closure);
+	}
+
+	return (lambda->native != &native_failed)? lambda->native : NULL;
+}
+
+static const void *vm_native_resume(vm_t *vm) {
+	if (!vm->running || vm->runmode != RUN_MODE_COMPILED) {
+		return NULL;
+	}
+
+	vm_native_t *native = native_code(vm, vm->closure);
+
+	return native? native->code + native->offsets[vm->ip] : NULL;
+}
+
+bool vm_run_native(vm_t *vm) {
+	const void *target = vm_native_resume(vm);
+
+	if (!target) {
+		return false;
+	}
+
+	// runs until control leaves native code
+	native_entry_t entry = (native_entry_t)vm->closure->lambda->native->code;
+	entry(vm, target);
+
+	return true;
+}
+
+#endif
@@ -5,16 +5,33 @@
 #include <nscheme/write.h>
 
 #include <stdlib.h>
+#include <string.h>
+
+// makes a closure for a builtin, which runs `func` followed by `next`
+// if it isn't NULL
+scm_closure_t *vm_make_builtin(vm_func func, vm_func next) {
+	scm_closure_t *ret = calloc(1, sizeof(scm_closure_t));
+	vm_lambda_t *lambda = calloc(1, sizeof(vm_lambda_t));
+
+	lambda->num_ops = next? 2 : 1;
+	lambda->code = calloc(1, sizeof(vm_op_t[lambda->num_ops]));
+	lambda->code[0].func = func;
+
+	if (next) {
+		lambda->code[1].func = next;
+	}
+
+	lambda->compiled = true;
+	ret->lambda = lambda;
+
+	return ret;
+}
 
 scm_value_t vm_func_return_last(void) {
 	static scm_closure_t *ret = NULL;
 
 	if (!ret) {
-		ret = calloc(1, sizeof(scm_closure_t));
-		ret->code = calloc(1, sizeof(vm_op_t[1]));
-
-		ret->compiled = true;
-		ret->code[0].func = vm_op_return_last;
+		ret = vm_make_builtin(vm_op_return_last, NULL);
 	}
 
 	return tag_closure(ret);
@@ -24,12 +41,7 @@ scm_value_t vm_func_intern_define(void) {
 	static scm_closure_t *ret = NULL;
 
 	if (!ret) {
-		ret = calloc(1, sizeof(scm_closure_t));
-		ret->code = calloc(1, sizeof(vm_op_t[2]));
-
-		ret->compiled = true;
-		ret->code[0].func = vm_op_intern_define;
-		ret->code[1].func = vm_op_return;
+		ret = vm_make_builtin(vm_op_intern_define, vm_op_return);
 	}
 
 	return tag_closure(ret);
@@ -39,12 +51,7 @@ scm_value_t vm_func_intern_set(void) {
 	static scm_closure_t *ret = NULL;
 
 	if (!ret) {
-		ret = calloc(1, sizeof(scm_closure_t));
-		ret->code = calloc(1, sizeof(vm_op_t[2]));
-
-		ret->compiled = true;
-		ret->code[0].func = vm_op_intern_set;
-		ret->code[1].func = vm_op_return;
+		ret = vm_make_builtin(vm_op_intern_set, vm_op_return);
 	}
 
 	return tag_closure(ret);
@@ -54,12 +61,7 @@ scm_value_t vm_func_intern_if(void) {
 	static scm_closure_t *ret = NULL;
 
 	if (!ret) {
-		ret = calloc(1, sizeof(scm_closure_t));
-		ret->code = calloc(1, sizeof(vm_op_t[2]));
-
-		ret->compiled = true;
-		ret->code[0].func = vm_op_intern_if;
-		ret->code[1].func = vm_op_return;
+		ret = vm_make_builtin(vm_op_intern_if, vm_op_return);
 	}
 
 	return tag_closure(ret);
@@ -84,45 +86,292 @@ static void vm_load_lambda_args(vm_t *vm, unsigned argnum, scm_value_t args) {
 	}
 }
 
+/*
+ * Lambdas are run by the tree walker until their closures have been called
+ * `tiers.compile_calls` times, then compiled to baseline code. Baseline
+ * code is recompiled by the optimizing tier once it's been called
+ * `tiers.optimize_calls` times or has looped `tiers.optimize_loops` times,
+ * using the guard failures it recorded.
+ *
+ * Call frames still returning into the code being replaced are moved over
+ * to copies of their closures which keep it. That code isn't freed, since
+ * it might be what's running right now, but lambdas only move up twice.
+ */
+bool vm_tier_up(vm_t *vm, scm_closure_t *clsr, unsigned tier) {
+	vm_lambda_t *lambda = clsr->lambda;
+
+	if (lambda->compiled && lambda->tier >= tier) {
+		// compiled through another closure in the meantime
+		return vm_bind_closure(vm, clsr);
+	}
+
+	if (lambda->compile_failures >= VM_MAX_COMPILE_FAILURES) {
+		return false;
+	}
+
+	// recompiled code keeps the slot layout of the code it replaces, so
+	// that closures made by INSTR_MAKE_CLOSURE still fit it
+	if (lambda->compiled && !vm_bind_closure(vm, clsr)) {
+		return false;
+	}
+
+	vm_lambda_t old = *lambda;
+	scm_closure_t old_clsr = *clsr;
+
+	if (!vm_compile_closure(vm, clsr, tier)) {
+		// some of the variables it refers to might not be defined yet,
+		// so try again later
+		vm_count_compile_failure(vm, lambda);
+		lambda->num_calls = 0;
+		return false;
+	}
+
+	if (old.compiled) {
+		// call sites might have cached the old code
+		vm->code_epoch++;
+
+		vm_lambda_t *copy = NULL;
+		scm_closure_t *last = NULL;
+		scm_closure_t *last_copy = NULL;
+
+		for (unsigned i = 0; i < vm->callp; i++) {
+			vm_callframe_t *frame = vm->calls + i;
+
+			if (frame->closure->lambda != lambda || frame->ip == VM_FRAME_INTERP) {
+				continue;
+			}
+
+			if (!copy) {
+				copy = malloc(sizeof(vm_lambda_t));
+				*copy = old;
+				gc_remember_lambda(&vm->gc, copy);
+			}
+
+			// recursive calls leave runs of frames for the same closure
+			if (frame->closure != last) {
+				last = frame->closure;
+				last_copy = malloc(sizeof(scm_closure_t));
+				*last_copy = (last == clsr)? old_clsr : *last;
+				last_copy->lambda  = copy;
+				last_copy->effects = NULL;
+			}
+
+			frame->closure = last_copy;
+		}
+
+		if (!copy) {
+			free(old.guard_misses);
+			free(old.stable_vars);
+		}
+	}
+
+	lambda->direct_code = NULL;
+	lambda->native      = NULL;
+	lambda->num_calls   = 0;
+	lambda->back_edges  = 0;
+
+	return true;
+}
+
+/*
+ * Closures made from a lambda compiled through another closure look up
+ * the variables the code refers to in their own environment. Returns
+ * false if some of them can't be found there, the closure is run by the
+ * tree walker then.
+ */
+bool vm_bind_closure(vm_t *vm, scm_closure_t *clsr) {
+	vm_lambda_t *lambda = clsr->lambda;
+
+	if (clsr->bound == lambda->varnames) {
+		return true;
+	}
+
+	env_node_t **closures = vm_alloc_tenured(vm, sizeof(env_node_t *[lambda->num_slots]));
+
+	for (unsigned i = 0; i < lambda->num_slots; i++) {
+		closures[i] = env_find_recurse(clsr->env, lambda->varnames[i]);
+
+		if (!closures[i]) {
+			return false;
+		}
+
+		// the code has the value of another variable built in
+		if (lambda->stable_vars && lambda->stable_vars[i]
+		    && closures[i] != lambda->stable_vars[i])
+		{
+			return false;
+		}
+	}
+
+	clsr->closures  = closures;
+	clsr->num_slots = lambda->num_slots;
+	clsr->bound     = lambda->varnames;
+
+	return true;
+}
+
+/*
+ * Optimized code can have the values of global variables which were never
+ * written to after being defined built in, see use_stable_global() in
+ * optimize.c. Each variable it relies on is watched, and writing to one
+ * throws the code out, the lambda then works its way up the tiers again.
+ */
+void vm_watch_var(vm_t *vm, env_node_t *var, scm_closure_t *clsr) {
+	vm_var_watch_t *watch = malloc(sizeof(vm_var_watch_t));
+
+	watch->var    = var;
+	watch->lambda = clsr->lambda;
+	watch->code   = clsr->lambda->code;
+	watch->next   = vm->var_watches;
+
+	vm->var_watches = watch;
+	var->watched = true;
+}
+
+// called after `var` was written to while watched
+void vm_var_written(vm_t *vm, env_node_t *var) {
+	vm_var_watch_t **link = &vm->var_watches;
+
+	var->watched = false;
+
+	while (*link) {
+		vm_var_watch_t *watch = *link;
+		vm_lambda_t *lambda = watch->lambda;
+
+		// code which was replaced in the meantime doesn't need watching
+		bool stale = !lambda->compiled || lambda->code != watch->code;
+
+		if (!stale && watch->var != var) {
+			link = &watch->next;
+			continue;
+		}
+
+		*link = watch->next;
+		free(watch);
+
+		if (stale) {
+			continue;
+		}
+
+		// only code which doesn't write anything relies on variables, so
+		// the write can't happen while it's running. top level bodies are
+		// compiled with it too, and only run once, so nothing is compiled
+		// again until it's called
+		free(lambda->stable_vars);
+		lambda->stable_vars = NULL;
+		lambda->compiled    = false;
+		lambda->tier        = VM_TIER_INTERP;
+		lambda->num_calls   = 0;
+		vm->code_epoch++;
+		vm->compile_stats.stable_writes++;
+	}
+}
+
+/*
+ * Frees `lambda` along with its code, in each engine's form of it. Only
+ * top level bodies are freed, by the collector once nothing runs them,
+ * the lambdas of lambda expressions are kept in `vm->lambdas`. Closures
+ * made by the code have those, so only the prototypes they're made from
+ * go with it. Variable watches on the code have to be dropped before.
+ */
+void vm_free_lambda(vm_t *vm, vm_lambda_t *lambda) {
+	for (unsigned i = 0; i < lambda->num_ops; i++) {
+		vm_op_t *op = lambda->code + i;
+		bool last = op->func == vm_op_make_closure;
+
+		// the same prototype can be made at more than one op
+		for (unsigned k = i + 1; last && k < lambda->num_ops; k++) {
+			last = lambda->code[k].func != vm_op_make_closure
+			    || lambda->code[k].arg != op->arg;
+		}
+
+		if (last) {
+			free((void *)op->arg);
+		}
+	}
+
+#ifdef VM_HAVE_DIRECT_THREADING
+	vm_direct_free(vm, lambda);
+#endif
+#ifdef VM_HAVE_NATIVE_JIT
+	vm_native_free(vm, lambda);
+#endif
+
+	free(lambda->code);
+	free(lambda->fold_guard);
+	free(lambda->varnames);
+	free(lambda->guard_misses);
+	free(lambda->arg_types);
+	free(lambda->stable_vars);
+	free(lambda->osr_entries);
+	free(lambda);
+}
+
+// runs the body of `clsr` with the tree walker, taking the arguments on
+// the stack above `vm->fp`
+static inline void vm_interp_closure(vm_t *vm, scm_closure_t *clsr) {
+	unsigned called_args = vm_argnum(vm);
+
+	vm->runmode = RUN_MODE_INTERP;
+	vm->env = env_create(clsr->env);
+	vm->ptr = clsr->lambda->definition;
+	vm->sp  = vm->fp;
+
+	vm_load_lambda_args(vm, called_args, clsr->lambda->args);
+	vm_stack_push(vm, vm_func_return_last());
+}
+
+static inline bool vm_should_compile(vm_t *vm, vm_lambda_t *lambda) {
+	return vm->tiers.eager
+	    || (vm->tiers.compile_calls
+	        && lambda->num_calls >= vm->tiers.compile_calls);
+}
+
+static inline bool vm_should_optimize(vm_t *vm, vm_lambda_t *lambda) {
+	return (vm->tiers.optimize_calls
+	        && lambda->num_calls >= vm->tiers.optimize_calls)
+	    || vm_loop_is_hot(vm, lambda->back_edges);
+}
+
 void vm_call_apply(vm_t *vm) {
-	scm_value_t func = vm->stack[vm->sp - vm->argnum];
+	scm_value_t func = vm->stack[vm->fp];
 
 	if (is_closure(func)) {
 		scm_closure_t *clsr = get_closure(func);
+		vm_lambda_t *lambda = clsr->lambda;
 		/*
 		printf( "    applying %s closure: %p\n",
-			((char *[]){"interpreted", "compiled"})[clsr->compiled],
+			((char *[]){"interpreted", "compiled"})[lambda->compiled],
 			clsr );
 			*/
 
+		if (!lambda->compiled) {
+			lambda->num_calls++;
+
+			if (vm_should_compile(vm, lambda)) {
+				vm_tier_up(vm, clsr, VM_TIER_BASELINE);
+			}
+
+		} else if (lambda->tier == VM_TIER_BASELINE) {
+			lambda->num_calls++;
+
+			if (vm_should_optimize(vm, lambda)) {
+				vm_tier_up(vm, clsr, VM_TIER_OPTIMIZED);
+			}
+		}
+
 		vm->closure = clsr;
 
-		if (clsr->compiled) {
+		if (lambda->compiled && vm_bind_closure(vm, clsr)) {
 			vm->runmode = RUN_MODE_COMPILED;
 			vm->ip = 0;
 
 		} else {
-			unsigned called_args = vm->argnum;
-
-			vm->runmode = RUN_MODE_INTERP;
-			vm->env = env_create(clsr->env);
-			vm->ptr = clsr->definition;
-			vm->sp -= vm->argnum;
-			vm->argnum = 0;
-			clsr->num_calls++;
-
-			if (clsr->num_calls >= 3) {
-				if (!vm_compile_closure(vm, clsr)) {
-					return;
-				}
-			}
-
-			vm_load_lambda_args(vm, called_args, clsr->args);
-			vm_stack_push(vm, vm_func_return_last());
+			vm_interp_closure(vm, clsr);
 		}
 
 	} else if (func == tag_run_type(RUN_TYPE_SET_PTR)) {
-		if (vm->argnum != 2) {
+		if (vm_argnum(vm) != 2) {
 			puts("    can't eval with given arguments");
 			vm_error(vm, "can't eval");
 			return;
@@ -141,6 +390,74 @@ void vm_call_apply(vm_t *vm) {
 	}
 }
 
+static inline void vm_call_cache_clear(vm_call_cache_t *cache) {
+	for (unsigned i = 0; i < VM_CALL_CACHE_WAYS; i++) {
+		cache->entries[i].callee = VM_CALL_CACHE_EMPTY;
+		cache->entries[i].code   = NULL;
+	}
+
+	cache->num_entries = 0;
+}
+
+// caches are set up for each call site when the engines decode or lower
+// the code, and kept for as long as the code
+void vm_call_cache_init(vm_t *vm, vm_call_cache_t *cache) {
+	memset(cache, 0, sizeof(vm_call_cache_t));
+	vm_call_cache_clear(cache);
+	cache->epoch = vm->code_epoch;
+	cache->next  = vm->call_caches;
+
+	if (cache->next) {
+		cache->next->prev = cache;
+	}
+
+	vm->call_caches = cache;
+}
+
+// called before the code `cache` is in is freed, what it counted is still
+// shown by the stats
+void vm_call_cache_unlink(vm_t *vm, vm_call_cache_t *cache) {
+	if (cache->prev) {
+		cache->prev->next = cache->next;
+
+	} else {
+		vm->call_caches = cache->next;
+	}
+
+	if (cache->next) {
+		cache->next->prev = cache->prev;
+	}
+
+	vm->compile_stats.freed_hits   += cache->hits;
+	vm->compile_stats.freed_misses += cache->misses;
+}
+
+// remembers that `callee`, which vm_call_cacheable() is true for, has its
+// code at `code` in the engine's form. caches start over after code is
+// thrown out, except at megamorphic sites
+void vm_call_cache_fill(vm_t *vm, vm_call_cache_t *cache,
+                        scm_value_t callee, const void *code)
+{
+	if (cache->epoch != vm->code_epoch) {
+		vm_call_cache_clear(cache);
+		cache->epoch = vm->code_epoch;
+	}
+
+	if (cache->megamorphic) {
+		return;
+	}
+
+	if (cache->num_entries == VM_CALL_CACHE_WAYS) {
+		vm_call_cache_clear(cache);
+		cache->megamorphic = true;
+		return;
+	}
+
+	cache->entries[cache->num_entries].callee = callee;
+	cache->entries[cache->num_entries].code   = code;
+	cache->num_entries++;
+}
+
 bool vm_op_return(vm_t *vm, uintptr_t arg) {
 	vm_call_return(vm);
 
@@ -148,7 +465,7 @@ bool vm_op_return(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_return_last(vm_t *vm, uintptr_t arg) {
-	vm->stack[vm->sp - vm->argnum] = vm_stack_pop(vm);
+	vm->stack[vm->fp] = vm_stack_pop(vm);
 	vm_call_return(vm);
 
 	return false;
@@ -180,13 +497,7 @@ bool vm_op_closure_ref(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_stack_ref(vm_t *vm, uintptr_t arg) {
-	// TODO: maybe find another way to do this that doesn't require
-	//       the temporary index variable, eg. storing the 'base'
-	//       stack index from the call frame in the vm struct
-	uintptr_t index   = vm->sp - vm->argnum + arg;
-	scm_value_t value = vm->stack[index];
-
-	vm_stack_push(vm, value);
+	vm_stack_push(vm, vm->stack[vm->fp + arg]);
 
 	return true;
 }
@@ -196,47 +507,716 @@ bool vm_op_push_const(vm_t *vm, uintptr_t arg) {
 	return true;
 }
 
-bool vm_op_do_call(vm_t *vm, uintptr_t arg) {
-	vm_callframe_t *frame = vm->calls + vm->callp++;
+// assigned variables on the stack are kept in boxes, see INSTR_BOX in
+// compiler.h
+bool vm_op_box(vm_t *vm, uintptr_t arg) {
+	env_node_t *box = calloc(1, sizeof(env_node_t));
+
+	box->value = vm->stack[vm->fp + arg];
+	env_write_barrier(box);
+	gc_own_variable(&vm->gc, box);
+	vm->stack[vm->fp + arg] = vm_tag_box(box);
+	vm_check_owned(vm);
+
+	return true;
+}
+
+bool vm_op_box_ref(vm_t *vm, uintptr_t arg) {
+	vm_stack_push(vm, vm_get_box(vm->stack[vm->fp + arg])->value);
+
+	return true;
+}
+
+// assignments leave the value on the stack as the result of the set!
+bool vm_op_box_set(vm_t *vm, uintptr_t arg) {
+	env_node_t *box = vm_get_box(vm->stack[vm->fp + arg]);
+
+	box->value = vm->stack[vm->sp - 1];
+	env_write_barrier(box);
+
+	return true;
+}
+
+bool vm_op_closure_set(vm_t *vm, uintptr_t arg) {
+	env_node_t *var = vm->closure->closures[arg];
+
+	var->value = vm->stack[vm->sp - 1];
+	var->writes++;
+	env_write_barrier(var);
+
+	if (var->watched) {
+		vm_var_written(vm, var);
+	}
+
+	return true;
+}
+
+bool vm_op_box_init(vm_t *vm, uintptr_t arg) {
+	env_node_t *box = vm_get_box(vm->stack[vm->fp + arg]);
+
+	box->value = vm_stack_pop(vm);
+	env_write_barrier(box);
+
+	return true;
+}
+
+// discards the value of an expression which is only run for its effects
+bool vm_op_drop(vm_t *vm, uintptr_t arg) {
+	vm->sp--;
+
+	return true;
+}
+
+// the value of an inlined procedure's body replaces its `arg` arguments
+bool vm_op_slide(vm_t *vm, uintptr_t arg) {
+	vm->stack[vm->sp - 1 - arg] = vm->stack[vm->sp - 1];
+	vm->sp -= arg;
+
+	return true;
+}
+
+// stores the value on top of the stack into slot `arg` of the frame too
+bool vm_op_stack_set(vm_t *vm, uintptr_t arg) {
+	vm->stack[vm->fp + arg] = vm->stack[vm->sp - 1];
+
+	return true;
+}
+
+// drops everything above slot `arg` of the frame
+bool vm_op_set_sp(vm_t *vm, uintptr_t arg) {
+	vm->sp = vm->fp + arg;
+
+	return true;
+}
+
+/*
+ * Throws out the optimized code of the running closure, which is at the
+ * start of its code with only the arguments on the stack. The call goes on
+ * in the tree walker, and the lambda is recompiled without the assumptions
+ * which failed.
+ *
+ * Frames further up the stack which are in the old code keep running it,
+ * see vm_tier_up().
+ */
+static void vm_deoptimize(vm_t *vm) {
+	scm_closure_t *clsr = vm->closure;
+	vm_lambda_t *lambda = clsr->lambda;
+
+	lambda->deopts++;
+	lambda->tier = VM_TIER_BASELINE;
+	vm_tier_up(vm, clsr, VM_TIER_OPTIMIZED);
+
+	vm_interp_closure(vm, clsr);
+}
 
-	unsigned start  = vm->sp - vm->argnum + arg;
-	unsigned argnum = vm->sp - start;
+// the first op of code which folded calls to builtins, see optimize_tree()
+bool vm_op_fold_guard(vm_t *vm, uintptr_t arg) {
+	vm_fold_guard_t *guard = (vm_fold_guard_t *)arg;
+
+	if (vm_fold_guard_holds(vm->closure, guard)
+	    && vm_fixnum_args_hold(vm->stack + vm->fp + 1, guard->fixnum_args))
+	{
+		return true;
+	}
+
+	vm_deoptimize(vm);
+	return false;
+}
+
+// the first op of baseline code, records the types of the `arg` arguments
+// for the optimizing tier
+bool vm_op_profile_args(vm_t *vm, uintptr_t arg) {
+	uint8_t *types = vm->closure->lambda->arg_types;
+
+	for (unsigned i = 0; i < arg; i++) {
+		types[i] |= vm_value_type(vm->stack[vm->fp + 1 + i]);
+	}
+
+	return true;
+}
+
+/*
+ * Makes a flat closure of a lambda nested in the running code, `arg` is a
+ * vm_closure_proto_t. Values on the stack are copied into new variables,
+ * unless they're assigned to and so boxed, and closure slots are shared
+ * with the running closure. There's no environment chain to look anything
+ * else up in, `env` is only kept for the names of special forms. The
+ * collector frees the closure and the new variables once they're dead.
+ */
+bool vm_op_make_closure(vm_t *vm, uintptr_t arg) {
+	vm_closure_proto_t *proto = (vm_closure_proto_t *)arg;
+	vm_lambda_t *lambda = proto->lambda;
+	// allocating can collect, which would free the closure and its
+	// variables before they're on the stack
+	env_node_t **closures = vm_alloc_tenured(vm, sizeof(env_node_t *[proto->num_slots]));
+	scm_closure_t *clsr = calloc(1, sizeof(scm_closure_t));
+
+	for (unsigned i = 0; i < proto->num_slots; i++) {
+		vm_capture_t *capture = proto->slots + i;
+
+		if (capture->type == VM_CAPTURE_STACK) {
+			env_node_t *var = calloc(1, sizeof(env_node_t));
+
+			var->key   = lambda->varnames[i];
+			var->value = vm->stack[vm->fp + capture->index];
+			env_write_barrier(var);
+			gc_own_variable(&vm->gc, var);
+			closures[i] = var;
+
+		} else if (capture->type == VM_CAPTURE_BOX) {
+			closures[i] = vm_get_box(vm->stack[vm->fp + capture->index]);
+
+		} else {
+			closures[i] = vm->closure->closures[capture->index];
+		}
+	}
+
+	clsr->lambda    = lambda;
+	clsr->closures  = closures;
+	clsr->num_slots = proto->num_slots;
+	clsr->bound     = lambda->varnames;
+	clsr->env       = vm->closure->env;
+	gc_own_closure(&vm->gc, clsr);
+
+	vm_stack_push(vm, tag_closure(clsr));
+	vm_check_owned(vm);
+	return true;
+}
+
+// pushes a call frame returning to `retip`, and applies the function
+// at stack offset `offset` in the current frame
+static inline void vm_do_call(vm_t *vm, uintptr_t offset, unsigned retip) {
+	vm_callframe_t *frame = vm->calls + vm->callp++;
 
 	frame->closure = vm->closure;
-	frame->ip      = vm->ip + 1;
-	frame->sp      = start;
-	frame->argnum  = vm->argnum - argnum;
-	frame->runmode = vm->runmode;
+	frame->ip      = retip;
+	frame->fp      = vm->fp;
 
-	vm->argnum = argnum;
+	vm->fp += offset;
 
 	vm_call_apply(vm);
+}
+
+bool vm_op_do_call(vm_t *vm, uintptr_t arg) {
+	vm_do_call(vm, arg, vm->ip + 1);
 
 	return false;
 }
 
-bool vm_op_do_tailcall(vm_t *vm, uintptr_t arg) {
-	unsigned newstart  = vm->sp - vm->argnum + arg;
+static inline void vm_do_tailcall(vm_t *vm, uintptr_t arg) {
+	unsigned newstart  = vm->fp + arg;
 	unsigned newargnum = vm->sp - newstart;
-	unsigned start     = vm->sp - vm->argnum;
 
 	for (unsigned i = 0; i < newargnum; i++) {
-		vm->stack[start + i] = vm->stack[newstart + i];
+		vm->stack[vm->fp + i] = vm->stack[newstart + i];
 	}
 
-	vm->sp     = start + newargnum;
-	vm->argnum = newargnum;
-	vm->ip     = 0;
+	vm->sp = vm->fp + newargnum;
+	vm->ip = 0;
 
 	vm_call_apply(vm);
+}
+
+bool vm_op_do_tailcall(vm_t *vm, uintptr_t arg) {
+	vm_do_tailcall(vm, arg);
+
+	return false;
+}
+
+bool vm_op_stack_ref2(vm_t *vm, uintptr_t arg) {
+	vm_stack_push(vm, vm->stack[vm->fp + vm_arg_low(arg)]);
+	vm_stack_push(vm, vm->stack[vm->fp + vm_arg_high(arg)]);
+
+	return true;
+}
+
+bool vm_op_closure_ref2(vm_t *vm, uintptr_t arg) {
+	env_node_t **closures = vm->closure->closures;
+
+	vm_stack_push(vm, closures[vm_arg_low(arg)]->value);
+	vm_stack_push(vm, closures[vm_arg_high(arg)]->value);
+
+	return true;
+}
+
+bool vm_op_closure_stack_ref(vm_t *vm, uintptr_t arg) {
+	vm_stack_push(vm, vm->closure->closures[vm_arg_low(arg)]->value);
+	vm_stack_push(vm, vm->stack[vm->fp + vm_arg_high(arg)]);
+
+	return true;
+}
+
+bool vm_op_stack_ref_call(vm_t *vm, uintptr_t arg) {
+	vm_stack_push(vm, vm->stack[vm->fp + vm_arg_low(arg)]);
+	vm_do_call(vm, vm_arg_high(arg), vm->ip + 1);
+
+	return false;
+}
+
+// the constant is stored in the arg of the following (data) op,
+// so the call returns past it
+bool vm_op_ref_const_call(vm_t *vm, uintptr_t arg) {
+	scm_value_t constant = vm->closure->lambda->code[vm->ip + 1].arg;
+
+	vm_stack_push(vm, vm->stack[vm->fp + vm_arg_low(arg)]);
+	vm_stack_push(vm, constant);
+	vm_do_call(vm, vm_arg_high(arg), vm->ip + 2);
+
+	return false;
+}
+
+/*
+ * Builtins inlined by the compiler. The arguments are on the stack without
+ * the procedure below them, and `arg` is the closure slot the procedure was
+ * referenced through. If that slot no longer holds the builtin, the
+ * procedure is inserted under the arguments and called normally, returning
+ * to `retip`.
+ */
+static void vm_inline_call(vm_t *vm, uintptr_t index, unsigned nargs, unsigned retip) {
+	unsigned start = vm->sp - nargs;
+
+	for (unsigned i = vm->sp; i > start; i--) {
+		vm->stack[i] = vm->stack[i - 1];
+	}
+
+	vm->stack[start] = vm->closure->closures[index]->value;
+	vm->sp++;
+
+	vm_do_call(vm, start - vm->fp, retip);
+}
+
+void vm_inline_fallback(vm_t *vm, uintptr_t index, unsigned nargs, unsigned retip) {
+	vm_guard_missed(vm, index);
+	vm_inline_call(vm, index, nargs, retip);
+}
+
+static inline bool vm_inline_fallback_op(vm_t *vm, uintptr_t index, unsigned nargs) {
+	vm_inline_fallback(vm, index, nargs, vm->ip + 1);
+	return false;
+}
+
+// ops which only take fixnums call the procedure in the slot instead when
+// given anything else, which for the builtin reports the error
+static inline bool vm_fixnum_operands(vm_t *vm) {
+	return is_integer(vm->stack[vm->sp - 1] | vm->stack[vm->sp - 2]);
+}
+
+static inline bool vm_inline_call_op(vm_t *vm, uintptr_t index, unsigned nargs) {
+	vm_inline_call(vm, index, nargs, vm->ip + 1);
+	return false;
+}
+
+bool vm_op_fix_add(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_add)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	scm_value_t op1 = vm_stack_pop(vm);
+	scm_value_t op2 = vm_stack_pop(vm);
+
+	vm_stack_push(vm, op2 + op1);
+	return true;
+}
+
+bool vm_op_fix_sub(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_sub)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	scm_value_t op1 = vm_stack_pop(vm);
+	scm_value_t op2 = vm_stack_pop(vm);
+
+	vm_stack_push(vm, op2 - op1);
+	return true;
+}
+
+bool vm_op_fix_lessthan(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_lessthan)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
+
+	vm_stack_push(vm, tag_boolean(op2 < op1));
+	return true;
+}
+
+bool vm_op_fix_greaterthan(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_greaterthan)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
+
+	vm_stack_push(vm, tag_boolean(op2 > op1));
+	return true;
+}
+
+bool vm_op_inline_add(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_add(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_inline_sub(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_sub(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_inline_lessthan(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_lessthan(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_inline_greaterthan(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_greaterthan(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_inline_equal(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_equal)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	scm_value_t op1 = vm_stack_pop(vm);
+	scm_value_t op2 = vm_stack_pop(vm);
+
+	vm_stack_push(vm, tag_boolean(op2 == op1));
+	return true;
+}
+
+bool vm_op_inline_car(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_car)) {
+		return vm_inline_fallback_op(vm, arg, 1);
+	}
+
+	scm_value_t value = vm_stack_peek(vm);
+
+	if (!is_pair(value)) {
+		vm_error(vm, "Value given to car is not a pair");
+		return true;
+	}
+
+	vm->stack[vm->sp - 1] = get_pair(value)->car;
+	return true;
+}
+
+bool vm_op_inline_cdr(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_cdr)) {
+		return vm_inline_fallback_op(vm, arg, 1);
+	}
+
+	scm_value_t value = vm_stack_peek(vm);
+
+	if (!is_pair(value)) {
+		vm_error(vm, "Value given to cdr is not a pair");
+		return true;
+	}
+
+	vm->stack[vm->sp - 1] = get_pair(value)->cdr;
+	return true;
+}
+
+bool vm_op_inline_is_null(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_is_null)) {
+		return vm_inline_fallback_op(vm, arg, 1);
+	}
+
+	vm->stack[vm->sp - 1] = tag_boolean(is_null(vm_stack_peek(vm)));
+	return true;
+}
+
+bool vm_op_inline_is_pair(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_is_pair)) {
+		return vm_inline_fallback_op(vm, arg, 1);
+	}
+
+	vm->stack[vm->sp - 1] = tag_boolean(is_pair(vm_stack_peek(vm)));
+	return true;
+}
+
+bool vm_op_inline_cons(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_cons)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	scm_value_t cdr = vm_stack_pop(vm);
+	scm_value_t car = vm_stack_pop(vm);
+
+	vm_stack_push(vm, construct_pair(vm, car, cdr));
+	return true;
+}
+
+/*
+ * Compare-and-branch forms of the above, for (if (< a b) ...) and such.
+ * These are always followed by the jump_if_false op of the `if`: the fast
+ * path skips over it or jumps to its target directly, and the fallback
+ * call returns to it so that it tests the returned value.
+ */
+static inline bool vm_inline_branch(vm_t *vm, bool test) {
+	vm->ip = test? vm->ip + 2 : vm->closure->lambda->code[vm->ip + 1].arg;
+	return false;
+}
+
+bool vm_op_fix_lt_jump(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_lessthan)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
+
+	return vm_inline_branch(vm, op2 < op1);
+}
+
+bool vm_op_fix_gt_jump(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_greaterthan)) {
+		return vm_inline_fallback_op(vm, arg, 2);
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
+
+	return vm_inline_branch(vm, op2 > op1);
+}
+
+bool vm_op_lt_jump(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_lt_jump(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_gt_jump(vm_t *vm, uintptr_t arg) {
+	return vm_fixnum_operands(vm)
+	     ? vm_op_fix_gt_jump(vm, arg)
+	     : vm_inline_call_op(vm, arg, 2);
+}
+
+bool vm_op_null_jump(vm_t *vm, uintptr_t arg) {
+	if (!vm_inline_guard(vm, arg, vm_op_is_null)) {
+		return vm_inline_fallback_op(vm, arg, 1);
+	}
+
+	return vm_inline_branch(vm, is_null(vm_stack_pop(vm)));
+}
+
+/*
+ * Tail calls to the closure being run are compiled to the new arguments, a
+ * guard checking that the variable called through (closure slot `arg`)
+ * still holds this closure, a store_args op moving the arguments into
+ * place, and a jump back to the start of the code.
+ *
+ * Arguments which are just the parameter in the same position aren't
+ * pushed, the operand of store_args is the parameter count and a mask of
+ * those skipped parameters (see vm_tail_skipped()).
+ *
+ * If the variable has been redefined, the procedure it holds now is tail
+ * called with the full argument list instead.
+ */
+bool vm_op_self_tail_guard(vm_t *vm, uintptr_t arg) {
+	scm_value_t func = vm->closure->closures[arg]->value;
+
+	if (func == tag_closure(vm->closure)) {
+		return true;
+	}
+
+	vm_guard_missed(vm, arg);
+
+	uintptr_t store = vm->closure->lambda->code[vm->ip + 1].arg;
+	unsigned nparams = vm_arg_low(store);
+	unsigned base    = vm->fp;
+	unsigned pushed  = 0;
+
+	for (unsigned i = 0; i < nparams; i++) {
+		pushed += !vm_tail_skipped(store, i);
+	}
+
+	// rebuild the argument list in place, from the top down so that
+	// pushed values aren't overwritten before they're moved
+	unsigned start = vm->sp - pushed;
+
+	for (unsigned i = nparams; i > 0; i--) {
+		vm->stack[start + i] = vm_tail_skipped(store, i - 1)
+		                       ? vm->stack[base + i]
+		                       : vm->stack[start + --pushed];
+	}
+
+	vm->stack[start] = func;
+	vm->sp = start + nparams + 1;
+
+	vm_do_tailcall(vm, start - base);
+
+	return false;
+}
+
+// always followed by the jump back to the start, which is taken here
+bool vm_op_store_args(vm_t *vm, uintptr_t arg) {
+	unsigned base = vm->fp;
+	unsigned nparams = vm_arg_low(arg);
+
+	for (unsigned i = nparams; i > 0; i--) {
+		if (!vm_tail_skipped(arg, i - 1)) {
+			vm->stack[base + i] = vm_stack_pop(vm);
+		}
+	}
+
+	vm->sp = base + 1 + nparams;
+	vm->ip = vm->closure->lambda->code[vm->ip + 1].arg;
+
+	return false;
+}
+
+/*
+ * Loops in baseline code which get hot are moved over to the optimizing
+ * tier while they're running. The loop header is the start of the closure,
+ * where the frame holds nothing but the arguments, so once they're stored
+ * the new code can take over from its first op.
+ */
+bool vm_op_loop_guard(vm_t *vm, uintptr_t arg) {
+	scm_closure_t *clsr = vm->closure;
+
+	if (!vm_loop_is_hot(vm, ++clsr->lambda->back_edges)
+	    || clsr->closures[arg]->value != tag_closure(clsr))
+	{
+		return vm_op_self_tail_guard(vm, arg);
+	}
+
+	vm->ip++;
+	vm_op_store_args(vm, clsr->lambda->code[vm->ip].arg);
+
+	if (vm_tier_up(vm, clsr, VM_TIER_OPTIMIZED)) {
+		vm->ip = 0;
+	}
 
 	return false;
 }
 
+/*
+ * On-stack replacement of tree walker activations. The tree walker runs
+ * the body of a closure as a call to return_last, with the value of each
+ * expression as an argument. That's the frame compiled code uses as well,
+ * apart from the closure's arguments, which the tree walker keeps in the
+ * activation's environment.
+ *
+ * When control comes back to the body of an activation whose closure has
+ * been compiled since it started, eg. by its own recursive calls, the
+ * arguments are moved from the environment into the frame and it carries
+ * on from the op starting the next expression.
+ */
+bool vm_osr_enter(vm_t *vm) {
+	scm_closure_t *clsr = vm->closure;
+	vm_lambda_t *lambda = clsr->lambda;
+	unsigned done = vm_argnum(vm) - 1;
+
+	if (vm->stack[vm->fp] != vm_func_return_last()
+	    || done >= lambda->num_osr_entries
+	    || lambda->osr_entries[done] == VM_NO_OSR_ENTRY)
+	{
+		return false;
+	}
+
+	// make sure this is the body itself, and not a `begin` inside it
+	scm_value_t rest = lambda->definition;
+
+	for (unsigned i = 0; i < done && is_pair(rest); i++) {
+		rest = get_pair(rest)->cdr;
+	}
+
+	if (rest != vm->ptr) {
+		return false;
+	}
+
+	unsigned nargs = 0;
+	scm_value_t arg = lambda->args;
+
+	for (; is_pair(arg); arg = get_pair(arg)->cdr) {
+		nargs++;
+	}
+
+	if (!is_null(arg) || !vm_bind_closure(vm, clsr)) {
+		return false;
+	}
+
+	if (lambda->fold_guard && !vm_fold_guard_holds(clsr, lambda->fold_guard)) {
+		return false;
+	}
+
+	// the arguments have to be of the types the code assumes, too
+	arg = lambda->args;
+
+	for (unsigned i = 0; lambda->fold_guard && i < nargs; i++, arg = get_pair(arg)->cdr) {
+		scm_value_t value = env_find_recurse(vm->env, get_pair(arg)->car)->value;
+
+		if (i < 32 && (lambda->fold_guard->fixnum_args & (1u << i))
+		    && !is_integer(value))
+		{
+			return false;
+		}
+	}
+
+	unsigned base = vm->fp + 1;
+
+	for (unsigned i = done; i > 0; i--) {
+		vm->stack[base + nargs + i - 1] = vm->stack[base + i - 1];
+	}
+
+	arg = lambda->args;
+
+	for (unsigned i = 0; i < nargs; i++, arg = get_pair(arg)->cdr) {
+		vm->stack[base + i] = env_find_recurse(vm->env, get_pair(arg)->car)->value;
+	}
+
+	// compiled code keeps local definitions in the slot of the define
+	// expression, the tree walker only puts them in the environment
+	rest = lambda->definition;
+
+	for (unsigned i = 0; i < done; i++, rest = get_pair(rest)->cdr) {
+		scm_value_t expr = get_pair(rest)->car;
+
+		if (is_pair(expr)
+		    && is_define_token(vm->env, get_pair(expr)->car)
+		    && is_pair(get_pair(expr)->cdr)
+		    && is_symbol(scm_car(get_pair(expr)->cdr)))
+		{
+			scm_value_t sym = scm_car(get_pair(expr)->cdr);
+			vm->stack[base + nargs + i] = env_find_recurse(vm->env, sym)->value;
+		}
+	}
+
+	vm->stack[vm->fp] = tag_closure(clsr);
+	vm->sp      = base + nargs + done;
+	vm->ip      = lambda->osr_entries[done];
+	vm->runmode = RUN_MODE_COMPILED;
+
+	return true;
+}
+
+// true if the arguments to the running builtin are all fixnums, reports
+// the error otherwise
+static inline bool vm_fixnum_args(vm_t *vm, const char *msg) {
+	for (unsigned i = vm->fp + 1; i < vm->sp; i++) {
+		if (!is_integer(vm->stack[i])) {
+			vm_error(vm, msg);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool vm_op_add(vm_t *vm, uintptr_t arg) {
 	scm_value_t sum = 0;
 
-	for (uintptr_t args = vm->argnum - 1; args; args--) {
+	if (!vm_fixnum_args(vm, "Value given to + is not a number")) {
+		return true;
+	}
+
+	for (uintptr_t args = vm_argnum(vm) - 1; args; args--) {
 		// no untagging/retagging needed because the lower bits
 		// of tagged integers are 0b00
 		sum += vm_stack_pop(vm);
@@ -252,9 +1232,13 @@ bool vm_op_add(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_sub(vm_t *vm, uintptr_t arg) {
-	scm_value_t sum = vm->stack[vm->sp - vm->argnum + 1];
+	scm_value_t sum = vm->stack[vm->fp + 1];
+
+	if (!vm_fixnum_args(vm, "Value given to - is not a number")) {
+		return true;
+	}
 
-	for (uintptr_t args = vm->argnum - 2; args; args--) {
+	for (uintptr_t args = vm_argnum(vm) - 2; args; args--) {
 		sum -= vm_stack_pop(vm);
 	}
 
@@ -268,7 +1252,11 @@ bool vm_op_sub(vm_t *vm, uintptr_t arg) {
 bool vm_op_mul(vm_t *vm, uintptr_t arg) {
 	uintptr_t sum = 1;
 
-	for (uintptr_t args = vm->argnum - 1; args; args--) {
+	if (!vm_fixnum_args(vm, "Value given to * is not a number")) {
+		return true;
+	}
+
+	for (uintptr_t args = vm_argnum(vm) - 1; args; args--) {
 		sum *= get_integer(vm_stack_pop(vm));
 	}
 
@@ -279,10 +1267,14 @@ bool vm_op_mul(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_div(vm_t *vm, uintptr_t arg) {
-	uintptr_t sum = vm->stack[vm->sp - vm->argnum + 1];
+	long int sum = get_integer(vm->stack[vm->fp + 1]);
 
-	for (uintptr_t args = vm->argnum - 2; args; args--) {
-		uintptr_t temp = vm_stack_pop(vm);
+	if (!vm_fixnum_args(vm, "Value given to / is not a number")) {
+		return true;
+	}
+
+	for (uintptr_t args = vm_argnum(vm) - 2; args; args--) {
+		long int temp = get_integer(vm_stack_pop(vm));
 
 		if (temp) {
 			sum /= temp;
@@ -302,7 +1294,7 @@ bool vm_op_div(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_cons(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "cons: not enough args");
 		return true;
@@ -318,7 +1310,7 @@ bool vm_op_cons(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_car(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 2) {
+	if (vm_argnum(vm) != 2) {
 		puts("cargs");
 		vm_error(vm, "Invalid number of arguments for car");
 		return true;
@@ -340,7 +1332,7 @@ bool vm_op_car(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_cdr(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 2) {
+	if (vm_argnum(vm) != 2) {
 		puts("cdargs");
 		vm_error(vm, "Invalid number of arguments for cdr");
 		return true;
@@ -362,14 +1354,18 @@ bool vm_op_cdr(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_lessthan(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "Invalid number of arguments for lessthan");
 		return true;
 	}
 
-	scm_value_t op1 = vm_stack_pop(vm);
-	scm_value_t op2 = vm_stack_pop(vm);
+	if (!vm_fixnum_args(vm, "Value given to < is not a number")) {
+		return true;
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
 
 	vm_stack_pop(vm);
 	vm_stack_push(vm, tag_boolean(op2 < op1));
@@ -378,7 +1374,7 @@ bool vm_op_lessthan(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_equal(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "Invalid number of arguments for equal");
 		return true;
@@ -394,14 +1390,18 @@ bool vm_op_equal(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_greaterthan(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "Invalid number of arguments for greaterthan");
 		return true;
 	}
 
-	scm_value_t op1 = vm_stack_pop(vm);
-	scm_value_t op2 = vm_stack_pop(vm);
+	if (!vm_fixnum_args(vm, "Value given to > is not a number")) {
+		return true;
+	}
+
+	long int op1 = vm_stack_pop(vm);
+	long int op2 = vm_stack_pop(vm);
 
 	vm_stack_pop(vm);
 	vm_stack_push(vm, tag_boolean(op2 > op1));
@@ -410,9 +1410,9 @@ bool vm_op_greaterthan(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_is_null(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 2) {
+	if (vm_argnum(vm) != 2) {
 		printf("[%s] Not enough arguments, have %u but need 2\n",
-		       __func__, vm->argnum);
+		       __func__, vm_argnum(vm));
 
 		return true;
 	}
@@ -425,9 +1425,9 @@ bool vm_op_is_null(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_is_pair(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 2) {
+	if (vm_argnum(vm) != 2) {
 		printf("[%s] Not enough arguments, have %u but need 2\n",
-		       __func__, vm->argnum);
+		       __func__, vm_argnum(vm));
 
 		return true;
 	}
@@ -440,7 +1440,7 @@ bool vm_op_is_pair(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_intern_define(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "Invalid number of arguments for define");
 		return true;
@@ -455,13 +1455,17 @@ bool vm_op_intern_define(vm_t *vm, uintptr_t arg) {
 		return true;
 	}
 
-	env_set(vm->env, sym, datum);
+	env_node_t *var = env_set(vm->env, sym, datum);
+
+	if (var->watched) {
+		vm_var_written(vm, var);
+	}
 
 	return true;
 }
 
 bool vm_op_intern_set(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 3) {
+	if (vm_argnum(vm) != 3) {
 		puts("not enough args man");
 		vm_error(vm, "Invalid number of arguments given to set");
 		return true;
@@ -476,14 +1480,18 @@ bool vm_op_intern_set(vm_t *vm, uintptr_t arg) {
 		return true;
 	}
 
-	env_set_recurse(vm->env, sym, datum);
+	env_node_t *var = env_set_recurse(vm->env, sym, datum);
+
+	if (var->watched) {
+		vm_var_written(vm, var);
+	}
 
 	return true;
 }
 
 bool vm_op_intern_if(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 4) {
-		printf("if: not enough args, have %u but expected 4\n", vm->argnum);
+	if (vm_argnum(vm) != 4) {
+		printf("if: not enough args, have %u but expected 4\n", vm_argnum(vm));
 		return true;
 	}
 
@@ -504,8 +1512,8 @@ bool vm_op_intern_if(vm_t *vm, uintptr_t arg) {
 }
 
 bool vm_op_display(vm_t *vm, uintptr_t arg) {
-	if (vm->argnum != 2) {
-		printf("display: expected 2 args but have %u\n", vm->argnum);
+	if (vm_argnum(vm) != 2) {
+		printf("display: expected 2 args but have %u\n", vm_argnum(vm));
 		return true;
 	}
 
@@ -27,7 +27,7 @@ void write_list(scm_pair_t *pair) {
 
 void write_value(scm_value_t value) {
 	if (is_integer(value)) {
-		printf("%lu", get_integer(value));
+		printf("%ld", get_integer(value));
 
 	} else if (is_boolean(value)) {
 		printf("#%c", get_boolean(value)? 't' : 'f');
@@ -50,7 +50,7 @@ void write_value(scm_value_t value) {
 		printf("#<closure:%s @ %p>",
 		((char *[]) {
 			"interpreted", "compiled"
-		})[clsr->compiled],
+		})[clsr->lambda->compiled],
 		clsr);
 
     } else if (is_syntax_rules(value)) {
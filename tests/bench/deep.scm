@@ -0,0 +1,13 @@
+; non-tail recursion a thousand calls deep, repeated
+(define (depth n)
+  (if (> n 0)
+    (+ 1 (depth (- n 1)))
+    0))
+
+(define (repeat k acc)
+  (if (> k 0)
+    (repeat (- k 1) (+ acc (depth 1000)))
+    acc))
+
+(display (repeat 3000 0))
+(newline)
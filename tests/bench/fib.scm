@@ -0,0 +1,8 @@
+; call-heavy: two non-tail calls and three arithmetic calls per activation
+(define (fib n)
+  (if (< n 2)
+    n
+    (+ (fib (- n 1)) (fib (- n 2)))))
+
+(display (fib 30))
+(newline)
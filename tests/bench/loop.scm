@@ -0,0 +1,15 @@
+; tail-call loops, driven by an outer self-recursive procedure
+(define (count-to i n acc)
+  (if (< i n)
+    (count-to (+ i 1) n (+ acc i))
+    acc))
+
+(define (repeat k)
+  (if (> k 0)
+    (begin
+      (count-to 0 100000 0)
+      (repeat (- k 1)))
+    (display (count-to 0 100000 0))))
+
+(repeat 50)
+(newline)
@@ -0,0 +1,22 @@
+; binary trees of pairs, a large one kept for the whole run while smaller
+; ones are made and dropped. those outlive the nursery, so the old
+; generation is collected as a whole over and over with the large one in it
+(define (make-tree depth)
+  (if (> depth 0)
+    (cons (make-tree (- depth 1)) (make-tree (- depth 1)))
+    '()))
+
+(define (count-tree tree)
+  (if (null? tree)
+    1
+    (+ (count-tree (car tree)) (count-tree (cdr tree)))))
+
+(define kept (make-tree 18))
+
+(define (churn k total)
+  (if (> k 0)
+    (churn (- k 1) (+ total (count-tree (make-tree 14))))
+    total))
+
+(display (+ (churn 200 0) (count-tree kept)))
+(newline)
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+INTERP=../nscheme
+ENGINES="call direct"
+RUNS=5
+TIMEFORMAT='%R'
+
+# prints the fastest of $RUNS runs, timings are noisy on shared machines
+best_time() {
+	for run in `seq $RUNS`; do
+		{ time "$@" > /dev/null; } 2>&1
+	done | sort -n | head -n 1
+}
+
+# the native engine is only there when configured with --native-jit
+if ! $INTERP -e native /dev/null 2>&1 | grep -q "unknown engine"; then
+	ENGINES="native $ENGINES"
+fi
+
+echo "Running benchmarks for $INTERP in $PWD"
+
+for thing in `ls bench | grep -e ".scm$"`; do
+	prog=bench/$thing
+	expected=""
+
+	echo "  ====> $thing"
+
+	for engine in $ENGINES; do
+		out=`$INTERP -e $engine $prog`
+		secs=`best_time $INTERP -e $engine $prog`
+
+		# every engine has to produce the same output as the first one
+		if [ -z "$expected" ]; then
+			expected="$out"
+		elif [ "$out" != "$expected" ]; then
+			echo "    [x] output mismatch for engine $engine"
+		fi
+
+		printf "    %-8s %ss\n" "$engine" "$secs"
+	done
+done
+
+# collections of the whole heap on more and more threads, doubling up to the
+# number of cores, which trees.scm spends most of its time in
+cores=`nproc 2>/dev/null || echo 1`
+threads=1
+
+echo "  ====> trees.scm, collector threads"
+
+while [ $threads -le $cores ]; do
+	secs=`best_time $INTERP -j $threads bench/trees.scm`
+	printf "    -j %-5s %ss\n" "$threads" "$secs"
+
+	if [ $threads -lt $cores ] && [ $((threads * 2)) -gt $cores ]; then
+		threads=$cores
+	else
+		threads=$((threads * 2))
+	fi
+done
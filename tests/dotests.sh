@@ -11,6 +11,26 @@ get_expected_out() {
 	cat $1 | grep '^;; => ' | sed 's/;; => //'
 }
 
+# extra interpreter options for a test, given on a ';; args: ' line
+get_args() {
+	cat $1 | grep '^;; args: ' | sed 's/;; args: //'
+}
+
+# lines the stats printed with -s have to match, as extended regexes given
+# on ';; stats: ' lines
+get_stats() {
+	cat $1 | grep '^;; stats: ' | sed 's/;; stats: //'
+}
+
+# prints the stats patterns which no line of the stats output matches
+missing_stats() {
+	get_stats $1 | while read -r pattern; do
+		if ! grep -Eq "^$pattern\$" $2; then
+			echo "missing stats: $pattern"
+		fi
+	done
+}
+
 failed=0
 
 for module in $tests; do
@@ -19,7 +39,13 @@ for module in $tests; do
 	for thing in `ls src/$module | grep -e ".scm$"`; do
 		prog=src/$module/$thing
 
-		$INTERP $prog > output/$thing.out;
+		if [ "`get_stats $prog`" ]; then
+			$INTERP -s `get_args $prog` $prog > output/$thing.out 2> output/$thing.stats
+			missing_stats $prog output/$thing.stats >> output/$thing.out
+		else
+			$INTERP `get_args $prog` $prog > output/$thing.out;
+		fi
+
 		if [ ! "`get_expected_out $prog | diff - output/$thing.out`" ]; then
 			echo "    [ ] Test passed: $thing"
 		else
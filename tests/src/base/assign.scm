@@ -0,0 +1,57 @@
+; assigned variables live in boxes in compiled code, so closures that
+; capture them see each other's updates
+(define (make-counter)
+  (define count 0)
+  (lambda ()
+    (set! count (+ count 1))
+    count))
+
+(define counter (make-counter))
+(define other (make-counter))
+(counter)
+(counter)
+(other)
+;; => 3
+(display (counter))
+(newline)
+;; => 2
+(display (other))
+(newline)
+
+; assigned parameters, with a self tail call rebinding them
+(define (sum-loop n acc)
+  (if (< n 1)
+    acc
+    (begin
+      (set! acc (+ acc n))
+      (sum-loop (- n 1) acc))))
+
+;; => 5050
+(display (sum-loop 100 0))
+(newline)
+;; => 5050
+(display (sum-loop 100 0))
+(newline)
+
+; closures sharing one box
+(define (make-pair-of-closures start)
+  (cons (lambda () start)
+        (lambda (x) (set! start x))))
+
+(define cell (make-pair-of-closures 1))
+((cdr cell) 42)
+;; => 42
+(display ((car cell)))
+(newline)
+
+; assigning globals from compiled code
+(define total 0)
+(define (add-to-total! n)
+  (set! total (+ total n))
+  total)
+
+(add-to-total! 10)
+(add-to-total! 20)
+;; => 30
+(display total)
+(newline)
@@ -0,0 +1,12 @@
+;; args: -c 1 -O 0 -l 0
+; compiling can't be turned off like optimizing can, the tree walker has
+; no tail calls and loops run out of stack in it. this stays in baseline
+; code, looping far deeper than the stack goes
+(define (count-to i n acc)
+  (if (< i n)
+    (count-to (+ i 1) n (+ acc i))
+    acc))
+
+;; => 4999950000
+(display (count-to 0 100000 0))
+(newline)
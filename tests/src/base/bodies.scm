@@ -0,0 +1,114 @@
+;; args: -t -n 4k
+;; stats: gc: [1-9][0-9]+ closures, variables and lambdas freed, [0-9]{1,2} left
+; each top level form is compiled into the body of a closure and run once,
+; the closure, its lambda and the code are freed once they've run. the
+; small nursery has them collected every few forms
+(define (print x)
+  (display x)
+  (newline))
+(define (square x) (* x x))
+(define total 0)
+
+(set! total (+ total (square 1)))
+(set! total (+ total (square 2)))
+(set! total (+ total (square 3)))
+(set! total (+ total (square 4)))
+(set! total (+ total (square 5)))
+(set! total (+ total (square 6)))
+(set! total (+ total (square 7)))
+(set! total (+ total (square 8)))
+(set! total (+ total (square 9)))
+(set! total (+ total (square 10)))
+(set! total (+ total (square 11)))
+(set! total (+ total (square 12)))
+(set! total (+ total (square 13)))
+(set! total (+ total (square 14)))
+(set! total (+ total (square 15)))
+(set! total (+ total (square 16)))
+(set! total (+ total (square 17)))
+(set! total (+ total (square 18)))
+(set! total (+ total (square 19)))
+(set! total (+ total (square 20)))
+(set! total (+ total (square 21)))
+(set! total (+ total (square 22)))
+(set! total (+ total (square 23)))
+(set! total (+ total (square 24)))
+(set! total (+ total (square 25)))
+(set! total (+ total (square 26)))
+(set! total (+ total (square 27)))
+(set! total (+ total (square 28)))
+(set! total (+ total (square 29)))
+(set! total (+ total (square 30)))
+(set! total (+ total (square 31)))
+(set! total (+ total (square 32)))
+(set! total (+ total (square 33)))
+(set! total (+ total (square 34)))
+(set! total (+ total (square 35)))
+(set! total (+ total (square 36)))
+(set! total (+ total (square 37)))
+(set! total (+ total (square 38)))
+(set! total (+ total (square 39)))
+(set! total (+ total (square 40)))
+(set! total (+ total (square 41)))
+(set! total (+ total (square 42)))
+(set! total (+ total (square 43)))
+(set! total (+ total (square 44)))
+(set! total (+ total (square 45)))
+(set! total (+ total (square 46)))
+(set! total (+ total (square 47)))
+(set! total (+ total (square 48)))
+(set! total (+ total (square 49)))
+(set! total (+ total (square 50)))
+(set! total (+ total (square 51)))
+(set! total (+ total (square 52)))
+(set! total (+ total (square 53)))
+(set! total (+ total (square 54)))
+(set! total (+ total (square 55)))
+(set! total (+ total (square 56)))
+(set! total (+ total (square 57)))
+(set! total (+ total (square 58)))
+(set! total (+ total (square 59)))
+(set! total (+ total (square 60)))
+(set! total (+ total (square 61)))
+(set! total (+ total (square 62)))
+(set! total (+ total (square 63)))
+(set! total (+ total (square 64)))
+(set! total (+ total (square 65)))
+(set! total (+ total (square 66)))
+(set! total (+ total (square 67)))
+(set! total (+ total (square 68)))
+(set! total (+ total (square 69)))
+(set! total (+ total (square 70)))
+(set! total (+ total (square 71)))
+(set! total (+ total (square 72)))
+(set! total (+ total (square 73)))
+(set! total (+ total (square 74)))
+(set! total (+ total (square 75)))
+(set! total (+ total (square 76)))
+(set! total (+ total (square 77)))
+(set! total (+ total (square 78)))
+(set! total (+ total (square 79)))
+(set! total (+ total (square 80)))
+(set! total (+ total (square 81)))
+(set! total (+ total (square 82)))
+(set! total (+ total (square 83)))
+(set! total (+ total (square 84)))
+(set! total (+ total (square 85)))
+(set! total (+ total (square 86)))
+(set! total (+ total (square 87)))
+(set! total (+ total (square 88)))
+(set! total (+ total (square 89)))
+(set! total (+ total (square 90)))
+(set! total (+ total (square 91)))
+(set! total (+ total (square 92)))
+(set! total (+ total (square 93)))
+(set! total (+ total (square 94)))
+(set! total (+ total (square 95)))
+(set! total (+ total (square 96)))
+(set! total (+ total (square 97)))
+(set! total (+ total (square 98)))
+(set! total (+ total (square 99)))
+(set! total (+ total (square 100)))
+
+;; => 338350
+(print total)
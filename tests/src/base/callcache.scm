@@ -0,0 +1,56 @@
+;; args: -c 1 -O 2
+; call sites remember the procedures they call, and still call whatever
+; they're given when that changes
+(define (print x)
+  (display x)
+  (newline))
+(define (apply-to f x) (f x))
+(define (inc x) (+ x 1))
+(define (dec x) (- x 1))
+(define (dbl x) (+ x x))
+(define (neg x) (- 0 x))
+(define (sqr x) (* x x))
+
+;; => 2
+(print (apply-to inc 1))
+;; => 2
+(print (apply-to inc 1))
+;; => 2
+(print (apply-to inc 1))
+;; => 0
+(print (apply-to dec 1))
+;; => 6
+(print (apply-to dbl 3))
+;; => -3
+(print (apply-to neg 3))
+;; => 9
+(print (apply-to sqr 3))
+;; => 4
+(print (apply-to inc 3))
+;; => 9
+(print (apply-to sqr 3))
+
+; redefined and recompiled callees
+(define (g) 1)
+(define (call-g) (g))
+;; => 1
+(print (call-g))
+;; => 1
+(print (call-g))
+;; => 1
+(print (call-g))
+(define (g) 2)
+;; => 2
+(print (call-g))
+(define (size x) (if (pair? x) 100 (+ x 1)))
+(define (size-of x) (size x))
+;; => 2
+(print (size-of 1))
+;; => 2
+(print (size-of 1))
+;; => 2
+(print (size-of 1))
+;; => 100
+(print (size-of (cons 1 2)))
+;; => 3
+(print (size-of 2))
@@ -0,0 +1,50 @@
+; lambdas nested in compiled code are made into flat closures, which
+; capture the variables they refer to when they're made
+(define nil (cdr (cons 1 '())))
+(define (map f xs)
+  (if (null? xs)
+    nil
+    (cons (f (car xs)) (map f (cdr xs)))))
+
+(define (scale-all k xs)
+  (map (lambda (x) (* k x)) xs))
+(define (curry3 a)
+  (lambda (b) (lambda (c) (+ a (+ b c)))))
+(define (compose f g)
+  (lambda (x) (f (g x))))
+
+; each closure made in a loop gets its own copy of the loop variable
+(define (sum-closures n acc)
+  (if (> n 0)
+    (sum-closures (- n 1) (+ acc ((lambda (y) (+ y n)) 1)))
+    acc))
+
+; locals can be captured once they're defined
+(define (with-local n)
+  (define m (+ n 1))
+  ((lambda () (* m 2))))
+
+(define (run k)
+  (display (cons (scale-all k (cons 1 (cons 2 (cons 3 nil))))
+                 (cons (((curry3 k) 2) 3)
+                       (cons ((compose car cdr) (cons 1 (cons k nil)))
+                             (cons (sum-closures 10 0)
+                                   (cons (with-local k) nil))))))
+  (newline))
+
+;; => ((1 2 3) 6 1 65 4)
+(run 1)
+;; => ((2 4 6) 7 2 65 6)
+(run 2)
+;; => ((3 6 9) 8 3 65 8)
+(run 3)
+;; => ((4 8 12) 9 4 65 10)
+(run 4)
+;; => ((5 10 15) 10 5 65 12)
+(run 5)
+
+; closures made by the tree walker and by compiled code share the code
+(define adder (curry3 100))
+;; => 111
+(display ((adder 10) 1))
+(newline)
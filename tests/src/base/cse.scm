@@ -0,0 +1,69 @@
+;; args: -c 1 -O 1
+; calls repeated with the same arguments are computed once by the optimizing
+; tier, and calls which stay the same through a self tail call loop are
+; computed before it
+(define (print x)
+  (display x)
+  (newline))
+(define (second xs) (car (cdr xs)))
+(define (sum-ends xs) (+ (car (cdr xs)) (second xs)))
+(define (dist2 a b) (+ (* (- a b) (- a b)) 1))
+; values computed in one branch aren't there in the other, or after the if
+(define (dec-twice x) (+ (if (> x 0) (- x 1) 0) (- x 1)))
+
+;; => 4
+(print (sum-ends (cons 1 (cons 2 (cons 3 '())))))
+;; => 4
+(print (sum-ends (cons 1 (cons 2 (cons 3 '())))))
+;; => 4
+(print (sum-ends (cons 1 (cons 2 (cons 3 '())))))
+;; => 10
+(print (dist2 5 2))
+;; => 10
+(print (dist2 5 2))
+;; => 10
+(print (dist2 5 2))
+;; => -1
+(print (dec-twice 0))
+;; => 8
+(print (dec-twice 5))
+;; => -1
+(print (dec-twice 0))
+;; => 8
+(print (dec-twice 5))
+
+(define (sq x) (* x x))
+(define (sum-squares n k acc)
+  (if (> n 0)
+    (sum-squares (- n 1) k (+ acc (sq k)))
+    acc))
+; parameters which change in the loop aren't invariant
+(define (sum-changing n k acc)
+  (if (> n 0)
+    (sum-changing (- n 1) (+ k 1) (+ acc (sq k)))
+    acc))
+;; => 90
+(print (sum-squares 10 3 0))
+;; => 90
+(print (sum-squares 10 3 0))
+;; => 90
+(print (sum-squares 10 3 0))
+;; => 30
+(print (sum-changing 4 1 0))
+;; => 30
+(print (sum-changing 4 1 0))
+;; => 30
+(print (sum-changing 4 1 0))
+
+(define (second xs) (car xs))
+(define (sq x) (+ x x))
+;; => 3
+(print (sum-ends (cons 1 (cons 2 (cons 3 '())))))
+;; => 3
+(print (sum-ends (cons 1 (cons 2 (cons 3 '())))))
+;; => 60
+(print (sum-squares 10 3 0))
+;; => 60
+(print (sum-squares 10 3 0))
+;; => 20
+(print (sum-changing 4 1 0))
@@ -0,0 +1,29 @@
+;; args: -e native -c 1 -O 1 -l 1
+; a body expression using every slot the optimizing tier keeps repeated
+; values in drops more of the stack than fits in a byte, the sum of squares
+; is added to 0 so that it isn't a tail call and the slots are dropped
+(define (print x)
+  (display x)
+  (newline))
+(define (squares a)
+  (+ 0 (+ (* (+ a 1) (+ a 1)) (* (+ a 2) (+ a 2)) (* (+ a 3) (+ a 3))
+     (* (+ a 4) (+ a 4)) (* (+ a 5) (+ a 5)) (* (+ a 6) (+ a 6))
+     (* (+ a 7) (+ a 7)) (* (+ a 8) (+ a 8)) (* (+ a 9) (+ a 9))
+     (* (+ a 10) (+ a 10)) (* (+ a 11) (+ a 11)) (* (+ a 12) (+ a 12))
+     (* (+ a 13) (+ a 13)) (* (+ a 14) (+ a 14)) (* (+ a 15) (+ a 15))
+     (* (+ a 16) (+ a 16)))))
+(define (twice a)
+  (+ (squares a) (squares a)))
+
+;; => 1496
+(print (squares 0))
+;; => 1496
+(print (squares 0))
+;; => 1496
+(print (squares 0))
+;; => 3568
+(print (twice 1))
+;; => 3568
+(print (twice 1))
+;; => 3568
+(print (twice 1))
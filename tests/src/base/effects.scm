@@ -0,0 +1,58 @@
+;; args: -c 1 -O 1
+; discarded values are dropped by the optimizing tier if computing them has
+; no effects, which depends on what the procedures called do
+(define (inner x) (+ x 1))
+(define (outer x) (inner (inner x)))
+(define (discard x) (begin (outer x) (cons x x) x))
+; local definitions keep this one from being inlined
+(define (local-outer x)
+  (define y (inner x))
+  (inner y))
+(define (discard-local x) (begin (local-outer x) x))
+
+;; => 1
+(display (discard 1))
+(newline)
+;; => 2
+(display (discard 2))
+(newline)
+;; => 3
+(display (discard 3))
+(newline)
+;; => 1
+(display (discard-local 1))
+(newline)
+;; => 2
+(display (discard-local 2))
+(newline)
+;; => 3
+(display (discard-local 3))
+(newline)
+
+; output and assignments aren't dropped
+(define count 0)
+(define (bump) (set! count (+ count 1)))
+(define (noisy x) (display x) (newline) x)
+(define (keep x) (begin (bump) (noisy x) x))
+;; => 5
+(keep 5)
+;; => 6
+(keep 6)
+;; => 7
+(keep 7)
+;; => 3
+(display count)
+(newline)
+
+; procedures called by dropped calls can be redefined to do something
+(define (inner x) (noisy x))
+;; => 4
+;; => 4
+;; => 4
+(display (discard 4))
+(newline)
+;; => 5
+;; => 5
+;; => 5
+(display (discard-local 5))
+(newline)
@@ -0,0 +1,38 @@
+;; args: -c 1 -O 1
+; calls to builtins with constant arguments, and the branches they decide,
+; are folded by the optimizing tier until the builtins are redefined
+(define (pair a b) (cons a b))
+(define (consts x)
+  (if (< 1 2)
+    (pair (+ x (* 2 3)) (begin 1 x (- 10 4 1)))
+    (pair 0 0)))
+
+(define (loop n acc)
+  (if (> n 0)
+    (loop (- n 1) (+ acc (+ 1 2)))
+    acc))
+
+;; => (7 . 5)
+(display (consts 1))
+(newline)
+;; => (8 . 5)
+(display (consts 2))
+(newline)
+;; => 30
+(display (loop 10 0))
+(newline)
+; only the value of the last expression in a begin is kept
+(define (effects x) (pair (begin (set! x (+ x 1)) x) 3))
+;; => (6 . 3)
+(display (effects 5))
+(newline)
+(define + -)
+;; => (-5 . 5)
+(display (consts 1))
+(newline)
+;; => 10
+(display (loop 10 0))
+(newline)
+;; => (-5 . 5)
+(display (consts 1))
+(newline)
@@ -0,0 +1,39 @@
+; quoted data, and procedures defined inside bodies, are compiled along
+; with the code around them
+(define (tagged x)
+  (cons 'value (cons x '())))
+
+(define (sum-list xs)
+  (define (loop xs acc)
+    (if (null? xs)
+      acc
+      (loop (cdr xs) (+ acc (car xs)))))
+  (loop xs 0))
+
+; locally defined procedures can refer to each other
+(define (parity n)
+  (define (even? n) (if (eq? n 0) 'even (odd? (- n 1))))
+  (define (odd? n) (if (eq? n 0) 'odd (even? (- n 1))))
+  (even? n))
+
+(define (scaled-sum k xs)
+  (define scale k)
+  (define (scale-all xs)
+    (if (null? xs)
+      '()
+      (cons (* scale (car xs)) (scale-all (cdr xs)))))
+  (sum-list (scale-all xs)))
+
+(define (run n)
+  (display (cons (tagged n)
+                 (cons (sum-list '(1 2 3 4))
+                       (cons (parity n)
+                             (cons (scaled-sum n '(1 2 3)) '())))))
+  (newline))
+
+;; => ((value 7) 10 odd 42)
+(run 7)
+;; => ((value 10) 10 even 60)
+(run 10)
+;; => ((value 3) 10 odd 18)
+(run 3)
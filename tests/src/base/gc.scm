@@ -0,0 +1,47 @@
+; lists made and dropped in loops take up far more than the heap holds,
+; the space they used has to be reclaimed, and what's still referenced
+; moved without changing
+(define (make-list n acc)
+  (if (> n 0)
+    (make-list (- n 1) (cons n acc))
+    acc))
+(define (sum xs acc)
+  (if (null? xs)
+    acc
+    (sum (cdr xs) (+ acc (car xs)))))
+(define (churn n total)
+  (if (> n 0)
+    (churn (- n 1) (+ total (sum (make-list 100 '()) 0)))
+    total))
+
+(define kept (make-list 200 '()))
+;; => 5050000
+(display (churn 1000 0))
+(newline)
+;; => 20100
+(display (sum kept 0))
+(newline)
+
+; values held by closures and boxes
+(define (adder xs)
+  (lambda (n) (+ n (sum xs 0))))
+(define add-kept (adder (make-list 10 '())))
+(define (counter)
+  (define xs '())
+  (lambda ()
+    (set! xs (cons 1 xs))
+    (sum xs 0)))
+(define count (counter))
+(define (count-to n)
+  (if (> n 1)
+    (begin (count) (churn 10 0) (count-to (- n 1)))
+    (count)))
+;; => 5105
+(display (add-kept (churn 1 0)))
+(newline)
+;; => 500
+(display (count-to 500))
+(newline)
+;; => (1 2 3 4 5)
+(display (make-list 5 '()))
+(newline)
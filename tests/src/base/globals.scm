@@ -0,0 +1,77 @@
+;; args: -c 1 -O 1
+; global variables which were never assigned to are built into optimized
+; code, which is thrown out when they are
+(define (print x)
+  (display x)
+  (newline))
+(define limit 10)
+(define step 2)
+(define (below-limit? n) (< n limit))
+(define (count-up n acc)
+  (if (below-limit? n)
+    (count-up (+ n step) (+ acc 1))
+    acc))
+(define (pure n) (+ (* n step) limit))
+
+;; => 5
+(print (count-up 0 0))
+;; => 5
+(print (count-up 0 0))
+;; => 5
+(print (count-up 0 0))
+;; => 16
+(print (pure 3))
+;; => 16
+(print (pure 3))
+
+(set! step 5)
+;; => 2
+(print (count-up 0 0))
+;; => 2
+(print (count-up 0 0))
+;; => 25
+(print (pure 3))
+;; => 25
+(print (pure 3))
+
+(define limit 20)
+;; => 4
+(print (count-up 0 0))
+;; => 4
+(print (count-up 0 0))
+;; => 35
+(print (pure 3))
+
+; assignments from compiled code
+(define scale 3)
+(define (scaled n) (* n scale))
+(define (set-scale! n) (set! scale n))
+;; => 6
+(print (scaled 2))
+;; => 6
+(print (scaled 2))
+;; => 6
+(print (scaled 2))
+(set-scale! 4)
+;; => 8
+(print (scaled 2))
+(set-scale! 5)
+;; => 10
+(print (scaled 2))
+;; => 10
+(print (scaled 2))
+
+; procedures the code calls are watched too
+(define (helper x) (+ x 1))
+(define (use-helper x) (helper (helper x)))
+;; => 3
+(print (use-helper 1))
+;; => 3
+(print (use-helper 1))
+;; => 3
+(print (use-helper 1))
+(define (helper x) (* x 10))
+;; => 100
+(print (use-helper 1))
+;; => 100
+(print (use-helper 1))
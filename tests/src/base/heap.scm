@@ -0,0 +1,33 @@
+;; args: -H 8k -M 3m -o 40 -n 32k
+; the heap grows to hold more live data than it started out with. a list
+; too big to be made twice within the largest size the heap can grow to is
+; only made again once the first one's been reclaimed. lists promoted and
+; dropped after that keep collecting the whole heap, which shrinks it as far
+; as the blocks pinned near its end allow
+;; stats: gc: heap grew [1-9][0-9]* times and shrank [1-9][0-9]* times, at most [0-9]+ bytes
+(define (make-list n acc)
+  (if (> n 0)
+    (make-list (- n 1) (cons n acc))
+    acc))
+(define (sum xs acc)
+  (if (null? xs)
+    acc
+    (sum (cdr xs) (+ acc (car xs)))))
+(define (chain n a b)
+  (if (> n 0)
+    (chain (- n 1) (make-list 100 '()) a)
+    (+ (sum a 0) (sum b 0))))
+
+(define big (make-list 50000 '()))
+;; => 1250025000
+(display (sum big 0))
+(newline)
+(define big '())
+(define big (make-list 50000 '()))
+;; => 1250025000
+(display (sum big 0))
+(newline)
+(define big '())
+;; => 10100
+(display (chain 3000 '() '()))
+(newline)
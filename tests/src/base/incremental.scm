@@ -0,0 +1,56 @@
+;; args: -n 4k -p 1
+; the old generation is collected a slice at a time between minor
+; collections, while lists are moved between variables, closures and boxes
+; it might have scanned already
+(define (make-list n acc)
+  (if (> n 0)
+    (make-list (- n 1) (cons n acc))
+    acc))
+(define (sum xs acc)
+  (if (null? xs)
+    acc
+    (sum (cdr xs) (+ acc (car xs)))))
+(define (churn n total)
+  (if (> n 0)
+    (churn (- n 1) (+ total (sum (make-list 100 '()) 0)))
+    total))
+
+(define kept (make-list 1000 '()))
+(define (rotate n)
+  (if (> n 0)
+    (begin
+      (set! kept (cons (car kept) (make-list 50 (cdr kept))))
+      (churn 2 0)
+      (rotate (- n 1)))
+    (sum kept 0)))
+;; => 755500
+(display (rotate 200))
+(newline)
+
+(define (holder xs)
+  (lambda (ys)
+    (define old xs)
+    (set! xs ys)
+    (churn 1 0)
+    (sum old 0)))
+(define swap (holder (make-list 100 '())))
+(define (swap-all n total)
+  (if (> n 0)
+    (swap-all (- n 1) (+ total (swap (make-list n '()))))
+    total))
+;; => 1358449
+(display (swap-all 200 0))
+(newline)
+
+(define (boxed n)
+  (define a (make-list 10 '()))
+  (define b '())
+  (define (loop i)
+    (if (> i 0)
+      (begin (set! b (cons (sum a 0) b)) (set! a (make-list i '())) (churn 1 0)
+             (loop (- i 1)))
+      (sum b 0)))
+  (loop n))
+;; => 171754
+(display (boxed 100))
+(newline)
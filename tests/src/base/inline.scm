@@ -0,0 +1,71 @@
+;; args: -c 1 -O 1
+; calls to small procedures are replaced by their bodies in the optimizing
+; tier, until the procedures are redefined
+(define (print x)
+  (display x)
+  (newline))
+(define (add-one n)
+  (print (+ n 1)))
+(define (square x) (* x x))
+(define (sum-squares a b) (+ (square a) (square b)))
+
+;; => 2
+(add-one 1)
+;; => 3
+(add-one 2)
+;; => 4
+(add-one 3)
+;; => 25
+(print (sum-squares 3 4))
+;; => 25
+(print (sum-squares 3 4))
+
+; arguments are evaluated once, before the body
+(define (twice x) (+ x x))
+(define (bump-twice n) (twice (begin (set! n (+ n 1)) n)))
+;; => 4
+(print (bump-twice 1))
+;; => 4
+(print (bump-twice 1))
+
+; the body's free variables are its own, not the caller's locals
+(define y 100)
+(define (add-y x) (+ x y))
+(define (shadow y) (add-y y))
+;; => 101
+(print (shadow 1))
+;; => 102
+(print (shadow 2))
+
+; inlined into loops, and with tail calls in the inlined body
+(define (pick a b) (if (< a b) a b))
+(define (sum-picks n acc)
+  (if (> n 0)
+    (sum-picks (- n 1) (+ acc (pick n 3)))
+    acc))
+(define (apply-to f x) (f x))
+(define (square-of x) (apply-to square x))
+;; => 27
+(print (sum-picks 10 0))
+;; => 27
+(print (sum-picks 10 0))
+;; => 36
+(print (square-of 6))
+;; => 36
+(print (square-of 6))
+
+(define (square x) (+ x x))
+;; => 14
+(print (sum-squares 3 4))
+;; => 14
+(print (sum-squares 3 4))
+;; => 12
+(print (square-of 6))
+(define (print x)
+  (display (pair x x))
+  (newline))
+(define (pair a b) (cons a b))
+;; => (5 . 5)
+(add-one 4)
+;; => (6 . 6)
+(add-one 5)
@@ -0,0 +1,37 @@
+; closures made from the same lambda expression share its compiled code,
+; each one still sees the variables of the environment it was made in
+(define (make-adder n)
+  (lambda (x) (+ x n)))
+
+(define (sum-adders k acc)
+  (if (> k 0)
+    (sum-adders (- k 1) (+ acc ((make-adder k) 1)))
+    acc))
+
+;; => 5150
+(display (sum-adders 100 0))
+(newline)
+
+(define add5 (make-adder 5))
+(define add7 (make-adder 7))
+;; => 12
+(display (add5 7))
+(newline)
+;; => 14
+(display (add7 7))
+(newline)
+
+; closures made after the code was compiled, called from a hot loop
+(define (make-stepper step)
+  (lambda (n) (- n step)))
+(define (count-down next n acc)
+  (if (< n 1)
+    acc
+    (count-down next (next n) (+ acc 1))))
+
+;; => 1000
+(display (count-down (make-stepper 1) 1000 0))
+(newline)
+;; => 500
+(display (count-down (make-stepper 2) 1000 0))
+(newline)
@@ -0,0 +1,58 @@
+;; args: -n 4k
+; young lists referenced only from variables, closures and boxes have to
+; survive minor collections, which only look at what was written to since
+; the last one
+(define (make-list n acc)
+  (if (> n 0)
+    (make-list (- n 1) (cons n acc))
+    acc))
+(define (sum xs acc)
+  (if (null? xs)
+    acc
+    (sum (cdr xs) (+ acc (car xs)))))
+(define (churn n total)
+  (if (> n 0)
+    (churn (- n 1) (+ total (sum (make-list 100 '()) 0)))
+    total))
+
+(define acc '())
+(define (push-all n)
+  (if (> n 0)
+    (begin (set! acc (cons n acc)) (churn 1 0) (push-all (- n 1)))
+    (sum acc 0)))
+;; => 500500
+(display (push-all 1000))
+(newline)
+
+(define (collector)
+  (define xs '())
+  (lambda (x)
+    (set! xs (cons x xs))
+    (churn 1 0)
+    (sum xs 0)))
+(define collect (collector))
+(define (collect-to n)
+  (if (> n 1)
+    (begin (collect n) (collect-to (- n 1)))
+    (collect 1)))
+;; => 20100
+(display (collect-to 200))
+(newline)
+
+(define (boxed n)
+  (define xs '())
+  (define (loop i)
+    (if (> i 0)
+      (begin (set! xs (cons i xs)) (churn 1 0) (loop (- i 1)))
+      (sum xs 0)))
+  (loop n))
+;; => 5050
+(display (boxed 100))
+(newline)
+
+(define (keep xs)
+  (lambda () (sum xs 0)))
+(define kept (keep (make-list 300 '())))
+;; => 45150
+(display (begin (churn 100 0) (kept)))
+(newline)
@@ -0,0 +1,27 @@
+; the first few activations of a recursive procedure are run by the tree
+; walker, once the procedure is compiled they carry on in compiled code
+; when the recursive call returns, locals included
+(define (walk n)
+  (define twice (+ n n))
+  (if (> n 0) (walk (- n 1)) 0)
+  (display twice)
+  (newline)
+  twice)
+
+;; => 0
+;; => 2
+;; => 4
+;; => 6
+;; => 8
+;; => 10
+(walk 5)
+
+; loops running in baseline code move over to optimized code
+(define (spin n acc)
+  (if (> n 0)
+    (spin (- n 1) (+ acc 2))
+    acc))
+
+;; => 200000
+(display (spin 100000 0))
+(newline)
@@ -0,0 +1,47 @@
+;; args: -j 4 -n 64k
+; collections of the whole heap mark it on several threads, which steal
+; from each other, and compact it a region at a time. a tree spread over
+; regions is kept through them while others are made and dropped
+(define (make-tree depth n)
+  (if (> depth 0)
+    (cons (make-tree (- depth 1) (* 2 n))
+          (make-tree (- depth 1) (+ (* 2 n) 1)))
+    n))
+
+(define (sum-tree tree)
+  (if (pair? tree)
+    (+ (sum-tree (car tree)) (sum-tree (cdr tree)))
+    tree))
+
+(define kept (make-tree 15 1))
+
+(define (churn k total)
+  (if (> k 0)
+    (churn (- k 1) (+ total (sum-tree (make-tree 12 1))))
+    total))
+
+;; => 1006551040
+(display (churn 40 0))
+(newline)
+;; => 1610596352
+(display (sum-tree kept))
+(newline)
+
+; trees held by closures and boxes, swapped between collections
+(define (holder tree)
+  (lambda (new)
+    (define old tree)
+    (set! tree new)
+    (churn 2 0)
+    (sum-tree old)))
+
+(define swap (holder (make-tree 10 1)))
+
+(define (swap-all depth total)
+  (if (> depth 0)
+    (swap-all (- depth 1) (+ total (swap (make-tree depth 1))))
+    total))
+
+;; => 9958906
+(display (swap-all 11 0))
+(newline)
@@ -0,0 +1,33 @@
+;; args: -c 1
+;; stats: gc: [1-9][0-9]{5,} closures, variables and lambdas freed, [0-9]{1,4} left
+; closures made by compiled code, the variables they capture, and the boxes
+; of assigned parameters are freed once nothing references them. a loop
+; which makes those without allocating anything on the heap collects them
+; too, and a few thousand at most are left at the end
+(define (print x)
+  (display x)
+  (newline))
+(define (adder n) (lambda (x) (+ x n)))
+(define (add-all i acc)
+  (if (> i 0)
+    (add-all (- i 1) (+ acc ((adder i) 1)))
+    acc))
+(define (bump x) (set! x (+ x 1)) x)
+(define (bump-all i acc)
+  (if (> i 0)
+    (bump-all (- i 1) (+ acc (bump i)))
+    acc))
+(define (make-counter n)
+  (lambda () (set! n (+ n 1)) n))
+(define (count-up c i)
+  (if (> i 1)
+    (begin (c) (count-up c (- i 1)))
+    (c)))
+
+;; => 20000300000
+(print (add-all 200000 0))
+;; => 20000300000
+(print (bump-all 200000 0))
+; a counter kept across collections keeps its box
+;; => 100000
+(print (count-up (make-counter 0) 100000))
@@ -0,0 +1,32 @@
+; builtins called from compiled code are open-coded, redefining them
+; has to be picked up by the guards. each procedure is called a few
+; times first so that it's compiled
+(define (add-pair a b) (+ a b))
+(define (first xs) (car xs))
+(define (below? a b) (if (< a b) 1 0))
+
+(add-pair 1 2)
+(add-pair 1 2)
+(add-pair 1 2)
+(first (cons 1 2))
+(first (cons 1 2))
+(first (cons 1 2))
+(below? 1 2)
+(below? 1 2)
+(below? 1 2)
+
+;; => 3
+(display (add-pair 1 2))
+(newline)
+(define + -)
+(define car cdr)
+(define < >)
+;; => -1
+(display (add-pair 1 2))
+(newline)
+;; => 2
+(display (first (cons 1 2)))
+(newline)
+;; => 0
+(display (below? 1 2))
+(newline)
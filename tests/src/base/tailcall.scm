@@ -0,0 +1,27 @@
+; self tail calls are compiled to loops, this would run out of call
+; frames otherwise
+(define (count-to n i)
+  (if (< i n)
+    (count-to n (+ i 1))
+    i))
+
+;; => 100000
+(display (count-to 100000 0))
+(newline)
+
+; once the name is redefined, the loop has to call the new procedure
+(define (spin n)
+  (if (> n 0)
+    (spin (- n 1))
+    0))
+
+(spin 3)
+(spin 3)
+(spin 3)
+
+(define old-spin spin)
+(define (spin n) 42)
+
+;; => 42
+(display (old-spin 5))
+(newline)
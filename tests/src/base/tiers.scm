@@ -0,0 +1,32 @@
+; procedures move up to the optimizing tier after enough calls, while
+; frames of the baseline code they're replacing are still live
+(define (sum-to n)
+  (if (< n 1)
+    0
+    (+ n (sum-to (- n 1)))))
+
+;; => 125250
+(display (sum-to 500))
+(newline)
+;; => 125250
+(display (sum-to 500))
+(newline)
+
+; builtins redefined while running baseline code are called normally by
+; the optimized code
+(define (second xs) (car (cdr xs)))
+(define (call-second n acc)
+  (if (> n 0)
+    (call-second (- n 1) (+ acc (second (cons 1 (cons 2 3)))))
+    acc))
+
+;; => 20
+(display (call-second 10 0))
+(newline)
+(define car cdr)
+;; => 300
+(display (call-second 100 0))
+(newline)
+;; => 300
+(display (call-second 100 0))
+(newline)
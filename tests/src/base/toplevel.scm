@@ -0,0 +1,26 @@
+;; args: -f
+; top-level expressions between definitions are compiled together
+(define (square x) (* x x))
+(define total (+ (square 3) (square 4)))
+
+;; => 25
+(display total)
+(newline)
+;; => 7
+(display (- total 18))
+(newline)
+
+; definitions in between change what the following expressions refer to
+(define square (lambda (x) (+ x x)))
+;; => 14
+(display (+ (square 3) (square 4)))
+(newline)
+
+; forms the compiler doesn't handle are run by the tree walker
+(set! total 10)
+;; => 10
+(display total)
+(newline)
+;; => (1 . 2)
+(display (cons 1 2))
+(newline)
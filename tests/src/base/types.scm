@@ -0,0 +1,62 @@
+;; args: -c 1 -O 2
+; parameters which baseline code only saw fixnums in are assumed to hold
+; fixnums by the optimizing tier, which checks them on entry and throws the
+; code out when they don't
+(define (print x)
+  (display x)
+  (newline))
+(define (size x) (if (pair? x) 100 (+ x 1)))
+(define (count-up n acc)
+  (if (> n 0)
+    (count-up (- n 1) (+ acc (size n)))
+    acc))
+
+;; => 65
+(print (count-up 10 0))
+;; => 65
+(print (count-up 10 0))
+;; => 65
+(print (count-up 10 0))
+;; => 65
+(print (count-up 10 0))
+;; => 100
+(print (size (cons 1 2)))
+;; => 65
+(print (count-up 10 0))
+;; => 8
+(print (size 7))
+
+; arithmetic checks the types of operands it doesn't know about
+(define (add-all xs acc)
+  (if (null? xs)
+    acc
+    (add-all (cdr xs) (+ acc (car xs)))))
+(define nums (cons 1 (cons 2 (cons 3 '()))))
+;; => 6
+(print (add-all nums 0))
+;; => 6
+(print (add-all nums 0))
+;; => 6
+(print (add-all nums 0))
+;; => 6
+(print (add-all nums 0))
+;; => #t
+(print (< (add-all nums 0) 7))
+
+; loops check again when they pass along something not known to be a fixnum
+(define (walk n x lst)
+  (if (> n 0)
+    (walk (- n 1) (if (> n 1) (+ x 1) (car lst)) lst)
+    x))
+;; => 5
+(print (walk 3 0 '(5)))
+;; => 5
+(print (walk 3 0 '(5)))
+;; => 5
+(print (walk 3 0 '(5)))
+;; => 5
+(print (walk 3 0 '(5)))
+;; => a
+(print (walk 3 0 '(a)))
+;; => 5
+(print (walk 3 0 '(5)))